@@ -1,6 +1,10 @@
 #ifndef _SSRE_INTERNAL_H_
 #define _SSRE_INTERNAL_H_
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
 #include "ssre.h"
 
 namespace ssre 
@@ -14,12 +18,156 @@ namespace ssre
             return r;
         }
 
+        // the size rendered at, the window is output_width x output_height
         extern int window_width;
         extern int window_height;
+        extern int output_width;
+        extern int output_height;
         extern Matrix matrix_model_view;
         extern Matrix model_view_inverse_transpose;
         extern Matrix matrix_projection;
+        // the view port set in window pixels, and scaled to the render size
+        extern Matrix window_view_port;
         extern Matrix matrix_view_port;
+        /* a view port in window pixels scaled to the render size */
+        Matrix render_view_port(const Matrix &view_port);
+        void update_view_port();
+        void set_render_size(int width, int height);
+
+        /* window pixels [x0, x1) x [y0, y1), y going up */
+        struct ScissorBox
+        {
+            int x0, y0, x1, y1;
+        };
+        /* limits the color spans of polygons to the box */
+        extern bool scissor_enabled;
+        extern ScissorBox scissor;
+
+        // clears are deferred to the dirty rectangles while they are on
+        extern bool dirty_rectangles_enabled;
+        void defer_clear(uint32 color);
+        void defer_clear_depth(float depth);
+        void render_dirty_objects();
+
+        /*
+         * distributed rendering. Waits for the regions of the other
+         * processes, and hands out the next frame after present
+         */
+        void gather_distributed_frame();
+        void start_distributed_frame();
+        void stop_distributed_rendering();
+
+        /* hands the presented frame to the capture thread */
+        void capture_frame(const uint32 *frame);
+
+/* kernels for instruction sets beyond the one compiled for, x86 only */
+#if defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SSRE_X86_KERNELS
+#define SSRE_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+        struct Bone;
+        struct SkinnedMesh;
+
+        /* instruction sets with kernels, each includes the ones before */
+        enum KernelLevel
+        {
+            ScalarKernels, SSE2Kernels, AVX2Kernels, AVX512Kernels
+        };
+
+        /*
+         * the hot loops, picked at startup for the processor. Variants
+         * give the same results, except the scalar ones which may round
+         * differently
+         */
+        struct Kernels
+        {
+            KernelLevel level;
+            void (*fill)(uint32 *dest, uint32 value, int count);
+            void (*transform_vertices)(const Matrix &m,
+                    const Matrix &normal_matrix, const Vertex *source,
+                    Vertex *dest, int count);
+            uint32 (*sample_texture)(const Texture &texture, float u, float v);
+            // the resolve of the half float buffer, tone maps its pixels
+            // [begin, end) into the frame
+            void (*tone_map_pixels)(int begin, int end);
+            // the rasterizer's span loop for untextured, unlit spans. Writes
+            // the interpolated colors and z of count pixels whose z is less
+            // than in depths, or of all of them without the depth test
+            void (*color_span)(uint32 *pixels, float *depths,
+                    const float *attributes, const float *steps, int count,
+                    bool depth_test);
+            // linear blend skinning of the vertices [begin, end) of a mesh
+            void (*skin_vertices)(const Bone *palette, const SkinnedMesh &mesh,
+                    Vertex *vertices, int begin, int end);
+        };
+        extern Kernels kernels;
+
+        void fill_scalar(uint32 *dest, uint32 value, int count);
+        void transform_vertices_scalar(const Matrix &m,
+                const Matrix &normal_matrix, const Vertex *source,
+                Vertex *dest, int count);
+        uint32 sample_texture_scalar(const Texture &texture, float u, float v);
+        void tone_map_pixels_scalar(int begin, int end);
+        void color_span_scalar(uint32 *pixels, float *depths,
+                const float *attributes, const float *steps, int count,
+                bool depth_test);
+        void skin_vertices_scalar(const Bone *palette, const SkinnedMesh &mesh,
+                Vertex *vertices, int begin, int end);
+#ifdef __SSE2__
+        void fill_sse2(uint32 *dest, uint32 value, int count);
+        void transform_vertices_sse2(const Matrix &m,
+                const Matrix &normal_matrix, const Vertex *source,
+                Vertex *dest, int count);
+        uint32 sample_texture_sse2(const Texture &texture, float u, float v);
+        void tone_map_pixels_sse2(int begin, int end);
+        void color_span_sse2(uint32 *pixels, float *depths,
+                const float *attributes, const float *steps, int count,
+                bool depth_test);
+        void skin_vertices_sse2(const Bone *palette, const SkinnedMesh &mesh,
+                Vertex *vertices, int begin, int end);
+#endif
+#ifdef SSRE_X86_KERNELS
+        void fill_avx2(uint32 *dest, uint32 value, int count);
+        void transform_vertices_avx2(const Matrix &m,
+                const Matrix &normal_matrix, const Vertex *source,
+                Vertex *dest, int count);
+        uint32 sample_texture_avx2(const Texture &texture, float u, float v);
+        void tone_map_pixels_avx2(int begin, int end);
+        void color_span_avx2(uint32 *pixels, float *depths,
+                const float *attributes, const float *steps, int count,
+                bool depth_test);
+        void skin_vertices_avx(const Bone *palette, const SkinnedMesh &mesh,
+                Vertex *vertices, int begin, int end);
+        void fill_avx512(uint32 *dest, uint32 value, int count);
+        void transform_vertices_avx512(const Matrix &m,
+                const Matrix &normal_matrix, const Vertex *source,
+                Vertex *dest, int count);
+        void tone_map_pixels_avx512(int begin, int end);
+        void color_span_avx512(uint32 *pixels, float *depths,
+                const float *attributes, const float *steps, int count,
+                bool depth_test);
+#endif
+
+        /* count values from row on, 32 bit ones through the fill kernel */
+        template <typename T>
+        inline void fill_row(T *row, int count, T value)
+        {
+            std::fill(row, row + count, value);
+        }
+
+        inline void fill_row(uint32 *row, int count, uint32 value)
+        {
+            kernels.fill(row, value, count);
+        }
+
+        inline void fill_row(float *row, int count, float value)
+        {
+            uint32 bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            kernels.fill((uint32 *)row, bits, count);
+        }
 
         struct InternalVertex
         {
@@ -27,6 +175,14 @@ namespace ssre
             Vector normal;
             TextureCoordiate tex_coord;
             MaterialColor color;
+            // eye space position and the contribution of each shadow
+            // casting light, kept for per pixel shadows
+            Vector eye_position;
+            MaterialColor shadowed[SSRE_MAX_SHADOW_MAPS];
+            // eye space, only with a normal map
+            Vector tangent;
+            // 1 / w of the clip space position, 1 before the projection
+            float inverse_w;
         };
 
         struct InternalPolygon
@@ -36,6 +192,158 @@ namespace ssre
             InternalVertex vertices[SSRE_MAX_VERTEX_COUNT];
             const Material &material;
             InternalPolygon(const Polygon &p);
+            /* no vertices yet */
+            explicit InternalPolygon(const Material &m) :
+                count(0), material(m) {}
+        };
+
+        Matrix look_at_matrix(const Vector &eye, const Vector &ref,
+                const Vector &up);
+        Matrix ortho_matrix(float xmin, float xmax, float ymin, float ymax,
+                float dnear, float dfar);
+        Matrix perspective_matrix(float theta, float aspect,
+                float dnear, float dfar);
+        Matrix view_port_matrix(int xmin, int ymin, int width, int height);
+        void transform_positions(InternalPolygon &polygon, const Matrix &matrix);
+        void transform_normals(InternalPolygon &polygon, const Matrix &matrix);
+        void transform_tangents(InternalPolygon &polygon, const Matrix &matrix);
+        /* projects and divides the positions, keeping 1 / w */
+        void project_positions(InternalPolygon &polygon);
+        /*
+         * culls, lights, projects and clips an eye space polygon into
+         * window space, false when nothing is left to rasterize
+         */
+        bool assemble_polygon(InternalPolygon &polygon);
+        /* the pipeline after the model view transform */
+        void render_eye_polygon(InternalPolygon &polygon);
+
+        enum TessellationMode
+        {
+            FlatTessellation, PNTriangles
+        };
+        extern bool tessellation_enabled;
+        extern TessellationMode tessellation_mode;
+        extern TessellationSettings tessellation_settings;
+        void render_tessellated_mesh(const Mesh &mesh);
+
+        /* whether the sphere is outside the frustum of object to clip m */
+        bool sphere_outside(const Matrix &m, const Vector &sphere);
+        inline void transform_vertices(const Matrix &m,
+                const Matrix &normal_matrix, const Vertex *source,
+                Vertex *dest, int count)
+        {
+            kernels.transform_vertices(m, normal_matrix, source, dest, count);
+        }
+
+        /* the buffer between begin_command_buffer and its end */
+        extern CommandBuffer *recording;
+        uint64 hash_command_buffer(const CommandBuffer &commands);
+        /* the window pixels [x0, x1) x [y0, y1) the commands may touch */
+        void command_buffer_bounds(const CommandBuffer &commands,
+                int &x0, int &y0, int &x1, int &y1);
+        void record_polygon(const Polygon &polygon);
+        /* count instances of the mesh, tessellated like render_mesh */
+        void record_mesh(const Mesh &mesh, const Matrix transforms[],
+                int count, bool tessellate);
+
+        const int MAX_RASTER_ATTRIBUTES = 32;
+
+        /*
+         * window coordinates in 28.4 fixed point. Pixel x covers
+         * [x, x + 1) with its center half way, like OpenGL
+         */
+        const int SUBPIXEL_BITS = 4;
+        const int SUBPIXEL_ONE = 1 << SUBPIXEL_BITS;
+        const int SUBPIXEL_HALF = SUBPIXEL_ONE >> 1;
+
+        inline int to_subpixel(float v)
+        {
+            return (int)std::floor(v * SUBPIXEL_ONE + 0.5f);
+        }
+
+        inline Pointi to_subpixel(const Vector &v)
+        {
+            return Pointi {to_subpixel(v.x()), to_subpixel(v.y())};
+        }
+
+        /* screen space polygon handed to the scan converter */
+        struct RasterPolygon
+        {
+            int count;
+            int attribute_count;
+            // the rows that may hold pixels of the polygon
+            int y_min, y_max;
+            // in 28.4 fixed point
+            Pointi points[SSRE_MAX_VERTEX_COUNT];
+            // instead of points for more than SSRE_MAX_VERTEX_COUNT
+            const Pointi *more_points = nullptr;
+            // attribute_count values per vertex
+            const float *attributes;
+            // the last attribute is 1 / w and all but z are divided by w,
+            // so that they are linear in screen space
+            bool perspective = false;
+
+            const Pointi &point(int i) const
+            {
+                return more_points ? more_points[i] : points[i];
+            }
+        };
+        void bound_rows(RasterPolygon &polygon);
+
+        /* attribute layout of the color pass */
+        enum ColorAttribute
+        {
+            Z_ATTRIBUTE = 0,
+            COLOR_ATTRIBUTE = 1,
+            U_ATTRIBUTE = COLOR_ATTRIBUTE + SSRE_LIGHTING_COMPONENT,
+            V_ATTRIBUTE,
+            // only present with per pixel shadows or lighting
+            EYE_ATTRIBUTE,
+            SHADOWED_ATTRIBUTE = EYE_ATTRIBUTE + 3,
+            // per pixel lighting replaces the shadowed colors
+            NORMAL_ATTRIBUTE = EYE_ATTRIBUTE + 3,
+            TANGENT_ATTRIBUTE = NORMAL_ATTRIBUTE + 3,
+            LIT_ATTRIBUTE_COUNT = TANGENT_ATTRIBUTE + 4
+        };
+        /* diffuse is sampled instead of the enabled texture when set */
+        void fill_polygon(const RasterPolygon &polygon, int pixel_shadow_maps,
+                const Texture *diffuse);
+        void fill_lit_polygon(const RasterPolygon &polygon,
+                const Material &material);
+        void fill_stencil_polygon(const RasterPolygon &polygon);
+        bool front_facing(const RasterPolygon &polygon);
+
+        /* room for a polygon after clip_homogeneous added its vertices */
+        const int MAX_CLIP_VERTEX_COUNT = SSRE_MAX_VERTEX_COUNT + 8;
+        /* clips clip space points against all planes but the far one */
+        int clip_homogeneous(Vector *points, int n);
+
+        /* bump allocator for data that lives until the end of the frame */
+        class FrameArena
+        {
+        public:
+            FrameArena() {}
+            ~FrameArena();
+            DISABLE_COPY_AND_ASSIGN(FrameArena);
+
+            void *allocate(size_t size, size_t alignment);
+            template<typename T>
+            T *allocate(size_t n = 1)
+            {
+                return static_cast<T *>(allocate(sizeof(T) * n, alignof(T)));
+            }
+            void reset();
+
+        private:
+            const static size_t BLOCK_SIZE = 1 << 20;
+            struct Block
+            {
+                uint8 *data;
+                size_t size;
+            };
+            std::vector<Block> blocks;
+            size_t current = 0;
+            size_t offset = 0;
         };
 
         struct SSREBuffer
@@ -43,6 +351,8 @@ namespace ssre
             const static int LIGHTING_SOURCE_BUFFER_SIZE = 32;
             int lighting_source_count = 0;
             LightingSource lighting_sources[LIGHTING_SOURCE_BUFFER_SIZE];
+            int shadow_map_count = 0;
+            FrameArena arena;
 
             void reset();
         };
@@ -51,6 +361,78 @@ namespace ssre
         extern bool clipping_enabled;
         extern bool z_buffer_enabled;
 
+        extern CompareFunction depth_function;
+
+        extern bool s_buffer_enabled;
+        void clear_s_buffer();
+        void seed_s_buffer();
+
+        /* a func b, e.g. a < b for CompareLess */
+        template<typename T>
+        inline bool compare(CompareFunction func, T a, T b)
+        {
+            switch (func)
+            {
+                case CompareNever: return false;
+                case CompareLess: return a < b;
+                case CompareLessEqual: return a <= b;
+                case CompareEqual: return a == b;
+                case CompareGreaterEqual: return a >= b;
+                case CompareGreater: return a > b;
+                case CompareNotEqual: return a != b;
+                case CompareAlways: return true;
+            }
+            return false;
+        }
+
+        struct StencilState
+        {
+            CompareFunction func = CompareAlways;
+            uint8 reference = 0;
+            uint8 mask = 0xff;
+            uint8 write_mask = 0xff;
+            // sfail, zfail and zpass of front and back faces
+            StencilOperation operations[2][3] = {
+                {StencilKeep, StencilKeep, StencilKeep},
+                {StencilKeep, StencilKeep, StencilKeep}
+            };
+        };
+        extern bool stencil_test_enabled;
+        extern StencilState stencil_state;
+
+        inline uint8 stencil_operation(StencilOperation op, uint8 s)
+        {
+            switch (op)
+            {
+                case StencilKeep: return s;
+                case StencilZero: return 0;
+                case StencilReplace: return stencil_state.reference;
+                case StencilIncrement: return s == 0xff ? s : s + 1;
+                case StencilDecrement: return s == 0 ? s : s - 1;
+                case StencilIncrementWrap: return (uint8)(s + 1);
+                case StencilDecrementWrap: return (uint8)(s - 1);
+                case StencilInvert: return ~s;
+            }
+            return s;
+        }
+
+        /*
+         * runs the stencil test and updates the stencil value of one
+         * pixel. Returns whether the fragment survives both tests
+         */
+        inline bool stencil_update(uint8 &s, bool depth_pass, bool front)
+        {
+            const StencilOperation *ops = stencil_state.operations[front ? 0 : 1];
+            uint8 mask = stencil_state.mask;
+            // like OpenGL the reference is on the left: ref func stencil
+            bool pass = compare(stencil_state.func, 
+                    (uint8)(stencil_state.reference & mask), (uint8)(s & mask));
+            StencilOperation op = !pass ? ops[0] : (depth_pass ? ops[2] : ops[1]);
+            uint8 write_mask = stencil_state.write_mask;
+            s = (s & ~write_mask) | (stencil_operation(op, s) & write_mask);
+            return pass && depth_pass;
+        }
+
         bool culling(const InternalPolygon &polygon);
         bool clipping(InternalPolygon &polygon);
         void rasterize_polygon(const InternalPolygon &polygon);
@@ -58,6 +440,31 @@ namespace ssre
 
         void compute_lighting_color(InternalPolygon &polygon);
 
+        struct ShadowMap
+        {
+            int light;
+            LightingSourceType type;
+            int size;
+            int cascades;
+            float bias;
+            // view distance where each cascade ends
+            float splits[SSRE_MAX_SHADOW_CASCADES];
+            // eye space to the clip space of the light
+            Matrix projections[SSRE_MAX_SHADOW_CASCADES];
+            std::vector<float> depths[SSRE_MAX_SHADOW_CASCADES];
+        };
+        enum ShadowMode
+        {
+            PerVertex, PerPixel
+        };
+        extern ShadowMode shadow_mode;
+        extern bool shadow_pcf_enabled;
+        extern ShadowMap shadow_maps[SSRE_MAX_SHADOW_MAPS];
+        extern const ShadowMap *shadow_pass;
+        int light_shadow_map(int light);
+        float shadow_visibility(const ShadowMap &map, const Vector &eye_position);
+        void render_shadow_polygon(const InternalPolygon &polygon);
+
         enum TextureMode
         {
             Decal, Modulate
@@ -66,7 +473,143 @@ namespace ssre
         extern bool texture_enabled;
         extern TextureMode texture_mode;
         uint32 get_texture_color(float u, float v);
+        inline uint32 sample_texture(const Texture &texture, float u, float v)
+        {
+            return kernels.sample_texture(texture, u, v);
+        }
+        /* the texture bound to a unit of the material, nullptr without */
+        const Texture *material_texture(const Material &material,
+                TextureUnit unit);
+
+        /* nearest texel of a width x height map, wrapping around */
+        inline int wrapped_texel(int width, int height, float u, float v)
+        {
+            u -= std::floor(u);
+            v -= std::floor(v);
+            int x = std::min((int)(u * width), width - 1);
+            int y = std::min((int)(v * height), height - 1);
+            return y * width + x;
+        }
+        uint32 average_color(uint32 c0, uint32 c1, uint32 c2, uint32 c3);
+
+        /* sampled instead of texture while set */
+        extern VirtualTexture *virtual_texture;
+        /* the level of detail of the texture coordinate steps of a pixel */
+        float virtual_texture_lod(const VirtualTexture &texture, float du_dx,
+                float dv_dx, float du_dy, float dv_dy);
+        uint32 sample_virtual_texture(VirtualTexture &texture, float u,
+                float v, float lod);
+        /* installs the pages read and reads the requested ones */
+        void update_virtual_textures();
+
+        /* c0 * (256 - weight) + c1 * weight per channel, weight in [0, 256] */
+        inline uint32 lerp_color(uint32 c0, uint32 c1, int weight)
+        {
+            uint32 rb0 = c0 & 0xff00ff, ag0 = (c0 >> 8) & 0xff00ff;
+            uint32 rb1 = c1 & 0xff00ff, ag1 = (c1 >> 8) & 0xff00ff;
+            uint32 rb = (rb0 * (256 - weight) + rb1 * weight) >> 8;
+            uint32 ag = ag0 * (256 - weight) + ag1 * weight;
+            return (rb & 0xff00ff) | (ag & 0xff00ff00);
+        }
+
+        extern bool normal_map_enabled;
+        extern NormalMap normal_map;
+        /* the normal map of the material, else the enabled one or nullptr */
+        const NormalMap *material_normal_map(const Material &material);
+
+        /* a light folded with the material for per pixel lighting */
+        struct PixelLight
+        {
+            LightingSourceType type;
+            // eye space. direction points towards directional lights
+            // and along the axis of spot lights
+            float position[3];
+            float direction[3];
+            float ambient[3];
+            float diffuse[3];
+            float specular[3];
+            Attenuation attenuation;
+            float cos_cutoff;
+            int shadow_map;
+        };
+        int prepare_pixel_lights(const Material &material, PixelLight *lights);
+        /*
+         * lights count pixels of a span at the given offsets from the
+         * start, whose attributes follow the LIT_ATTRIBUTE_COUNT layout
+         */
+        void shade_lit_pixels(const float *attributes, const float *steps,
+                const int *offsets, int count, const PixelLight *lights,
+                int light_count, const Material &material, uint32 *colors);
+
+        void render_skybox(const CubeMap &cube_map, uint32 *pixels,
+                const float *depths, int width, int height);
         uint32 modulate_color(uint32 c0, uint32 c1);
+        /* installs decoded textures and evicts down to the budget */
+        void update_streamed_textures();
+        /* waits for the decodes and joins the decode threads */
+        void stop_texture_decoding();
+        /* background file work, finished by stop_texture_decoding */
+        void run_on_decode_thread(const std::function<void()> &job);
+        /*
+         * keeps the streamed texture a copy refers to resident until it
+         * is unpinned as often, copies of other textures are ignored
+         */
+        void pin_streamed_texture(const Texture &texture);
+        void unpin_streamed_texture(const Texture &texture);
+
+        /* [begin, end) sub range of a parallel_for */
+        typedef std::function<void(int, int)> RangeFunction;
+        int worker_count();
+        /*
+         * the processes the cores are shared by. Stops the threads, fork
+         * copies only the calling one
+         */
+        void share_worker_threads(int processes);
+        void parallel_for(int begin, int end, int grain,
+                const RangeFunction &func);
+
+        /*
+         * clips the span of row y, z at x_left plus dz per pixel, against
+         * the S-buffer and calls visible with the [begin, end) ranges in
+         * front, left to right. occlude adds those ranges to the row
+         */
+        void s_buffer_span(int y, int x_left, int x_right, float z, float dz,
+                bool occlude, const RangeFunction &visible);
+
+        enum BlendMode
+        {
+            Sorted, OrderIndependent, Additive
+        };
+        extern bool blending_enabled;
+        extern BlendMode blend_mode;
+        uint32 blend_color(uint32 src, uint32 dest);
+        uint32 add_color(uint32 src, uint32 dest);
+        uint32 add_saturate(uint32 c0, uint32 c1);
+        void append_fragment(int index, uint32 color, float z);
+        void resolve_fragments(uint32 *pixels, const float *depths,
+                int width, int height);
+
+        void render_particles(ParticleSystem *system, uint32 *pixels,
+                const float *depths, int width, int height);
+
+        /*
+         * half float r, g, b and coverage per pixel, the coverage tells
+         * the pixels drawn since the last tone mapping
+         */
+        extern bool hdr_enabled;
+        extern uint64 *hdr_pixels;
+        void decode_srgb(uint32 c, float *rgba);
+        void write_hdr_pixel(int index, const float *rgba, float z);
+        void resolve_hdr();
+
+        extern bool fxaa_enabled;
+        const uint32 *fxaa(const uint32 *pixels, int width, int height);
+
+        /* bilinear, with the pixel centers of both sizes lined up */
+        const uint32 *upscale(const uint32 *pixels, int width, int height,
+                int out_width, int out_height);
+        /* measures the frame just presented, resizes the next one */
+        void update_dynamic_resolution();
     }
 }
 
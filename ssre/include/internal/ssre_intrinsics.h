@@ -0,0 +1,15 @@
+#ifndef _SSRE_INTRINSICS_H_
+#define _SSRE_INTRINSICS_H_
+
+/*
+ * the x86 intrinsics of every instruction set, for kernels built for
+ * more than the compiler targets. GCC 12 takes the undefined registers
+ * inside its AVX-512 intrinsics for uninitialized variables
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+
+#endif
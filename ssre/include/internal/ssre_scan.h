@@ -0,0 +1,182 @@
+#ifndef _SSRE_SCAN_H_
+#define _SSRE_SCAN_H_
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    namespace internal
+    {
+        /* floor and ceiling of a / b for b > 0, whatever the sign of a */
+        inline long long floor_div(long long a, long long b)
+        {
+            return a >= 0 ? a / b : -((-a + b - 1) / b);
+        }
+
+        inline long long ceil_div(long long a, long long b)
+        {
+            return -floor_div(-a, b);
+        }
+
+        /*
+         * a polygon edge in 28.4 fixed point, from its lower end. It
+         * holds the rows whose pixel centers lie above its lower end and
+         * not above its upper one, so that of two edges meeting at a
+         * vertex exactly one crosses the vertex's row
+         */
+        struct ScanEdge
+        {
+            long long x0, y0, dx, dy;
+            int first_row, last_row;
+            const float *a0;
+            const float *a1;
+
+            /* false for edges that cross no pixel center */
+            bool setup(const Pointi &p0, const Pointi &p1,
+                    const float *_a0, const float *_a1)
+            {
+                const Pointi *low = &p0, *high = &p1;
+                a0 = _a0;
+                a1 = _a1;
+                if (p0.y > p1.y)
+                {
+                    std::swap(low, high);
+                    std::swap(a0, a1);
+                }
+                x0 = low->x;
+                y0 = low->y;
+                dx = high->x - low->x;
+                dy = high->y - low->y;
+                first_row = floor_div(y0 - SUBPIXEL_HALF, SUBPIXEL_ONE) + 1;
+                last_row = floor_div(high->y - SUBPIXEL_HALF, SUBPIXEL_ONE);
+                return dy > 0 && first_row <= last_row;
+            }
+
+            /* x at the center of row y, scaled by dy */
+            long long scaled_x(int y) const
+            {
+                long long center = (long long)y * SUBPIXEL_ONE + SUBPIXEL_HALF;
+                return x0 * dy + (center - y0) * dx;
+            }
+        };
+
+        /* the attributes of an edge at the center of row y */
+        inline void interpolate_edge(const ScanEdge &edge, int y,
+                int attribute_count, float *attributes)
+        {
+            long long center = (long long)y * SUBPIXEL_ONE + SUBPIXEL_HALF;
+            float t = (float)(center - edge.y0) / edge.dy;
+            for (int a = 0; a < attribute_count; a++)
+                attributes[a] = edge.a0[a] + (edge.a1[a] - edge.a0[a]) * t;
+        }
+
+        /* where an edge crosses a row, in pixels with centers at 0 */
+        struct ScanCrossing
+        {
+            double x;
+            // the first pixel whose center is not left of the crossing
+            int pixel;
+            const ScanEdge *edge;
+        };
+
+        /*
+         * scan convert the rows [y_begin, y_end) of a polygon with the
+         * top-left rule: a pixel is drawn when its center is inside, on
+         * a left edge or on a top edge, so polygons sharing an edge draw
+         * each of its pixels once. For every span span(y, x_left,
+         * x_right, attributes, steps) is called with the attributes at
+         * the center of x_left and their increment per pixel. Every row
+         * is computed on its own, so splitting the rows between workers
+         * gives the same pixels
+         */
+        template<typename Span>
+        void scan_polygon(const RasterPolygon &polygon,
+                int y_begin, int y_end, Span &span)
+        {
+            int n = polygon.count;
+            int attribute_count = polygon.attribute_count;
+            if (n < 3)
+                throw new std::invalid_argument("less than 3 vertices");
+            y_begin = std::max(y_begin, polygon.y_min);
+            y_end = std::min(y_end, polygon.y_max + 1);
+            if (y_begin >= y_end)
+                return;
+            // on the stack unless the polygon has more vertices
+            ScanEdge stack_edges[SSRE_MAX_VERTEX_COUNT];
+            ScanCrossing stack_crossings[SSRE_MAX_VERTEX_COUNT];
+            std::vector<ScanEdge> more_edges;
+            std::vector<ScanCrossing> more_crossings;
+            ScanEdge *edges = stack_edges;
+            ScanCrossing *crossings = stack_crossings;
+            if (n > SSRE_MAX_VERTEX_COUNT)
+            {
+                more_edges.resize(n);
+                more_crossings.resize(n);
+                edges = more_edges.data();
+                crossings = more_crossings.data();
+            }
+            int count = 0;
+            for (int i = 0; i < n; i++)
+            {
+                int j = (i + 1) % n;
+                if (edges[count].setup(polygon.point(i), polygon.point(j),
+                            polygon.attributes + i * attribute_count,
+                            polygon.attributes + j * attribute_count))
+                    count++;
+            }
+
+            float left[MAX_RASTER_ATTRIBUTES], right[MAX_RASTER_ATTRIBUTES];
+            float steps[MAX_RASTER_ATTRIBUTES];
+            for (int y = y_begin; y < y_end; y++)
+            {
+                // crossings of the row, sorted left to right
+                int k = 0;
+                for (int i = 0; i < count; i++)
+                {
+                    const ScanEdge &edge = edges[i];
+                    if (y < edge.first_row || y > edge.last_row)
+                        continue;
+                    long long x = edge.scaled_x(y);
+                    long long scale = edge.dy * SUBPIXEL_ONE;
+                    ScanCrossing crossing = {
+                        ((double)x / edge.dy - SUBPIXEL_HALF) / SUBPIXEL_ONE,
+                        (int)ceil_div(x - edge.dy * SUBPIXEL_HALF, scale),
+                        &edge};
+                    int m = k++;
+                    for (; m > 0 && crossings[m - 1].x > crossing.x; m--)
+                        crossings[m] = crossings[m - 1];
+                    crossings[m] = crossing;
+                }
+
+                // spans between pairs of crossings, the right end of each
+                // is left out
+                for (int i = 0; i + 1 < k; i += 2)
+                {
+                    const ScanCrossing &l = crossings[i];
+                    const ScanCrossing &r = crossings[i + 1];
+                    int x_left = l.pixel;
+                    int x_right = r.pixel - 1;
+                    if (x_right < x_left)
+                        continue;
+                    interpolate_edge(*l.edge, y, attribute_count, left);
+                    interpolate_edge(*r.edge, y, attribute_count, right);
+                    double length = r.x - l.x;
+                    float offset = (float)(x_left - l.x);
+                    for (int a = 0; a < attribute_count; a++)
+                    {
+                        steps[a] = length > 0.0 ?
+                            (float)((right[a] - left[a]) / length) : 0.0f;
+                        left[a] += steps[a] * offset;
+                    }
+                    span(y, x_left, x_right, left, steps);
+                }
+            }
+        }
+    }
+}
+
+#endif
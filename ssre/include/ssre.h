@@ -35,6 +35,13 @@ namespace ssre
 
     const int SSRE_LIGHTING_COMPONENT = 4;
 
+    const int SSRE_MAX_CUBE_MAP_LEVELS = 16;
+
+    const int SSRE_TEXTURE_UNITS = 3;
+
+    const int SSRE_MAX_SHADOW_MAPS = 4;
+    const int SSRE_MAX_SHADOW_CASCADES = 4;
+
     struct Pointi
     {
         int x, y;
@@ -106,6 +113,9 @@ namespace ssre
         Vector normal;
         Vector position;
         TextureCoordiate tex_coord;
+        // only read with a normal map, h holds the handedness of the
+        // bitangent. see compute_tangents
+        Vector tangent;
     };
 
     struct MaterialColor
@@ -126,12 +136,23 @@ namespace ssre
         uint32 toARGB();
     };
 
+    /* the textures a material binds, indices into Material::textures */
+    enum TextureUnit
+    {
+        DiffuseUnit,
+        NormalUnit,
+        SpecularUnit
+    };
+
     struct Material
     {
         MaterialColor ambient;
         MaterialColor diffuse;
         MaterialColor specular;
         float shininess;
+        // texture handles by TextureUnit, 0 leaves a unit to the enabled
+        // texture and normal map
+        int textures[SSRE_TEXTURE_UNITS];
     };
 
     struct LightColors
@@ -173,19 +194,185 @@ namespace ssre
         bool disabled;
         void contribute_lighting(const Material &material, 
                 const Vector &vertex_position, const Vector &vertex_normal,
-                MaterialColor &color) const;
+                MaterialColor &color, float visibility = 1.0f) const;
         void transform();
     };
 
+    /*
+     * size is the resolution of each map. Directional lights split the
+     * view frustum into cascades and catch casters up to dfar in front
+     * of each of them, spot lights use one perspective map covering
+     * [dnear, dfar] from the light. bias is in depth buffer units
+     */
+    struct ShadowSettings
+    {
+        int size;
+        int cascades;
+        float bias;
+        float dnear, dfar;
+    };
+
     struct Texture
     {
         int width, height;
         uint32 *pixels;
     };
 
+    /* tangent space normals as signed bytes, xyz and one pad byte */
+    struct NormalMap
+    {
+        int width, height;
+        int8 *normals;
+    };
+
+    enum CubeMapFace
+    {
+        CubePositiveX,
+        CubeNegativeX,
+        CubePositiveY,
+        CubeNegativeY,
+        CubePositiveZ,
+        CubeNegativeZ
+    };
+
+    /*
+     * six square faces in CubeMapFace order, laid out like OpenGL cube
+     * maps. Level 0 is the full size, every level halves it
+     */
+    struct CubeMap
+    {
+        int size;
+        int levels;
+        uint32 *pixels[6][SSRE_MAX_CUBE_MAP_LEVELS];
+    };
+
+    enum ParticleType
+    {
+        ParticleLauncher,
+        ParticleShell,
+        ParticleSecondaryShell
+    };
+
+    /* lifetimes are in milliseconds, speeds and gravity per second */
+    struct ParticleSystemSettings
+    {
+        int capacity;
+        float launcher_lifetime;
+        float shell_lifetime;
+        float secondary_shell_lifetime;
+        int secondary_shell_count;
+        float shell_speed;
+        float gravity;
+        float billboard_size;
+        MaterialColor color;
+    };
+
+    struct ParticleSystem;
+
+    /*
+     * skeletal animation. A model holds the bind pose, an animation the
+     * joints of every frame and an instance one skinned copy of a model
+     */
+    struct SkinnedModel;
+    struct SkeletalAnimation;
+    struct SkinnedInstance;
+
+    /*
+     * draws recorded with the state they were issued with, to be sorted
+     * once and replayed any number of times
+     */
+    struct CommandBuffer;
+
+    /*
+     * a texture paged from disk into a fixed number of cached pages,
+     * for textures too large to keep resident
+     */
+    struct VirtualTexture;
+
+    /* indexed triangle mesh, counter clockwise triangles face the front */
+    struct Mesh
+    {
+        int vertex_count;
+        Vertex *vertices;
+        int triangle_count;
+        int *indices;
+        Material *material;
+    };
+
+    /*
+     * every edge of a Mesh once with the triangles on both sides, the
+     * second one -1 on open edges. The face planes are in model space,
+     * the edge mesh has to be rebuilt when the positions change
+     */
+    struct EdgeMesh
+    {
+        int edge_count;
+        int *vertices;
+        int *faces;
+        // set where the faces meet at more than the crease angle
+        uint8 *creases;
+        int face_count;
+        float *plane_x, *plane_y, *plane_z, *plane_d;
+    };
+
+    /*
+     * edges are cut into max_level segments up to dnear from the eye,
+     * falling linearly to a single segment at dfar
+     */
+    struct TessellationSettings
+    {
+        int max_level;
+        float dnear, dfar;
+    };
+
+    enum CompareFunction
+    {
+        CompareNever,
+        CompareLess,
+        CompareLessEqual,
+        CompareEqual,
+        CompareGreaterEqual,
+        CompareGreater,
+        CompareNotEqual,
+        CompareAlways
+    };
+
+    enum StencilOperation
+    {
+        StencilKeep,
+        StencilZero,
+        StencilReplace,
+        StencilIncrement,
+        StencilDecrement,
+        StencilIncrementWrap,
+        StencilDecrementWrap,
+        StencilInvert
+    };
+
+    enum PolygonFace
+    {
+        FrontFace,
+        BackFace,
+        FrontAndBack
+    };
+
+    enum CaptureFormat
+    {
+        // YUV 4:2:0 frames behind a YUV4MPEG2 header
+        CaptureY4M,
+        // 8 bit red, green and blue, rows top down
+        CaptureRGB
+    };
+
+    enum ToneMapOperator
+    {
+        ToneMapReinhard,
+        ToneMapACES
+    };
+
     // rasterize
     void present();
-    void present_impl(uint32 *pixels, int pitch);
+    void present_impl(const uint32 *pixels, int pitch);
     void clear(uint32 color);
     void draw_points(const Pointi[], uint32 color, int n);
     void draw_points(const Pointi[], uint32 colors[], int n);
@@ -227,6 +414,17 @@ namespace ssre
     void load_identity_model_view();
     void load_identity_projection();
     void render_polygon(const Polygon &polygon);
+    void render_mesh(const Mesh &mesh);
+    /* bounding sphere of the mesh's positions, x, y, z and the radius */
+    Vector bounding_sphere(const Mesh &mesh);
+    /*
+     * renders the mesh once per transform, applied before the model view
+     * matrix. Instances whose sphere, the mesh's bounding_sphere computed
+     * once, is outside the frustum are skipped whole. Tessellation does
+     * not apply
+     */
+    void render_instanced(const Mesh &mesh, const Vector &sphere,
+            const Matrix transforms[], int count);
     void view_port(int vp_xmin, int vp_ymin, int vp_width, int vp_height);
     void translate(float tx, float ty, float tz);
     void rotate(float theta, float vx, float vy, float vz);
@@ -240,12 +438,76 @@ namespace ssre
     void enable_z_buffer();
     void disable_z_buffer();
     void clear_depth(float d);
+    void depth_func(CompareFunction func);
+    /*
+     * per row lists of covered spans in place of the per pixel depth
+     * test, cleared by clear_depth. Hidden spans are dropped before
+     * shading, which pays off when polygons come front to back. The
+     * depth function is always less, and stencil z-fail operations do
+     * not run on the dropped pixels. Enabling it while the z-buffer is
+     * on rebuilds the spans from the depth buffer, so the two can be
+     * mixed within a frame
+     */
+    void enable_s_buffer();
+    void disable_s_buffer();
+
+    // stencil
+    void enable_stencil_test();
+    void disable_stencil_test();
+    void clear_stencil(uint8 s);
+    void stencil_func(CompareFunction func, uint8 ref, uint8 mask);
+    void stencil_write_mask(uint8 mask);
+    void stencil_op(PolygonFace face, StencilOperation sfail,
+            StencilOperation zfail, StencilOperation zpass);
 
     // lighting
     int enable_light(const LightingSource &source);
     void disable_light(int handle);
     void enable_light(int handle);
 
+    // shadows
+    void begin_shadow_pass(int light_handle, const ShadowSettings &settings);
+    void end_shadow_pass();
+    void shadow_mode_per_vertex();
+    void shadow_mode_per_pixel();
+    void enable_shadow_pcf();
+    void disable_shadow_pcf();
+    /*
+     * z-fail stencil shadow volumes. adjacency holds the neighbouring
+     * triangle of every edge, -1 on open edges. The volume only touches
+     * the stencil buffer, through the operations set with stencil_op
+     */
+    void build_adjacency(const Mesh &mesh, int *adjacency);
+    void render_shadow_volume(const Mesh &mesh, const int *adjacency,
+            int light_handle);
+
+    // outlines, silhouette and crease edges drawn as lines
+    EdgeMesh create_edge_mesh(const Mesh &mesh, float crease_angle);
+    void release_edge_mesh(EdgeMesh &edges);
+    void render_outline(const Mesh &mesh, const EdgeMesh &edges, uint32 color);
+
+    // tessellation, only applies to render_mesh
+    void enable_tessellation(const TessellationSettings &settings);
+    void disable_tessellation();
+    void tessellation_mode_flat();
+    void tessellation_mode_pn_triangles();
+
+    // command buffers
+    CommandBuffer *create_command_buffer();
+    void destroy_command_buffer(CommandBuffer *commands);
+    /*
+     * until end_command_buffer, render_polygon, render_mesh and
+     * render_instanced are recorded into the buffer instead of drawn.
+     * Geometry is copied, materials and texture pixels are referenced
+     */
+    void begin_command_buffer(CommandBuffer *commands);
+    void end_command_buffer();
+    /*
+     * opaque draws go first, grouped by state and front to back, then
+     * the blended ones back to front. The current state is kept
+     */
+    void execute_command_buffer(const CommandBuffer *commands);
+
     // texture
     void enable_texture(const Texture &texture);
     void disable_texture();
@@ -254,6 +516,180 @@ namespace ssre
     Texture load_external_texture(const char *file);
     Texture load_external_texture_impl(const char *file);
     void release_external_texture(Texture &texture);
+
+    /*
+     * texture streaming. stream_texture returns a handle at once and
+     * decodes the file on background threads. Until it is decoded, or
+     * after it was evicted for the budget, a grey placeholder is handed
+     * out. Decoded textures show up at present, and the pixels handed
+     * out in a frame stay valid through the next one. Command buffers
+     * and material handles holding them keep them resident, until the
+     * buffer is recorded again or destroyed or the handle released
+     */
+    int stream_texture(const char *file);
+    Texture streamed_texture(int handle);
+    void enable_streamed_texture(int handle);
+    bool texture_resident(int handle);
+    void release_streamed_texture(int handle);
+    /* blocks until every requested texture is decoded and resident */
+    void finish_texture_streaming();
+    void set_texture_decode_thread_count(int count);
+    /* bytes of resident texels, least recently used ones go first */
+    void set_texture_budget(size_t bytes);
+
+    /*
+     * virtual textures. bake_virtual_texture splits an image into pages
+     * of every mip level, stored in a page file. Sampled pages that are
+     * not cached are read on the texture decode threads, a few at a
+     * time, and show up at a later present; coarser levels are shown
+     * meanwhile. enable_texture switches back to
+     * plain textures
+     */
+    void bake_virtual_texture(const char *image, const char *page_file);
+    VirtualTexture *create_virtual_texture(const char *page_file,
+            int cache_pages);
+    void destroy_virtual_texture(VirtualTexture *texture);
+    void enable_virtual_texture(VirtualTexture *texture);
+    int resident_page_count(const VirtualTexture *texture);
+
+    /*
+     * material textures. Handles go into Material::textures, the pixels
+     * of registered textures and normal maps are referenced. A texture
+     * array copies same sized layers into one allocation, its layers
+     * have consecutive handles starting with the one returned. Normal
+     * and specular units are sampled by per pixel lighting, which a
+     * normal map turns on
+     */
+    int register_texture(const Texture &texture);
+    int register_normal_map(const NormalMap &normal_map);
+    void release_texture_handle(int handle);
+    int create_texture_array(const Texture layers[], int count);
+    void destroy_texture_array(int first);
+
+    // normal mapping
+    void compute_tangents(Mesh &mesh);
+    NormalMap create_normal_map(const Texture &texture);
+    void release_normal_map(NormalMap &normal_map);
+    void enable_normal_map(const NormalMap &normal_map);
+    void disable_normal_map();
+
+    // cube maps
+    CubeMap create_cube_map(const Texture faces[6], bool mipmaps);
+    void release_cube_map(CubeMap &cube_map);
+    uint32 sample_cube_map(const CubeMap &cube_map, const Vector &direction,
+            float lod);
+    void render_skybox(const CubeMap &cube_map);
+
+    // blending
+    void enable_blending();
+    void disable_blending();
+    void blend_mode_sorted();
+    void blend_mode_order_independent();
+    void blend_mode_additive();
+
+    // skinning
+    SkinnedModel *load_md5_model(const char *file);
+    void destroy_skinned_model(SkinnedModel *model);
+    SkeletalAnimation *load_md5_animation(const char *file);
+    void destroy_skeletal_animation(SkeletalAnimation *animation);
+    SkinnedInstance *create_skinned_instance(const SkinnedModel *model,
+            Material *material);
+    void destroy_skinned_instance(SkinnedInstance *instance);
+    /* time in milliseconds, wraps around. nullptr keeps the bind pose */
+    void pose_skinned_instance(SkinnedInstance *instance,
+            const SkeletalAnimation *animation, float time);
+    /* skins the instances in parallel, their meshes go to render_mesh */
+    void skin_instances(SkinnedInstance *const instances[], int count);
+    int skinned_mesh_count(const SkinnedInstance *instance);
+    const Mesh &skinned_mesh(const SkinnedInstance *instance, int index);
+
+    // particles
+    ParticleSystem *create_particle_system(
+            const ParticleSystemSettings &settings);
+    void destroy_particle_system(ParticleSystem *system);
+    void add_particle_launcher(ParticleSystem *system, const Vector &position);
+    void update_particle_system(ParticleSystem *system, float delta);
+    void render_particle_system(ParticleSystem *system);
+    int particle_count(const ParticleSystem *system);
+
+    // post processing
+    void enable_fxaa(float edge_threshold);
+    void disable_fxaa();
+
+    /*
+     * high dynamic range. Polygons are lit without the clamp to 1 and
+     * drawn into a half float buffer, blended and accumulated there,
+     * and tone mapped after exposure and sRGB encoded in one pass at
+     * present. Texels and what is in the 8 bit frame are taken as
+     * sRGB. Points, lines and particles draw on the 8 bit frame, which
+     * is tone mapped before them when polygons were drawn since the
+     * last pass. Per pixel lighting stays clamped
+     */
+    void enable_hdr(ToneMapOperator op, float exposure);
+    void disable_hdr();
+
+    /*
+     * dynamic resolution. The frame time is measured at every present,
+     * and the size rendered at is scaled to keep it near target_ms.
+     * Scales are per axis in (0, 1]; frames rendered smaller are
+     * scaled up to the window at present
+     */
+    void enable_dynamic_resolution(float target_ms, float min_scale,
+            float max_scale);
+    void disable_dynamic_resolution();
+    float resolution_scale();
+
+    /*
+     * dirty rectangles. Everything drawn between begin_object and
+     * end_object is recorded under the id instead of drawn, and at
+     * present only the tiles where an object changed, moved, appeared
+     * or was not begun again are cleared and redrawn. Everything in a
+     * frame has to be drawn inside objects, and clear and clear_depth
+     * only set what the tiles are cleared to. Objects are compared by
+     * their geometry, state and materials, textures by their pixel
+     * pointers. Not for the S-buffer, which is kept per row
+     */
+    void enable_dirty_rectangles();
+    void disable_dirty_rectangles();
+    void begin_object(int id);
+    void end_object();
+
+    /*
+     * sort-first distributed rendering. Forks process_count - 1 workers
+     * that call func once per frame like main_loop, each drawing its
+     * band of rows and handing it over in a frame shared with this
+     * process, which draws the first band and composites at present. Bands are
+     * rebalanced every frame by the time each process took. func has
+     * to draw the same frame in every process, call after init_window
+     * and before any rendering. Not with dirty rectangles
+     */
+    void enable_distributed_rendering(int process_count, render_function func);
+    void disable_distributed_rendering();
+
+    /*
+     * frame capture. Every presented frame is copied into one of
+     * buffered_frames buffers and converted and written to fd on an
+     * output thread, so rendering goes on while earlier frames are
+     * written. A frame finding every buffer taken is dropped rather
+     * than waited for. stop_capture writes what is left, and throws
+     * if writing failed; fd stays open
+     */
+    void start_capture(int fd, CaptureFormat format, int fps,
+            int buffered_frames);
+    void stop_capture();
+    int captured_frame_count();
+    int dropped_frame_count();
+
+    // threading
+    void set_worker_thread_count(int count);
+
+    /*
+     * the instruction set of the kernels picked at startup, "scalar",
+     * "sse2", "avx2" or "avx512". The SSRE_KERNELS environment variable
+     * set to one of them picks it instead, if the processor has it.
+     * Other values print a warning on stderr
+     */
+    const char *kernel_set();
 }
 
 #endif
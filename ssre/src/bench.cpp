@@ -0,0 +1,663 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+/*
+ * ssre bench <name> [arguments] renders the scenes the timings in the
+ * commit log were taken on, and prints the best of a few runs
+ */
+
+namespace ssre
+{
+    extern int width;
+    extern int height;
+    extern uint32 *pixels;
+}
+
+namespace
+{
+    using namespace ssre;
+
+    const int BENCH_WIDTH = 640;
+    const int BENCH_HEIGHT = 480;
+
+    LightingSource sun = {
+        DirectionalSource,
+        {0, 0, 1, 0},
+        {0.3f, 0.5f, 1},
+        {
+            {{0.2f, 0.2f, 0.2f, 1}},
+            {{1, 1, 1, 1}},
+            {{0, 0, 0, 0}},
+        },
+        {1, 0, 0},
+        0,
+        false
+    };
+
+    double now_ms()
+    {
+        using namespace std::chrono;
+        return duration<double, std::milli>(
+                steady_clock::now().time_since_epoch()).count();
+    }
+
+    /* pixels of the frame whose color differs from reference */
+    int frame_difference(const std::vector<uint32> &reference, int &largest)
+    {
+        int count = 0;
+        largest = 0;
+        for (int i = 0; i < width * height; i++)
+        {
+            int d = 0;
+            for (int shift = 0; shift < 24; shift += 8)
+            {
+                int a = (pixels[i] >> shift) & 0xff;
+                int b = (reference[i] >> shift) & 0xff;
+                d = std::max(d, std::abs(a - b));
+            }
+            count += d > 0;
+            largest = std::max(largest, d);
+        }
+        return count;
+    }
+
+    /*
+     * best time of runs calls of draw, which renders one frame, each
+     * after an untimed call of setup. The frames are presented outside
+     * of the timing, which also drops their lights, the last one is left
+     * in pixels
+     */
+    template<typename S, typename F>
+    double best_of(int runs, S setup, F draw)
+    {
+        double best = 1e30;
+        for (int i = 0; i < runs; i++)
+        {
+            if (i > 0)
+                present();
+            setup();
+            double start = now_ms();
+            draw();
+            best = std::min(best, now_ms() - start);
+        }
+        return best;
+    }
+
+    template<typename F>
+    double best_of(int runs, F draw)
+    {
+        return best_of(runs, []() {}, draw);
+    }
+
+    void open_bench_window()
+    {
+        init_window("SSRE Bench", SSRE_WINDOW_DEFAULT_X,
+                SSRE_WINDOW_DEFAULT_Y, BENCH_WIDTH, BENCH_HEIGHT, 0);
+        init_3d_viewing();
+    }
+
+    /*
+     * lit and textured quads covering the screen, one behind the
+     * other, plus two intersecting quads in front of them
+     */
+    struct LayerScene
+    {
+        Material materials[8];
+        uint32 texels[64 * 64];
+        Texture texture;
+
+        LayerScene()
+        {
+            for (int i = 0; i < 8; i++)
+            {
+                materials[i] = {
+                    {{0.1f, 0.1f, 0.1f, 1}},
+                    {{0.2f + 0.1f * i, 0.9f - 0.1f * i, 0.5f, 1}},
+                    {{0, 0, 0, 1}},
+                    8,
+                    {0, 0, 0}
+                };
+            }
+            for (int i = 0; i < 64 * 64; i++)
+                texels[i] = ((i / 8 + i / 512) & 1) ? 0xffff8080 : 0xffffffff;
+            texture = {64, 64, texels};
+        }
+
+        void quad(const Vector corners[4], Material *material)
+        {
+            Vertex v[4];
+            const TextureCoordiate uv[4] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+            for (int i = 0; i < 4; i++)
+                v[i] = {{0, 0, 1}, corners[i], uv[i], {}};
+            Polygon polygon = {4, {&v[0], &v[1], &v[2], &v[3]}, material};
+            render_polygon(polygon);
+        }
+
+        void draw(int layers, bool front_to_back)
+        {
+            clear(0xff000000);
+            clear_depth(1.0f);
+            enable_light(sun);
+            for (int l = 0; l < layers; l++)
+            {
+                int k = front_to_back ? l : layers - 1 - l;
+                float z = -2 - k * 0.05f;
+                float s = 1.5f + 0.3f * std::sin((float)k);
+                Vector corners[4] = {
+                    {-s, -s, z, 1}, {s, -s, z, 1}, {s, s, z, 1}, {-s, s, z, 1}
+                };
+                quad(corners, &materials[k & 7]);
+            }
+            Vector a[4] = {
+                {-1, -0.5f, -1.5f, 1}, {1, -0.5f, -1.0f, 1},
+                {1, 0.5f, -1.0f, 1}, {-1, 0.5f, -1.5f, 1}
+            };
+            Vector b[4] = {
+                {-1, -0.3f, -1.0f, 1}, {1, -0.3f, -1.5f, 1},
+                {1, 0.7f, -1.5f, 1}, {-1, 0.7f, -1.0f, 1}
+            };
+            quad(a, &materials[1]);
+            quad(b, &materials[2]);
+        }
+    };
+
+    /* a UV sphere of radius r with 4 * rings * rings triangles */
+    struct SphereMesh
+    {
+        std::vector<Vertex> vertices;
+        std::vector<int> indices;
+        Mesh mesh;
+
+        SphereMesh(int rings, float r, Material *material)
+        {
+            const float pi = 3.14159265f;
+            int segments = 2 * rings;
+            for (int i = 0; i <= rings; i++)
+            {
+                for (int j = 0; j < segments; j++)
+                {
+                    float theta = pi * i / rings;
+                    float phi = 2 * pi * j / segments;
+                    Vector n = {std::sin(theta) * std::cos(phi),
+                        std::cos(theta), std::sin(theta) * std::sin(phi), 1};
+                    Vector p = {r * n.x(), r * n.y(), r * n.z(), 1};
+                    vertices.push_back({{n.x(), n.y(), n.z()}, p, {0, 0}, {}});
+                }
+            }
+            for (int i = 0; i < rings; i++)
+            {
+                for (int j = 0; j < segments; j++)
+                {
+                    int a = i * segments + j;
+                    int b = i * segments + (j + 1) % segments;
+                    indices.insert(indices.end(), {a, a + segments, b,
+                            b, a + segments, b + segments});
+                }
+            }
+            mesh = {(int)vertices.size(), vertices.data(),
+                (int)indices.size() / 3, indices.data(), material};
+        }
+    };
+
+    /* FNV-1a of size bytes */
+    uint32 checksum(const void *data, size_t size)
+    {
+        const uint8 *bytes = (const uint8 *)data;
+        uint32 hash = 2166136261u;
+        for (size_t i = 0; i < size; i++)
+            hash = (hash ^ bytes[i]) * 16777619u;
+        return hash;
+    }
+
+    /* sums samples of the texture along a diagonal, calling F directly */
+    template<uint32 (*F)(const Texture &, float, float)>
+    uint32 sample_direct(const Texture &texture, int count)
+    {
+        uint32 sum = 0;
+        for (int i = 0; i < count; i++)
+            sum += F(texture, i / (float)count, 1.0f - i / (float)count);
+        return sum;
+    }
+
+    /* sample_direct through the kernel table */
+    uint32 sample_dispatched(const Texture &texture, int count)
+    {
+        uint32 sum = 0;
+        for (int i = 0; i < count; i++)
+            sum += internal::sample_texture(texture, i / (float)count,
+                    1.0f - i / (float)count);
+        return sum;
+    }
+
+    /*
+     * kernels: every kernel of the set SSRE_KERNELS picks, with a
+     * checksum of what it produced to compare the sets with
+     */
+    int bench_kernels(int, char **)
+    {
+        using internal::kernels;
+        std::printf("kernel set %s\n", kernel_set());
+        open_bench_window();
+
+        std::vector<uint32> frame(BENCH_WIDTH * BENCH_HEIGHT);
+        double time = best_of(20, [&]() {
+            kernels.fill(frame.data(), 0xff204060, (int)frame.size());
+        });
+        std::printf("%-18s %8.3fms  %08x\n", "fill", time,
+                checksum(frame.data(), frame.size() * 4));
+
+        const int vertex_count = 1 << 16;
+        std::vector<Vertex> source(vertex_count), dest(vertex_count);
+        for (int i = 0; i < vertex_count; i++)
+        {
+            float a = i * 0.001f;
+            source[i] = {{std::sin(a), std::cos(a), 0.5f, 0},
+                {std::cos(a) * 3, std::sin(a) * 2, a, 1}, {a, -a},
+                {std::cos(a), 0.25f, std::sin(a), i & 1 ? 1.0f : -1.0f}};
+        }
+        Matrix m, normal_matrix;
+        for (int r = 0; r < 4; r++)
+        {
+            for (int c = 0; c < 4; c++)
+            {
+                m.v[r][c] = (r == c ? 1.0f : 0.0f) + 0.1f * (r + 2 * c);
+                normal_matrix.v[r][c] = (r == c ? 0.9f : 0.05f * (c - r));
+            }
+        }
+        time = best_of(20, [&]() {
+            kernels.transform_vertices(m, normal_matrix, source.data(),
+                    dest.data(), vertex_count);
+        });
+        std::printf("%-18s %8.3fms  %08x\n", "transform 64K", time,
+                checksum(dest.data(), dest.size() * sizeof(Vertex)));
+
+        std::vector<float> depths(frame.size());
+        time = best_of(20, [&]() {
+            for (int y = 0; y < BENCH_HEIGHT; y++)
+            {
+                // half of every row passes the depth test
+                float attributes[internal::U_ATTRIBUTE] = {
+                    0.25f + y * 0.001f, 0.1f, 0.9f, 0.3f, 1.0f};
+                float steps[internal::U_ATTRIBUTE] = {
+                    0.001f, 0.0013f, -0.0011f, 0.0009f, 0.0f};
+                uint32 *row = frame.data() + y * BENCH_WIDTH;
+                float *depth_row = depths.data() + y * BENCH_WIDTH;
+                std::fill(depth_row, depth_row + BENCH_WIDTH, 0.57f);
+                kernels.color_span(row, depth_row, attributes, steps,
+                        BENCH_WIDTH, true);
+            }
+        });
+        std::printf("%-18s %8.3fms  %08x %08x\n", "color span", time,
+                checksum(frame.data(), frame.size() * 4),
+                checksum(depths.data(), depths.size() * 4));
+
+        const int samples = 1 << 20;
+        std::vector<uint32> texels(256 * 256);
+        for (int i = 0; i < 256 * 256; i++)
+            texels[i] = i * 2654435761u;
+        Texture texture = {256, 256, texels.data()};
+        uint32 (*direct)(const Texture &, int) =
+            sample_direct<internal::sample_texture_scalar>;
+#ifdef __SSE2__
+        if (kernels.level == internal::SSE2Kernels)
+            direct = sample_direct<internal::sample_texture_sse2>;
+#endif
+#ifdef SSRE_X86_KERNELS
+        if (kernels.level >= internal::AVX2Kernels)
+            direct = sample_direct<internal::sample_texture_avx2>;
+#endif
+        uint32 sum = 0;
+        time = best_of(10, [&]() { sum = direct(texture, samples); });
+        std::printf("%-18s %8.3fms  %08x\n", "sample 1M direct", time, sum);
+        time = best_of(10, [&]() {
+            sum = sample_dispatched(texture, samples);
+        });
+        std::printf("%-18s %8.3fms  %08x\n", "sample 1M table", time, sum);
+
+        // the span kernel inside the rasterizer
+        Material material = {
+            {{0.1f, 0.1f, 0.1f, 1}},
+            {{0.6f, 0.5f, 0.4f, 1}},
+            {{0, 0, 0, 1}},
+            8,
+            {0, 0, 0}
+        };
+        enable_z_buffer();
+        enable_clipping();
+        project_perspective(60.0f, 4.0f / 3.0f, 0.5f, 80.0f);
+        time = best_of(5, [&]() {
+            clear(0xff000000);
+            clear_depth(1.0f);
+            enable_light(sun);
+            for (int l = 49; l >= 0; l--)
+            {
+                float z = -2 - l * 0.05f, s = 1.6f;
+                Vertex v[4] = {
+                    {{0, 0, 1}, {-s, -s, z, 1}, {0, 0}, {}},
+                    {{0.3f, 0, 1}, {s, -s, z, 1}, {1, 0}, {}},
+                    {{0, 0.3f, 1}, {s, s, z, 1}, {1, 1}, {}},
+                    {{-0.3f, 0, 1}, {-s, s, z, 1}, {0, 1}, {}}
+                };
+                Polygon polygon = {4, {&v[0], &v[1], &v[2], &v[3]},
+                    &material};
+                render_polygon(polygon);
+            }
+        });
+        std::printf("%-18s %8.3fms  %08x\n", "50 lit layers", time,
+                checksum(pixels, width * height * 4));
+        present();
+
+        // the resolve clears hdr_pixels, every run gets them again
+        enable_hdr(ToneMapACES, 1.0f);
+        time = best_of(20, [&]() {
+            for (int i = 0; i < width * height; i++)
+                internal::hdr_pixels[i] = (uint64)i * 0x0001000300050007ull &
+                    0x3bff3bff3bff3bffull;
+        }, [&]() {
+            kernels.tone_map_pixels(0, width * height);
+        });
+        std::printf("%-18s %8.3fms  %08x\n", "tone map", time,
+                checksum(pixels, width * height * 4));
+        disable_hdr();
+        present();
+        destroy_window();
+        return 0;
+    }
+
+    /*
+     * mesh [threads...]: render_mesh of a lit sphere of 262144
+     * triangles with every worker count, each frame compared with the
+     * first one
+     */
+    int bench_mesh(int argc, char **argv)
+    {
+        std::vector<int> threads;
+        for (int i = 0; i < argc; i++)
+            threads.push_back(std::atoi(argv[i]));
+        if (threads.empty())
+            threads = {1, 4, 8};
+        Material material = {
+            {{0.1f, 0.1f, 0.1f, 1}},
+            {{0.8f, 0.6f, 0.4f, 1}},
+            {{0, 0, 0, 1}},
+            8,
+            {0, 0, 0}
+        };
+        SphereMesh sphere(256, 1.2f, &material);
+        open_bench_window();
+        enable_z_buffer();
+        enable_clipping();
+        enable_culling();
+        view_look_at(0, 0, 2.5f, 0, 0, 0, 0, 1, 0);
+        project_perspective(60.0f, 4.0f / 3.0f, 0.5f, 60.0f);
+        std::vector<uint32> first;
+        for (int count : threads)
+        {
+            set_worker_thread_count(count);
+            double time = best_of(5, [&]() {
+                enable_light(sun);
+                clear(0xff000000);
+                clear_depth(1.0f);
+                render_mesh(sphere.mesh);
+            });
+            if (first.empty())
+                first.assign(pixels, pixels + width * height);
+            int largest;
+            int off = frame_difference(first, largest);
+            std::printf("%d triangles, %d workers: %.1fms, %d pixels off\n",
+                    sphere.mesh.triangle_count, count, time, off);
+            present();
+        }
+        destroy_window();
+        return 0;
+    }
+
+    /* outline [rings]: silhouette of a sphere, 2M triangles by default */
+    int bench_outline(int argc, char **argv)
+    {
+        int rings = argc > 0 ? std::atoi(argv[0]) : 700;
+        Material material = {
+            {{0.1f, 0.1f, 0.1f, 1}},
+            {{0.8f, 0.8f, 0.8f, 1}},
+            {{0, 0, 0, 1}},
+            8,
+            {0, 0, 0}
+        };
+        SphereMesh sphere(rings, 1.0f, &material);
+        double start = now_ms();
+        EdgeMesh edges = create_edge_mesh(sphere.mesh, 30.0f);
+        std::printf("%d triangles, %d edges built in %.0fms\n",
+                sphere.mesh.triangle_count, edges.edge_count,
+                now_ms() - start);
+        open_bench_window();
+        view_look_at(0, 1, 3, 0, 0, 0, 0, 1, 0);
+        project_perspective(60.0f, 4.0f / 3.0f, 0.5f, 30.0f);
+        double time = best_of(3, [&]() {
+            clear(0xff000000);
+            render_outline(sphere.mesh, edges, 0xffffffff);
+        });
+        int lit = 0;
+        for (int i = 0; i < width * height; i++)
+            lit += pixels[i] != 0xff000000;
+        std::printf("outline %.1fms, %d pixels drawn\n", time, lit);
+        present();
+        release_edge_mesh(edges);
+        destroy_window();
+        return 0;
+    }
+
+    /*
+     * skinning [instances] [md5mesh md5anim]: one skin_instances call
+     * over differently posed instances, with the blend loop of the
+     * kernel set SSRE_KERNELS picks
+     */
+    int bench_skinning(int argc, char **argv)
+    {
+        int count = argc > 0 ? std::atoi(argv[0]) : 200;
+        const char *mesh_file = argc > 2 ? argv[1] :
+            "../ogldev/content/boblampclean.md5mesh";
+        const char *animation_file = argc > 2 ? argv[2] :
+            "../ogldev/content/boblampclean.md5anim";
+        Material material = {
+            {{0.2f, 0.2f, 0.2f, 1}},
+            {{0.8f, 0.7f, 0.6f, 1}},
+            {{0, 0, 0, 1}},
+            8,
+            {0, 0, 0}
+        };
+        SkinnedModel *model = load_md5_model(mesh_file);
+        SkeletalAnimation *animation = load_md5_animation(animation_file);
+        std::vector<SkinnedInstance *> instances;
+        for (int i = 0; i < count; i++)
+        {
+            instances.push_back(create_skinned_instance(model, &material));
+            pose_skinned_instance(instances.back(), animation, i * 37.0f);
+        }
+        int vertices = 0;
+        for (int k = 0; k < skinned_mesh_count(instances[0]); k++)
+            vertices += skinned_mesh(instances[0], k).vertex_count;
+        open_bench_window();
+        double time = best_of(10, [&]() {
+            skin_instances(instances.data(), count);
+        });
+        uint32 sum = 0;
+        for (int k = 0; k < skinned_mesh_count(instances[0]); k++)
+        {
+            const Mesh &mesh = skinned_mesh(instances[0], k);
+            sum ^= checksum(mesh.vertices,
+                    mesh.vertex_count * sizeof(Vertex));
+        }
+        std::printf("%s: %d instances of %d vertices skinned in %.2fms  "
+                "%08x\n", kernel_set(), count, vertices, time, sum);
+        for (SkinnedInstance *instance : instances)
+            destroy_skinned_instance(instance);
+        destroy_skeletal_animation(animation);
+        destroy_skinned_model(model);
+        destroy_window();
+        return 0;
+    }
+
+    /*
+     * perspective [frame file]: a checkered floor reaching into the
+     * distance. The frame is saved to a file that does not exist yet
+     * and compared with one that does, so that a build with
+     * -DSSRE_PERSPECTIVE_BLOCK=1 can serve as the reference
+     */
+    int bench_perspective(int argc, char **argv)
+    {
+        std::vector<uint32> texels(256 * 256);
+        for (int y = 0; y < 256; y++)
+            for (int x = 0; x < 256; x++)
+                texels[y * 256 + x] = (((x / 8) ^ (y / 8)) & 1) ?
+                    0xff202020 : 0xffe0e0e0;
+        Texture texture = {256, 256, texels.data()};
+        Material material = {
+            {{1, 1, 1, 1}},
+            {{0, 0, 0, 1}},
+            {{0, 0, 0, 1}},
+            1,
+            {0, 0, 0}
+        };
+        LightingSource ambient = {
+            DirectionalSource,
+            {0, 0, 1, 0},
+            {0, 0, 1},
+            {
+                {{1, 1, 1, 1}},
+                {{0, 0, 0, 0}},
+                {{0, 0, 0, 0}},
+            },
+            {1, 0, 0},
+            0,
+            false
+        };
+        Vertex v[4] = {
+            {{0, 1, 0}, {-4, 0, 1, 1}, {0, 0}, {}},
+            {{0, 1, 0}, {4, 0, 1, 1}, {1, 0}, {}},
+            {{0, 1, 0}, {4, 0, -30, 1}, {1, 1}, {}},
+            {{0, 1, 0}, {-4, 0, -30, 1}, {0, 1}, {}}
+        };
+        Polygon floor = {4, {&v[0], &v[1], &v[2], &v[3]}, &material};
+        open_bench_window();
+        enable_z_buffer();
+        enable_clipping();
+        view_look_at(0, 1, 2, 0, 0, -3, 0, 1, 0);
+        project_perspective(60.0f, 4.0f / 3.0f, 0.1f, 50.0f);
+        enable_texture(texture);
+        texture_mode_decal();
+        double time = best_of(10, [&]() {
+            enable_light(ambient);
+            clear(0xff000000);
+            clear_depth(1.0f);
+            render_polygon(floor);
+        });
+        std::printf("floor %.2fms\n", time);
+        if (argc > 0)
+        {
+            int n = width * height;
+            std::vector<uint32> reference(n);
+            FILE *file = std::fopen(argv[0], "rb");
+            if (file && std::fread(reference.data(), 4, n, file) == (size_t)n)
+            {
+                int largest;
+                int off = frame_difference(reference, largest);
+                std::printf("%d pixels off by up to %d\n", off, largest);
+            }
+            else
+            {
+                if (file)
+                    std::fclose(file);
+                file = std::fopen(argv[0], "wb");
+                if (!file)
+                {
+                    std::perror(argv[0]);
+                    return 1;
+                }
+                std::fwrite(pixels, 4, n, file);
+                std::printf("frame saved to %s\n", argv[0]);
+            }
+            std::fclose(file);
+        }
+        present();
+        destroy_window();
+        return 0;
+    }
+
+    /* sbuffer [layers...]: z-buffer against S-buffer */
+    int bench_sbuffer(int argc, char **argv)
+    {
+        std::vector<int> layers;
+        for (int i = 0; i < argc; i++)
+            layers.push_back(std::atoi(argv[i]));
+        if (layers.empty())
+            layers = {1, 100, 1000};
+        open_bench_window();
+        enable_z_buffer();
+        enable_clipping();
+        project_perspective(60.0f, 4.0f / 3.0f, 0.5f, 80.0f);
+        LayerScene *scene = new LayerScene();
+        enable_texture(scene->texture);
+        texture_mode_modulate();
+        std::printf("%-8s %-14s %10s %10s  %s\n", "layers", "order",
+                "z-buffer", "S-buffer", "pixels off (by up to)");
+        for (int n : layers)
+        {
+            for (int front_to_back = 1; front_to_back >= 0; front_to_back--)
+            {
+                auto draw = [&]() { scene->draw(n, front_to_back); };
+                disable_s_buffer();
+                double z_time = best_of(3, draw);
+                std::vector<uint32> z_frame(pixels, pixels + width * height);
+                present();
+                enable_s_buffer();
+                double s_time = best_of(3, draw);
+                int largest;
+                int off = frame_difference(z_frame, largest);
+                disable_s_buffer();
+                present();
+                std::printf("%-8d %-14s %8.1fms %8.1fms  %d (%d)\n", n,
+                        front_to_back ? "front to back" : "back to front",
+                        z_time, s_time, off, largest);
+            }
+        }
+        delete scene;
+        destroy_window();
+        return 0;
+    }
+
+    struct Bench
+    {
+        const char *name;
+        const char *arguments;
+        int (*run)(int argc, char **argv);
+    };
+
+    const Bench benches[] = {
+        {"kernels", "", bench_kernels},
+        {"mesh", "[threads...]", bench_mesh},
+        {"outline", "[rings]", bench_outline},
+        {"perspective", "[frame file]", bench_perspective},
+        {"sbuffer", "[layers...]", bench_sbuffer},
+        {"skinning", "[instances] [md5mesh md5anim]", bench_skinning},
+    };
+}
+
+int run_bench(int argc, char **argv)
+{
+    for (const Bench &bench : benches)
+    {
+        if (argc > 0 && std::strcmp(argv[0], bench.name) == 0)
+            return bench.run(argc - 1, argv + 1);
+    }
+    std::fprintf(stderr, "usage: ssre bench <name> [arguments]\n");
+    for (const Bench &bench : benches)
+        std::fprintf(stderr, "    %s %s\n", bench.name, bench.arguments);
+    return 1;
+}
@@ -1,5 +1,8 @@
+#include <cstring>
 #include "ssre.h"
 
+int run_bench(int argc, char **argv);
+
 ssre::Vector positions[] = {
             {100, 100, 100, 1},
             {-100, 100, 100, 1},
@@ -46,30 +49,30 @@ ssre::TextureCoordiate tc2 = {1.0f, 1.0f};
 ssre::TextureCoordiate tc3 = {1.0f, 0.0f};
 
 ssre::Vertex vertices[] = {
-    {positions[0], positions[0], tc0},
-    {positions[1], positions[1], tc1},
-    {positions[2], positions[2], tc2},
-    {positions[3], positions[3], tc3},
-    {positions[4], positions[4], tc0},
-    {positions[5], positions[5], tc1},
-    {positions[6], positions[6], tc2},
-    {positions[7], positions[7], tc3},
-    {positions[8], positions[8], tc0},
-    {positions[9], positions[9], tc1},
-    {positions[10], positions[10], tc2},
-    {positions[11], positions[11], tc3},
-    {positions[12], positions[12], tc0},
-    {positions[13], positions[13], tc1},
-    {positions[14], positions[14], tc2},
-    {positions[15], positions[15], tc3},
-    {positions[16], positions[16], tc0},
-    {positions[17], positions[17], tc1},
-    {positions[18], positions[18], tc2},
-    {positions[19], positions[19], tc3},
-    {positions[20], positions[20], tc0},
-    {positions[21], positions[21], tc1},
-    {positions[22], positions[22], tc2},
-    {positions[23], positions[23], tc3},
+    {positions[0], positions[0], tc0, {}},
+    {positions[1], positions[1], tc1, {}},
+    {positions[2], positions[2], tc2, {}},
+    {positions[3], positions[3], tc3, {}},
+    {positions[4], positions[4], tc0, {}},
+    {positions[5], positions[5], tc1, {}},
+    {positions[6], positions[6], tc2, {}},
+    {positions[7], positions[7], tc3, {}},
+    {positions[8], positions[8], tc0, {}},
+    {positions[9], positions[9], tc1, {}},
+    {positions[10], positions[10], tc2, {}},
+    {positions[11], positions[11], tc3, {}},
+    {positions[12], positions[12], tc0, {}},
+    {positions[13], positions[13], tc1, {}},
+    {positions[14], positions[14], tc2, {}},
+    {positions[15], positions[15], tc3, {}},
+    {positions[16], positions[16], tc0, {}},
+    {positions[17], positions[17], tc1, {}},
+    {positions[18], positions[18], tc2, {}},
+    {positions[19], positions[19], tc3, {}},
+    {positions[20], positions[20], tc0, {}},
+    {positions[21], positions[21], tc1, {}},
+    {positions[22], positions[22], tc2, {}},
+    {positions[23], positions[23], tc3, {}},
 };
 
 ssre::MaterialColor zero = {{0, 0, 0, 1}};
@@ -80,7 +83,7 @@ ssre::MaterialColor light = {{0.8, 0.8, 0.8, 1.0}};
 ssre::MaterialColor one = {{1, 1, 1, 1}};
 
 ssre::Material material = {
-    zero, light_dark, light_light, 0
+    zero, light_dark, light_light, 0, {0, 0, 0}
 };
 
 ssre::Polygon polygons[] = {
@@ -140,9 +143,11 @@ void make_check_image()
 }
 
 
-int main() 
+int main(int argc, char **argv)
 {
     using namespace ssre;
+    if (argc > 1 && std::strcmp(argv[1], "bench") == 0)
+        return run_bench(argc - 2, argv + 2);
     init_window("SSRE Window",
             SSRE_WINDOW_DEFAULT_X, SSRE_WINDOW_DEFAULT_Y,
             800, 400, SSRE_WINDOW_OPENGL);
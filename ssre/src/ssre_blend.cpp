@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <vector>
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    void enable_blending()
+    {
+        internal::blending_enabled = true;
+    }
+
+    void disable_blending()
+    {
+        internal::blending_enabled = false;
+    }
+
+    void blend_mode_sorted()
+    {
+        internal::blend_mode = internal::Sorted;
+    }
+
+    void blend_mode_order_independent()
+    {
+        internal::blend_mode = internal::OrderIndependent;
+    }
+
+    void blend_mode_additive()
+    {
+        internal::blend_mode = internal::Additive;
+    }
+
+    namespace internal
+    {
+        bool blending_enabled = false;
+        BlendMode blend_mode = Sorted;
+
+        /* rows handed to a worker at a time when resolving */
+        const int RESOLVE_ROW_GRAIN = 16;
+
+        struct Fragment
+        {
+            uint32 color;
+            float z;
+            Fragment *next;
+        };
+
+        /* per pixel list heads, the fragments live in the frame arena */
+        static std::vector<Fragment *> fragment_heads;
+        static bool fragments_pending = false;
+
+        uint32 blend_color(uint32 src, uint32 dest)
+        {
+            uint32 a = SSRE_A(src);
+            if (a == 0xff)
+                return src;
+            if (a == 0)
+                return dest;
+            // (s * a + d * (255 - a)) / 255 on two channels at a time
+            uint32 ia = 255 - a;
+            uint32 rb = (src & 0xff00ff) * a + (dest & 0xff00ff) * ia;
+            uint32 g = SSRE_G(src) * a + SSRE_G(dest) * ia;
+            rb = ((rb + 0x800080 + ((rb >> 8) & 0xff00ff)) >> 8) & 0xff00ff;
+            g = ((g + 0x80 + (g >> 8)) >> 8) << 8;
+            uint32 da = SSRE_A(dest);
+            uint32 oa = a + (da * ia + 127) / 255;
+            return (oa << 24) | rb | g;
+        }
+
+        uint32 add_saturate(uint32 c0, uint32 c1)
+        {
+            // add the low 7 bits of every channel, then fix up bit 7
+            // and saturate the channels that carried out
+            uint32 sum = (c0 & 0x7f7f7f7f) + (c1 & 0x7f7f7f7f);
+            uint32 high = (c0 ^ c1) & 0x80808080;
+            uint32 carry = ((c0 & c1) | (high & sum)) & 0x80808080;
+            return (sum ^ high) | ((carry >> 7) * 0xff);
+        }
+
+        uint32 add_color(uint32 src, uint32 dest)
+        {
+            uint32 a = SSRE_A(src);
+            uint32 r = (SSRE_R(src) * a + 127) / 255;
+            uint32 g = (SSRE_G(src) * a + 127) / 255;
+            uint32 b = (SSRE_B(src) * a + 127) / 255;
+            return add_saturate(SSRE_ARGB(0, r, g, b), dest);
+        }
+
+        void append_fragment(int index, uint32 color, float z)
+        {
+            size_t size = (size_t)window_width * window_height;
+            if (fragment_heads.size() < size)
+                fragment_heads.resize(size, nullptr);
+            Fragment *fragment = buffer.arena.allocate<Fragment>();
+            fragment->color = color;
+            fragment->z = z;
+            fragment->next = fragment_heads[index];
+            fragment_heads[index] = fragment;
+            fragments_pending = true;
+        }
+
+        /*
+         * fragments behind opaque surfaces drawn after them are dropped,
+         * with the depth test in effect at the resolve
+         */
+        void resolve_pixel_fragments(Fragment *head, uint32 &pixel,
+                float depth, std::vector<Fragment *> &sorted)
+        {
+            sorted.clear();
+            for (Fragment *f = head; f; f = f->next)
+                if (!z_buffer_enabled || compare(depth_function, f->z, depth))
+                    sorted.push_back(f);
+            // the lists are built by prepending, restore submission order
+            // so the stable sort keeps it for fragments at equal depth
+            std::reverse(sorted.begin(), sorted.end());
+            std::stable_sort(sorted.begin(), sorted.end(),
+                    [](const Fragment *f0, const Fragment *f1) {
+                        return f0->z > f1->z;
+                    });
+            uint32 color = pixel;
+            for (const Fragment *f : sorted)
+                color = blend_color(f->color, color);
+            pixel = color;
+        }
+
+        void resolve_fragments(uint32 *pixels, const float *depths,
+                int width, int height)
+        {
+            if (!fragments_pending)
+                return;
+            Fragment **heads = fragment_heads.data();
+            parallel_for(0, height, RESOLVE_ROW_GRAIN, [&](int y0, int y1) {
+                std::vector<Fragment *> sorted;
+                for (int i = y0 * width, end = y1 * width; i < end; i++)
+                {
+                    if (!heads[i])
+                        continue;
+                    resolve_pixel_fragments(heads[i], pixels[i], depths[i],
+                            sorted);
+                    heads[i] = nullptr;
+                }
+            });
+            fragments_pending = false;
+        }
+    }
+}
@@ -8,9 +8,48 @@ namespace ssre
     {
         SSREBuffer buffer;
 
+        const size_t FrameArena::BLOCK_SIZE;
+
+        FrameArena::~FrameArena()
+        {
+            for (Block &block : blocks)
+                delete[] block.data;
+        }
+
+        void *FrameArena::allocate(size_t size, size_t alignment)
+        {
+            while (current < blocks.size())
+            {
+                Block &block = blocks[current];
+                size_t start = (offset + alignment - 1) & ~(alignment - 1);
+                if (start + size <= block.size)
+                {
+                    offset = start + size;
+                    return block.data + start;
+                }
+                ++current;
+                offset = 0;
+            }
+            // blocks are new[]-ed, so they are aligned for any scalar type
+            size_t block_size = std::max(BLOCK_SIZE, size);
+            Block block = {new uint8[block_size], block_size};
+            blocks.push_back(block);
+            current = blocks.size() - 1;
+            offset = size;
+            return block.data;
+        }
+
+        void FrameArena::reset()
+        {
+            current = 0;
+            offset = 0;
+        }
+
         void SSREBuffer::reset()
         {
             lighting_source_count = 0;
+            shadow_map_count = 0;
+            arena.reset();
         }
     }
 }
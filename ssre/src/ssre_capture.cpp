@@ -0,0 +1,364 @@
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    namespace internal
+    {
+        /*
+         * BT.601 studio range in 8 bit fixed point, chroma from the sum
+         * of a 2x2 block. Coefficients are in B, G, R, A order, the
+         * order of the bytes of an ARGB pixel in memory
+         */
+        inline uint8 luma(uint32 c)
+        {
+            return ((66 * SSRE_R(c) + 129 * SSRE_G(c) + 25 * SSRE_B(c) +
+                        128) >> 8) + 16;
+        }
+
+        inline uint8 chroma(int b, int g, int r, int cb, int cg, int cr)
+        {
+            return ((cb * b + cg * g + cr * r + 512) >> 10) + 128;
+        }
+
+        void convert_luma(const uint32 *src, uint8 *dest, int count)
+        {
+            int x = 0;
+#ifdef __SSE2__
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i weights = _mm_setr_epi16(25, 129, 66, 0,
+                    25, 129, 66, 0);
+            const __m128i round = _mm_set1_epi32(128);
+            const __m128i offset = _mm_set1_epi16(16);
+            // the sums of the B, G and R, A pairs of four pixels
+            auto four = [&](__m128i pixels) {
+                __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero),
+                        weights);
+                __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero),
+                        weights);
+                __m128 a = _mm_castsi128_ps(lo), b = _mm_castsi128_ps(hi);
+                __m128i even = _mm_castps_si128(_mm_shuffle_ps(a, b,
+                            _MM_SHUFFLE(2, 0, 2, 0)));
+                __m128i odd = _mm_castps_si128(_mm_shuffle_ps(a, b,
+                            _MM_SHUFFLE(3, 1, 3, 1)));
+                return _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(even, odd),
+                            round), 8);
+            };
+            for (; x + 8 <= count; x += 8)
+            {
+                __m128i y0 = four(_mm_loadu_si128((const __m128i *)(src + x)));
+                __m128i y1 = four(_mm_loadu_si128(
+                            (const __m128i *)(src + x + 4)));
+                __m128i y = _mm_add_epi16(_mm_packs_epi32(y0, y1), offset);
+                _mm_storel_epi64((__m128i *)(dest + x),
+                        _mm_packus_epi16(y, zero));
+            }
+#endif
+            for (; x < count; x++)
+                dest[x] = luma(src[x]);
+        }
+
+        /* a row of chroma from two rows of pixels, odd ends repeat */
+        void convert_chroma(const uint32 *row0, const uint32 *row1,
+                uint8 *u, uint8 *v, int count)
+        {
+            int x = 0;
+#ifdef __SSE2__
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i u_weights = _mm_setr_epi16(112, -74, -38, 0,
+                    112, -74, -38, 0);
+            const __m128i v_weights = _mm_setr_epi16(-18, -94, 112, 0,
+                    -18, -94, 112, 0);
+            const __m128i round = _mm_set1_epi32(512);
+            const __m128i offset = _mm_set1_epi32(128);
+            // two blocks of four pixels at a time
+            for (; 2 * x + 4 <= count; x += 2)
+            {
+                __m128i a = _mm_loadu_si128((const __m128i *)(row0 + 2 * x));
+                __m128i b = _mm_loadu_si128((const __m128i *)(row1 + 2 * x));
+                __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+                        _mm_unpacklo_epi8(b, zero));
+                __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+                        _mm_unpackhi_epi8(b, zero));
+                __m128i blocks = _mm_unpacklo_epi64(
+                        _mm_add_epi16(lo, _mm_srli_si128(lo, 8)),
+                        _mm_add_epi16(hi, _mm_srli_si128(hi, 8)));
+                __m128 us = _mm_castsi128_ps(_mm_madd_epi16(blocks, u_weights));
+                __m128 vs = _mm_castsi128_ps(_mm_madd_epi16(blocks, v_weights));
+                // u of both blocks, then v of both
+                __m128i sums = _mm_add_epi32(
+                        _mm_castps_si128(_mm_shuffle_ps(us, vs,
+                                _MM_SHUFFLE(2, 0, 2, 0))),
+                        _mm_castps_si128(_mm_shuffle_ps(us, vs,
+                                _MM_SHUFFLE(3, 1, 3, 1))));
+                sums = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(sums, round),
+                            10), offset);
+                int32 c[4];
+                _mm_storeu_si128((__m128i *)c, sums);
+                u[x] = c[0];
+                u[x + 1] = c[1];
+                v[x] = c[2];
+                v[x + 1] = c[3];
+            }
+#endif
+            for (; 2 * x < count; x++)
+            {
+                int x1 = std::min(2 * x + 1, count - 1);
+                uint32 p[4] = {row0[2 * x], row0[x1], row1[2 * x], row1[x1]};
+                int b = 0, g = 0, r = 0;
+                for (uint32 c : p)
+                {
+                    b += SSRE_B(c);
+                    g += SSRE_G(c);
+                    r += SSRE_R(c);
+                }
+                u[x] = chroma(b, g, r, 112, -74, -38);
+                v[x] = chroma(b, g, r, -18, -94, 112);
+            }
+        }
+
+        /*
+         * frames go from the renderer to the output thread through a
+         * ring of buffers, the renderer only ever copies into a free one
+         */
+        class FrameCapture
+        {
+        public:
+            FrameCapture() {}
+            ~FrameCapture() { stop(); }
+            DISABLE_COPY_AND_ASSIGN(FrameCapture);
+
+            void start(int fd, CaptureFormat format, int fps,
+                    int buffered_frames);
+            bool stop();
+            void capture(const uint32 *frame);
+
+            bool running = false;
+            int captured = 0;
+            int dropped = 0;
+
+        private:
+            void output();
+            void convert(const uint32 *frame);
+            bool write_all(const void *data, size_t size);
+
+            int fd;
+            CaptureFormat format;
+            int fps;
+            int width, height;
+            std::thread thread;
+            std::mutex mutex;
+            std::condition_variable frame_ready;
+            bool stopping = false;
+            bool failed = false;
+            std::vector<std::vector<uint32>> frames;
+            // indices into frames
+            std::vector<int> free_frames;
+            std::deque<int> queued;
+            // only touched by the output thread
+            std::vector<uint8> converted;
+        };
+
+        void FrameCapture::start(int fd, CaptureFormat format, int fps,
+                int buffered_frames)
+        {
+            this->fd = fd;
+            this->format = format;
+            this->fps = fps;
+            width = output_width;
+            height = output_height;
+            frames.assign(buffered_frames,
+                    std::vector<uint32>((size_t)width * height));
+            free_frames.clear();
+            for (int i = 0; i < buffered_frames; i++)
+                free_frames.push_back(i);
+            queued.clear();
+            captured = dropped = 0;
+            stopping = failed = false;
+            running = true;
+            thread = std::thread(&FrameCapture::output, this);
+        }
+
+        bool FrameCapture::stop()
+        {
+            if (!running)
+                return true;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            frame_ready.notify_one();
+            thread.join();
+            running = false;
+            frames.clear();
+            return !failed;
+        }
+
+        void FrameCapture::capture(const uint32 *frame)
+        {
+            int index;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (free_frames.empty() || failed)
+                {
+                    ++dropped;
+                    return;
+                }
+                index = free_frames.back();
+                free_frames.pop_back();
+            }
+            std::memcpy(frames[index].data(), frame,
+                    sizeof(uint32) * width * height);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                queued.push_back(index);
+            }
+            ++captured;
+            frame_ready.notify_one();
+        }
+
+        bool FrameCapture::write_all(const void *data, size_t size)
+        {
+            const char *bytes = (const char *)data;
+            while (size > 0)
+            {
+                ssize_t written = write(fd, bytes, size);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0)
+                    return false;
+                bytes += written;
+                size -= written;
+            }
+            return true;
+        }
+
+        void FrameCapture::convert(const uint32 *frame)
+        {
+            if (format == CaptureRGB)
+            {
+                converted.resize((size_t)width * height * 3);
+                uint8 *rgb = converted.data();
+                for (int i = 0; i < width * height; i++, rgb += 3)
+                {
+                    rgb[0] = SSRE_R(frame[i]);
+                    rgb[1] = SSRE_G(frame[i]);
+                    rgb[2] = SSRE_B(frame[i]);
+                }
+                return;
+            }
+            static const char tag[] = "FRAME\n";
+            int chroma_width = (width + 1) / 2, chroma_height = (height + 1) / 2;
+            size_t luma_size = (size_t)width * height;
+            size_t chroma_size = (size_t)chroma_width * chroma_height;
+            converted.resize(sizeof(tag) - 1 + luma_size + 2 * chroma_size);
+            std::memcpy(converted.data(), tag, sizeof(tag) - 1);
+            uint8 *y = converted.data() + sizeof(tag) - 1;
+            uint8 *u = y + luma_size, *v = u + chroma_size;
+            for (int row = 0; row < height; row++)
+                convert_luma(frame + row * width, y + row * width, width);
+            for (int row = 0; row < chroma_height; row++)
+            {
+                const uint32 *row0 = frame + 2 * row * width;
+                const uint32 *row1 = frame +
+                    std::min(2 * row + 1, height - 1) * width;
+                convert_chroma(row0, row1, u + row * chroma_width,
+                        v + row * chroma_width, width);
+            }
+        }
+
+        void FrameCapture::output()
+        {
+            // a reader that went away fails the writes with EPIPE instead
+            // of killing the process, the signal stays with this thread
+            sigset_t pipe_signal;
+            sigemptyset(&pipe_signal);
+            sigaddset(&pipe_signal, SIGPIPE);
+            pthread_sigmask(SIG_BLOCK, &pipe_signal, nullptr);
+            if (format == CaptureY4M)
+            {
+                char header[128];
+                int length = std::snprintf(header, sizeof(header),
+                        "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+                        width, height, fps);
+                if (!write_all(header, length))
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    failed = true;
+                }
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true)
+            {
+                frame_ready.wait(lock, [&] {
+                    return stopping || !queued.empty();
+                });
+                if (queued.empty())
+                    return;
+                int index = queued.front();
+                queued.pop_front();
+                bool skip = failed;
+                lock.unlock();
+                if (!skip)
+                {
+                    convert(frames[index].data());
+                    skip = !write_all(converted.data(), converted.size());
+                }
+                lock.lock();
+                failed |= skip;
+                free_frames.push_back(index);
+            }
+        }
+
+        static FrameCapture frame_capture;
+
+        void capture_frame(const uint32 *frame)
+        {
+            if (frame_capture.running)
+                frame_capture.capture(frame);
+        }
+    }
+
+    void start_capture(int fd, CaptureFormat format, int fps,
+            int buffered_frames)
+    {
+        using namespace internal;
+        if (frame_capture.running)
+            throw new std::runtime_error("capture already started");
+        if (fd < 0 || fps <= 0 || buffered_frames < 1)
+            throw new std::invalid_argument("invalid capture settings");
+        frame_capture.start(fd, format, fps, buffered_frames);
+    }
+
+    void stop_capture()
+    {
+        if (!internal::frame_capture.stop())
+            throw new std::runtime_error("failed writing captured frames");
+    }
+
+    int captured_frame_count()
+    {
+        return internal::frame_capture.captured;
+    }
+
+    int dropped_frame_count()
+    {
+        return internal::frame_capture.dropped;
+    }
+}
@@ -0,0 +1,523 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    namespace internal
+    {
+        /* what render_eye_polygon and its spans read besides the polygon */
+        struct CommandState
+        {
+            bool texture_enabled;
+            Texture texture;
+            VirtualTexture *virtual_texture;
+            TextureMode texture_mode;
+            bool normal_map_enabled;
+            NormalMap normal_map;
+            bool blending_enabled;
+            BlendMode blend_mode;
+            bool culling_enabled;
+            bool clipping_enabled;
+            bool z_buffer_enabled;
+            CompareFunction depth_function;
+            bool stencil_test_enabled;
+            StencilState stencil_state;
+            bool s_buffer_enabled;
+            ShadowMode shadow_mode;
+            bool shadow_pcf_enabled;
+            TessellationMode tessellation_mode;
+            TessellationSettings tessellation_settings;
+            Matrix projection;
+            Matrix view_port;
+            int light_count;
+            LightingSource lights[SSREBuffer::LIGHTING_SOURCE_BUFFER_SIZE];
+        };
+
+        /* vertices and indices of a mesh or polygon, copied once */
+        struct CommandGeometry
+        {
+            int first_vertex;
+            int vertex_count;
+            int first_index;
+            // vertices per primitive, 3 for meshes
+            int sides;
+            int primitive_count;
+            Vector sphere;
+        };
+
+        struct Command
+        {
+            int geometry;
+            int state;
+            Material *material;
+            bool tessellate;
+            // eye distance of the bounding sphere, the sorting depth
+            float depth;
+            Matrix model_view;
+            Matrix normal_matrix;
+        };
+    }
+
+    struct CommandBuffer
+    {
+        std::vector<Vertex> vertices;
+        std::vector<int> indices;
+        std::vector<internal::CommandGeometry> geometries;
+        std::vector<internal::CommandState> states;
+        std::vector<internal::Command> commands;
+        // commands in execution order, set by end_command_buffer
+        std::vector<int> order;
+    };
+
+    namespace internal
+    {
+        /* draws transformed ahead of the rasterizer, and at a time */
+        const int COMMAND_BATCH_VERTICES = 1 << 16;
+        const int COMMAND_GRAIN = 16;
+
+        CommandBuffer *recording = nullptr;
+
+        /*
+         * zeroed first so that identical states compare equal with
+         * memcmp, padding included
+         */
+        void capture_state(CommandState &state)
+        {
+            memset((void *)&state, 0, sizeof(state));
+            state.texture_enabled = texture_enabled;
+            state.texture = texture;
+            state.virtual_texture = virtual_texture;
+            state.texture_mode = texture_mode;
+            state.normal_map_enabled = normal_map_enabled;
+            state.normal_map = normal_map;
+            state.blending_enabled = blending_enabled;
+            state.blend_mode = blend_mode;
+            state.culling_enabled = culling_enabled;
+            state.clipping_enabled = clipping_enabled;
+            state.z_buffer_enabled = z_buffer_enabled;
+            state.depth_function = depth_function;
+            state.stencil_test_enabled = stencil_test_enabled;
+            memcpy((void *)&state.stencil_state, (const void *)&stencil_state,
+                    sizeof(StencilState));
+            state.s_buffer_enabled = s_buffer_enabled;
+            state.shadow_mode = shadow_mode;
+            state.shadow_pcf_enabled = shadow_pcf_enabled;
+            state.tessellation_mode = tessellation_mode;
+            state.tessellation_settings = tessellation_settings;
+            state.projection = matrix_projection;
+            state.view_port = window_view_port;
+            state.light_count = buffer.lighting_source_count;
+            memcpy((void *)state.lights, buffer.lighting_sources,
+                    sizeof(LightingSource) * state.light_count);
+        }
+
+        void apply_state(const CommandState &state)
+        {
+            texture_enabled = state.texture_enabled;
+            texture = state.texture;
+            virtual_texture = state.virtual_texture;
+            texture_mode = state.texture_mode;
+            normal_map_enabled = state.normal_map_enabled;
+            normal_map = state.normal_map;
+            blending_enabled = state.blending_enabled;
+            blend_mode = state.blend_mode;
+            culling_enabled = state.culling_enabled;
+            clipping_enabled = state.clipping_enabled;
+            z_buffer_enabled = state.z_buffer_enabled;
+            depth_function = state.depth_function;
+            stencil_test_enabled = state.stencil_test_enabled;
+            stencil_state = state.stencil_state;
+            s_buffer_enabled = state.s_buffer_enabled;
+            shadow_mode = state.shadow_mode;
+            shadow_pcf_enabled = state.shadow_pcf_enabled;
+            tessellation_mode = state.tessellation_mode;
+            tessellation_settings = state.tessellation_settings;
+            matrix_projection = state.projection;
+            window_view_port = state.view_port;
+            update_view_port();
+            buffer.lighting_source_count = state.light_count;
+            memcpy((void *)buffer.lighting_sources, state.lights,
+                    sizeof(LightingSource) * state.light_count);
+        }
+
+        /* index of the current state, shared with earlier commands */
+        int record_state(CommandBuffer &commands)
+        {
+            CommandState state;
+            capture_state(state);
+            for (size_t i = 0; i < commands.states.size(); i++)
+                if (!memcmp((const void *)&commands.states[i],
+                            (const void *)&state, sizeof(state)))
+                    return i;
+            // a streamed texture has to outlive the frame it was handed
+            // out in for as long as the buffer may be executed
+            pin_streamed_texture(state.texture);
+            commands.states.push_back(state);
+            return commands.states.size() - 1;
+        }
+
+        void unpin_states(CommandBuffer &commands)
+        {
+            for (const CommandState &state : commands.states)
+                unpin_streamed_texture(state.texture);
+        }
+
+        int record_geometry(CommandBuffer &commands, const Vertex *vertices,
+                int vertex_count, const int *indices, int index_count,
+                int sides)
+        {
+            CommandGeometry geometry;
+            geometry.first_vertex = commands.vertices.size();
+            geometry.vertex_count = vertex_count;
+            geometry.first_index = commands.indices.size();
+            geometry.sides = sides;
+            geometry.primitive_count = index_count / sides;
+            commands.vertices.insert(commands.vertices.end(),
+                    vertices, vertices + vertex_count);
+            commands.indices.insert(commands.indices.end(),
+                    indices, indices + index_count);
+            Mesh mesh = {vertex_count, &commands.vertices[
+                geometry.first_vertex], 0, nullptr, nullptr};
+            geometry.sphere = bounding_sphere(mesh);
+            commands.geometries.push_back(geometry);
+            return commands.geometries.size() - 1;
+        }
+
+        void record_command(CommandBuffer &commands, int geometry,
+                Material *material, const Matrix &transform, bool tessellate)
+        {
+            Command command;
+            command.geometry = geometry;
+            command.state = record_state(commands);
+            command.material = material;
+            command.tessellate = tessellate;
+            command.model_view = matrix_model_view * transform;
+            command.normal_matrix = command.model_view.inverse().transpose();
+            const Vector &sphere = commands.geometries[geometry].sphere;
+            command.depth = -(command.model_view * Vector {sphere.x(),
+                    sphere.y(), sphere.z(), 1.0f}).z();
+            commands.commands.push_back(command);
+        }
+
+        void record_polygon(const Polygon &polygon)
+        {
+            Vertex vertices[SSRE_MAX_VERTEX_COUNT];
+            int indices[SSRE_MAX_VERTEX_COUNT];
+            for (int i = 0; i < polygon.count; i++)
+            {
+                vertices[i] = *polygon.vertices[i];
+                indices[i] = i;
+            }
+            int geometry = record_geometry(*recording, vertices,
+                    polygon.count, indices, polygon.count, polygon.count);
+            Matrix identity;
+            load_identity_matrix(identity);
+            record_command(*recording, geometry, polygon.material, identity,
+                    false);
+        }
+
+        void record_mesh(const Mesh &mesh, const Matrix transforms[],
+                int count, bool tessellate)
+        {
+            if (mesh.vertex_count == 0)
+                return;
+            int geometry = record_geometry(*recording, mesh.vertices,
+                    mesh.vertex_count, mesh.indices, mesh.triangle_count * 3,
+                    3);
+            for (int i = 0; i < count; i++)
+                record_command(*recording, geometry, mesh.material,
+                        transforms[i], tessellate);
+        }
+
+        /*
+         * opaque commands first, by state, then by the textures of
+         * their materials and then front to back, so that the depth test
+         * rejects most hidden pixels. Blended ones follow back to front
+         */
+        void sort_commands(CommandBuffer &commands)
+        {
+            const std::vector<Command> &c = commands.commands;
+            const std::vector<CommandState> &states = commands.states;
+            commands.order.resize(c.size());
+            for (size_t i = 0; i < c.size(); i++)
+                commands.order[i] = i;
+            std::sort(commands.order.begin(), commands.order.end(),
+                    [&](int a, int b) {
+                bool blended_a = states[c[a].state].blending_enabled;
+                bool blended_b = states[c[b].state].blending_enabled;
+                if (blended_a != blended_b)
+                    return blended_b;
+                if (!blended_a && c[a].state != c[b].state)
+                    return c[a].state < c[b].state;
+                const int *textures_a = c[a].material->textures;
+                const int *textures_b = c[b].material->textures;
+                if (!blended_a && !std::equal(textures_a,
+                            textures_a + SSRE_TEXTURE_UNITS, textures_b))
+                    return std::lexicographical_compare(textures_a,
+                            textures_a + SSRE_TEXTURE_UNITS, textures_b,
+                            textures_b + SSRE_TEXTURE_UNITS);
+                if (c[a].depth != c[b].depth)
+                    return blended_a ? c[a].depth > c[b].depth :
+                        c[a].depth < c[b].depth;
+                return a < b;
+            });
+        }
+
+        void render_command(const CommandBuffer &commands,
+                const Command &command, const Vertex *eye)
+        {
+            const CommandGeometry &geometry =
+                commands.geometries[command.geometry];
+            const int *indices = &commands.indices[geometry.first_index];
+            Polygon polygon;
+            polygon.count = geometry.sides;
+            polygon.material = command.material;
+            for (int p = 0; p < geometry.primitive_count; p++)
+            {
+                for (int k = 0; k < geometry.sides; k++)
+                    polygon.vertices[k] = const_cast<Vertex *>(
+                            &eye[indices[p * geometry.sides + k]]);
+                InternalPolygon internal_polygon(polygon);
+                render_eye_polygon(internal_polygon);
+            }
+        }
+
+        /* tessellation goes through the mesh path in its own eye space */
+        void render_tessellated_command(const CommandBuffer &commands,
+                const Command &command)
+        {
+            const CommandGeometry &geometry =
+                commands.geometries[command.geometry];
+            Mesh mesh = {geometry.vertex_count,
+                const_cast<Vertex *>(&commands.vertices[
+                        geometry.first_vertex]),
+                geometry.primitive_count,
+                const_cast<int *>(&commands.indices[geometry.first_index]),
+                command.material};
+            matrix_model_view = command.model_view;
+            model_view_inverse_transpose = command.normal_matrix;
+            render_tessellated_mesh(mesh);
+        }
+    }
+
+    namespace internal
+    {
+        /* FNV-1a, continued from hash */
+        uint64 hash_bytes(uint64 hash, const void *data, size_t size)
+        {
+            const uint8 *bytes = (const uint8 *)data;
+            for (size_t i = 0; i < size; i++)
+                hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+            return hash;
+        }
+
+        /*
+         * states are zeroed before they are captured, so they can be
+         * hashed whole. Materials are hashed by their colors and texture
+         * handles, textures by their pixel pointers
+         */
+        uint64 hash_command_buffer(const CommandBuffer &commands)
+        {
+            uint64 hash = 0xcbf29ce484222325ull;
+            hash = hash_bytes(hash, commands.vertices.data(),
+                    commands.vertices.size() * sizeof(Vertex));
+            hash = hash_bytes(hash, commands.indices.data(),
+                    commands.indices.size() * sizeof(int));
+            hash = hash_bytes(hash, commands.states.data(),
+                    commands.states.size() * sizeof(CommandState));
+            for (const Command &command : commands.commands)
+            {
+                const CommandGeometry &geometry =
+                    commands.geometries[command.geometry];
+                hash = hash_bytes(hash, &geometry.first_vertex, sizeof(int));
+                hash = hash_bytes(hash, &geometry.vertex_count, sizeof(int));
+                hash = hash_bytes(hash, &geometry.first_index, sizeof(int));
+                hash = hash_bytes(hash, &command.state, sizeof(int));
+                hash = hash_bytes(hash, &command.tessellate, sizeof(bool));
+                hash = hash_bytes(hash, command.material, sizeof(Material));
+                hash = hash_bytes(hash, &command.model_view, sizeof(Matrix));
+            }
+            return hash;
+        }
+
+        /*
+         * window pixels the commands may touch, the whole window when a
+         * vertex is behind the eye. Tessellated commands bulge out of
+         * their control points and are bounded by their spheres
+         */
+        void command_buffer_bounds(const CommandBuffer &commands,
+                int &x0, int &y0, int &x1, int &y1)
+        {
+            float low[2] = {1e30f, 1e30f}, high[2] = {-1e30f, -1e30f};
+            auto cover = [&](const Matrix &to_window, const Vector &p) {
+                Vector q = to_window * p;
+                if (q.h() <= 1e-6f)
+                    return false;
+                for (int k = 0; k < 2; k++)
+                {
+                    low[k] = std::min(low[k], q.v[k] / q.h());
+                    high[k] = std::max(high[k], q.v[k] / q.h());
+                }
+                return true;
+            };
+            bool bounded = true;
+            for (size_t i = 0; bounded && i < commands.commands.size(); i++)
+            {
+                const Command &command = commands.commands[i];
+                const CommandGeometry &geometry =
+                    commands.geometries[command.geometry];
+                const CommandState &state = commands.states[command.state];
+                Matrix to_window = render_view_port(state.view_port) *
+                    state.projection * command.model_view;
+                if (command.tessellate)
+                {
+                    const Vector &s = geometry.sphere;
+                    for (int corner = 0; bounded && corner < 8; corner++)
+                        bounded = cover(to_window, Vector {
+                                s.x() + (corner & 1 ? s.h() : -s.h()),
+                                s.y() + (corner & 2 ? s.h() : -s.h()),
+                                s.z() + (corner & 4 ? s.h() : -s.h()),
+                                1.0f});
+                    continue;
+                }
+                const Vertex *vertices =
+                    &commands.vertices[geometry.first_vertex];
+                for (int v = 0; bounded && v < geometry.vertex_count; v++)
+                    bounded = cover(to_window, vertices[v].position);
+            }
+            if (!bounded)
+            {
+                x0 = y0 = 0;
+                x1 = window_width;
+                y1 = window_height;
+                return;
+            }
+            // a pixel more on every side for the centers on the edges
+            x0 = std::max((int)std::floor(low[0]) - 1, 0);
+            y0 = std::max((int)std::floor(low[1]) - 1, 0);
+            x1 = std::min((int)std::ceil(high[0]) + 1, window_width);
+            y1 = std::min((int)std::ceil(high[1]) + 1, window_height);
+        }
+    }
+
+    CommandBuffer *create_command_buffer()
+    {
+        return new CommandBuffer;
+    }
+
+    void destroy_command_buffer(CommandBuffer *commands)
+    {
+        if (commands == internal::recording)
+            internal::recording = nullptr;
+        internal::unpin_states(*commands);
+        delete commands;
+    }
+
+    void begin_command_buffer(CommandBuffer *commands)
+    {
+        if (internal::recording)
+            throw new std::runtime_error("command buffer already begun");
+        internal::unpin_states(*commands);
+        commands->vertices.clear();
+        commands->indices.clear();
+        commands->geometries.clear();
+        commands->states.clear();
+        commands->commands.clear();
+        commands->order.clear();
+        internal::recording = commands;
+    }
+
+    void end_command_buffer()
+    {
+        if (!internal::recording)
+            throw new std::runtime_error("no command buffer to end");
+        internal::sort_commands(*internal::recording);
+        internal::recording = nullptr;
+    }
+
+    void execute_command_buffer(const CommandBuffer *commands)
+    {
+        using namespace internal;
+        if (recording)
+            throw new std::runtime_error(
+                    "command buffers cannot be executed while recording");
+        CommandState saved;
+        capture_state(saved);
+        Matrix model_view = matrix_model_view;
+        Matrix inverse_transpose = model_view_inverse_transpose;
+
+        const std::vector<int> &order = commands->order;
+        std::vector<Vertex> eye;
+        std::vector<int> offsets;
+        std::vector<uint8> visible;
+        int current_state = -1;
+        for (size_t first = 0; first < order.size();)
+        {
+            // the next commands, up to a batch of vertices
+            size_t last = first;
+            int vertex_count = 0;
+            offsets.clear();
+            while (last < order.size() && (last == first ||
+                        vertex_count < COMMAND_BATCH_VERTICES))
+            {
+                const Command &command = commands->commands[order[last++]];
+                offsets.push_back(vertex_count);
+                if (!command.tessellate)
+                    vertex_count += commands->geometries[
+                        command.geometry].vertex_count;
+            }
+            eye.resize(vertex_count);
+            visible.resize(last - first);
+
+            parallel_for(first, last, COMMAND_GRAIN, [&](int begin, int end) {
+                for (int i = begin; i < end; i++)
+                {
+                    const Command &command = commands->commands[order[i]];
+                    const CommandGeometry &geometry =
+                        commands->geometries[command.geometry];
+                    const CommandState &state =
+                        commands->states[command.state];
+                    // shadow casters may lie outside the view frustum,
+                    // and curved patches outside the control points
+                    visible[i - first] = !state.clipping_enabled ||
+                        shadow_pass || command.tessellate || !sphere_outside(
+                                state.projection * command.model_view,
+                                geometry.sphere);
+                    if (command.tessellate || !visible[i - first])
+                        continue;
+                    transform_vertices(command.model_view,
+                            command.normal_matrix,
+                            &commands->vertices[geometry.first_vertex],
+                            &eye[offsets[i - first]], geometry.vertex_count);
+                }
+            });
+
+            for (size_t i = first; i < last; i++)
+            {
+                const Command &command = commands->commands[order[i]];
+                if (!visible[i - first])
+                    continue;
+                if (command.state != current_state)
+                {
+                    apply_state(commands->states[command.state]);
+                    current_state = command.state;
+                }
+                if (command.tessellate)
+                    render_tessellated_command(*commands, command);
+                else
+                    render_command(*commands, command,
+                            &eye[offsets[i - first]]);
+            }
+            first = last;
+        }
+
+        apply_state(saved);
+        matrix_model_view = model_view;
+        model_view_inverse_transpose = inverse_transpose;
+    }
+}
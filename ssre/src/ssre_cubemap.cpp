@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    namespace internal
+    {
+        /* rows handed to a worker at a time */
+        const int SKYBOX_ROW_GRAIN = 16;
+
+        uint32 average_color(uint32 c0, uint32 c1, uint32 c2, uint32 c3)
+        {
+            uint32 rb = (c0 & 0xff00ff) + (c1 & 0xff00ff) +
+                (c2 & 0xff00ff) + (c3 & 0xff00ff) + 0x20002;
+            uint32 ag = ((c0 >> 8) & 0xff00ff) + ((c1 >> 8) & 0xff00ff) +
+                ((c2 >> 8) & 0xff00ff) + ((c3 >> 8) & 0xff00ff) + 0x20002;
+            return ((rb >> 2) & 0xff00ff) | ((ag << 6) & 0xff00ff00);
+        }
+
+        void downsample(const uint32 *src, uint32 *dest, int size)
+        {
+            int half = size >> 1;
+            for (int y = 0; y < half; y++)
+                for (int x = 0; x < half; x++)
+                {
+                    const uint32 *p = src + 2 * y * size + 2 * x;
+                    dest[y * half + x] = average_color(p[0], p[1],
+                            p[size], p[size + 1]);
+                }
+        }
+
+        /* bilinear sample, s and t in texels with the centers at +0.5 */
+        uint32 sample_face(const uint32 *pixels, int size, float s, float t)
+        {
+            s = std::min(std::max(s - 0.5f, 0.0f), size - 1.0f);
+            t = std::min(std::max(t - 0.5f, 0.0f), size - 1.0f);
+            int x = (int)s, y = (int)t;
+            int wx = (int)((s - x) * 256.0f), wy = (int)((t - y) * 256.0f);
+            int x1 = std::min(x + 1, size - 1);
+            const uint32 *row0 = pixels + y * size;
+            const uint32 *row1 = pixels + std::min(y + 1, size - 1) * size;
+            return lerp_color(lerp_color(row0[x], row0[x1], wx),
+                    lerp_color(row1[x], row1[x1], wx), wy);
+        }
+
+        uint32 sample_cube_map(const CubeMap &cube_map, float x, float y,
+                float z, int level)
+        {
+            // major axis picks the face, the others give the coordinates
+            // the way OpenGL orients them
+            float ax = std::abs(x), ay = std::abs(y), az = std::abs(z);
+            int face;
+            float sc, tc, ma;
+            if (ax >= ay && ax >= az)
+            {
+                face = x > 0.0f ? CubePositiveX : CubeNegativeX;
+                sc = x > 0.0f ? -z : z;
+                tc = -y;
+                ma = ax;
+            }
+            else if (ay >= az)
+            {
+                face = y > 0.0f ? CubePositiveY : CubeNegativeY;
+                sc = x;
+                tc = y > 0.0f ? z : -z;
+                ma = ay;
+            }
+            else
+            {
+                face = z > 0.0f ? CubePositiveZ : CubeNegativeZ;
+                sc = z > 0.0f ? x : -x;
+                tc = -y;
+                ma = az;
+            }
+            if (ma == 0.0f)
+                return 0;
+            int size = cube_map.size >> level;
+            float scale = 0.5f * size / ma;
+            return sample_face(cube_map.pixels[face][level], size,
+                    (sc * scale + 0.5f * size), (tc * scale + 0.5f * size));
+        }
+
+        int cube_map_level(const CubeMap &cube_map, float lod)
+        {
+            int level = (int)(lod + 0.5f);
+            return std::min(std::max(level, 0), cube_map.levels - 1);
+        }
+
+        void render_skybox(const CubeMap &cube_map, uint32 *pixels,
+                const float *depths, int width, int height)
+        {
+            // window position to a world space direction. Points on the
+            // far plane move linearly with the pixel, so the direction is
+            // stepped instead of unprojected per pixel
+            Matrix to_eye = (matrix_view_port * matrix_projection).inverse();
+            Matrix to_world = matrix_model_view.inverse();
+            auto direction = [&](float x, float y) -> Vector {
+                Vector p = (to_eye * Vector {x, y, 1.0f, 1.0f}).divideH();
+                p.v[3] = 0.0f;
+                return (to_world * p).discardH();
+            };
+            Vector origin = direction(0.5f, 0.5f);
+            Vector dx = direction(1.5f, 0.5f) - origin;
+            Vector dy = direction(0.5f, 1.5f) - origin;
+
+            // one mip level for the pass from the angle a pixel covers
+            // in the middle of the view against a texel at a face center
+            Vector center = origin + dx * (width / 2) + dy * (height / 2);
+            float angle = ((center + dx).normalize() -
+                    center.normalize()).length();
+            int level = cube_map_level(cube_map,
+                    std::log2(std::max(angle * cube_map.size * 0.5f, 1.0f)));
+
+            parallel_for(0, height, SKYBOX_ROW_GRAIN, [&](int r0, int r1) {
+                for (int r = r0; r < r1; r++)
+                {
+                    int y = height - 1 - r;
+                    uint32 *line = pixels + r * width;
+                    const float *depth_line = depths + r * width;
+                    Vector d = origin + dy * (float)y;
+                    for (int x = 0; x < width; x++, d += dx)
+                    {
+                        // only what opaque geometry left at the far plane
+                        if (depth_line[x] < 1.0f)
+                            continue;
+                        line[x] = sample_cube_map(cube_map, d.x(), d.y(),
+                                d.z(), level);
+                    }
+                }
+            });
+        }
+    }
+
+    CubeMap create_cube_map(const Texture faces[6], bool mipmaps)
+    {
+        int size = faces[0].width;
+        if (size <= 0)
+            throw new std::invalid_argument("empty cube map face");
+        for (int i = 0; i < 6; i++)
+            if (faces[i].width != size || faces[i].height != size)
+                throw new std::invalid_argument(
+                        "cube map faces must be squares of the same size");
+        CubeMap cube_map;
+        memset(&cube_map, 0, sizeof(cube_map));
+        cube_map.size = size;
+        cube_map.levels = 1;
+        if (mipmaps)
+            while (cube_map.levels < SSRE_MAX_CUBE_MAP_LEVELS &&
+                    (size >> cube_map.levels) > 0 &&
+                    ((size >> (cube_map.levels - 1)) & 1) == 0)
+                cube_map.levels++;
+        for (int i = 0; i < 6; i++)
+        {
+            cube_map.pixels[i][0] = new uint32[size * size];
+            memcpy(cube_map.pixels[i][0], faces[i].pixels,
+                    sizeof(uint32) * size * size);
+            for (int level = 1; level < cube_map.levels; level++)
+            {
+                int level_size = size >> level;
+                cube_map.pixels[i][level] =
+                    new uint32[level_size * level_size];
+                internal::downsample(cube_map.pixels[i][level - 1],
+                        cube_map.pixels[i][level], level_size << 1);
+            }
+        }
+        return cube_map;
+    }
+
+    void release_cube_map(CubeMap &cube_map)
+    {
+        for (int i = 0; i < 6; i++)
+            for (int level = 0; level < cube_map.levels; level++)
+            {
+                delete[] cube_map.pixels[i][level];
+                cube_map.pixels[i][level] = nullptr;
+            }
+        cube_map.size = cube_map.levels = 0;
+    }
+
+    uint32 sample_cube_map(const CubeMap &cube_map, const Vector &direction,
+            float lod)
+    {
+        return internal::sample_cube_map(cube_map, direction.x(),
+                direction.y(), direction.z(),
+                internal::cube_map_level(cube_map, lod));
+    }
+}
@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <vector>
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    extern int width;
+    extern int height;
+    extern uint32 *pixels;
+    extern float *depths;
+
+    namespace internal
+    {
+        /* pixels on the side of the squares the frame is redrawn in */
+        const int DIRTY_TILE_SIZE = 32;
+
+        struct DirtyObject
+        {
+            CommandBuffer *commands;
+            uint64 hash;
+            ScissorBox bounds;
+            bool submitted;
+            // what the retained pixels show of it
+            bool drawn;
+            uint64 drawn_hash;
+            ScissorBox drawn_bounds;
+        };
+
+        bool dirty_rectangles_enabled = false;
+        static std::map<int, DirtyObject> objects;
+        // ids in the order of this frame
+        static std::vector<int> submitted;
+        static DirtyObject *current = nullptr;
+        static uint32 background = 0;
+        static float background_depth = 1.0f;
+        static bool redraw_all = true;
+        static int drawn_width = 0, drawn_height = 0;
+        static std::vector<uint8> dirty_tiles;
+
+        void defer_clear(uint32 color)
+        {
+            redraw_all |= color != background;
+            background = color;
+        }
+
+        void defer_clear_depth(float depth)
+        {
+            redraw_all |= depth != background_depth;
+            background_depth = depth;
+        }
+
+        bool same_box(const ScissorBox &a, const ScissorBox &b)
+        {
+            return a.x0 == b.x0 && a.y0 == b.y0 && a.x1 == b.x1 &&
+                a.y1 == b.y1;
+        }
+
+        bool overlap(const ScissorBox &a, const ScissorBox &b)
+        {
+            return a.x0 < b.x1 && b.x0 < a.x1 && a.y0 < b.y1 && b.y0 < a.y1;
+        }
+
+        void mark_dirty(const ScissorBox &box, int tiles_x)
+        {
+            if (box.x0 >= box.x1 || box.y0 >= box.y1)
+                return;
+            for (int ty = box.y0 / DIRTY_TILE_SIZE;
+                    ty <= (box.y1 - 1) / DIRTY_TILE_SIZE; ty++)
+                for (int tx = box.x0 / DIRTY_TILE_SIZE;
+                        tx <= (box.x1 - 1) / DIRTY_TILE_SIZE; tx++)
+                    dirty_tiles[ty * tiles_x + tx] = 1;
+        }
+
+        /*
+         * runs of dirty tiles along the rows, merged with the run of the
+         * row below when they cover the same columns
+         */
+        std::vector<ScissorBox> dirty_boxes(int tiles_x, int tiles_y)
+        {
+            std::vector<ScissorBox> boxes;
+            std::vector<int> below, open;
+            for (int ty = 0; ty < tiles_y; ty++)
+            {
+                open.clear();
+                for (int tx = 0; tx < tiles_x;)
+                {
+                    if (!dirty_tiles[ty * tiles_x + tx])
+                    {
+                        tx++;
+                        continue;
+                    }
+                    int end = tx;
+                    while (end < tiles_x && dirty_tiles[ty * tiles_x + end])
+                        end++;
+                    ScissorBox run = {tx * DIRTY_TILE_SIZE,
+                        ty * DIRTY_TILE_SIZE,
+                        std::min(end * DIRTY_TILE_SIZE, width),
+                        std::min((ty + 1) * DIRTY_TILE_SIZE, height)};
+                    auto merged = std::find_if(below.begin(), below.end(),
+                            [&](int i) {
+                        return boxes[i].x0 == run.x0 && boxes[i].x1 == run.x1;
+                    });
+                    if (merged != below.end())
+                    {
+                        boxes[*merged].y1 = run.y1;
+                        open.push_back(*merged);
+                    }
+                    else
+                    {
+                        boxes.push_back(run);
+                        open.push_back(boxes.size() - 1);
+                    }
+                    tx = end;
+                }
+                below.swap(open);
+            }
+            return boxes;
+        }
+
+        void clear_box(const ScissorBox &box)
+        {
+            for (int y = box.y0; y < box.y1; y++)
+            {
+                int index = (height - 1 - y) * width + box.x0;
+                fill_row(pixels + index, box.x1 - box.x0, background);
+                fill_row(depths + index, box.x1 - box.x0, background_depth);
+                if (hdr_enabled)
+                    std::fill(hdr_pixels + index,
+                            hdr_pixels + index + box.x1 - box.x0, 0);
+            }
+        }
+
+        /*
+         * objects that changed, appeared or went away dirty the tiles of
+         * where they are and where they were. Those tiles are cleared
+         * and every object overlapping them is drawn again, limited to
+         * them
+         */
+        void render_dirty_objects()
+        {
+            if (!dirty_rectangles_enabled)
+                return;
+            if (current)
+                throw new std::runtime_error("object not ended at present");
+            int tiles_x = (width + DIRTY_TILE_SIZE - 1) / DIRTY_TILE_SIZE;
+            int tiles_y = (height + DIRTY_TILE_SIZE - 1) / DIRTY_TILE_SIZE;
+            dirty_tiles.assign(tiles_x * tiles_y, redraw_all ||
+                    width != drawn_width || height != drawn_height);
+            for (auto it = objects.begin(); it != objects.end();)
+            {
+                DirtyObject &object = it->second;
+                bool changed = !object.submitted || !object.drawn ||
+                    object.hash != object.drawn_hash ||
+                    !same_box(object.bounds, object.drawn_bounds);
+                if (changed && object.drawn)
+                    mark_dirty(object.drawn_bounds, tiles_x);
+                if (!object.submitted)
+                {
+                    destroy_command_buffer(object.commands);
+                    it = objects.erase(it);
+                    continue;
+                }
+                if (changed)
+                    mark_dirty(object.bounds, tiles_x);
+                ++it;
+            }
+
+            bool scissor_was_enabled = scissor_enabled;
+            ScissorBox saved = scissor;
+            scissor_enabled = true;
+            for (const ScissorBox &box : dirty_boxes(tiles_x, tiles_y))
+            {
+                clear_box(box);
+                scissor = box;
+                for (int id : submitted)
+                {
+                    const DirtyObject &object = objects[id];
+                    if (overlap(object.bounds, box))
+                        execute_command_buffer(object.commands);
+                }
+            }
+            scissor_enabled = scissor_was_enabled;
+            scissor = saved;
+
+            for (auto &entry : objects)
+            {
+                DirtyObject &object = entry.second;
+                object.drawn = true;
+                object.drawn_hash = object.hash;
+                object.drawn_bounds = object.bounds;
+                object.submitted = false;
+            }
+            submitted.clear();
+            redraw_all = false;
+            drawn_width = width;
+            drawn_height = height;
+        }
+
+        void release_dirty_objects()
+        {
+            for (auto &entry : objects)
+                destroy_command_buffer(entry.second.commands);
+            objects.clear();
+            submitted.clear();
+            current = nullptr;
+        }
+    }
+
+    void enable_dirty_rectangles()
+    {
+        internal::dirty_rectangles_enabled = true;
+        internal::redraw_all = true;
+    }
+
+    void disable_dirty_rectangles()
+    {
+        internal::dirty_rectangles_enabled = false;
+        internal::release_dirty_objects();
+    }
+
+    void begin_object(int id)
+    {
+        using namespace internal;
+        if (!dirty_rectangles_enabled)
+            return;
+        if (current)
+            throw new std::runtime_error("object already begun");
+        auto found = objects.find(id);
+        if (found == objects.end())
+        {
+            DirtyObject object = {create_command_buffer(), 0,
+                {0, 0, 0, 0}, false, false, 0, {0, 0, 0, 0}};
+            found = objects.insert(std::make_pair(id, object)).first;
+        }
+        if (found->second.submitted)
+            throw new std::runtime_error("object submitted twice");
+        current = &found->second;
+        current->submitted = true;
+        submitted.push_back(id);
+        begin_command_buffer(current->commands);
+    }
+
+    void end_object()
+    {
+        using namespace internal;
+        if (!dirty_rectangles_enabled)
+            return;
+        if (!current)
+            throw new std::runtime_error("no object to end");
+        end_command_buffer();
+        current->hash = hash_command_buffer(*current->commands);
+        ScissorBox &bounds = current->bounds;
+        command_buffer_bounds(*current->commands, bounds.x0, bounds.y0,
+                bounds.x1, bounds.y1);
+        current = nullptr;
+    }
+}
@@ -0,0 +1,136 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#ifdef __SSE2__
+#include "internal/ssre_intrinsics.h"
+#endif
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    namespace internal
+    {
+        /* by KernelLevel, also the values of SSRE_KERNELS */
+        static const char *KERNEL_LEVEL_NAMES[] = {
+            "scalar", "sse2", "avx2", "avx512"
+        };
+
+        void fill_scalar(uint32 *dest, uint32 value, int count)
+        {
+            std::fill(dest, dest + count, value);
+        }
+
+#ifdef __SSE2__
+        void fill_sse2(uint32 *dest, uint32 value, int count)
+        {
+            const __m128i v = _mm_set1_epi32(value);
+            int i = 0;
+            for (; i + 4 <= count; i += 4)
+                _mm_storeu_si128((__m128i *)(dest + i), v);
+            fill_scalar(dest + i, value, count - i);
+        }
+#endif
+
+#ifdef SSRE_X86_KERNELS
+        SSRE_TARGET("avx2")
+        void fill_avx2(uint32 *dest, uint32 value, int count)
+        {
+            const __m256i v = _mm256_set1_epi32(value);
+            int i = 0;
+            for (; i + 8 <= count; i += 8)
+                _mm256_storeu_si256((__m256i *)(dest + i), v);
+            fill_sse2(dest + i, value, count - i);
+        }
+
+        SSRE_TARGET("avx512f")
+        void fill_avx512(uint32 *dest, uint32 value, int count)
+        {
+            const __m512i v = _mm512_set1_epi32(value);
+            int i = 0;
+            for (; i + 16 <= count; i += 16)
+                _mm512_storeu_si512(dest + i, v);
+            fill_sse2(dest + i, value, count - i);
+        }
+#endif
+
+        Kernels kernels_for(KernelLevel level)
+        {
+            Kernels k = {ScalarKernels, fill_scalar, transform_vertices_scalar,
+                sample_texture_scalar, tone_map_pixels_scalar,
+                color_span_scalar, skin_vertices_scalar};
+#ifndef __SSE2__
+            (void)level;
+#else
+            if (level >= SSE2Kernels)
+                k = Kernels {SSE2Kernels, fill_sse2, transform_vertices_sse2,
+                    sample_texture_sse2, tone_map_pixels_sse2,
+                    color_span_sse2, skin_vertices_sse2};
+#endif
+#ifdef SSRE_X86_KERNELS
+            if (level >= AVX2Kernels)
+                k = Kernels {AVX2Kernels, fill_avx2, transform_vertices_avx2,
+                    sample_texture_avx2, tone_map_pixels_avx2,
+                    color_span_avx2, skin_vertices_avx};
+            // a single bilinear sample has no use for 512 bits, nor has the
+            // blend of a bone's columns
+            if (level >= AVX512Kernels)
+                k = Kernels {AVX512Kernels, fill_avx512,
+                    transform_vertices_avx512, sample_texture_avx2,
+                    tone_map_pixels_avx512, color_span_avx512,
+                    skin_vertices_avx};
+#endif
+            return k;
+        }
+
+        /*
+         * from cpuid, which the compiler's builtins read along with the
+         * register state the operating system saves
+         */
+        KernelLevel supported_kernel_level()
+        {
+#if defined(SSRE_X86_KERNELS)
+            // may run before the constructors of the runtime
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f"))
+                return AVX512Kernels;
+            if (__builtin_cpu_supports("avx2"))
+                return AVX2Kernels;
+            return SSE2Kernels;
+#elif defined(__SSE2__)
+            return SSE2Kernels;
+#else
+            return ScalarKernels;
+#endif
+        }
+
+        /*
+         * the best supported one, or the one SSRE_KERNELS names if
+         * supported. Other values are ignored with a warning, so that a
+         * benchmark does not measure another set unnoticed
+         */
+        KernelLevel select_kernel_level()
+        {
+            KernelLevel supported = supported_kernel_level();
+            const char *name = std::getenv("SSRE_KERNELS");
+            if (!name)
+                return supported;
+            for (int level = ScalarKernels; level <= supported; level++)
+                if (!std::strcmp(name, KERNEL_LEVEL_NAMES[level]))
+                    return (KernelLevel)level;
+            std::fprintf(stderr, "ssre: SSRE_KERNELS=%s is not a supported "
+                    "kernel set, using %s\n", name,
+                    KERNEL_LEVEL_NAMES[supported]);
+            return supported;
+        }
+
+        // picked while the program starts, before main
+        Kernels kernels = kernels_for(select_kernel_level());
+    }
+
+    const char *kernel_set()
+    {
+        return internal::KERNEL_LEVEL_NAMES[internal::kernels.level];
+    }
+}
@@ -0,0 +1,328 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    extern int width;
+    extern int height;
+    extern uint32 *pixels;
+    extern float *depths;
+
+    namespace internal
+    {
+        /* how far the rows move toward the measured balance in a frame */
+        const float REGION_SMOOTHING = 0.5f;
+
+        /* from the coordinator, the rows [y0, y1) of a frame */
+        struct RegionOrder
+        {
+            int width, height;
+            int y0, y1;
+            bool quit;
+        };
+
+        /* from a worker once its rows are in the shared frame */
+        struct RegionDone
+        {
+            float time;
+        };
+
+        /* a process and its band of rows, the coordinator first */
+        struct RenderProcess
+        {
+            pid_t pid;
+            int socket;
+            int y0, y1;
+            // milliseconds it took for its rows in the last frame
+            float time;
+        };
+
+        static bool distributed = false;
+        static bool frame_pending = false;
+        static std::vector<RenderProcess> processes;
+        static std::chrono::steady_clock::time_point frame_start;
+        // every process draws into its own frame, and only its band
+        // goes through the shared one
+        static uint32 *shared_pixels = nullptr;
+        static size_t shared_bytes = 0;
+
+        float elapsed_since(std::chrono::steady_clock::time_point start)
+        {
+            return std::chrono::duration<float, std::milli>(
+                    std::chrono::steady_clock::now() - start).count();
+        }
+
+        bool send_message(int socket, const void *message, size_t size)
+        {
+            const char *data = (const char *)message;
+            while (size > 0)
+            {
+                ssize_t sent = send(socket, data, size, MSG_NOSIGNAL);
+                if (sent < 0 && errno == EINTR)
+                    continue;
+                if (sent <= 0)
+                    return false;
+                data += sent;
+                size -= sent;
+            }
+            return true;
+        }
+
+        bool receive_message(int socket, void *message, size_t size)
+        {
+            char *data = (char *)message;
+            while (size > 0)
+            {
+                ssize_t received = recv(socket, data, size, 0);
+                if (received < 0 && errno == EINTR)
+                    continue;
+                if (received <= 0)
+                    return false;
+                data += received;
+                size -= received;
+            }
+            return true;
+        }
+
+        void set_region(int y0, int y1)
+        {
+            scissor_enabled = true;
+            scissor = ScissorBox {0, y0, width, y1};
+        }
+
+        /* memory rows of the rows [y0, y1), whose y goes up */
+        void copy_band(uint32 *dest, const uint32 *source, int y0, int y1)
+        {
+            size_t offset = (size_t)(height - y1) * width;
+            std::memcpy(dest + offset, source + offset,
+                    sizeof(uint32) * (y1 - y0) * width);
+        }
+
+        /*
+         * a worker draws every frame like the coordinator, with its color
+         * spans limited to the rows it is given. Skyboxes, particles,
+         * points and lines still cover every row of its frame, so only
+         * its band is copied into the shared one
+         */
+        void run_worker(int socket, render_function func)
+        {
+            while (true)
+            {
+                RegionOrder order;
+                if (!receive_message(socket, &order, sizeof(order)) ||
+                        order.quit)
+                    return;
+                auto start = std::chrono::steady_clock::now();
+                if (order.width != width || order.height != height)
+                    set_render_size(order.width, order.height);
+                set_region(order.y0, order.y1);
+                func();
+                resolve_hdr();
+                resolve_fragments(pixels, depths, width, height);
+                copy_band(shared_pixels, pixels, order.y0, order.y1);
+                buffer.reset();
+                update_streamed_textures();
+                update_virtual_textures();
+                RegionDone done = {elapsed_since(start)};
+                if (!send_message(socket, &done, sizeof(done)))
+                    return;
+            }
+        }
+
+        /*
+         * rows go to the processes by the rows per millisecond they
+         * managed in the last frame, every process keeps at least one
+         */
+        void balance_regions()
+        {
+            int count = processes.size();
+            int old_height = processes.back().y1;
+            std::vector<float> speeds(count);
+            float total = 0.0f;
+            for (int i = 0; i < count; i++)
+            {
+                const RenderProcess &process = processes[i];
+                speeds[i] = (process.y1 - process.y0) /
+                    std::max(process.time, 0.01f);
+                total += speeds[i];
+            }
+            float share = 0.0f;
+            int y = 0;
+            for (int i = 0; i < count; i++)
+            {
+                RenderProcess &process = processes[i];
+                float old_share = (float)(process.y1 - process.y0) /
+                    old_height;
+                share += old_share + REGION_SMOOTHING *
+                    (speeds[i] / total - old_share);
+                int y1 = i == count - 1 ? height :
+                    std::min(std::max((int)(share * height + 0.5f), y + 1),
+                            height - (count - 1 - i));
+                process.y0 = y;
+                process.y1 = y1;
+                y = y1;
+            }
+        }
+
+        void send_orders()
+        {
+            for (size_t i = 1; i < processes.size(); i++)
+            {
+                const RenderProcess &process = processes[i];
+                RegionOrder order = {width, height, process.y0, process.y1,
+                    false};
+                if (!send_message(process.socket, &order, sizeof(order)))
+                    throw new std::runtime_error(
+                            "lost a distributed render process");
+            }
+            set_region(processes[0].y0, processes[0].y1);
+            frame_start = std::chrono::steady_clock::now();
+            frame_pending = true;
+        }
+
+        void wait_for_regions()
+        {
+            for (size_t i = 1; i < processes.size(); i++)
+            {
+                RegionDone done;
+                if (!receive_message(processes[i].socket, &done, sizeof(done)))
+                    throw new std::runtime_error(
+                            "lost a distributed render process");
+                processes[i].time = done.time;
+                copy_band(pixels, shared_pixels, processes[i].y0,
+                        processes[i].y1);
+            }
+            frame_pending = false;
+        }
+
+        void gather_distributed_frame()
+        {
+            if (!distributed)
+                return;
+            processes[0].time = elapsed_since(frame_start);
+            wait_for_regions();
+        }
+
+        void start_distributed_frame()
+        {
+            if (!distributed)
+                return;
+            if (height < (int)processes.size())
+                throw new std::runtime_error(
+                        "fewer rows than distributed render processes");
+            balance_regions();
+            send_orders();
+        }
+
+        void stop_distributed_rendering()
+        {
+            if (!distributed)
+                return;
+            if (frame_pending)
+                wait_for_regions();
+            RegionOrder quit = {0, 0, 0, 0, true};
+            for (size_t i = 1; i < processes.size(); i++)
+            {
+                send_message(processes[i].socket, &quit, sizeof(quit));
+                close(processes[i].socket);
+                waitpid(processes[i].pid, nullptr, 0);
+            }
+            processes.clear();
+            munmap(shared_pixels, shared_bytes);
+            shared_pixels = nullptr;
+            scissor_enabled = false;
+            share_worker_threads(1);
+            distributed = false;
+        }
+    }
+
+    void enable_distributed_rendering(int process_count, render_function func)
+    {
+        using namespace internal;
+        if (distributed)
+            throw new std::runtime_error("distributed rendering already on");
+        if (process_count < 1 || process_count > height)
+            throw new std::invalid_argument("invalid render process count");
+        if (!func)
+            throw new std::invalid_argument("no render function");
+
+        // frame the workers hand their rows over in, mapped before the
+        // fork so that every process sees the same pages
+        shared_bytes = sizeof(uint32) * output_width * output_height;
+        void *shared = mmap(nullptr, shared_bytes, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (shared == MAP_FAILED)
+            throw new std::runtime_error("failed mapping the shared frame");
+        shared_pixels = (uint32 *)shared;
+
+        // threads are not copied by fork, they start again in every process
+        share_worker_threads(process_count);
+        stop_texture_decoding();
+
+        RenderProcess coordinator = {getpid(), -1, 0, height, 0.0f};
+        processes.push_back(coordinator);
+        distributed = true;
+        for (int i = 1; i < process_count; i++)
+        {
+            int sockets[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+            {
+                stop_distributed_rendering();
+                throw new std::runtime_error("failed creating a socket pair");
+            }
+            pid_t pid = fork();
+            if (pid < 0)
+            {
+                close(sockets[0]);
+                close(sockets[1]);
+                stop_distributed_rendering();
+                throw new std::runtime_error("failed starting a process");
+            }
+            if (pid == 0)
+            {
+                // the worker never returns into the application, and
+                // leaves the window and its exit handlers alone
+                close(sockets[0]);
+                for (size_t p = 1; p < processes.size(); p++)
+                    close(processes[p].socket);
+                processes.clear();
+                distributed = false;
+                try
+                {
+                    run_worker(sockets[1], func);
+                }
+                catch (...)
+                {
+                    _exit(1);
+                }
+                _exit(0);
+            }
+            close(sockets[1]);
+            RenderProcess worker = {pid, sockets[0], 0, 0, 0.0f};
+            processes.push_back(worker);
+        }
+
+        // equal bands to begin with
+        for (int i = 0; i < process_count; i++)
+        {
+            processes[i].y0 = height * i / process_count;
+            processes[i].y1 = height * (i + 1) / process_count;
+        }
+        send_orders();
+    }
+
+    void disable_distributed_rendering()
+    {
+        internal::stop_distributed_rendering();
+    }
+}
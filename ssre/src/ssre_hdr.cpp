@@ -0,0 +1,384 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#ifdef __SSE2__
+#include "internal/ssre_intrinsics.h"
+#endif
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    extern int width;
+    extern int height;
+    extern uint32 *pixels;
+
+    namespace internal
+    {
+        /* rows tone mapped by a worker at a time */
+        const int TONE_MAP_ROW_GRAIN = 16;
+        /* entries of the linear to sRGB table over [0, 1] */
+        const int SRGB_STEPS = 4096;
+        /* alpha of a written pixel, 1 as a half */
+        const uint64 HDR_COVERED = (uint64)0x3c00 << 48;
+
+        bool hdr_enabled = false;
+        uint64 *hdr_pixels = nullptr;
+        bool hdr_pending = false;
+        static std::vector<uint64> hdr_buffer;
+        static ToneMapOperator tone_map_operator;
+        static float hdr_exposure;
+        static float srgb_to_linear[256];
+        static uint8 linear_to_srgb[SRGB_STEPS];
+
+        void build_srgb_tables()
+        {
+            for (int i = 0; i < 256; i++)
+            {
+                float c = i / 255.0f;
+                srgb_to_linear[i] = c <= 0.04045f ? c / 12.92f :
+                    std::pow((c + 0.055f) / 1.055f, 2.4f);
+            }
+            for (int i = 0; i < SRGB_STEPS; i++)
+            {
+                float c = (float)i / (SRGB_STEPS - 1);
+                float s = c <= 0.0031308f ? c * 12.92f :
+                    1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+                linear_to_srgb[i] = (uint8)(s * 255.0f + 0.5f);
+            }
+        }
+
+        /*
+         * positive values only, rounded to nearest. What is below the
+         * smallest normal half goes to zero, what is above the largest
+         * saturates
+         */
+        inline uint16 to_half(float f)
+        {
+            f = std::min(std::max(f, 0.0f), 65504.0f);
+            uint32 bits;
+            std::memcpy(&bits, &f, sizeof(bits));
+            if (bits < 0x38800000)
+                return 0;
+            return (bits - 0x38000000 + 0x1000) >> 13;
+        }
+
+        inline float from_half(uint16 h)
+        {
+            if ((h & 0x7fff) < 0x400)
+                return 0.0f;
+            uint32 bits = ((uint32)(h & 0x7fff) << 13) + 0x38000000;
+            float f;
+            std::memcpy(&f, &bits, sizeof(f));
+            return f;
+        }
+
+        inline uint64 pack_hdr(const float *rgb)
+        {
+            return to_half(rgb[0]) | (uint64)to_half(rgb[1]) << 16 |
+                (uint64)to_half(rgb[2]) << 32 | HDR_COVERED;
+        }
+
+        void decode_srgb(uint32 c, float *rgba)
+        {
+            rgba[0] = srgb_to_linear[SSRE_R(c)];
+            rgba[1] = srgb_to_linear[SSRE_G(c)];
+            rgba[2] = srgb_to_linear[SSRE_B(c)];
+            rgba[3] = SSRE_A(c) / 255.0f;
+        }
+
+        inline float tone_map(float x)
+        {
+            x *= hdr_exposure;
+            if (tone_map_operator == ToneMapReinhard)
+                return x / (1.0f + x);
+            // the fit of the ACES curve by Narkowicz
+            return std::min(x * (2.51f * x + 0.03f) /
+                    (x * (2.43f * x + 0.59f) + 0.14f), 1.0f);
+        }
+
+        inline uint8 encode_srgb(float x)
+        {
+            x = std::min(std::max(x, 0.0f), 1.0f);
+            return linear_to_srgb[(int)(x * (SRGB_STEPS - 1) + 0.5f)];
+        }
+
+        /* the frame buffer pixel as linear color, tone mapped or not */
+        void hdr_destination(int index, float *rgb)
+        {
+            uint64 d = hdr_pixels[index];
+            if (!(d & HDR_COVERED))
+            {
+                float rgba[4];
+                decode_srgb(pixels[index], rgba);
+                std::copy(rgba, rgba + 3, rgb);
+                return;
+            }
+            for (int k = 0; k < 3; k++)
+                rgb[k] = from_half(d >> (16 * k));
+        }
+
+        void write_hdr_pixel(int index, const float *rgba, float z)
+        {
+            hdr_pending = true;
+            if (!blending_enabled)
+            {
+                hdr_pixels[index] = pack_hdr(rgba);
+                return;
+            }
+            if (blend_mode == OrderIndependent)
+            {
+                // fragments are blended at present, after tone mapping
+                append_fragment(index, SSRE_ARGB(
+                            (int)(std::min(rgba[3], 1.0f) * 255.0f),
+                            encode_srgb(tone_map(rgba[0])),
+                            encode_srgb(tone_map(rgba[1])),
+                            encode_srgb(tone_map(rgba[2]))), z);
+                return;
+            }
+            float rgb[3];
+            hdr_destination(index, rgb);
+            float a = std::min(std::max(rgba[3], 0.0f), 1.0f);
+            for (int k = 0; k < 3; k++)
+                rgb[k] = blend_mode == Additive ? rgb[k] + rgba[k] * a :
+                    rgba[k] * a + rgb[k] * (1.0f - a);
+            hdr_pixels[index] = pack_hdr(rgb);
+        }
+
+        inline uint32 srgb_pixel(const int32 *indices)
+        {
+            return SSRE_ARGB(0xff, linear_to_srgb[indices[0]],
+                    linear_to_srgb[indices[1]], linear_to_srgb[indices[2]]);
+        }
+
+        /* the written pixels of [begin, end) into the frame */
+        void tone_map_pixels_scalar(int begin, int end)
+        {
+            uint64 *hdr = hdr_pixels;
+            for (int i = begin; i < end; i++)
+            {
+                if (hdr[i] & HDR_COVERED)
+                    pixels[i] = SSRE_ARGB(0xff,
+                            encode_srgb(tone_map(from_half(hdr[i]))),
+                            encode_srgb(tone_map(from_half(hdr[i] >> 16))),
+                            encode_srgb(tone_map(from_half(hdr[i] >> 32))));
+                hdr[i] = 0;
+            }
+        }
+
+#ifdef __SSE2__
+        /* four halves in the low bits of each lane, positive normals */
+        inline __m128 half_to_float(__m128i h)
+        {
+            __m128i em = _mm_and_si128(h, _mm_set1_epi32(0x7fff));
+            __m128i bits = _mm_add_epi32(_mm_slli_epi32(em, 13),
+                    _mm_set1_epi32(0x38000000));
+            __m128i normal = _mm_cmpgt_epi32(em, _mm_set1_epi32(0x3ff));
+            return _mm_castsi128_ps(_mm_and_si128(bits, normal));
+        }
+
+        /* r, g, b, a of one pixel to indices into linear_to_srgb */
+        inline __m128i tone_map_pixel(__m128i h, __m128 exposure)
+        {
+            __m128 x = _mm_mul_ps(half_to_float(h), exposure);
+            __m128 one = _mm_set1_ps(1.0f);
+            __m128 y;
+            if (tone_map_operator == ToneMapReinhard)
+                y = _mm_div_ps(x, _mm_add_ps(one, x));
+            else
+                y = _mm_div_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x,
+                                    _mm_set1_ps(2.51f)), _mm_set1_ps(0.03f))),
+                        _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x,
+                                        _mm_set1_ps(2.43f)),
+                                    _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f)));
+            y = _mm_min_ps(_mm_max_ps(y, _mm_setzero_ps()), one);
+            return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(y,
+                            _mm_set1_ps(SRGB_STEPS - 1.0f)), _mm_set1_ps(0.5f)));
+        }
+
+        void tone_map_pixels_sse2(int begin, int end)
+        {
+            uint64 *hdr = hdr_pixels;
+            int i = begin;
+            const __m128i zero = _mm_setzero_si128();
+            const __m128 exposure = _mm_setr_ps(hdr_exposure, hdr_exposure,
+                    hdr_exposure, 0.0f);
+            for (; i + 2 <= end; i += 2)
+            {
+                __m128i two = _mm_loadu_si128((const __m128i *)(hdr + i));
+                int32 indices[8];
+                _mm_storeu_si128((__m128i *)indices, tone_map_pixel(
+                            _mm_unpacklo_epi16(two, zero), exposure));
+                _mm_storeu_si128((__m128i *)(indices + 4), tone_map_pixel(
+                            _mm_unpackhi_epi16(two, zero), exposure));
+                if (hdr[i] & HDR_COVERED)
+                    pixels[i] = srgb_pixel(indices);
+                if (hdr[i + 1] & HDR_COVERED)
+                    pixels[i + 1] = srgb_pixel(indices + 4);
+                _mm_storeu_si128((__m128i *)(hdr + i), zero);
+            }
+            tone_map_pixels_scalar(i, end);
+        }
+#endif
+
+#ifdef SSRE_X86_KERNELS
+        /* tone_map_pixel of two pixels */
+        SSRE_TARGET("avx2")
+        inline __m256i tone_map_pixel_pair(__m256i h, __m256 exposure)
+        {
+            __m256i em = _mm256_and_si256(h, _mm256_set1_epi32(0x7fff));
+            __m256i bits = _mm256_add_epi32(_mm256_slli_epi32(em, 13),
+                    _mm256_set1_epi32(0x38000000));
+            __m256i normal = _mm256_cmpgt_epi32(em, _mm256_set1_epi32(0x3ff));
+            __m256 x = _mm256_mul_ps(_mm256_castsi256_ps(
+                        _mm256_and_si256(bits, normal)), exposure);
+            __m256 one = _mm256_set1_ps(1.0f);
+            __m256 y;
+            if (tone_map_operator == ToneMapReinhard)
+                y = _mm256_div_ps(x, _mm256_add_ps(one, x));
+            else
+                y = _mm256_div_ps(_mm256_mul_ps(x, _mm256_add_ps(
+                                _mm256_mul_ps(x, _mm256_set1_ps(2.51f)),
+                                _mm256_set1_ps(0.03f))),
+                        _mm256_add_ps(_mm256_mul_ps(x, _mm256_add_ps(
+                                    _mm256_mul_ps(x, _mm256_set1_ps(2.43f)),
+                                    _mm256_set1_ps(0.59f))),
+                            _mm256_set1_ps(0.14f)));
+            y = _mm256_min_ps(_mm256_max_ps(y, _mm256_setzero_ps()), one);
+            return _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(y,
+                            _mm256_set1_ps(SRGB_STEPS - 1.0f)),
+                        _mm256_set1_ps(0.5f)));
+        }
+
+        /* like the SSE2 one, four pixels at a time */
+        SSRE_TARGET("avx2")
+        void tone_map_pixels_avx2(int begin, int end)
+        {
+            uint64 *hdr = hdr_pixels;
+            int i = begin;
+            const __m256 exposure = _mm256_setr_ps(hdr_exposure, hdr_exposure,
+                    hdr_exposure, 0.0f, hdr_exposure, hdr_exposure,
+                    hdr_exposure, 0.0f);
+            for (; i + 4 <= end; i += 4)
+            {
+                __m256i four = _mm256_loadu_si256((const __m256i *)(hdr + i));
+                int32 indices[16];
+                _mm256_storeu_si256((__m256i *)indices, tone_map_pixel_pair(
+                            _mm256_cvtepu16_epi32(_mm256_castsi256_si128(four)),
+                            exposure));
+                _mm256_storeu_si256((__m256i *)(indices + 8),
+                        tone_map_pixel_pair(_mm256_cvtepu16_epi32(
+                                _mm256_extracti128_si256(four, 1)), exposure));
+                for (int k = 0; k < 4; k++)
+                    if (hdr[i + k] & HDR_COVERED)
+                        pixels[i + k] = srgb_pixel(indices + 4 * k);
+                _mm256_storeu_si256((__m256i *)(hdr + i),
+                        _mm256_setzero_si256());
+            }
+            tone_map_pixels_sse2(i, end);
+        }
+
+        /* tone_map_pixel of four pixels */
+        SSRE_TARGET("avx512f")
+        inline __m512i tone_map_pixel_quad(__m512i h, __m512 exposure)
+        {
+            __m512i em = _mm512_and_si512(h, _mm512_set1_epi32(0x7fff));
+            __m512i bits = _mm512_add_epi32(_mm512_slli_epi32(em, 13),
+                    _mm512_set1_epi32(0x38000000));
+            __mmask16 normal = _mm512_cmpgt_epi32_mask(em,
+                    _mm512_set1_epi32(0x3ff));
+            __m512 x = _mm512_mul_ps(_mm512_castsi512_ps(
+                        _mm512_maskz_mov_epi32(normal, bits)), exposure);
+            __m512 one = _mm512_set1_ps(1.0f);
+            __m512 y;
+            if (tone_map_operator == ToneMapReinhard)
+                y = _mm512_div_ps(x, _mm512_add_ps(one, x));
+            else
+                y = _mm512_div_ps(_mm512_mul_ps(x, _mm512_add_ps(
+                                _mm512_mul_ps(x, _mm512_set1_ps(2.51f)),
+                                _mm512_set1_ps(0.03f))),
+                        _mm512_add_ps(_mm512_mul_ps(x, _mm512_add_ps(
+                                    _mm512_mul_ps(x, _mm512_set1_ps(2.43f)),
+                                    _mm512_set1_ps(0.59f))),
+                            _mm512_set1_ps(0.14f)));
+            y = _mm512_min_ps(_mm512_max_ps(y, _mm512_setzero_ps()), one);
+            return _mm512_cvttps_epi32(_mm512_add_ps(_mm512_mul_ps(y,
+                            _mm512_set1_ps(SRGB_STEPS - 1.0f)),
+                        _mm512_set1_ps(0.5f)));
+        }
+
+        /* like the SSE2 one, eight pixels at a time */
+        SSRE_TARGET("avx512f")
+        void tone_map_pixels_avx512(int begin, int end)
+        {
+            uint64 *hdr = hdr_pixels;
+            int i = begin;
+            const __m512 exposure = _mm512_broadcast_f32x4(_mm_setr_ps(
+                        hdr_exposure, hdr_exposure, hdr_exposure, 0.0f));
+            for (; i + 8 <= end; i += 8)
+            {
+                __m512i eight = _mm512_loadu_si512(hdr + i);
+                int32 indices[32];
+                _mm512_storeu_si512(indices, tone_map_pixel_quad(
+                            _mm512_cvtepu16_epi32(_mm512_castsi512_si256(eight)),
+                            exposure));
+                _mm512_storeu_si512(indices + 16, tone_map_pixel_quad(
+                            _mm512_cvtepu16_epi32(
+                                _mm512_extracti64x4_epi64(eight, 1)),
+                            exposure));
+                for (int k = 0; k < 8; k++)
+                    if (hdr[i + k] & HDR_COVERED)
+                        pixels[i + k] = srgb_pixel(indices + 4 * k);
+                _mm512_storeu_si512(hdr + i, _mm512_setzero_si512());
+            }
+            tone_map_pixels_sse2(i, end);
+        }
+#endif
+
+        /*
+         * one pass over the rows drawn into since the last one. Runs at
+         * present, and before anything that draws on the 8 bit frame
+         */
+        void resolve_hdr()
+        {
+            if (!hdr_enabled || !hdr_pending)
+                return;
+            int y_begin = scissor_enabled ? scissor.y0 : 0;
+            int y_end = scissor_enabled ? scissor.y1 : height;
+            // memory rows go down while y goes up
+            parallel_for(height - y_end, height - y_begin, TONE_MAP_ROW_GRAIN,
+                    [&](int row0, int row1) {
+                kernels.tone_map_pixels(row0 * width, row1 * width);
+            });
+            hdr_pending = false;
+        }
+    }
+
+    void enable_hdr(ToneMapOperator op, float exposure)
+    {
+        using namespace internal;
+        if (exposure <= 0.0f)
+            throw new std::invalid_argument("non positive exposure");
+        if (!hdr_enabled)
+        {
+            build_srgb_tables();
+            hdr_buffer.assign((size_t)output_width * output_height, 0);
+            hdr_pixels = hdr_buffer.data();
+        }
+        tone_map_operator = op;
+        hdr_exposure = exposure;
+        hdr_enabled = true;
+    }
+
+    void disable_hdr()
+    {
+        using namespace internal;
+        resolve_hdr();
+        hdr_enabled = false;
+        hdr_pending = false;
+        hdr_pixels = nullptr;
+        std::vector<uint64>().swap(hdr_buffer);
+    }
+}
@@ -0,0 +1,359 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#ifdef __SSE2__
+#include "internal/ssre_intrinsics.h"
+#endif
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    namespace internal
+    {
+        /* instances culled or transformed by a worker at a time */
+        const int INSTANCE_GRAIN = 64;
+        /* eye space vertices transformed ahead of the rasterizer */
+        const int INSTANCE_BATCH_VERTICES = 1 << 16;
+
+        /*
+         * frustum test in object space. The planes come out of the rows
+         * of the object to clip space matrix, normalized so that the
+         * distances are in object units
+         */
+        bool sphere_outside(const Matrix &m, const Vector &sphere)
+        {
+            for (int plane = 0; plane < 6; plane++)
+            {
+                const float *axis = m.v[plane >> 1];
+                float sign = (plane & 1) ? -1.0f : 1.0f;
+                float p[4];
+                for (int k = 0; k < 4; k++)
+                    p[k] = m.v[3][k] + sign * axis[k];
+                float length = std::sqrt(p[0] * p[0] + p[1] * p[1] +
+                        p[2] * p[2]);
+                if (length == 0.0f)
+                    continue;
+                float distance = p[0] * sphere.x() + p[1] * sphere.y() +
+                    p[2] * sphere.z() + p[3];
+                if (distance < -sphere.h() * length)
+                    return true;
+            }
+            return false;
+        }
+
+        /*
+         * eye space copies of count vertices, normals go through the
+         * inverse transpose and tangents keep their handedness
+         */
+        void transform_vertices_scalar(const Matrix &m,
+                const Matrix &normal_matrix, const Vertex *source,
+                Vertex *dest, int count)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                const Vertex &s = source[i];
+                Vertex &d = dest[i];
+                d.position = m * s.position;
+                d.normal = (normal_matrix * s.normal.discardH()).discardH();
+                Vector t = m * s.tangent.discardH();
+                d.tangent = Vector {t.x(), t.y(), t.z(), s.tangent.h()};
+                d.tex_coord = s.tex_coord;
+            }
+        }
+
+#ifdef __SSE2__
+        void transform_vertices_sse2(const Matrix &m,
+                const Matrix &normal_matrix, const Vertex *source,
+                Vertex *dest, int count)
+        {
+            __m128 c[4], n[3];
+            for (int k = 0; k < 4; k++)
+                c[k] = _mm_setr_ps(m.v[0][k], m.v[1][k], m.v[2][k], m.v[3][k]);
+            for (int k = 0; k < 3; k++)
+                n[k] = _mm_setr_ps(normal_matrix.v[0][k],
+                        normal_matrix.v[1][k], normal_matrix.v[2][k], 0.0f);
+            // w of the columns is dropped for directions
+            __m128 xyz = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+            for (int i = 0; i < count; i++)
+            {
+                const Vertex &s = source[i];
+                Vertex &d = dest[i];
+                __m128 p = _mm_add_ps(_mm_add_ps(
+                            _mm_mul_ps(c[0], _mm_set1_ps(s.position.v[0])),
+                            _mm_mul_ps(c[1], _mm_set1_ps(s.position.v[1]))),
+                        _mm_add_ps(
+                            _mm_mul_ps(c[2], _mm_set1_ps(s.position.v[2])),
+                            _mm_mul_ps(c[3], _mm_set1_ps(s.position.v[3]))));
+                _mm_storeu_ps(d.position.v, p);
+                __m128 normal = _mm_add_ps(_mm_add_ps(
+                            _mm_mul_ps(n[0], _mm_set1_ps(s.normal.v[0])),
+                            _mm_mul_ps(n[1], _mm_set1_ps(s.normal.v[1]))),
+                        _mm_mul_ps(n[2], _mm_set1_ps(s.normal.v[2])));
+                _mm_storeu_ps(d.normal.v, normal);
+                __m128 tangent = _mm_and_ps(xyz, _mm_add_ps(_mm_add_ps(
+                                _mm_mul_ps(c[0], _mm_set1_ps(s.tangent.v[0])),
+                                _mm_mul_ps(c[1], _mm_set1_ps(s.tangent.v[1]))),
+                            _mm_mul_ps(c[2], _mm_set1_ps(s.tangent.v[2]))));
+                _mm_storeu_ps(d.tangent.v, tangent);
+                d.tangent.v[3] = s.tangent.v[3];
+                d.tex_coord = s.tex_coord;
+            }
+        }
+#endif
+
+#ifdef SSRE_X86_KERNELS
+        /*
+         * like the SSE2 one with a vertex in every 128 bit lane. The same
+         * products are summed in the same order, so the results match
+         */
+        SSRE_TARGET("avx2")
+        inline __m256 transform_pair(const __m256 *c, __m256 v)
+        {
+            return _mm256_add_ps(_mm256_add_ps(
+                        _mm256_mul_ps(c[0], _mm256_permute_ps(v, 0x00)),
+                        _mm256_mul_ps(c[1], _mm256_permute_ps(v, 0x55))),
+                    _mm256_add_ps(
+                        _mm256_mul_ps(c[2], _mm256_permute_ps(v, 0xaa)),
+                        _mm256_mul_ps(c[3], _mm256_permute_ps(v, 0xff))));
+        }
+
+        /* transform_pair of a direction, without the fourth column */
+        SSRE_TARGET("avx2")
+        inline __m256 rotate_pair(const __m256 *c, __m256 v)
+        {
+            return _mm256_add_ps(_mm256_add_ps(
+                        _mm256_mul_ps(c[0], _mm256_permute_ps(v, 0x00)),
+                        _mm256_mul_ps(c[1], _mm256_permute_ps(v, 0x55))),
+                    _mm256_mul_ps(c[2], _mm256_permute_ps(v, 0xaa)));
+        }
+
+        SSRE_TARGET("avx2")
+        inline __m256 load_pair(const Vector &a, const Vector &b)
+        {
+            return _mm256_insertf128_ps(_mm256_castps128_ps256(
+                        _mm_loadu_ps(a.v)), _mm_loadu_ps(b.v), 1);
+        }
+
+        SSRE_TARGET("avx2")
+        inline void store_pair(Vector &a, Vector &b, __m256 v)
+        {
+            _mm_storeu_ps(a.v, _mm256_castps256_ps128(v));
+            _mm_storeu_ps(b.v, _mm256_extractf128_ps(v, 1));
+        }
+
+        /* two vertices at a time */
+        SSRE_TARGET("avx2")
+        void transform_vertices_avx2(const Matrix &m,
+                const Matrix &normal_matrix, const Vertex *source,
+                Vertex *dest, int count)
+        {
+            __m256 c[4], n[3];
+            for (int k = 0; k < 4; k++)
+                c[k] = _mm256_setr_ps(m.v[0][k], m.v[1][k], m.v[2][k],
+                        m.v[3][k], m.v[0][k], m.v[1][k], m.v[2][k], m.v[3][k]);
+            for (int k = 0; k < 3; k++)
+                n[k] = _mm256_setr_ps(normal_matrix.v[0][k],
+                        normal_matrix.v[1][k], normal_matrix.v[2][k], 0.0f,
+                        normal_matrix.v[0][k], normal_matrix.v[1][k],
+                        normal_matrix.v[2][k], 0.0f);
+            __m256 xyz = _mm256_castsi256_ps(_mm256_setr_epi32(-1, -1, -1, 0,
+                        -1, -1, -1, 0));
+            int i = 0;
+            for (; i + 2 <= count; i += 2)
+            {
+                const Vertex &s0 = source[i], &s1 = source[i + 1];
+                Vertex &d0 = dest[i], &d1 = dest[i + 1];
+                store_pair(d0.position, d1.position, transform_pair(c,
+                            load_pair(s0.position, s1.position)));
+                store_pair(d0.normal, d1.normal, rotate_pair(n,
+                            load_pair(s0.normal, s1.normal)));
+                store_pair(d0.tangent, d1.tangent, _mm256_and_ps(xyz,
+                            rotate_pair(c, load_pair(s0.tangent,
+                                    s1.tangent))));
+                d0.tangent.v[3] = s0.tangent.v[3];
+                d1.tangent.v[3] = s1.tangent.v[3];
+                d0.tex_coord = s0.tex_coord;
+                d1.tex_coord = s1.tex_coord;
+            }
+            transform_vertices_sse2(m, normal_matrix, source + i, dest + i,
+                    count - i);
+        }
+
+        /* transform_pair of four vertices */
+        SSRE_TARGET("avx512f")
+        inline __m512 transform_quad(const __m512 *c, __m512 v)
+        {
+            return _mm512_add_ps(_mm512_add_ps(
+                        _mm512_mul_ps(c[0], _mm512_permute_ps(v, 0x00)),
+                        _mm512_mul_ps(c[1], _mm512_permute_ps(v, 0x55))),
+                    _mm512_add_ps(
+                        _mm512_mul_ps(c[2], _mm512_permute_ps(v, 0xaa)),
+                        _mm512_mul_ps(c[3], _mm512_permute_ps(v, 0xff))));
+        }
+
+        SSRE_TARGET("avx512f")
+        inline __m512 rotate_quad(const __m512 *c, __m512 v)
+        {
+            return _mm512_add_ps(_mm512_add_ps(
+                        _mm512_mul_ps(c[0], _mm512_permute_ps(v, 0x00)),
+                        _mm512_mul_ps(c[1], _mm512_permute_ps(v, 0x55))),
+                    _mm512_mul_ps(c[2], _mm512_permute_ps(v, 0xaa)));
+        }
+
+        SSRE_TARGET("avx512f")
+        inline __m512 load_quad(const Vector &a, const Vector &b,
+                const Vector &c, const Vector &d)
+        {
+            __m512 v = _mm512_castps128_ps512(_mm_loadu_ps(a.v));
+            v = _mm512_insertf32x4(v, _mm_loadu_ps(b.v), 1);
+            v = _mm512_insertf32x4(v, _mm_loadu_ps(c.v), 2);
+            return _mm512_insertf32x4(v, _mm_loadu_ps(d.v), 3);
+        }
+
+        SSRE_TARGET("avx512f")
+        inline void store_quad(Vector &a, Vector &b, Vector &c, Vector &d,
+                __m512 v)
+        {
+            _mm_storeu_ps(a.v, _mm512_castps512_ps128(v));
+            _mm_storeu_ps(b.v, _mm512_extractf32x4_ps(v, 1));
+            _mm_storeu_ps(c.v, _mm512_extractf32x4_ps(v, 2));
+            _mm_storeu_ps(d.v, _mm512_extractf32x4_ps(v, 3));
+        }
+
+        /* four vertices at a time */
+        SSRE_TARGET("avx512f")
+        void transform_vertices_avx512(const Matrix &m,
+                const Matrix &normal_matrix, const Vertex *source,
+                Vertex *dest, int count)
+        {
+            __m512 c[4], n[3];
+            for (int k = 0; k < 4; k++)
+                c[k] = _mm512_broadcast_f32x4(_mm_setr_ps(m.v[0][k],
+                            m.v[1][k], m.v[2][k], m.v[3][k]));
+            for (int k = 0; k < 3; k++)
+                n[k] = _mm512_broadcast_f32x4(_mm_setr_ps(
+                            normal_matrix.v[0][k], normal_matrix.v[1][k],
+                            normal_matrix.v[2][k], 0.0f));
+            // _mm512_and_ps would need AVX-512DQ
+            __m512i xyz = _mm512_broadcast_i32x4(_mm_setr_epi32(-1, -1, -1,
+                        0));
+            int i = 0;
+            for (; i + 4 <= count; i += 4)
+            {
+                const Vertex *s = source + i;
+                Vertex *d = dest + i;
+                store_quad(d[0].position, d[1].position, d[2].position,
+                        d[3].position, transform_quad(c, load_quad(
+                                s[0].position, s[1].position, s[2].position,
+                                s[3].position)));
+                store_quad(d[0].normal, d[1].normal, d[2].normal,
+                        d[3].normal, rotate_quad(n, load_quad(s[0].normal,
+                                s[1].normal, s[2].normal, s[3].normal)));
+                __m512 tangent = rotate_quad(c, load_quad(s[0].tangent,
+                            s[1].tangent, s[2].tangent, s[3].tangent));
+                store_quad(d[0].tangent, d[1].tangent, d[2].tangent,
+                        d[3].tangent, _mm512_castsi512_ps(_mm512_and_si512(xyz,
+                                _mm512_castps_si512(tangent))));
+                for (int k = 0; k < 4; k++)
+                {
+                    d[k].tangent.v[3] = s[k].tangent.v[3];
+                    d[k].tex_coord = s[k].tex_coord;
+                }
+            }
+            transform_vertices_avx2(m, normal_matrix, source + i, dest + i,
+                    count - i);
+        }
+#endif
+    }
+
+    Vector bounding_sphere(const Mesh &mesh)
+    {
+        if (mesh.vertex_count == 0)
+            return Vector {0.0f, 0.0f, 0.0f, 0.0f};
+        Vector low = mesh.vertices[0].position.discardH();
+        Vector high = low;
+        for (int i = 1; i < mesh.vertex_count; i++)
+            for (int k = 0; k < 3; k++)
+            {
+                float v = mesh.vertices[i].position.v[k];
+                low.v[k] = std::min(low.v[k], v);
+                high.v[k] = std::max(high.v[k], v);
+            }
+        Vector center = (low + high) * 0.5f;
+        float radius2 = 0.0f;
+        for (int i = 0; i < mesh.vertex_count; i++)
+        {
+            Vector d = mesh.vertices[i].position.discardH() - center;
+            radius2 = std::max(radius2, d.dot_product(d));
+        }
+        return Vector {center.x(), center.y(), center.z(),
+            std::sqrt(radius2)};
+    }
+
+    void render_instanced(const Mesh &mesh, const Vector &sphere,
+            const Matrix transforms[], int count)
+    {
+        using namespace internal;
+        if (count <= 0 || mesh.vertex_count == 0)
+            return;
+        if (recording)
+        {
+            record_mesh(mesh, transforms, count, false);
+            return;
+        }
+        // the view parts shared by every instance
+        Matrix projection = matrix_projection;
+        Matrix *model_views = buffer.arena.allocate<Matrix>(count);
+        uint8 *visible = buffer.arena.allocate<uint8>(count);
+        parallel_for(0, count, INSTANCE_GRAIN, [&](int begin, int end) {
+            for (int i = begin; i < end; i++)
+            {
+                model_views[i] = matrix_model_view * transforms[i];
+                // shadow casters may lie outside the view frustum
+                visible[i] = !clipping_enabled || shadow_pass ||
+                    !sphere_outside(projection * model_views[i], sphere);
+            }
+        });
+
+        std::vector<int> batch;
+        std::vector<Vertex> eye;
+        int batch_size = std::max(1,
+                INSTANCE_BATCH_VERTICES / mesh.vertex_count);
+        Polygon polygon;
+        polygon.count = 3;
+        polygon.material = mesh.material;
+        for (int first = 0; first < count;)
+        {
+            // the next visible instances, up to a batch of vertices
+            batch.clear();
+            for (; first < count && (int)batch.size() < batch_size; first++)
+                if (visible[first])
+                    batch.push_back(first);
+            if (batch.empty())
+                continue;
+            eye.resize(batch.size() * mesh.vertex_count);
+            parallel_for(0, (int)batch.size(), 1, [&](int begin, int end) {
+                for (int b = begin; b < end; b++)
+                {
+                    const Matrix &model_view = model_views[batch[b]];
+                    transform_vertices(model_view,
+                            model_view.inverse().transpose(), mesh.vertices,
+                            &eye[b * mesh.vertex_count], mesh.vertex_count);
+                }
+            });
+            for (size_t b = 0; b < batch.size(); b++)
+            {
+                Vertex *vertices = &eye[b * mesh.vertex_count];
+                for (int t = 0; t < mesh.triangle_count; t++)
+                {
+                    for (int k = 0; k < 3; k++)
+                        polygon.vertices[k] =
+                            &vertices[mesh.indices[t * 3 + k]];
+                    InternalPolygon internal_polygon(polygon);
+                    render_eye_polygon(internal_polygon);
+                }
+            }
+        }
+    }
+}
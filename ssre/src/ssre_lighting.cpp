@@ -71,7 +71,8 @@ namespace ssre
 
     void LightingSource::contribute_lighting(
             const Material &material, const Vector &vertex_position, 
-            const Vector &vertex_normal, MaterialColor &color) const
+            const Vector &vertex_normal, MaterialColor &color,
+            float visibility) const
     {
         Vector N = vertex_normal.normalize();
         Vector V = -vertex_position.discardH().normalize();
@@ -107,11 +108,11 @@ namespace ssre
                 colors.ambient.color[i];
             if (NL > 0.0f)
             {
-                contribution += 
+                contribution += visibility * (
                     NL * material.diffuse.color[i] * 
                     colors.diffuse.color[i]
                     + NHS * material.specular.color[i] * 
-                    colors.specular.color[i];
+                    colors.specular.color[i]);
             }
             contribution = attenuation_factor * 
                 spotlight_factor * contribution;
@@ -149,26 +150,75 @@ namespace ssre
     {
         void compute_lighting_color(InternalPolygon &polygon)
         {
+            // normal mapped polygons are lit per pixel by the rasterizer
+            if (material_normal_map(polygon.material))
+            {
+                for (int i = 0; i < polygon.count; i++)
+                {
+                    InternalVertex &vertex = polygon.vertices[i];
+                    vertex.eye_position = vertex.position;
+                    vertex.color = {{0.0f, 0.0f, 0.0f,
+                        polygon.material.diffuse.color[3]}};
+                }
+                return;
+            }
             // clear colors
             for (int i = 0; i < polygon.count; i++)
+            {
                 polygon.vertices[i].color = {{0.0f, 0.0f, 0.0f, 0.0f}};
+                for (int j = 0; j < buffer.shadow_map_count; j++)
+                    polygon.vertices[i].shadowed[j] = 
+                        {{0.0f, 0.0f, 0.0f, 0.0f}};
+            }
             // compute the contribution of each point source
             for (int i = 0; i < polygon.count; i++)
             {
                 InternalVertex &vertex = polygon.vertices[i];
+                vertex.eye_position = vertex.position;
                 for (int j = 0; j < buffer.lighting_source_count; j++)
                 {
                     const LightingSource &source= buffer.lighting_sources[j];
-                    if (!source.disabled)
+                    if (source.disabled)
+                        continue;
+                    int map = light_shadow_map(j);
+                    if (map < 0)
                         source.contribute_lighting(polygon.material, 
                                 vertex.position, vertex.normal, vertex.color);
+                    else if (shadow_mode == PerVertex)
+                        source.contribute_lighting(polygon.material, 
+                                vertex.position, vertex.normal, vertex.color,
+                                shadow_visibility(shadow_maps[map],
+                                    vertex.position));
+                    else
+                    {
+                        // keep the part the shadow can remove apart, the
+                        // rasterizer scales it by the visibility per pixel
+                        MaterialColor lit = {{0.0f, 0.0f, 0.0f, 0.0f}};
+                        MaterialColor unlit = {{0.0f, 0.0f, 0.0f, 0.0f}};
+                        source.contribute_lighting(polygon.material, 
+                                vertex.position, vertex.normal, lit);
+                        source.contribute_lighting(polygon.material, 
+                                vertex.position, vertex.normal, unlit, 0.0f);
+                        vertex.color += unlit;
+                        vertex.shadowed[map] = lit - unlit;
+                    }
                 }
             }
             // normalize
             for (int i = 0; i < polygon.count; i++)
                 for (int j = 0; j < SSRE_LIGHTING_COMPONENT; j++)
-                    polygon.vertices[i].color.color[j] = std::min(1.0f, 
-                        std::max(polygon.vertices[i].color.color[j], 0.0f));
+                {
+                    // the half float buffer keeps what is above 1
+                    float &c = polygon.vertices[i].color.color[j];
+                    c = std::max(c, 0.0f);
+                    if (!hdr_enabled)
+                        c = std::min(c, 1.0f);
+                }
+            // like the fixed-function pipeline, opacity is the alpha
+            // of the diffuse material rather than a lit quantity
+            for (int i = 0; i < polygon.count; i++)
+                polygon.vertices[i].color.color[3] = 
+                    polygon.material.diffuse.color[3];
         }    
     }
 }
@@ -0,0 +1,129 @@
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <vector>
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    namespace internal
+    {
+        /* what a handle refers to, one of the two is set */
+        struct TextureBinding
+        {
+            Texture texture;
+            NormalMap normal_map;
+            bool released;
+        };
+
+        // handle - 1 indexes the bindings, handles are not reused
+        static std::vector<TextureBinding> bindings;
+        // the texels of every array by the handle of its first layer
+        static std::map<int, std::vector<uint32>> texture_arrays;
+
+        int add_binding(const Texture &texture, const NormalMap &normal_map)
+        {
+            bindings.push_back(TextureBinding {texture, normal_map, false});
+            return bindings.size();
+        }
+
+        TextureBinding &binding(int handle)
+        {
+            if (handle <= 0 || handle > (int)bindings.size() ||
+                    bindings[handle - 1].released)
+                throw new std::invalid_argument("invalid texture handle");
+            return bindings[handle - 1];
+        }
+
+        const Texture *material_texture(const Material &material,
+                TextureUnit unit)
+        {
+            int handle = material.textures[unit];
+            if (!handle)
+                return nullptr;
+            const Texture &texture = binding(handle).texture;
+            if (!texture.pixels)
+                throw new std::invalid_argument("not a texture handle");
+            return &texture;
+        }
+
+        const NormalMap *material_normal_map(const Material &material)
+        {
+            int handle = material.textures[NormalUnit];
+            if (!handle)
+                return normal_map_enabled ? &normal_map : nullptr;
+            const NormalMap &map = binding(handle).normal_map;
+            if (!map.normals)
+                throw new std::invalid_argument("not a normal map handle");
+            return &map;
+        }
+    }
+
+    int register_texture(const Texture &texture)
+    {
+        if (texture.width <= 0 || texture.height <= 0 || !texture.pixels)
+            throw new std::invalid_argument("invalid texture");
+        NormalMap none = {0, 0, nullptr};
+        internal::pin_streamed_texture(texture);
+        return internal::add_binding(texture, none);
+    }
+
+    int register_normal_map(const NormalMap &normal_map)
+    {
+        if (normal_map.width <= 0 || normal_map.height <= 0 ||
+                !normal_map.normals)
+            throw new std::invalid_argument("invalid normal map");
+        Texture none = {0, 0, nullptr};
+        return internal::add_binding(none, normal_map);
+    }
+
+    void release_texture_handle(int handle)
+    {
+        using namespace internal;
+        if (texture_arrays.count(handle))
+            throw new std::invalid_argument(
+                    "texture arrays go with destroy_texture_array");
+        TextureBinding &texture = binding(handle);
+        unpin_streamed_texture(texture.texture);
+        texture.released = true;
+    }
+
+    int create_texture_array(const Texture layers[], int count)
+    {
+        using namespace internal;
+        if (count < 1)
+            throw new std::invalid_argument("no texture array layers");
+        int w = layers[0].width, h = layers[0].height;
+        for (int i = 0; i < count; i++)
+            if (layers[i].width != w || layers[i].height != h ||
+                    w <= 0 || h <= 0 || !layers[i].pixels)
+                throw new std::invalid_argument(
+                        "texture array layers differ in size");
+        size_t size = (size_t)w * h;
+        std::vector<uint32> texels(size * count);
+        for (int i = 0; i < count; i++)
+            std::memcpy(&texels[size * i], layers[i].pixels,
+                    sizeof(uint32) * size);
+        NormalMap none = {0, 0, nullptr};
+        int first = bindings.size() + 1;
+        for (int i = 0; i < count; i++)
+            add_binding(Texture {w, h, &texels[size * i]}, none);
+        // moving the vector keeps its allocation
+        texture_arrays[first] = std::move(texels);
+        return first;
+    }
+
+    void destroy_texture_array(int first)
+    {
+        using namespace internal;
+        auto array = texture_arrays.find(first);
+        if (array == texture_arrays.end())
+            throw new std::invalid_argument("invalid texture array");
+        const Texture &layer = bindings[first - 1].texture;
+        int count = array->second.size() / ((size_t)layer.width * layer.height);
+        for (int i = 0; i < count; i++)
+            bindings[first - 1 + i].released = true;
+        texture_arrays.erase(array);
+    }
+}
@@ -0,0 +1,511 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    void compute_tangents(Mesh &mesh)
+    {
+        // sum the texture space directions of the triangles around every
+        // vertex, then orthogonalize against the normal
+        std::vector<Vector> sdirs(mesh.vertex_count, Vector {0.0f, 0.0f, 0.0f});
+        std::vector<Vector> tdirs(mesh.vertex_count, Vector {0.0f, 0.0f, 0.0f});
+        for (int t = 0; t < mesh.triangle_count; t++)
+        {
+            const int *index = mesh.indices + t * 3;
+            const Vertex &v0 = mesh.vertices[index[0]];
+            const Vertex &v1 = mesh.vertices[index[1]];
+            const Vertex &v2 = mesh.vertices[index[2]];
+            Vector e1 = (v1.position - v0.position).discardH();
+            Vector e2 = (v2.position - v0.position).discardH();
+            float s1 = v1.tex_coord.u - v0.tex_coord.u;
+            float s2 = v2.tex_coord.u - v0.tex_coord.u;
+            float t1 = v1.tex_coord.v - v0.tex_coord.v;
+            float t2 = v2.tex_coord.v - v0.tex_coord.v;
+            float d = s1 * t2 - s2 * t1;
+            if (d == 0.0f)
+                continue;
+            float r = 1.0f / d;
+            Vector sdir = (e1 * t2 - e2 * t1) * r;
+            Vector tdir = (e2 * s1 - e1 * s2) * r;
+            for (int k = 0; k < 3; k++)
+            {
+                sdirs[index[k]] += sdir;
+                tdirs[index[k]] += tdir;
+            }
+        }
+        for (int i = 0; i < mesh.vertex_count; i++)
+        {
+            Vertex &vertex = mesh.vertices[i];
+            Vector n = vertex.normal.discardH().normalize();
+            Vector t = (sdirs[i] - n * n.dot_product(sdirs[i])).normalize();
+            float handedness = (n * t).dot_product(tdirs[i]) < 0.0f ?
+                -1.0f : 1.0f;
+            vertex.tangent = Vector {t.x(), t.y(), t.z(), handedness};
+        }
+    }
+
+    NormalMap create_normal_map(const Texture &texture)
+    {
+        if (texture.width <= 0 || texture.height <= 0)
+            throw new std::invalid_argument("empty normal map");
+        int size = texture.width * texture.height;
+        NormalMap normal_map = {texture.width, texture.height,
+            new int8[size * 4]};
+        for (int i = 0; i < size; i++)
+        {
+            uint32 c = texture.pixels[i];
+            float x = SSRE_R(c) / 127.5f - 1.0f;
+            float y = SSRE_G(c) / 127.5f - 1.0f;
+            float z = SSRE_B(c) / 127.5f - 1.0f;
+            float length = std::sqrt(x * x + y * y + z * z);
+            if (length == 0.0f)
+            {
+                x = y = 0.0f;
+                z = length = 1.0f;
+            }
+            int8 *n = normal_map.normals + i * 4;
+            n[0] = (int8)std::lround(x / length * 127.0f);
+            n[1] = (int8)std::lround(y / length * 127.0f);
+            n[2] = (int8)std::lround(z / length * 127.0f);
+            n[3] = 0;
+        }
+        return normal_map;
+    }
+
+    void release_normal_map(NormalMap &normal_map)
+    {
+        delete[] normal_map.normals;
+        normal_map.normals = nullptr;
+        normal_map.width = normal_map.height = 0;
+    }
+
+    void enable_normal_map(const NormalMap &normal_map)
+    {
+        internal::normal_map = normal_map;
+        internal::normal_map_enabled = true;
+    }
+
+    void disable_normal_map()
+    {
+        internal::normal_map_enabled = false;
+    }
+
+    namespace internal
+    {
+        bool normal_map_enabled = false;
+        NormalMap normal_map;
+
+        int prepare_pixel_lights(const Material &material, PixelLight *lights)
+        {
+            int count = 0;
+            for (int j = 0; j < buffer.lighting_source_count; j++)
+            {
+                const LightingSource &source = buffer.lighting_sources[j];
+                if (source.disabled)
+                    continue;
+                PixelLight &light = lights[count++];
+                light.type = source.type;
+                for (int k = 0; k < 3; k++)
+                {
+                    light.position[k] = source.position.v[k];
+                    light.direction[k] = source.direction.v[k];
+                    light.ambient[k] = material.ambient.color[k] *
+                        source.colors.ambient.color[k];
+                    light.diffuse[k] = material.diffuse.color[k] *
+                        source.colors.diffuse.color[k];
+                    light.specular[k] = material.specular.color[k] *
+                        source.colors.specular.color[k];
+                }
+                light.attenuation = source.attenuation;
+                light.cos_cutoff = cos(source.spotlight_cutoff * M_PI / 180.0);
+                light.shadow_map = light_shadow_map(j);
+            }
+            return count;
+        }
+
+        /* texel index of the normal map, wrapping around */
+        inline int normal_texel(const NormalMap &map, float u, float v)
+        {
+            return wrapped_texel(map.width, map.height, u, v);
+        }
+
+        /* the color of a specular map, laid out like the normal map */
+        inline uint32 specular_texel(const Texture &map, float u, float v)
+        {
+            return map.pixels[wrapped_texel(map.width, map.height, u, v)];
+        }
+
+#ifdef __SSE2__
+        /* four pixels, one per lane */
+        struct Vector4x
+        {
+            __m128 x, y, z;
+        };
+
+        inline __m128 dot(const Vector4x &a, const Vector4x &b)
+        {
+            return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a.x, b.x),
+                        _mm_mul_ps(a.y, b.y)), _mm_mul_ps(a.z, b.z));
+        }
+
+        inline __m128 reciprocal_sqrt(__m128 x)
+        {
+            // one Newton step brings the estimate to about 22 bits
+            __m128 r = _mm_rsqrt_ps(x);
+            __m128 half_x = _mm_mul_ps(_mm_set1_ps(0.5f), x);
+            return _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f),
+                        _mm_mul_ps(half_x, _mm_mul_ps(r, r))));
+        }
+
+        inline Vector4x scale(const Vector4x &v, __m128 f)
+        {
+            return Vector4x {_mm_mul_ps(v.x, f), _mm_mul_ps(v.y, f),
+                _mm_mul_ps(v.z, f)};
+        }
+
+        inline Vector4x normalize(const Vector4x &v)
+        {
+            __m128 length2 = _mm_max_ps(dot(v, v), _mm_set1_ps(1e-20f));
+            return scale(v, reciprocal_sqrt(length2));
+        }
+
+        /* log2 of x > 0 */
+        inline __m128 log2_ps(__m128 x)
+        {
+            __m128i bits = _mm_castps_si128(x);
+            __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(
+                        _mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+            __m128 m = _mm_castsi128_ps(_mm_or_si128(
+                        _mm_and_si128(bits, _mm_set1_epi32(0x007fffff)),
+                        _mm_set1_epi32(0x3f800000)));
+            // ln(m) = 2 atanh((m - 1) / (m + 1)), m in [1, 2)
+            __m128 one = _mm_set1_ps(1.0f);
+            __m128 t = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+            __m128 t2 = _mm_mul_ps(t, t);
+            __m128 p = _mm_add_ps(_mm_set1_ps(1.0f / 5.0f),
+                    _mm_mul_ps(t2, _mm_set1_ps(1.0f / 7.0f)));
+            p = _mm_add_ps(_mm_set1_ps(1.0f / 3.0f), _mm_mul_ps(t2, p));
+            p = _mm_add_ps(one, _mm_mul_ps(t2, p));
+            __m128 ln = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(2.0f), t), p);
+            return _mm_add_ps(e, _mm_mul_ps(ln, _mm_set1_ps(1.44269504f)));
+        }
+
+        /* 2^x for x <= 0 */
+        inline __m128 exp2_ps(__m128 x)
+        {
+            x = _mm_max_ps(x, _mm_set1_ps(-126.0f));
+            __m128i i = _mm_cvttps_epi32(x);
+            __m128 fi = _mm_cvtepi32_ps(i);
+            // truncation rounds the negative values up, make it floor
+            __m128 above = _mm_cmpgt_ps(fi, x);
+            fi = _mm_sub_ps(fi, _mm_and_ps(above, _mm_set1_ps(1.0f)));
+            i = _mm_cvttps_epi32(fi);
+            __m128 f = _mm_sub_ps(x, fi);
+            __m128 p = _mm_set1_ps(1.3333558e-3f);
+            p = _mm_add_ps(_mm_set1_ps(9.6181291e-3f), _mm_mul_ps(f, p));
+            p = _mm_add_ps(_mm_set1_ps(5.5504109e-2f), _mm_mul_ps(f, p));
+            p = _mm_add_ps(_mm_set1_ps(2.4022651e-1f), _mm_mul_ps(f, p));
+            p = _mm_add_ps(_mm_set1_ps(6.9314718e-1f), _mm_mul_ps(f, p));
+            p = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(f, p));
+            return _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(p),
+                        _mm_slli_epi32(i, 23)));
+        }
+
+        /* x^e for x in [0, 1], zero where x <= 0 */
+        inline __m128 pow_ps(__m128 x, float e)
+        {
+            __m128 positive = _mm_cmpgt_ps(x, _mm_setzero_ps());
+            x = _mm_max_ps(x, _mm_set1_ps(1e-30f));
+            __m128 r = exp2_ps(_mm_mul_ps(log2_ps(x), _mm_set1_ps(e)));
+            return _mm_and_ps(r, positive);
+        }
+
+        inline __m128 attribute(const float *attributes, const float *steps,
+                int k, __m128 offsets)
+        {
+            return _mm_add_ps(_mm_set1_ps(attributes[k]),
+                    _mm_mul_ps(_mm_set1_ps(steps[k]), offsets));
+        }
+
+        inline __m128 clamp_to_byte(__m128 c)
+        {
+            c = _mm_min_ps(_mm_max_ps(c, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+            return _mm_mul_ps(c, _mm_set1_ps(255.0f));
+        }
+
+        void shade_lit_quad(const float *attributes, const float *steps,
+                const int *offsets, const PixelLight *lights,
+                int light_count, const Material &material,
+                const NormalMap &normal_map, const Texture *specular_map,
+                uint32 *colors)
+        {
+            __m128 o = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)offsets));
+            Vector4x eye = {attribute(attributes, steps, EYE_ATTRIBUTE, o),
+                attribute(attributes, steps, EYE_ATTRIBUTE + 1, o),
+                attribute(attributes, steps, EYE_ATTRIBUTE + 2, o)};
+            Vector4x n = normalize(Vector4x {
+                    attribute(attributes, steps, NORMAL_ATTRIBUTE, o),
+                    attribute(attributes, steps, NORMAL_ATTRIBUTE + 1, o),
+                    attribute(attributes, steps, NORMAL_ATTRIBUTE + 2, o)});
+            Vector4x t = {attribute(attributes, steps, TANGENT_ATTRIBUTE, o),
+                attribute(attributes, steps, TANGENT_ATTRIBUTE + 1, o),
+                attribute(attributes, steps, TANGENT_ATTRIBUTE + 2, o)};
+            __m128 handedness = attribute(attributes, steps,
+                    TANGENT_ATTRIBUTE + 3, o);
+            // Gram-Schmidt, the interpolated frame is no longer orthogonal
+            t = normalize(Vector4x {
+                    _mm_sub_ps(t.x, _mm_mul_ps(n.x, dot(n, t))),
+                    _mm_sub_ps(t.y, _mm_mul_ps(n.y, dot(n, t))),
+                    _mm_sub_ps(t.z, _mm_mul_ps(n.z, dot(n, t)))});
+            __m128 sign = _mm_or_ps(_mm_set1_ps(1.0f), _mm_and_ps(handedness,
+                        _mm_castsi128_ps(_mm_set1_epi32(0x80000000))));
+            Vector4x b = scale(Vector4x {
+                    _mm_sub_ps(_mm_mul_ps(n.y, t.z), _mm_mul_ps(n.z, t.y)),
+                    _mm_sub_ps(_mm_mul_ps(n.z, t.x), _mm_mul_ps(n.x, t.z)),
+                    _mm_sub_ps(_mm_mul_ps(n.x, t.y), _mm_mul_ps(n.y, t.x))},
+                    sign);
+
+            // fetch the four tangent space normals
+            __m128 u = attribute(attributes, steps, U_ATTRIBUTE, o);
+            __m128 v = attribute(attributes, steps, V_ATTRIBUTE, o);
+            float us[4], vs[4];
+            _mm_storeu_ps(us, u);
+            _mm_storeu_ps(vs, v);
+            int32 texels[4];
+            for (int k = 0; k < 4; k++)
+                memcpy(&texels[k], normal_map.normals +
+                        normal_texel(normal_map, us[k], vs[k]) * 4,
+                        sizeof(int32));
+            __m128i packed = _mm_loadu_si128((const __m128i *)texels);
+            __m128 unit = _mm_set1_ps(1.0f / 127.0f);
+            __m128 nx = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(
+                            _mm_slli_epi32(packed, 24), 24)), unit);
+            __m128 ny = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(
+                            _mm_slli_epi32(packed, 16), 24)), unit);
+            __m128 nz = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(
+                            _mm_slli_epi32(packed, 8), 24)), unit);
+            Vector4x N = normalize(Vector4x {
+                    _mm_add_ps(_mm_add_ps(_mm_mul_ps(t.x, nx),
+                            _mm_mul_ps(b.x, ny)), _mm_mul_ps(n.x, nz)),
+                    _mm_add_ps(_mm_add_ps(_mm_mul_ps(t.y, nx),
+                            _mm_mul_ps(b.y, ny)), _mm_mul_ps(n.y, nz)),
+                    _mm_add_ps(_mm_add_ps(_mm_mul_ps(t.z, nx),
+                            _mm_mul_ps(b.z, ny)), _mm_mul_ps(n.z, nz))});
+            // scales the specular colors, white without a specular map
+            __m128 specular_scale[3] = {_mm_set1_ps(1.0f), _mm_set1_ps(1.0f),
+                _mm_set1_ps(1.0f)};
+            if (specular_map)
+            {
+                for (int k = 0; k < 4; k++)
+                    texels[k] = specular_texel(*specular_map, us[k], vs[k]);
+                __m128i packed = _mm_loadu_si128((const __m128i *)texels);
+                for (int k = 0; k < 3; k++)
+                    specular_scale[k] = _mm_mul_ps(_mm_cvtepi32_ps(
+                                _mm_and_si128(_mm_srli_epi32(packed,
+                                        16 - 8 * k), _mm_set1_epi32(0xff))),
+                            _mm_set1_ps(1.0f / 255.0f));
+            }
+            __m128 zero = _mm_setzero_ps();
+            Vector4x V = normalize(Vector4x {_mm_sub_ps(zero, eye.x),
+                    _mm_sub_ps(zero, eye.y), _mm_sub_ps(zero, eye.z)});
+
+            __m128 r = zero, g = zero, bl = zero;
+            for (int j = 0; j < light_count; j++)
+            {
+                const PixelLight &light = lights[j];
+                Vector4x L;
+                __m128 distance = zero;
+                if (light.type == DirectionalSource)
+                    L = Vector4x {_mm_set1_ps(light.direction[0]),
+                        _mm_set1_ps(light.direction[1]),
+                        _mm_set1_ps(light.direction[2])};
+                else
+                {
+                    L = Vector4x {
+                        _mm_sub_ps(_mm_set1_ps(light.position[0]), eye.x),
+                        _mm_sub_ps(_mm_set1_ps(light.position[1]), eye.y),
+                        _mm_sub_ps(_mm_set1_ps(light.position[2]), eye.z)};
+                    __m128 length2 = _mm_max_ps(dot(L, L),
+                            _mm_set1_ps(1e-20f));
+                    __m128 inverse = reciprocal_sqrt(length2);
+                    distance = _mm_mul_ps(length2, inverse);
+                    L = scale(L, inverse);
+                }
+                Vector4x H = normalize(Vector4x {_mm_add_ps(L.x, V.x),
+                        _mm_add_ps(L.y, V.y), _mm_add_ps(L.z, V.z)});
+                __m128 NL = dot(N, L);
+                __m128 lit = _mm_cmpgt_ps(NL, zero);
+                __m128 diffuse = _mm_and_ps(NL, lit);
+                __m128 specular = _mm_and_ps(pow_ps(dot(N, H),
+                            material.shininess), lit);
+
+                __m128 factor = _mm_set1_ps(1.0f);
+                if (light.type != DirectionalSource)
+                {
+                    const Attenuation &a = light.attenuation;
+                    __m128 d = _mm_add_ps(_mm_set1_ps(a.constant),
+                            _mm_mul_ps(distance, _mm_add_ps(
+                                    _mm_set1_ps(a.linear), _mm_mul_ps(
+                                        distance, _mm_set1_ps(a.quadratic)))));
+                    factor = _mm_div_ps(factor, d);
+                }
+                if (light.type == SpotLight)
+                {
+                    Vector4x axis = {_mm_set1_ps(light.direction[0]),
+                        _mm_set1_ps(light.direction[1]),
+                        _mm_set1_ps(light.direction[2])};
+                    __m128 ED = _mm_sub_ps(zero, dot(L, axis));
+                    __m128 inside = _mm_cmpge_ps(ED,
+                            _mm_set1_ps(light.cos_cutoff));
+                    factor = _mm_mul_ps(factor, _mm_and_ps(inside,
+                                _mm_max_ps(ED, zero)));
+                }
+                if (light.shadow_map >= 0)
+                {
+                    float xs[4], ys[4], zs[4], visibility[4];
+                    _mm_storeu_ps(xs, eye.x);
+                    _mm_storeu_ps(ys, eye.y);
+                    _mm_storeu_ps(zs, eye.z);
+                    for (int k = 0; k < 4; k++)
+                        visibility[k] = shadow_visibility(
+                                shadow_maps[light.shadow_map],
+                                Vector {xs[k], ys[k], zs[k], 1.0f});
+                    __m128 shadow = _mm_loadu_ps(visibility);
+                    diffuse = _mm_mul_ps(diffuse, shadow);
+                    specular = _mm_mul_ps(specular, shadow);
+                }
+
+                __m128 *channels[3] = {&r, &g, &bl};
+                for (int k = 0; k < 3; k++)
+                {
+                    __m128 c = _mm_add_ps(_mm_set1_ps(light.ambient[k]),
+                            _mm_add_ps(_mm_mul_ps(diffuse,
+                                    _mm_set1_ps(light.diffuse[k])),
+                                _mm_mul_ps(_mm_mul_ps(specular,
+                                        specular_scale[k]),
+                                    _mm_set1_ps(light.specular[k]))));
+                    *channels[k] = _mm_add_ps(*channels[k],
+                            _mm_mul_ps(factor, c));
+                }
+            }
+
+            // same truncation as MaterialColor::toARGB
+            __m128i ri = _mm_cvttps_epi32(clamp_to_byte(r));
+            __m128i gi = _mm_cvttps_epi32(clamp_to_byte(g));
+            __m128i bi = _mm_cvttps_epi32(clamp_to_byte(bl));
+            int alpha = (int)(std::min(1.0f, std::max(0.0f,
+                            material.diffuse.color[3])) * 255.0f);
+            __m128i argb = _mm_or_si128(_mm_or_si128(
+                        _mm_set1_epi32(alpha << 24), _mm_slli_epi32(ri, 16)),
+                    _mm_or_si128(_mm_slli_epi32(gi, 8), bi));
+            _mm_storeu_si128((__m128i *)colors, argb);
+        }
+#else
+        uint32 shade_lit_pixel(const float *attributes, const float *steps,
+                int offset, const PixelLight *lights, int light_count,
+                const Material &material, const NormalMap &normal_map,
+                const Texture *specular_map)
+        {
+            float a[LIT_ATTRIBUTE_COUNT];
+            for (int k = 0; k < LIT_ATTRIBUTE_COUNT; k++)
+                a[k] = attributes[k] + steps[k] * offset;
+            Vector eye = {a[EYE_ATTRIBUTE], a[EYE_ATTRIBUTE + 1],
+                a[EYE_ATTRIBUTE + 2], 1.0f};
+            Vector n = Vector {a[NORMAL_ATTRIBUTE], a[NORMAL_ATTRIBUTE + 1],
+                a[NORMAL_ATTRIBUTE + 2]}.normalize();
+            Vector t = {a[TANGENT_ATTRIBUTE], a[TANGENT_ATTRIBUTE + 1],
+                a[TANGENT_ATTRIBUTE + 2]};
+            t = (t - n * n.dot_product(t)).normalize();
+            Vector b = (n * t) * (a[TANGENT_ATTRIBUTE + 3] < 0.0f ?
+                    -1.0f : 1.0f);
+            const int8 *texel = normal_map.normals +
+                normal_texel(normal_map, a[U_ATTRIBUTE], a[V_ATTRIBUTE]) * 4;
+            Vector N = (t * (texel[0] / 127.0f) + b * (texel[1] / 127.0f) +
+                    n * (texel[2] / 127.0f)).normalize();
+
+            // the material is already folded into the light colors
+            Material white = {{{1.0f, 1.0f, 1.0f, 1.0f}},
+                {{1.0f, 1.0f, 1.0f, 1.0f}}, {{1.0f, 1.0f, 1.0f, 1.0f}},
+                material.shininess, {0, 0, 0}};
+            if (specular_map)
+            {
+                uint32 c = specular_texel(*specular_map, a[U_ATTRIBUTE],
+                        a[V_ATTRIBUTE]);
+                white.specular = {{SSRE_R(c) / 255.0f, SSRE_G(c) / 255.0f,
+                    SSRE_B(c) / 255.0f, 1.0f}};
+            }
+            MaterialColor color = {{0.0f, 0.0f, 0.0f, 0.0f}};
+            for (int j = 0; j < light_count; j++)
+            {
+                const PixelLight &light = lights[j];
+                LightingSource source;
+                source.type = light.type;
+                source.position = Vector {light.position[0],
+                    light.position[1], light.position[2], 1.0f};
+                source.direction = Vector {light.direction[0],
+                    light.direction[1], light.direction[2]};
+                for (int k = 0; k < 3; k++)
+                {
+                    source.colors.ambient.color[k] = light.ambient[k];
+                    source.colors.diffuse.color[k] = light.diffuse[k];
+                    source.colors.specular.color[k] = light.specular[k];
+                }
+                source.colors.ambient.color[3] = 0.0f;
+                source.colors.diffuse.color[3] = 0.0f;
+                source.colors.specular.color[3] = 0.0f;
+                source.attenuation = light.attenuation;
+                source.spotlight_cutoff = acos(light.cos_cutoff) * 180.0 / M_PI;
+                float visibility = light.shadow_map < 0 ? 1.0f :
+                    shadow_visibility(shadow_maps[light.shadow_map], eye);
+                source.contribute_lighting(white, eye, N, color, visibility);
+            }
+            for (int k = 0; k < 3; k++)
+                color.color[k] = std::min(1.0f, std::max(color.color[k], 0.0f));
+            color.color[3] = std::min(1.0f, std::max(0.0f,
+                        material.diffuse.color[3]));
+            return color.toARGB();
+        }
+#endif
+
+        void shade_lit_pixels(const float *attributes, const float *steps,
+                const int *offsets, int count, const PixelLight *lights,
+                int light_count, const Material &material, uint32 *colors)
+        {
+            const NormalMap &normal_map = *material_normal_map(material);
+            const Texture *specular_map = material_texture(material,
+                    SpecularUnit);
+#ifdef __SSE2__
+            int i = 0;
+            for (; i + 4 <= count; i += 4)
+                shade_lit_quad(attributes, steps, offsets + i, lights,
+                        light_count, material, normal_map, specular_map,
+                        colors + i);
+            if (i < count)
+            {
+                // pad the last quad by repeating its final pixel
+                int rest[4];
+                uint32 shaded[4];
+                for (int k = 0; k < 4; k++)
+                    rest[k] = offsets[std::min(i + k, count - 1)];
+                shade_lit_quad(attributes, steps, rest, lights, light_count,
+                        material, normal_map, specular_map, shaded);
+                for (int k = 0; i + k < count; k++)
+                    colors[i + k] = shaded[k];
+            }
+#else
+            for (int i = 0; i < count; i++)
+                colors[i] = shade_lit_pixel(attributes, steps, offsets[i],
+                        lights, light_count, material, normal_map,
+                        specular_map);
+#endif
+        }
+    }
+}
@@ -0,0 +1,546 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    namespace internal
+    {
+        /* particles integrated by a worker at a time */
+        const int PARTICLE_CHUNK = 16384;
+        /* rows of the framebuffer a sprite bin covers */
+        const int SPRITE_BAND_ROWS = 32;
+        /* resolution of the sprite image */
+        const int SPRITE_SIZE = 32;
+
+        /* structure of arrays, one of them per ping-pong side */
+        struct ParticleBuffer
+        {
+            std::vector<uint8> type;
+            std::vector<float> x, y, z;
+            std::vector<float> vx, vy, vz;
+            std::vector<float> age;
+
+            void resize(int capacity)
+            {
+                type.resize(capacity);
+                for (std::vector<float> *v : {&x, &y, &z, &vx, &vy, &vz, &age})
+                    v->resize(capacity);
+            }
+        };
+
+        struct Launcher
+        {
+            Vector position;
+            float age;
+        };
+
+        /* per chunk bookkeeping between the integrate and scatter passes */
+        struct ParticleChunk
+        {
+            int alive;
+            int spawned;
+            int offset;
+        };
+    }
+
+    struct ParticleSystem
+    {
+        ParticleSystemSettings settings;
+        std::vector<internal::Launcher> launchers;
+        internal::ParticleBuffer buffers[2];
+        int current = 0;
+        int count = 0;
+        uint32 frame = 0;
+
+        std::vector<uint8> dead;
+        std::vector<internal::ParticleChunk> chunks;
+
+        // screen space sprites of the last render
+        std::vector<float> sx, sy, sz, half_size;
+        std::vector<int> bin_offsets;
+        std::vector<int> bins;
+    };
+
+    namespace internal
+    {
+        inline uint32 hash(uint32 x)
+        {
+            x ^= x >> 16;
+            x *= 0x7feb352d;
+            x ^= x >> 15;
+            x *= 0x846ca68b;
+            x ^= x >> 16;
+            return x;
+        }
+
+        /* direction in [-0.5, 0.5]^3, the random texture of the GL demo */
+        Vector random_direction(uint32 seed)
+        {
+            uint32 h0 = hash(seed), h1 = hash(h0), h2 = hash(h1);
+            return Vector {
+                (h0 >> 8) * (1.0f / 16777216.0f) - 0.5f,
+                (h1 >> 8) * (1.0f / 16777216.0f) - 0.5f,
+                (h2 >> 8) * (1.0f / 16777216.0f) - 0.5f
+            };
+        }
+
+        Vector shell_velocity(Vector direction, float speed)
+        {
+            if (direction.is_zero_vector())
+                direction = Vector {0.0f, 1.0f, 0.0f};
+            return direction.normalize() * speed;
+        }
+
+        /*
+         * advance age, position and velocity of [begin, end) and flag the
+         * particles whose lifetime ran out. Dead particles keep the
+         * position they had, it is where their secondaries are born
+         */
+        int integrate_particles(ParticleBuffer &b, uint8 *dead,
+                int begin, int end, float delta, float shell_lifetime,
+                float secondary_lifetime, float gravity)
+        {
+            float seconds = delta / 1000.0f;
+            float dv = seconds * gravity;
+            int alive = 0;
+            int i = begin;
+#ifdef __SSE2__
+            const __m128 vdelta = _mm_set1_ps(delta);
+            const __m128 vseconds = _mm_set1_ps(seconds);
+            const __m128 vdv = _mm_set1_ps(dv);
+            const __m128 vshell = _mm_set1_ps(shell_lifetime);
+            const __m128 vsecondary = _mm_set1_ps(secondary_lifetime);
+            for (; i + 4 <= end; i += 4)
+            {
+                int32 packed;
+                memcpy(&packed, &b.type[i], sizeof(packed));
+                __m128i types = _mm_cvtsi32_si128(packed);
+                types = _mm_unpacklo_epi16(_mm_unpacklo_epi8(types,
+                            _mm_setzero_si128()), _mm_setzero_si128());
+                __m128 is_shell = _mm_castsi128_ps(_mm_cmpeq_epi32(types,
+                            _mm_set1_epi32(ParticleShell)));
+                __m128 lifetime = _mm_or_ps(_mm_and_ps(is_shell, vshell),
+                        _mm_andnot_ps(is_shell, vsecondary));
+
+                __m128 age = _mm_add_ps(_mm_loadu_ps(&b.age[i]), vdelta);
+                __m128 live = _mm_cmplt_ps(age, lifetime);
+                _mm_storeu_ps(&b.age[i], age);
+
+                __m128 vx = _mm_loadu_ps(&b.vx[i]);
+                __m128 vy = _mm_loadu_ps(&b.vy[i]);
+                __m128 vz = _mm_loadu_ps(&b.vz[i]);
+                __m128 step = _mm_and_ps(live, vseconds);
+                _mm_storeu_ps(&b.x[i], _mm_add_ps(_mm_loadu_ps(&b.x[i]),
+                            _mm_mul_ps(vx, step)));
+                _mm_storeu_ps(&b.y[i], _mm_add_ps(_mm_loadu_ps(&b.y[i]),
+                            _mm_mul_ps(vy, step)));
+                _mm_storeu_ps(&b.z[i], _mm_add_ps(_mm_loadu_ps(&b.z[i]),
+                            _mm_mul_ps(vz, step)));
+                _mm_storeu_ps(&b.vy[i], _mm_add_ps(vy,
+                            _mm_and_ps(live, vdv)));
+
+                int mask = _mm_movemask_ps(live);
+                for (int k = 0; k < 4; k++)
+                    dead[i + k] = !(mask & (1 << k));
+                alive += __builtin_popcount(mask);
+            }
+#endif
+            for (; i < end; i++)
+            {
+                float lifetime = b.type[i] == ParticleShell ?
+                    shell_lifetime : secondary_lifetime;
+                b.age[i] += delta;
+                dead[i] = !(b.age[i] < lifetime);
+                if (dead[i])
+                    continue;
+                b.x[i] += b.vx[i] * seconds;
+                b.y[i] += b.vy[i] * seconds;
+                b.z[i] += b.vz[i] * seconds;
+                b.vy[i] += dv;
+                alive++;
+            }
+            return alive;
+        }
+
+        void store_particle(ParticleBuffer &b, int i, uint8 type,
+                const Vector &position, const Vector &velocity)
+        {
+            b.type[i] = type;
+            b.x[i] = position.x();
+            b.y[i] = position.y();
+            b.z[i] = position.z();
+            b.vx[i] = velocity.x();
+            b.vy[i] = velocity.y();
+            b.vz[i] = velocity.z();
+            b.age[i] = 0.0f;
+        }
+
+        /*
+         * copy the survivors of a chunk to the other buffer followed by
+         * the secondaries of its exploded shells. Output past the
+         * capacity is dropped
+         */
+        void scatter_particles(ParticleSystem *system, const ParticleBuffer &src,
+                ParticleBuffer &dest, int begin, int end, int offset,
+                uint32 seed)
+        {
+            const ParticleSystemSettings &settings = system->settings;
+            int capacity = settings.capacity;
+            const uint8 *dead = system->dead.data();
+            int out = offset;
+            for (int i = begin; i < end && out < capacity; i++)
+            {
+                if (dead[i])
+                    continue;
+                dest.type[out] = src.type[i];
+                dest.x[out] = src.x[i];
+                dest.y[out] = src.y[i];
+                dest.z[out] = src.z[i];
+                dest.vx[out] = src.vx[i];
+                dest.vy[out] = src.vy[i];
+                dest.vz[out] = src.vz[i];
+                dest.age[out] = src.age[i];
+                out++;
+            }
+            for (int i = begin; i < end; i++)
+            {
+                if (!dead[i] || src.type[i] != ParticleShell)
+                    continue;
+                Vector position = {src.x[i], src.y[i], src.z[i], 1.0f};
+                for (int k = 0; k < settings.secondary_shell_count; k++)
+                {
+                    if (out >= capacity)
+                        return;
+                    Vector direction = random_direction(
+                            seed ^ hash(i * 31 + k));
+                    store_particle(dest, out++, ParticleSecondaryShell,
+                            position, shell_velocity(direction,
+                                settings.shell_speed));
+                }
+            }
+        }
+    }
+
+    ParticleSystem *create_particle_system(
+            const ParticleSystemSettings &settings)
+    {
+        if (settings.capacity <= 0)
+            throw new std::invalid_argument("particle capacity must be positive");
+        ParticleSystem *system = new ParticleSystem;
+        system->settings = settings;
+        system->buffers[0].resize(settings.capacity);
+        system->buffers[1].resize(settings.capacity);
+        system->dead.resize(settings.capacity);
+        return system;
+    }
+
+    void destroy_particle_system(ParticleSystem *system)
+    {
+        delete system;
+    }
+
+    void add_particle_launcher(ParticleSystem *system, const Vector &position)
+    {
+        system->launchers.push_back({position, 0.0f});
+    }
+
+    int particle_count(const ParticleSystem *system)
+    {
+        return system->count;
+    }
+
+    void update_particle_system(ParticleSystem *system, float delta)
+    {
+        using namespace internal;
+        const ParticleSystemSettings &settings = system->settings;
+        ParticleBuffer &src = system->buffers[system->current];
+        ParticleBuffer &dest = system->buffers[1 - system->current];
+        uint32 seed = hash(++system->frame);
+
+        int count = system->count;
+        int chunk_count = (count + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK;
+        system->chunks.resize(chunk_count);
+        ParticleChunk *chunks = system->chunks.data();
+        uint8 *dead = system->dead.data();
+
+        parallel_for(0, chunk_count, 1, [&](int c0, int c1) {
+            for (int c = c0; c < c1; c++)
+            {
+                int begin = c * PARTICLE_CHUNK;
+                int end = std::min(count, begin + PARTICLE_CHUNK);
+                chunks[c].alive = integrate_particles(src, dead, begin, end,
+                        delta, settings.shell_lifetime,
+                        settings.secondary_shell_lifetime, settings.gravity);
+                int exploded = 0;
+                for (int i = begin; i < end; i++)
+                    exploded += dead[i] && src.type[i] == ParticleShell;
+                chunks[c].spawned = exploded * settings.secondary_shell_count;
+            }
+        });
+
+        // chunks keep their order in the output so the result does not
+        // depend on how the work was split across threads
+        int offset = 0;
+        for (int c = 0; c < chunk_count; c++)
+        {
+            chunks[c].offset = offset;
+            offset += chunks[c].alive + chunks[c].spawned;
+        }
+
+        parallel_for(0, chunk_count, 1, [&](int c0, int c1) {
+            for (int c = c0; c < c1; c++)
+            {
+                int begin = c * PARTICLE_CHUNK;
+                int end = std::min(count, begin + PARTICLE_CHUNK);
+                scatter_particles(system, src, dest, begin, end,
+                        chunks[c].offset, seed ^ hash(c));
+            }
+        });
+        count = std::min(offset, settings.capacity);
+
+        // launchers only emit, they never move or die
+        for (size_t i = 0; i < system->launchers.size(); i++)
+        {
+            Launcher &launcher = system->launchers[i];
+            launcher.age += delta;
+            if (launcher.age < settings.launcher_lifetime)
+                continue;
+            launcher.age = 0.0f;
+            if (count >= settings.capacity)
+                continue;
+            Vector direction = random_direction(seed ^ hash(~(uint32)i));
+            direction.v[1] = std::max(direction.y(), 0.5f);
+            store_particle(dest, count++, ParticleShell, launcher.position,
+                    shell_velocity(direction, settings.shell_speed));
+        }
+
+        system->count = count;
+        system->current = 1 - system->current;
+    }
+
+    namespace internal
+    {
+        /*
+         * project the particle centres and the billboard half size to the
+         * screen, 4 at a time. Culled particles get a zero size
+         */
+        void project_particles(ParticleSystem *system, const ParticleBuffer &b,
+                int begin, int end)
+        {
+            Matrix m = matrix_projection * matrix_model_view;
+            const Matrix &vp = matrix_view_port;
+            float size = system->settings.billboard_size * 0.5f *
+                matrix_projection.v[1][1] * vp.v[1][1];
+            int i = begin;
+#ifdef __SSE2__
+            for (; i + 4 <= end; i += 4)
+            {
+                __m128 x = _mm_loadu_ps(&b.x[i]);
+                __m128 y = _mm_loadu_ps(&b.y[i]);
+                __m128 z = _mm_loadu_ps(&b.z[i]);
+                __m128 c[4];
+                for (int r = 0; r < 4; r++)
+                    c[r] = _mm_add_ps(_mm_add_ps(
+                                _mm_mul_ps(x, _mm_set1_ps(m.v[r][0])),
+                                _mm_mul_ps(y, _mm_set1_ps(m.v[r][1]))),
+                            _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(m.v[r][2])),
+                                _mm_set1_ps(m.v[r][3])));
+                __m128 w = c[3];
+                __m128 inside = _mm_and_ps(
+                        _mm_cmpgt_ps(w, _mm_setzero_ps()),
+                        _mm_and_ps(_mm_cmple_ps(c[2], w),
+                            _mm_cmpge_ps(c[2],
+                                _mm_sub_ps(_mm_setzero_ps(), w))));
+                __m128 rw = _mm_div_ps(_mm_set1_ps(1.0f), w);
+                __m128 nx = _mm_mul_ps(c[0], rw);
+                __m128 ny = _mm_mul_ps(c[1], rw);
+                __m128 nz = _mm_mul_ps(c[2], rw);
+                _mm_storeu_ps(&system->sx[i], _mm_add_ps(
+                            _mm_mul_ps(nx, _mm_set1_ps(vp.v[0][0])),
+                            _mm_set1_ps(vp.v[0][3])));
+                _mm_storeu_ps(&system->sy[i], _mm_add_ps(
+                            _mm_mul_ps(ny, _mm_set1_ps(vp.v[1][1])),
+                            _mm_set1_ps(vp.v[1][3])));
+                _mm_storeu_ps(&system->sz[i], _mm_add_ps(
+                            _mm_mul_ps(nz, _mm_set1_ps(vp.v[2][2])),
+                            _mm_set1_ps(vp.v[2][3])));
+                _mm_storeu_ps(&system->half_size[i], _mm_and_ps(inside,
+                            _mm_mul_ps(rw, _mm_set1_ps(size))));
+            }
+#endif
+            for (; i < end; i++)
+            {
+                Vector c = m * Vector {b.x[i], b.y[i], b.z[i], 1.0f};
+                float w = c.h();
+                if (w <= 0.0f || c.z() > w || c.z() < -w)
+                {
+                    system->half_size[i] = 0.0f;
+                    continue;
+                }
+                system->sx[i] = c.x() / w * vp.v[0][0] + vp.v[0][3];
+                system->sy[i] = c.y() / w * vp.v[1][1] + vp.v[1][3];
+                system->sz[i] = c.z() / w * vp.v[2][2] + vp.v[2][3];
+                system->half_size[i] = size / w;
+            }
+        }
+
+        /*
+         * premultiplied sprite image, so that compositing a texel is a
+         * saturating add. Alpha stays zero to leave the destination alone
+         */
+        void build_sprite(const MaterialColor &color, uint32 *sprite)
+        {
+            for (int y = 0; y < SPRITE_SIZE; y++)
+                for (int x = 0; x < SPRITE_SIZE; x++)
+                {
+                    float u = (x + 0.5f) / SPRITE_SIZE;
+                    float v = (y + 0.5f) / SPRITE_SIZE;
+                    uint32 c;
+                    if (texture_enabled)
+                    {
+                        int tx = std::min(texture.width - 1,
+                                (int)(u * texture.width));
+                        int ty = std::min(texture.height - 1,
+                                (int)(v * texture.height));
+                        c = texture.pixels[ty * texture.width + tx];
+                    }
+                    else
+                    {
+                        // soft round point sprite
+                        float du = 2.0f * u - 1.0f, dv = 2.0f * v - 1.0f;
+                        float i = std::max(0.0f, 1.0f - (du * du + dv * dv));
+                        uint8 l = (uint8)(i * 255.0f);
+                        c = SSRE_ARGB(l, 255, 255, 255);
+                    }
+                    float a = SSRE_A(c) / 255.0f * color.color[3];
+                    sprite[y * SPRITE_SIZE + x] = SSRE_ARGB(0,
+                            (uint32)(SSRE_R(c) * color.color[0] * a),
+                            (uint32)(SSRE_G(c) * color.color[1] * a),
+                            (uint32)(SSRE_B(c) * color.color[2] * a));
+                }
+        }
+
+        void draw_sprite_band(const ParticleSystem *system, int band,
+                int chunk_count, const uint32 *sprite, uint32 *pixels,
+                const float *depths, int width, int height)
+        {
+            int y_min = band * SPRITE_BAND_ROWS;
+            int y_max = std::min(height, y_min + SPRITE_BAND_ROWS) - 1;
+            const std::vector<int> &offsets = system->bin_offsets;
+            bool depth_test = z_buffer_enabled;
+            for (int k = offsets[band * chunk_count];
+                    k < offsets[(band + 1) * chunk_count]; k++)
+            {
+                int i = system->bins[k];
+                float h = system->half_size[i];
+                float left = system->sx[i] - h, bottom = system->sy[i] - h;
+                int x0 = std::max(0, (int)std::ceil(left - 0.5f));
+                int x1 = std::min(width - 1, (int)std::floor(left + 2 * h - 0.5f));
+                int y0 = std::max(y_min, (int)std::ceil(bottom - 0.5f));
+                int y1 = std::min(y_max, (int)std::floor(bottom + 2 * h - 0.5f));
+                float z = system->sz[i];
+                // sprite texel coordinates in 16.16 fixed point
+                float scale = SPRITE_SIZE / (2 * h) * 65536.0f;
+                int step = (int)scale;
+                int u0 = (int)((x0 + 0.5f - left) * scale);
+                for (int y = y0; y <= y1; y++)
+                {
+                    int row = (height - 1 - y) * width;
+                    int ty = std::min(SPRITE_SIZE - 1,
+                            (int)((y + 0.5f - bottom) * scale) >> 16);
+                    const uint32 *texels = sprite + ty * SPRITE_SIZE;
+                    uint32 *line = pixels + row;
+                    const float *depth_line = depths + row;
+                    int u = u0;
+                    for (int x = x0; x <= x1; x++, u += step)
+                    {
+                        if (depth_test && !(z < depth_line[x]))
+                            continue;
+                        int tx = std::min(SPRITE_SIZE - 1, u >> 16);
+                        line[x] = add_saturate(texels[tx], line[x]);
+                    }
+                }
+            }
+        }
+
+        /* first and last band of rows a projected sprite touches */
+        bool sprite_bands(const ParticleSystem *system, int i, int height,
+                int &b0, int &b1)
+        {
+            float h = system->half_size[i];
+            if (h * 2.0f < 0.5f)
+                return false;
+            int y0 = (int)std::ceil(system->sy[i] - h - 0.5f);
+            int y1 = (int)std::floor(system->sy[i] + h - 0.5f);
+            if (y1 < 0 || y0 >= height || y0 > y1)
+                return false;
+            b0 = std::max(0, y0) / SPRITE_BAND_ROWS;
+            b1 = std::min(height - 1, y1) / SPRITE_BAND_ROWS;
+            return true;
+        }
+
+        void render_particles(ParticleSystem *system, uint32 *pixels,
+                const float *depths, int width, int height)
+        {
+            const ParticleBuffer &b = system->buffers[system->current];
+            int count = system->count;
+            for (std::vector<float> *v : {&system->sx, &system->sy,
+                    &system->sz, &system->half_size})
+                v->resize(count);
+
+            // project and count the sprites of every band per chunk, the
+            // bins are then filled chunk by chunk in particle order
+            int band_count = (height + SPRITE_BAND_ROWS - 1) / SPRITE_BAND_ROWS;
+            int chunk_count = (count + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK;
+            std::vector<int> &offsets = system->bin_offsets;
+            offsets.assign((size_t)band_count * chunk_count + 1, 0);
+            parallel_for(0, chunk_count, 1, [&](int c0, int c1) {
+                for (int c = c0; c < c1; c++)
+                {
+                    int begin = c * PARTICLE_CHUNK;
+                    int end = std::min(count, begin + PARTICLE_CHUNK);
+                    project_particles(system, b, begin, end);
+                    int b0, b1;
+                    for (int i = begin; i < end; i++)
+                        if (sprite_bands(system, i, height, b0, b1))
+                            for (int band = b0; band <= b1; band++)
+                                offsets[band * chunk_count + c + 1]++;
+                }
+            });
+            for (size_t k = 1; k < offsets.size(); k++)
+                offsets[k] += offsets[k - 1];
+            system->bins.resize(offsets.back());
+            parallel_for(0, chunk_count, 1, [&](int c0, int c1) {
+                std::vector<int> cursor(band_count);
+                for (int c = c0; c < c1; c++)
+                {
+                    for (int band = 0; band < band_count; band++)
+                        cursor[band] = offsets[band * chunk_count + c];
+                    int begin = c * PARTICLE_CHUNK;
+                    int end = std::min(count, begin + PARTICLE_CHUNK);
+                    int b0, b1;
+                    for (int i = begin; i < end; i++)
+                        if (sprite_bands(system, i, height, b0, b1))
+                            for (int band = b0; band <= b1; band++)
+                                system->bins[cursor[band]++] = i;
+                }
+            });
+
+            uint32 sprite[SPRITE_SIZE * SPRITE_SIZE];
+            build_sprite(system->settings.color, sprite);
+            parallel_for(0, band_count, 1, [&](int band0, int band1) {
+                for (int band = band0; band < band1; band++)
+                    draw_sprite_band(system, band, chunk_count, sprite,
+                            pixels, depths, width, height);
+            });
+        }
+    }
+}
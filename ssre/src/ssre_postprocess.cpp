@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    namespace internal
+    {
+        bool fxaa_enabled = false;
+        uint8 fxaa_threshold = 32;
+
+        /* rows handed to a worker at a time */
+        const int FXAA_ROW_GRAIN = 16;
+
+        static std::vector<uint8> luma_buffer;
+        static std::vector<uint32> fxaa_buffer;
+
+        inline uint8 luma(uint32 c)
+        {
+            return (uint8)((SSRE_R(c) * 77 + SSRE_G(c) * 150 +
+                        SSRE_B(c) * 29) >> 8);
+        }
+
+        void compute_luma_row(const uint32 *src, uint8 *dest, int n)
+        {
+            int x = 0;
+#ifdef __SSE2__
+            const __m128i mask = _mm_set1_epi32(0xff);
+            const __m128i wr = _mm_set1_epi32(77);
+            const __m128i wg = _mm_set1_epi32(150);
+            const __m128i wb = _mm_set1_epi32(29);
+            for (; x + 16 <= n; x += 16)
+            {
+                __m128i l[4];
+                for (int k = 0; k < 4; k++)
+                {
+                    __m128i c = _mm_loadu_si128((const __m128i *)(src + x + 4 * k));
+                    __m128i r = _mm_and_si128(_mm_srli_epi32(c, 16), mask);
+                    __m128i g = _mm_and_si128(_mm_srli_epi32(c, 8), mask);
+                    __m128i b = _mm_and_si128(c, mask);
+                    // each product fits in the low 16 bits of the lane
+                    __m128i s = _mm_add_epi32(_mm_mullo_epi16(r, wr),
+                            _mm_add_epi32(_mm_mullo_epi16(g, wg),
+                                _mm_mullo_epi16(b, wb)));
+                    l[k] = _mm_srli_epi32(s, 8);
+                }
+                __m128i lo = _mm_packs_epi32(l[0], l[1]);
+                __m128i hi = _mm_packs_epi32(l[2], l[3]);
+                _mm_storeu_si128((__m128i *)(dest + x), _mm_packus_epi16(lo, hi));
+            }
+#endif
+            for (; x < n; x++)
+                dest[x] = luma(src[x]);
+        }
+
+        /*
+         * bitmask of pixels in [x, x + 16) whose local luma contrast
+         * reaches the threshold, one bit per pixel
+         */
+        int edge_mask(const uint8 *up, const uint8 *mid, const uint8 *down,
+                int x, uint8 threshold)
+        {
+#ifdef __SSE2__
+            __m128i m = _mm_loadu_si128((const __m128i *)(mid + x));
+            __m128i n = _mm_loadu_si128((const __m128i *)(up + x));
+            __m128i s = _mm_loadu_si128((const __m128i *)(down + x));
+            __m128i w = _mm_loadu_si128((const __m128i *)(mid + x - 1));
+            __m128i e = _mm_loadu_si128((const __m128i *)(mid + x + 1));
+            __m128i lmax = _mm_max_epu8(_mm_max_epu8(m, n),
+                    _mm_max_epu8(_mm_max_epu8(s, w), e));
+            __m128i lmin = _mm_min_epu8(_mm_min_epu8(m, n),
+                    _mm_min_epu8(_mm_min_epu8(s, w), e));
+            __m128i range = _mm_subs_epu8(lmax, lmin);
+            // zero where range >= threshold
+            __m128i below = _mm_subs_epu8(
+                    _mm_set1_epi8((char)threshold), range);
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(below,
+                        _mm_setzero_si128()));
+#else
+            int mask = 0;
+            for (int k = 0; k < 16; k++)
+            {
+                int i = x + k;
+                uint8 lmax = std::max({mid[i], up[i], down[i],
+                        mid[i - 1], mid[i + 1]});
+                uint8 lmin = std::min({mid[i], up[i], down[i],
+                        mid[i - 1], mid[i + 1]});
+                if (lmax - lmin >= threshold)
+                    mask |= 1 << k;
+            }
+            return mask;
+#endif
+        }
+
+        /*
+         * FXAA-lite for one pixel: pick the edge orientation from the
+         * 3x3 luma neighbourhood and blend towards the neighbour across
+         * the edge by the sub-pixel aliasing estimate
+         */
+        uint32 fxaa_pixel(const uint32 *src, const uint8 *up,
+                const uint8 *mid, const uint8 *down, int x, int width)
+        {
+            int m = mid[x];
+            int n = up[x], s = down[x], w = mid[x - 1], e = mid[x + 1];
+            int nw = up[x - 1], ne = up[x + 1];
+            int sw = down[x - 1], se = down[x + 1];
+            int lmax = std::max({m, n, s, w, e});
+            int lmin = std::min({m, n, s, w, e});
+            int range = lmax - lmin;
+
+            int edge_h = std::abs(nw + sw - 2 * w) +
+                2 * std::abs(n + s - 2 * m) + std::abs(ne + se - 2 * e);
+            int edge_v = std::abs(nw + ne - 2 * n) +
+                2 * std::abs(w + e - 2 * m) + std::abs(sw + se - 2 * s);
+            bool horizontal = edge_h >= edge_v;
+
+            int l0 = horizontal ? n : w;
+            int l1 = horizontal ? s : e;
+            int offset;
+            if (std::abs(l0 - m) >= std::abs(l1 - m))
+                offset = horizontal ? -width : -1;
+            else
+                offset = horizontal ? width : 1;
+
+            // sub-pixel aliasing: distance of the centre luma from the
+            // average of its neighbours relative to the local contrast
+            int average = (2 * (n + s + w + e) + nw + ne + sw + se) / 12;
+            int blend = std::min(256, (std::abs(average - m) << 8) / range);
+            blend = (blend * blend) >> 8;
+            blend = (blend * 3) >> 2;
+            return lerp_color(src[x], src[x + offset], blend);
+        }
+
+        void fxaa_rows(const uint32 *src, uint32 *dest,
+                int width, int height, int y0, int y1)
+        {
+            const uint8 *lumas = luma_buffer.data();
+            for (int y = y0; y < y1; y++)
+            {
+                const uint32 *src_line = src + y * width;
+                uint32 *dest_line = dest + y * width;
+                if (y == 0 || y == height - 1 || width < 3)
+                {
+                    memcpy(dest_line, src_line, width * sizeof(uint32));
+                    continue;
+                }
+                const uint8 *up = lumas + (y - 1) * width;
+                const uint8 *mid = lumas + y * width;
+                const uint8 *down = lumas + (y + 1) * width;
+                dest_line[0] = src_line[0];
+                int x = 1;
+                for (; x + 16 < width; x += 16)
+                {
+                    int mask = edge_mask(up, mid, down, x, fxaa_threshold);
+                    if (!mask)
+                    {
+                        memcpy(dest_line + x, src_line + x,
+                                16 * sizeof(uint32));
+                        continue;
+                    }
+                    for (int k = 0; k < 16; k++)
+                        dest_line[x + k] = (mask & (1 << k)) ?
+                            fxaa_pixel(src_line, up, mid, down,
+                                    x + k, width) :
+                            src_line[x + k];
+                }
+                for (; x < width - 1; x++)
+                {
+                    int lmax = std::max({mid[x], up[x], down[x],
+                            mid[x - 1], mid[x + 1]});
+                    int lmin = std::min({mid[x], up[x], down[x],
+                            mid[x - 1], mid[x + 1]});
+                    dest_line[x] = lmax - lmin >= fxaa_threshold ?
+                        fxaa_pixel(src_line, up, mid, down, x, width) :
+                        src_line[x];
+                }
+                dest_line[width - 1] = src_line[width - 1];
+            }
+        }
+
+        const uint32 *fxaa(const uint32 *src, int width, int height)
+        {
+            size_t size = (size_t)width * height;
+            if (luma_buffer.size() != size)
+            {
+                luma_buffer.resize(size);
+                fxaa_buffer.resize(size);
+            }
+            uint8 *lumas = luma_buffer.data();
+            parallel_for(0, height, FXAA_ROW_GRAIN, [&](int y0, int y1) {
+                for (int y = y0; y < y1; y++)
+                    compute_luma_row(src + y * width, lumas + y * width, width);
+            });
+            uint32 *dest = fxaa_buffer.data();
+            parallel_for(0, height, FXAA_ROW_GRAIN, [&](int y0, int y1) {
+                fxaa_rows(src, dest, width, height, y0, y1);
+            });
+            return dest;
+        }
+    }
+
+    void enable_fxaa(float edge_threshold)
+    {
+        if (edge_threshold <= 0.0f || edge_threshold > 1.0f)
+            throw new std::invalid_argument("fxaa threshold out of (0, 1]");
+        internal::fxaa_threshold = (uint8)std::max(1.0f,
+                edge_threshold * 255.0f + 0.5f);
+        internal::fxaa_enabled = true;
+    }
+
+    void disable_fxaa()
+    {
+        internal::fxaa_enabled = false;
+    }
+}
@@ -1,11 +1,16 @@
 #include <algorithm>
-#include <new>
+#include <cstdlib>
 #include <cstring>
 #include <cassert>
 #include <stdexcept>
+#include <vector>
+#ifdef __SSE2__
+#include "internal/ssre_intrinsics.h"
+#endif
 #include "ssre.h"
 #include "ssre_util.h"
 #include "internal/ssre_internal.h"
+#include "internal/ssre_scan.h"
 
 namespace ssre
 {
@@ -35,25 +40,81 @@ namespace ssre
     {
         int window_width = 0;
         int window_height = 0;
+        bool scissor_enabled = false;
+        ScissorBox scissor;
+
+        void bound_rows(RasterPolygon &polygon)
+        {
+            int low = polygon.point(0).y, high = low;
+            for (int i = 1; i < polygon.count; i++)
+            {
+                low = std::min(low, polygon.point(i).y);
+                high = std::max(high, polygon.point(i).y);
+            }
+            // rows with their centers in (low, high]
+            polygon.y_min = floor_div(low - SUBPIXEL_HALF, SUBPIXEL_ONE) + 1;
+            polygon.y_max = floor_div(high - SUBPIXEL_HALF, SUBPIXEL_ONE);
+        }
 
         void fill_polygon(const InternalPolygon &polygon)
         {
-            Pointi points[SSRE_MAX_VERTEX_COUNT];
-            MaterialColor colors[SSRE_MAX_VERTEX_COUNT];
-            float z_values[SSRE_MAX_VERTEX_COUNT];
-            float u_values[SSRE_MAX_VERTEX_COUNT];
-            float v_values[SSRE_MAX_VERTEX_COUNT];
+            bool normal_mapped = material_normal_map(polygon.material);
+            int pixel_shadow_maps = shadow_mode == PerPixel && 
+                !normal_mapped ? buffer.shadow_map_count : 0;
+            int attribute_count = EYE_ATTRIBUTE;
+            if (normal_mapped)
+                attribute_count = LIT_ATTRIBUTE_COUNT;
+            else if (pixel_shadow_maps)
+                attribute_count = SHADOWED_ATTRIBUTE + 3 * pixel_shadow_maps;
+            float attributes[SSRE_MAX_VERTEX_COUNT * MAX_RASTER_ATTRIBUTES];
+            RasterPolygon raster;
+            raster.count = polygon.count;
+            raster.perspective = matrix_projection.v[3][3] == 0.0f;
+            raster.attribute_count = attribute_count + raster.perspective;
+            raster.attributes = attributes;
             for (int i = 0; i < polygon.count; i++)
             {
-                const Vector &v = polygon.vertices[i].position;
-                points[i] = {(int)(v.x() + 0.5f), (int)(v.y() + 0.5f)};
-                colors[i] = polygon.vertices[i].color;
-                z_values[i] = polygon.vertices[i].position.z();
-                u_values[i] = polygon.vertices[i].tex_coord.u;
-                v_values[i] = polygon.vertices[i].tex_coord.v;
+                const InternalVertex &vertex = polygon.vertices[i];
+                const Vector &v = vertex.position;
+                float *a = attributes + i * raster.attribute_count;
+                raster.points[i] = to_subpixel(v);
+                a[Z_ATTRIBUTE] = v.z();
+                for (int k = 0; k < SSRE_LIGHTING_COMPONENT; k++)
+                    a[COLOR_ATTRIBUTE + k] = vertex.color.color[k];
+                a[U_ATTRIBUTE] = vertex.tex_coord.u;
+                a[V_ATTRIBUTE] = vertex.tex_coord.v;
+                if (attribute_count == EYE_ATTRIBUTE)
+                    continue;
+                for (int k = 0; k < 3; k++)
+                    a[EYE_ATTRIBUTE + k] = vertex.eye_position.v[k];
+                if (normal_mapped)
+                {
+                    for (int k = 0; k < 3; k++)
+                        a[NORMAL_ATTRIBUTE + k] = vertex.normal.v[k];
+                    for (int k = 0; k < 4; k++)
+                        a[TANGENT_ATTRIBUTE + k] = vertex.tangent.v[k];
+                    continue;
+                }
+                for (int j = 0; j < pixel_shadow_maps; j++)
+                    for (int k = 0; k < 3; k++)
+                        a[SHADOWED_ATTRIBUTE + 3 * j + k] = 
+                            vertex.shadowed[j].color[k];
+            }
+            // z is already linear in screen space, the rest is not
+            for (int i = 0; raster.perspective && i < polygon.count; i++)
+            {
+                float *a = attributes + i * raster.attribute_count;
+                float inverse_w = polygon.vertices[i].inverse_w;
+                for (int k = Z_ATTRIBUTE + 1; k < attribute_count; k++)
+                    a[k] *= inverse_w;
+                a[attribute_count] = inverse_w;
             }
-            fill_polygon(points, colors, z_values, 
-                    u_values, v_values, polygon.count);
+            bound_rows(raster);
+            if (normal_mapped)
+                fill_lit_polygon(raster, polygon.material);
+            else
+                fill_polygon(raster, pixel_shadow_maps,
+                        material_texture(polygon.material, DiffuseUnit));
         }
 
         void draw_wire_frame(const InternalPolygon &polygon)
@@ -82,21 +143,53 @@ namespace ssre
     int height = 0;
     uint32 *pixels = nullptr;
     float *depths = nullptr;
+    uint8 *stencils = nullptr;
+
+    namespace internal
+    {
+        int output_width = 0;
+        int output_height = 0;
+
+        void set_render_size(int render_width, int render_height)
+        {
+            width = window_width = render_width;
+            height = window_height = render_height;
+            update_view_port();
+        }
+
+        /* the part of a buffer inside the scissor box, or all of it */
+        template <typename T>
+        void fill_buffer(T *buffer, T value)
+        {
+            if (!scissor_enabled)
+            {
+                fill_row(buffer, width * height, value);
+                return;
+            }
+            for (int y = scissor.y0; y < scissor.y1; y++)
+            {
+                T *row = buffer + (height - 1 - y) * width;
+                fill_row(row + scissor.x0, scissor.x1 - scissor.x0, value);
+            }
+        }
+    }
 
     void init_window(const char *title, int x, int y,
             int _width, int _height, uint32 flags)
     {
         width = _width;
         height = _height;
-        internal::window_width = width;
-        internal::window_height = height;
+        internal::window_width = internal::output_width = width;
+        internal::window_height = internal::output_height = height;
         pixels = new uint32[width * height];
         depths = new float[width * height];
+        stencils = new uint8[width * height]();
         init_window_impl(title, x, y, width, height, flags);
     }
 
     void destroy_window()
     {
+        internal::stop_distributed_rendering();
         destroy_window_impl();
 
         delete[] pixels;
@@ -104,28 +197,75 @@ namespace ssre
 
         delete[] depths;
         depths = nullptr;
+
+        delete[] stencils;
+        stencils = nullptr;
     }
 
     void clear(uint32 color)
     {
-        for (int i = 0; i < width * height; ++i)
-            pixels[i] = color;
+        if (internal::dirty_rectangles_enabled)
+        {
+            internal::defer_clear(color);
+            return;
+        }
+        internal::fill_buffer(pixels, color);
+        if (internal::hdr_enabled)
+            internal::fill_buffer(internal::hdr_pixels, (uint64)0);
     }
 
     void clear_depth(float d)
     {
-        for (int i = 0; i < width * height; i++)
-            depths[i] = d;
+        if (internal::dirty_rectangles_enabled)
+        {
+            internal::defer_clear_depth(d);
+            return;
+        }
+        internal::fill_buffer(depths, d);
+        internal::clear_s_buffer();
+    }
+
+    void clear_stencil(uint8 s)
+    {
+        internal::fill_buffer(stencils, s);
     }
 
     void present()
     {
-        present_impl(pixels, width << 2);
+        internal::render_dirty_objects();
+        internal::resolve_hdr();
+        internal::resolve_fragments(pixels, depths, width, height);
+        internal::gather_distributed_frame();
+        const uint32 *frame = pixels;
+        if (internal::fxaa_enabled)
+            frame = internal::fxaa(pixels, width, height);
+        if (width != internal::output_width ||
+                height != internal::output_height)
+            frame = internal::upscale(frame, width, height,
+                    internal::output_width, internal::output_height);
+        present_impl(frame, internal::output_width << 2);
+        internal::capture_frame(frame);
         internal::buffer.reset();
+        internal::update_streamed_textures();
+        internal::update_virtual_textures();
+        internal::update_dynamic_resolution();
+        internal::start_distributed_frame();
+    }
+
+    void render_particle_system(ParticleSystem *system)
+    {
+        internal::resolve_hdr();
+        internal::render_particles(system, pixels, depths, width, height);
+    }
+
+    void render_skybox(const CubeMap &cube_map)
+    {
+        internal::render_skybox(cube_map, pixels, depths, width, height);
     }
 
     void draw_points(const Pointi *points, uint32 color, int n)
     {
+        internal::resolve_hdr();
         for (int i = 0; i < n; ++i) 
         {
             int index = (height - 1 - points[i].y) * width + points[i].x;
@@ -140,6 +280,7 @@ namespace ssre
 
     void draw_points(const Pointi *points, uint32 *colors, int n)
     {
+        internal::resolve_hdr();
         for (int i = 0; i < n; ++i) 
         {
             int index = (height - 1 - points[i].y) * width + points[i].x;
@@ -154,6 +295,7 @@ namespace ssre
 
     void draw_line(const Pointi &p0, const Pointi &p1, uint32 color)
     {
+        internal::resolve_hdr();
         int x0 = p0.x, y0 = p0.y, x1 = p1.x, y1 = p1.y;
         int dx = abs(x1 - x0);
         int dy = abs(y1 - y0);
@@ -187,211 +329,715 @@ namespace ssre
         }
     }
 
-    struct iEdgeNode
+    namespace internal
     {
-        const Pointi *p0 = nullptr;
-        const Pointi *p1 = nullptr;
-        int dx = 0;
-        int dy = 0;
-        int sx = 0;
-        int di = 0;
-        int err = 0;
-        int x = 0;
-        MaterialColor color = {{0.0f, 0.0f, 0.0f, 0.0f}};
-        MaterialColor dc = {{0.0f, 0.0f, 0.0f, 0.0f}};
-        float z;
-        float dz;
-        float u;
-        float du;
-        float v;
-        float dv;
-
-        iEdgeNode() {}
-
-        iEdgeNode(const ssre::Pointi *_p0, const ssre::Pointi *_p1, 
-                const MaterialColor* c0, const MaterialColor *c1, 
-                float z0, float z1, float u0, float u1, float v0, float v1) :
-            p0(_p0), p1(_p1)
+        /*
+         * pixels between two divisions of a perspective span, building
+         * with -DSSRE_PERSPECTIVE_BLOCK=1 divides at every pixel
+         */
+#ifndef SSRE_PERSPECTIVE_BLOCK
+#define SSRE_PERSPECTIVE_BLOCK 16
+#endif
+        const int PERSPECTIVE_BLOCK = SSRE_PERSPECTIVE_BLOCK;
+
+        /* offsets and colors of the visible pixels of a lit span */
+        static std::vector<int> lit_offsets;
+        static std::vector<uint32> lit_colors;
+
+        /* pixel i of color_span, colors truncated like toARGB */
+        inline void color_span_pixel(uint32 *pixels, float *depths,
+                const float *attributes, const float *steps, int i,
+                bool depth_test)
         {
-            if (p0->y > p1->y)
-            {
-                std::swap(z0, z1);
-                std::swap(c0, c1);
-                std::swap(p0, p1);
-                std::swap(u0, u1);
-                std::swap(v0, v1);
-            }
-            dy = p1->y - p0->y;
-            dx = abs(p1->x - p0->x);
-            sx = dx == 0 ? 0 : (p1->x > p0->x ? 1 : -1);
-            di = dx / dy * sx;
-            dx = dx % dy;
-            x = p0->x;
-            color = *c0;
-            dc = (*c1 - *c0) / dy;
-            z = z0;
-            dz = (z1 - z0) / dy;
-            u = u0;
-            du = (u1 - u0) / dy;
-            v = v0;
-            dv = (v1 - v0) / dy;
+            float z = attributes[Z_ATTRIBUTE] + steps[Z_ATTRIBUTE] * i;
+            if (depth_test && !(z < depths[i]))
+                return;
+            int c[4];
+            for (int k = 0; k < 4; k++)
+                c[k] = (int)((attributes[COLOR_ATTRIBUTE + k] +
+                            steps[COLOR_ATTRIBUTE + k] * i) * 255.0f);
+            pixels[i] = SSRE_ARGB(c[3], c[0], c[1], c[2]);
+            depths[i] = z;
         }
 
-        bool operator < (const iEdgeNode &node) const
+        void color_span_scalar(uint32 *pixels, float *depths,
+                const float *attributes, const float *steps, int count,
+                bool depth_test)
         {
-            if (p0->y != node.p0->y)
-                return p0->y < node.p0->y;
-            if (p0->x != node.p0->x)
-                return p0->x < node.p0->x;
-            return (node.p1->y - node.p0->y) * (p1->x - p0->x) <
-            (p1->y - p0->y) * (node.p1->x - node.p0->x);
+            for (int i = 0; i < count; i++)
+                color_span_pixel(pixels, depths, attributes, steps, i,
+                        depth_test);
         }
-    };
 
-    void fill_polygon(const Pointi *points, const MaterialColor *colors, 
-            const float *z_values, 
-            const float *u_values, const float *v_values, int n)
-    {
-        if (n < 3)
-            throw new std::invalid_argument("less than 3 vertices");
-        // prepare the edge list
-        typedef LinkedListNode<iEdgeNode> ListNode;
-        iEdgeNode *nodes =(iEdgeNode *)::operator new(n * sizeof(iEdgeNode));
-        ListNode *list_nodes = (ListNode *)::operator new(n * sizeof(ListNode));
-        int count = 0;
-        for (int i = 0; i < n; i++)
+#ifdef __SSE2__
+        /* the color attributes at the pixels x as ARGB bytes */
+        inline __m128i span_colors(const float *attributes,
+                const float *steps, __m128 x)
+        {
+            const __m128 scale = _mm_set1_ps(255.0f);
+            const int shifts[4] = {16, 8, 0, 24};
+            __m128i argb = _mm_setzero_si128();
+            for (int k = 0; k < 4; k++)
+            {
+                __m128 c = _mm_add_ps(_mm_set1_ps(attributes[COLOR_ATTRIBUTE +
+                            k]), _mm_mul_ps(_mm_set1_ps(
+                                steps[COLOR_ATTRIBUTE + k]), x));
+                __m128i byte = _mm_and_si128(_mm_cvttps_epi32(
+                            _mm_mul_ps(c, scale)), _mm_set1_epi32(0xff));
+                argb = _mm_or_si128(argb, _mm_sll_epi32(byte,
+                            _mm_cvtsi32_si128(shifts[k])));
+            }
+            return argb;
+        }
+
+        /* four pixels at a time, merging the passing ones in */
+        void color_span_sse2(uint32 *pixels, float *depths,
+                const float *attributes, const float *steps, int count,
+                bool depth_test)
+        {
+            const __m128 lanes = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+            const __m128 all = _mm_castsi128_ps(_mm_set1_epi32(-1));
+            int i = 0;
+            for (; i + 4 <= count; i += 4)
+            {
+                __m128 x = _mm_add_ps(_mm_set1_ps((float)i), lanes);
+                __m128 z = _mm_add_ps(_mm_set1_ps(attributes[Z_ATTRIBUTE]),
+                        _mm_mul_ps(_mm_set1_ps(steps[Z_ATTRIBUTE]), x));
+                __m128 d = _mm_loadu_ps(depths + i);
+                __m128 pass = depth_test ? _mm_cmplt_ps(z, d) : all;
+                if (!_mm_movemask_ps(pass))
+                    continue;
+                __m128i mask = _mm_castps_si128(pass);
+                __m128i old = _mm_loadu_si128((__m128i *)(pixels + i));
+                __m128i argb = span_colors(attributes, steps, x);
+                _mm_storeu_si128((__m128i *)(pixels + i), _mm_or_si128(
+                            _mm_and_si128(mask, argb),
+                            _mm_andnot_si128(mask, old)));
+                _mm_storeu_ps(depths + i, _mm_or_ps(_mm_and_ps(pass, z),
+                            _mm_andnot_ps(pass, d)));
+            }
+            for (; i < count; i++)
+                color_span_pixel(pixels, depths, attributes, steps, i,
+                        depth_test);
+        }
+#endif
+
+#ifdef SSRE_X86_KERNELS
+        SSRE_TARGET("avx2")
+        inline __m256i span_colors_avx2(const float *attributes,
+                const float *steps, __m256 x)
+        {
+            const __m256 scale = _mm256_set1_ps(255.0f);
+            const int shifts[4] = {16, 8, 0, 24};
+            __m256i argb = _mm256_setzero_si256();
+            for (int k = 0; k < 4; k++)
+            {
+                __m256 c = _mm256_add_ps(_mm256_set1_ps(
+                            attributes[COLOR_ATTRIBUTE + k]), _mm256_mul_ps(
+                                _mm256_set1_ps(steps[COLOR_ATTRIBUTE + k]), x));
+                __m256i byte = _mm256_and_si256(_mm256_cvttps_epi32(
+                            _mm256_mul_ps(c, scale)), _mm256_set1_epi32(0xff));
+                argb = _mm256_or_si256(argb, _mm256_sll_epi32(byte,
+                            _mm_cvtsi32_si128(shifts[k])));
+            }
+            return argb;
+        }
+
+        /* eight pixels at a time, with masked stores */
+        SSRE_TARGET("avx2")
+        void color_span_avx2(uint32 *pixels, float *depths,
+                const float *attributes, const float *steps, int count,
+                bool depth_test)
         {
-            int j = (i + 1) % n;
-            const Pointi *p0 = &points[i], *p1 = &points[j];
-            const MaterialColor *c0 = &colors[i], *c1 = &colors[j];
-            float z0 = z_values[i], z1 = z_values[j];
-            float u0 = u_values[i], u1 = u_values[j];
-            float v0 = v_values[i], v1 = v_values[j];
-            if (p0->y == p1->y)
-                continue;
-            new (&nodes[count]) iEdgeNode(p0, p1, c0, c1, z0, z1, 
-                    u0, u1, v0, v1);
-            new (&list_nodes[count]) ListNode(&nodes[count]);
-            count++;
+            const __m256 lanes = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f,
+                    4.0f, 5.0f, 6.0f, 7.0f);
+            const __m256 all = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+            int i = 0;
+            for (; i + 8 <= count; i += 8)
+            {
+                __m256 x = _mm256_add_ps(_mm256_set1_ps((float)i), lanes);
+                __m256 z = _mm256_add_ps(_mm256_set1_ps(
+                            attributes[Z_ATTRIBUTE]), _mm256_mul_ps(
+                                _mm256_set1_ps(steps[Z_ATTRIBUTE]), x));
+                __m256 pass = depth_test ? _mm256_cmp_ps(z,
+                        _mm256_loadu_ps(depths + i), _CMP_LT_OQ) : all;
+                if (!_mm256_movemask_ps(pass))
+                    continue;
+                __m256i mask = _mm256_castps_si256(pass);
+                _mm256_maskstore_epi32((int *)(pixels + i), mask,
+                        span_colors_avx2(attributes, steps, x));
+                _mm256_maskstore_ps(depths + i, mask, z);
+            }
+            for (; i < count; i++)
+                color_span_pixel(pixels, depths, attributes, steps, i,
+                        depth_test);
+        }
+
+        SSRE_TARGET("avx512f")
+        inline __m512i span_colors_avx512(const float *attributes,
+                const float *steps, __m512 x)
+        {
+            const __m512 scale = _mm512_set1_ps(255.0f);
+            const int shifts[4] = {16, 8, 0, 24};
+            __m512i argb = _mm512_setzero_si512();
+            for (int k = 0; k < 4; k++)
+            {
+                __m512 c = _mm512_add_ps(_mm512_set1_ps(
+                            attributes[COLOR_ATTRIBUTE + k]), _mm512_mul_ps(
+                                _mm512_set1_ps(steps[COLOR_ATTRIBUTE + k]), x));
+                __m512i byte = _mm512_and_si512(_mm512_cvttps_epi32(
+                            _mm512_mul_ps(c, scale)), _mm512_set1_epi32(0xff));
+                argb = _mm512_or_si512(argb, _mm512_sll_epi32(byte,
+                            _mm_cvtsi32_si128(shifts[k])));
+            }
+            return argb;
+        }
+
+        /* sixteen pixels at a time, the depth test into a mask register */
+        SSRE_TARGET("avx512f")
+        void color_span_avx512(uint32 *pixels, float *depths,
+                const float *attributes, const float *steps, int count,
+                bool depth_test)
+        {
+            const __m512 lanes = _mm512_setr_ps(0.0f, 1.0f, 2.0f, 3.0f,
+                    4.0f, 5.0f, 6.0f, 7.0f, 8.0f, 9.0f, 10.0f, 11.0f, 12.0f,
+                    13.0f, 14.0f, 15.0f);
+            int i = 0;
+            for (; i + 16 <= count; i += 16)
+            {
+                __m512 x = _mm512_add_ps(_mm512_set1_ps((float)i), lanes);
+                __m512 z = _mm512_add_ps(_mm512_set1_ps(
+                            attributes[Z_ATTRIBUTE]), _mm512_mul_ps(
+                                _mm512_set1_ps(steps[Z_ATTRIBUTE]), x));
+                __mmask16 pass = depth_test ? _mm512_cmp_ps_mask(z,
+                        _mm512_loadu_ps(depths + i), _CMP_LT_OQ) : 0xffff;
+                if (!pass)
+                    continue;
+                _mm512_mask_storeu_epi32(pixels + i, pass,
+                        span_colors_avx512(attributes, steps, x));
+                _mm512_mask_storeu_ps(depths + i, pass, z);
+            }
+            for (; i < count; i++)
+                color_span_pixel(pixels, depths, attributes, steps, i,
+                        depth_test);
         }
-        std::sort(nodes, nodes + count);
-
-        // initialize the intersect list
-        iEdgeNode head_node;
-        LinkedListNode<iEdgeNode> head(&head_node);
-        head.insert(&list_nodes[0]);
-        int i = 1;
-        for (; i < count && nodes[i].p0->y == nodes[0].p0->y; ++i)
-            list_nodes[i - 1].insert(&list_nodes[i]);
-        int y = nodes[0].p0->y;
-        uint32 *pixel_line = &pixels[(height - 1 - y) * width];
-        float *depths_line = &depths[(height - 1 - y) * width];
-        while (head.next)
+#endif
+
+        /* writes the spans of the color pass into the frame buffer */
+        struct ColorSpan
         {
-            // render pixels
-            for (ListNode *node = head.next; node; node = node->next->next)
-            {
-                iEdgeNode *curr = node->payload;
-                // left edge. the actual position of x rx =
-                // x + sx * err / dy. Always start from ceil(rx)
-                // round up if there is positive fractional part
-                int x_left = curr->x;
-                if (curr->err && curr->sx == 1)
-                    ++x_left;
-                MaterialColor c = curr->color;
-                float z = curr->z;
-                float u = curr->u;
-                float v = curr->v;
-
-                // right edge. If it's an integer, it's counted
-                // outside the polygon, otherwise end at floor(rx)
-                curr = node->next->payload;
-                int x_right = curr->x;
-                if (!curr->err || curr->sx == -1)
-                    --x_right;
-                MaterialColor cdif = curr->color - c;
-                float zdif = curr->z - z;
-                float udif = curr->u - u;
-                float vdif = curr->v - v;
-                if (x_right != x_left)
+            int attribute_count;
+            int pixel_shadow_maps;
+            bool front;
+            // per pixel lighting, without it colors are interpolated
+            const PixelLight *lights;
+            int light_count;
+            const Material *material;
+            // see RasterPolygon
+            bool perspective;
+            // of the material, sampled instead of the enabled texture
+            const Texture *diffuse;
+            // change of u, v and 1 / w from row to row, for the level of
+            // detail of virtual textures, see texture_row_steps
+            float row_steps[3];
+
+            bool textured() const
+            {
+                return diffuse || texture_enabled;
+            }
+
+            uint32 texel(float u, float v, float lod) const
+            {
+                if (diffuse)
+                    return sample_texture(*diffuse, u, v);
+                return virtual_texture ? sample_virtual_texture(
+                        *virtual_texture, u, v, lod) : get_texture_color(u, v);
+            }
+
+            uint32 apply_texture(uint32 color, float u, float v,
+                    float lod) const
+            {
+                if (!textured())
+                    return color;
+                uint32 tc = texel(u, v, lod);
+                if (texture_mode == Modulate)
+                    return modulate_color(color, tc);
+                return tc;
+            }
+
+            /*
+             * interpolated colors written over less deep pixels, which
+             * the color_span kernel covers
+             */
+            bool plain_colors() const
+            {
+                return !textured() && !pixel_shadow_maps && !hdr_enabled &&
+                    !blending_enabled && !stencil_test_enabled &&
+                    (!z_buffer_enabled || s_buffer_enabled ||
+                     depth_function == CompareLess);
+            }
+
+            bool virtual_textured() const
+            {
+                return !diffuse && texture_enabled && virtual_texture;
+            }
+
+            /* from the steps of the span and of u and v between rows */
+            float texture_lod(const float *steps, float du_dy,
+                    float dv_dy) const
+            {
+                if (!virtual_textured())
+                    return 0.0f;
+                return virtual_texture_lod(*virtual_texture,
+                        steps[U_ATTRIBUTE], steps[V_ATTRIBUTE], du_dy, dv_dy);
+            }
+
+            /* the interpolated color with the shadows of the pixel */
+            MaterialColor lit_color(const float *a) const
+            {
+                MaterialColor c = {{a[COLOR_ATTRIBUTE], a[COLOR_ATTRIBUTE + 1],
+                    a[COLOR_ATTRIBUTE + 2], a[COLOR_ATTRIBUTE + 3]}};
+                if (pixel_shadow_maps)
                 {
-                    float dif = x_right - x_left;
-                    cdif /= dif;
-                    zdif /= dif;
-                    udif /= dif;
-                    vdif /= dif;
+                    Vector eye = {a[EYE_ATTRIBUTE], a[EYE_ATTRIBUTE + 1],
+                        a[EYE_ATTRIBUTE + 2], 1.0f};
+                    for (int j = 0; j < pixel_shadow_maps; j++)
+                    {
+                        float visibility = shadow_visibility(
+                                shadow_maps[j], eye);
+                        const float *shadowed = a + SHADOWED_ATTRIBUTE + 3 * j;
+                        for (int k = 0; k < 3; k++)
+                            c.color[k] += visibility * shadowed[k];
+                    }
+                    for (int k = 0; k < 3; k++)
+                    {
+                        c.color[k] = std::max(c.color[k], 0.0f);
+                        if (!hdr_enabled)
+                            c.color[k] = std::min(c.color[k], 1.0f);
+                    }
                 }
-                uint32 *segment = pixel_line + x_left;
-                float *d_segment = depths_line + x_left;
-                for (int x = x_left; x <= x_right; x++)
-                {
+                return c;
+            }
+
+            uint32 shade(const float *a, float lod) const
+            {
+                return apply_texture(lit_color(a).toARGB(), a[U_ATTRIBUTE],
+                        a[V_ATTRIBUTE], lod);
+            }
+
+            /* like apply_texture, the texel decoded to linear first */
+            void apply_texture_hdr(float *rgba, float u, float v,
+                    float lod) const
+            {
+                if (!textured())
+                    return;
+                float t[4];
+                decode_srgb(texel(u, v, lod), t);
+                for (int k = 0; k < 4; k++)
+                    rgba[k] = texture_mode == Modulate ? rgba[k] * t[k] : t[k];
+            }
+
+            /* like shade, in linear color for the half float buffer */
+            void shade_hdr(const float *a, float lod, float *rgba) const
+            {
+                MaterialColor c = lit_color(a);
+                std::copy(c.color, c.color + 4, rgba);
+                apply_texture_hdr(rgba, a[U_ATTRIBUTE], a[V_ATTRIBUTE], lod);
+            }
+
+            /* depth and stencil tests, updating the stencil buffer */
+            bool visible(int index, float z) const
+            {
+                // the S-buffer already left only the visible pixels
+                bool pass = !z_buffer_enabled || s_buffer_enabled ||
+                    compare(depth_function, z, depths[index]);
+                if (stencil_test_enabled)
+                    pass = stencil_update(stencils[index], pass, front);
+                return pass;
+            }
+
+            void write(int index, uint32 color, float z) const
+            {
 #ifdef DEBUG
-                    int index = segment - pixels;
-                    assert(index >= 0 && index < width * height);
-                    assert(x >= 0 && x < width && y >= 0 && y < height);
+                assert(index >= 0 && index < width * height);
 #endif
-                    if (!internal::z_buffer_enabled || z < *d_segment)
+                // translucent surfaces test against depth but
+                // do not occlude what is drawn after them
+                if (!blending_enabled)
+                {
+                    depths[index] = z;
+                    pixels[index] = color;
+                }
+                else if (blend_mode == Sorted)
+                    pixels[index] = blend_color(color, pixels[index]);
+                else if (blend_mode == Additive)
+                    pixels[index] = add_color(color, pixels[index]);
+                else
+                    append_fragment(index, color, z);
+            }
+
+            /* depth like write, the color into the half float buffer */
+            void write_hdr(int index, const float *rgba, float z) const
+            {
+                if (!blending_enabled)
+                    depths[index] = z;
+                write_hdr_pixel(index, rgba, z);
+            }
+
+            void operator()(int y, int x_left, int x_right,
+                    const float *attributes, const float *steps) const
+            {
+                float clipped[MAX_RASTER_ATTRIBUTES];
+                if (scissor_enabled && (x_left < scissor.x0 ||
+                            x_right >= scissor.x1))
+                {
+                    int left = std::max(x_left, scissor.x0);
+                    x_right = std::min(x_right, scissor.x1 - 1);
+                    if (x_right < left)
+                        return;
+                    for (int k = 0; k < attribute_count; k++)
+                        clipped[k] = attributes[k] + steps[k] * (left - x_left);
+                    attributes = clipped;
+                    x_left = left;
+                }
+                if (!s_buffer_enabled)
+                {
+                    shade_span(y, x_left, x_right, attributes, steps);
+                    return;
+                }
+                // translucent spans are clipped without occluding
+                s_buffer_span(y, x_left, x_right, attributes[Z_ATTRIBUTE],
+                        steps[Z_ATTRIBUTE], !blending_enabled,
+                        [&](int begin, int end) {
+                    float a[MAX_RASTER_ATTRIBUTES];
+                    for (int k = 0; k < attribute_count; k++)
+                        a[k] = attributes[k] + steps[k] * (begin - x_left);
+                    shade_span(y, begin, end - 1, a, steps);
+                });
+            }
+
+            /*
+             * divides by 1 / w every PERSPECTIVE_BLOCK pixels and steps
+             * linearly in between, which is close enough to dividing at
+             * every pixel
+             */
+            void shade_span(int y, int x_left, int x_right,
+                    const float *attributes, const float *steps) const
+            {
+                if (!perspective)
+                {
+                    affine_span(y, x_left, x_right, attributes, steps,
+                            texture_lod(steps, row_steps[0], row_steps[1]));
+                    return;
+                }
+                float a0[MAX_RASTER_ATTRIBUTES], a1[MAX_RASTER_ATTRIBUTES];
+                float block_steps[MAX_RASTER_ATTRIBUTES];
+                divide_w(attributes, steps, 0, a0);
+                for (int x = x_left; x <= x_right; x += PERSPECTIVE_BLOCK)
+                {
+                    // the last block ends on its last pixel
+                    int n = std::min(PERSPECTIVE_BLOCK, x_right - x + 1);
+                    int length = n == PERSPECTIVE_BLOCK ? n : n - 1;
+                    divide_w(attributes, steps, x - x_left + length, a1);
+                    float scale = length ? 1.0f / length : 0.0f;
+                    for (int k = 0; k < attribute_count; k++)
+                        block_steps[k] = (a1[k] - a0[k]) * scale;
+                    float lod = 0.0f;
+                    if (virtual_textured())
                     {
-                        *d_segment = z;
-                        uint32 color = c.toARGB();
-                        if (internal::texture_enabled)
+                        // u = (u / w) / (1 / w) differentiated, likewise v
+                        int w = attribute_count - 1;
+                        float inverse_w = attributes[w] +
+                            steps[w] * (x - x_left);
+                        lod = texture_lod(block_steps, (row_steps[0] -
+                                    a0[U_ATTRIBUTE] * row_steps[2]) /
+                                inverse_w, (row_steps[1] -
+                                    a0[V_ATTRIBUTE] * row_steps[2]) /
+                                inverse_w);
+                    }
+                    affine_span(y, x, x + n - 1, a0, block_steps, lod);
+                    memcpy(a0, a1, attribute_count * sizeof(float));
+                }
+            }
+
+            /* the attributes offset pixels into the span, divided by w */
+            void divide_w(const float *attributes, const float *steps,
+                    int offset, float *a) const
+            {
+                int count = attribute_count - 1;
+                float inverse_w = attributes[count] + steps[count] * offset;
+                a[Z_ATTRIBUTE] = attributes[Z_ATTRIBUTE] +
+                    steps[Z_ATTRIBUTE] * offset;
+                int k = Z_ATTRIBUTE + 1;
+#ifdef __SSE2__
+                // reciprocal estimate refined by one newton step
+                __m128 q = _mm_set_ss(inverse_w);
+                __m128 r = _mm_rcp_ss(q);
+                r = _mm_sub_ss(_mm_add_ss(r, r), _mm_mul_ss(q,
+                            _mm_mul_ss(r, r)));
+                __m128 w = _mm_shuffle_ps(r, r, 0);
+                __m128 o = _mm_set1_ps((float)offset);
+                for (; k + 4 <= count; k += 4)
+                {
+                    __m128 v = _mm_add_ps(_mm_loadu_ps(attributes + k),
+                            _mm_mul_ps(_mm_loadu_ps(steps + k), o));
+                    _mm_storeu_ps(a + k, _mm_mul_ps(v, w));
+                }
+                float reciprocal = _mm_cvtss_f32(r);
+#else
+                float reciprocal = 1.0f / inverse_w;
+#endif
+                for (; k < count; k++)
+                    a[k] = (attributes[k] + steps[k] * offset) * reciprocal;
+                a[count] = 1.0f;
+            }
+
+            void affine_span(int y, int x_left, int x_right,
+                    const float *attributes, const float *steps,
+                    float lod) const
+            {
+                int index = (height - 1 - y) * width + x_left;
+                if (lights)
+                {
+                    lit_span(index, x_right - x_left + 1, attributes, steps,
+                            lod);
+                    return;
+                }
+                if (plain_colors())
+                {
+                    kernels.color_span(pixels + index, depths + index,
+                            attributes, steps, x_right - x_left + 1,
+                            z_buffer_enabled && !s_buffer_enabled);
+                    return;
+                }
+                float a[MAX_RASTER_ATTRIBUTES];
+                memcpy(a, attributes, attribute_count * sizeof(float));
+                for (int x = x_left; x <= x_right; x++, index++)
+                {
+                    float z = a[Z_ATTRIBUTE];
+                    if (visible(index, z))
+                    {
+                        if (hdr_enabled)
                         {
-                            uint32 tc = internal::get_texture_color(u, v);
-                            if (internal::texture_mode == internal::Modulate)
-                                color = internal::modulate_color(color, tc);
-                            else if (internal::texture_mode == internal::Decal)
-                                color = tc;
+                            float rgba[4];
+                            shade_hdr(a, lod, rgba);
+                            write_hdr(index, rgba, z);
                         }
-                        *segment = color;
+                        else
+                            write(index, shade(a, lod), z);
                     }
-                    c += cdif;
-                    z += zdif;
-                    u += udif;
-                    v += vdif;
-                    segment++;
-                    d_segment++;
+                    for (int k = 0; k < attribute_count; k++)
+                        a[k] += steps[k];
                 }
+            }
 
+            /*
+             * gathers the visible pixels first, so that they can be lit
+             * four at a time without lighting hidden ones
+             */
+            void lit_span(int index, int n, const float *attributes,
+                    const float *steps, float lod) const
+            {
+                if ((int)lit_offsets.size() < n)
+                {
+                    lit_offsets.resize(n);
+                    lit_colors.resize(n);
+                }
+                int count = 0;
+                for (int i = 0; i < n; i++)
+                    if (visible(index + i, attributes[Z_ATTRIBUTE] + 
+                                steps[Z_ATTRIBUTE] * i))
+                        lit_offsets[count++] = i;
+                if (!count)
+                    return;
+                shade_lit_pixels(attributes, steps, lit_offsets.data(), count,
+                        lights, light_count, *material, lit_colors.data());
+                for (int k = 0; k < count; k++)
+                {
+                    int i = lit_offsets[k];
+                    float u = attributes[U_ATTRIBUTE] + steps[U_ATTRIBUTE] * i;
+                    float v = attributes[V_ATTRIBUTE] + steps[V_ATTRIBUTE] * i;
+                    float z = attributes[Z_ATTRIBUTE] + steps[Z_ATTRIBUTE] * i;
+                    uint32 color = lit_colors[k];
+                    if (!hdr_enabled)
+                    {
+                        write(index + i, apply_texture(color, u, v, lod), z);
+                        continue;
+                    }
+                    // lit in [0, 1] already, so taken as linear
+                    float rgba[4] = {SSRE_R(color) / 255.0f,
+                        SSRE_G(color) / 255.0f, SSRE_B(color) / 255.0f,
+                        SSRE_A(color) / 255.0f};
+                    apply_texture_hdr(rgba, u, v, lod);
+                    write_hdr(index + i, rgba, z);
+                }
             }
-            // move the scan line up one pixel
-            ++y;
-            pixel_line -= width;
-            depths_line -= width;
-            // remove all edges whose top is reached by the scan line
-            for (ListNode *node = head.next; node; node = node->next)
+        };
+
+        /* runs the depth and stencil tests of a polygon, writes nothing else */
+        struct StencilSpan
+        {
+            bool front;
+
+            void operator()(int y, int x_left, int x_right,
+                    const float *attributes, const float *steps) const
             {
-                if (node->payload->p1->y == y)
-                    node->remove();
+                float z = attributes[Z_ATTRIBUTE];
+                int offset = (height - 1 - y) * width + x_left;
+                const float *d_segment = depths + offset;
+                uint8 *s_segment = stencils + offset;
+                for (int x = x_left; x <= x_right; x++)
+                {
+                    // clamp instead of clipping at the far plane so that
+                    // volumes extruded to infinity stay closed
+                    bool depth_pass = !z_buffer_enabled || compare(
+                            depth_function, std::min(z, 1.0f), *d_segment);
+                    stencil_update(*s_segment, depth_pass, front);
+                    z += steps[Z_ATTRIBUTE];
+                    d_segment++;
+                    s_segment++;
+                }
             }
-            // update the intersect point
-            for (ListNode *node = head.next; node; node = node->next)
+        };
+
+        bool front_facing(const RasterPolygon &polygon)
+        {
+            // counter clockwise in window coordinates, y goes up
+            long long area = 0;
+            for (int i = 0, n = polygon.count; i < n; i++)
             {
-                iEdgeNode *curr = node->payload;
-                curr->x += curr->di;
-                curr->err += curr->dx;
-                if (curr->err >= curr->dy)
+                const Pointi &p0 = polygon.point(i);
+                const Pointi &p1 = polygon.point((i + 1) % n);
+                area += (long long)p0.x * p1.y - (long long)p1.x * p0.y;
+            }
+            return area >= 0;
+        }
+
+        /* the rows color spans are drawn in */
+        void color_rows(int &y_begin, int &y_end)
+        {
+            y_begin = scissor_enabled ? scissor.y0 : 0;
+            y_end = scissor_enabled ? scissor.y1 : height;
+        }
+
+        /*
+         * of the attributes u, v and 1 / w, linear in screen space. From
+         * the plane through the widest triangle of the first vertex and
+         * two neighbouring ones, clipped polygons are planar anyway
+         */
+        void texture_row_steps(const RasterPolygon &polygon, float *row_steps)
+        {
+            const int indices[3] = {U_ATTRIBUTE, V_ATTRIBUTE,
+                polygon.attribute_count - 1};
+            std::fill(row_steps, row_steps + 3, 0.0f);
+            const Pointi &p0 = polygon.point(0);
+            long long widest = 0;
+            int best = 0;
+            for (int i = 1; i + 1 < polygon.count; i++)
+            {
+                const Pointi &p1 = polygon.point(i), &p2 = polygon.point(i + 1);
+                long long area = std::llabs((long long)(p1.x - p0.x) *
+                        (p2.y - p0.y) - (long long)(p2.x - p0.x) *
+                        (p1.y - p0.y));
+                if (area > widest)
                 {
-                    curr->err -= curr->dy;
-                    curr->x += curr->sx;
+                    widest = area;
+                    best = i;
                 }
-                curr->color += curr->dc;
-                curr->z += curr->dz;
-                curr->u += curr->du;
-                curr->v += curr->dv;
             }
-            // insert all edges whose bottom is reached by the scan line
-            ListNode *node = &head;
-            while (i < count && nodes[i].p0->y == y)
+            if (!widest)
+                return;
+            const Pointi &p1 = polygon.point(best);
+            const Pointi &p2 = polygon.point(best + 1);
+            double area = (double)(p1.x - p0.x) * (p2.y - p0.y) -
+                (double)(p2.x - p0.x) * (p1.y - p0.y);
+            const float *a0 = polygon.attributes;
+            const float *a1 = a0 + best * polygon.attribute_count;
+            const float *a2 = a1 + polygon.attribute_count;
+            for (int k = 0; k < (polygon.perspective ? 3 : 2); k++)
             {
-                while (node->next && node->next->payload->x < nodes[i].x)
-                    node = node->next;
-                node->insert(&list_nodes[i]);
-                ++i;
-                node = node->next;
+                int a = indices[k];
+                row_steps[k] = (float)(((double)(p1.x - p0.x) *
+                            (a2[a] - a0[a]) - (double)(p2.x - p0.x) *
+                            (a1[a] - a0[a])) / area * SUBPIXEL_ONE);
             }
         }
 
-        delete list_nodes;
-        delete nodes;
+        void fill_polygon(const RasterPolygon &polygon, int pixel_shadow_maps,
+                const Texture *diffuse)
+        {
+            ColorSpan span = {polygon.attribute_count, pixel_shadow_maps,
+                front_facing(polygon), nullptr, 0, nullptr,
+                polygon.perspective, diffuse, {0.0f, 0.0f, 0.0f}};
+            if (span.virtual_textured())
+                texture_row_steps(polygon, span.row_steps);
+            int y_begin, y_end;
+            color_rows(y_begin, y_end);
+            scan_polygon(polygon, y_begin, y_end, span);
+        }
+
+        void fill_lit_polygon(const RasterPolygon &polygon,
+                const Material &material)
+        {
+            PixelLight lights[SSREBuffer::LIGHTING_SOURCE_BUFFER_SIZE];
+            int light_count = prepare_pixel_lights(material, lights);
+            ColorSpan span = {polygon.attribute_count, 0,
+                front_facing(polygon), lights, light_count, &material,
+                polygon.perspective, material_texture(material, DiffuseUnit),
+                {0.0f, 0.0f, 0.0f}};
+            if (span.virtual_textured())
+                texture_row_steps(polygon, span.row_steps);
+            int y_begin, y_end;
+            color_rows(y_begin, y_end);
+            scan_polygon(polygon, y_begin, y_end, span);
+        }
+
+        void fill_stencil_polygon(const RasterPolygon &polygon)
+        {
+            if (!stencil_test_enabled)
+                return;
+            StencilSpan span = {front_facing(polygon)};
+            scan_polygon(polygon, 0, height, span);
+        }
+    }
+
+    void fill_polygon(const Pointi *points, const MaterialColor *colors, 
+            const float *z_values, 
+            const float *u_values, const float *v_values, int n)
+    {
+        using namespace internal;
+        // on the stack up to SSRE_MAX_VERTEX_COUNT vertices
+        float stack_attributes[SSRE_MAX_VERTEX_COUNT * EYE_ATTRIBUTE];
+        std::vector<float> more_attributes;
+        std::vector<Pointi> more_points;
+        RasterPolygon polygon;
+        float *attributes = stack_attributes;
+        Pointi *raster_points = polygon.points;
+        if (n > SSRE_MAX_VERTEX_COUNT)
+        {
+            more_attributes.resize(n * EYE_ATTRIBUTE);
+            more_points.resize(n);
+            attributes = more_attributes.data();
+            raster_points = more_points.data();
+            polygon.more_points = raster_points;
+        }
+        polygon.count = n;
+        polygon.attribute_count = EYE_ATTRIBUTE;
+        polygon.attributes = attributes;
+        for (int i = 0; i < n; i++)
+        {
+            float *a = attributes + i * EYE_ATTRIBUTE;
+            // whole pixels, the polygon goes through their centers
+            raster_points[i] = {points[i].x * SUBPIXEL_ONE + SUBPIXEL_HALF,
+                points[i].y * SUBPIXEL_ONE + SUBPIXEL_HALF};
+            a[Z_ATTRIBUTE] = z_values[i];
+            for (int k = 0; k < SSRE_LIGHTING_COMPONENT; k++)
+                a[COLOR_ATTRIBUTE + k] = colors[i].color[k];
+            a[U_ATTRIBUTE] = u_values[i];
+            a[V_ATTRIBUTE] = v_values[i];
+        }
+        if (n > 0)
+            bound_rows(polygon);
+        internal::fill_polygon(polygon, 0, nullptr);
     }
 }
@@ -35,11 +35,17 @@ namespace ssre
         internal::z_buffer_enabled = false;
     }
 
+    void depth_func(CompareFunction func)
+    {
+        internal::depth_function = func;
+    }
+
     namespace internal 
     {
         bool culling_enabled = false;
         bool clipping_enabled = false;
         bool z_buffer_enabled = false;
+        CompareFunction depth_function = CompareLess;
 
         void compute_normal(InternalPolygon &polygon)
         {
@@ -127,15 +133,60 @@ namespace ssre
             v.position = intersect(v0.position, v1.position, boundary);
             float full_length = (v1.position - v0.position).length();
             float part_length = (v.position - v0.position).length();
-            MaterialColor cdiff = (v1.color - v0.color) / full_length;
-            v.color = v0.color + cdiff * part_length;
-            float udiff = (v1.tex_coord.u - v0.tex_coord.u) / full_length;
-            v.tex_coord.u = v0.tex_coord.u + udiff * part_length;
-            float vdiff = (v1.tex_coord.v - v0.tex_coord.v) / full_length;
-            v.tex_coord.v = v0.tex_coord.v + vdiff * part_length;
+            // 1 / w is linear after the divide, the attributes are
+            // interpolated at the matching point of the eye space edge
+            float s = part_length / full_length;
+            v.inverse_w = v0.inverse_w + (v1.inverse_w - v0.inverse_w) * s;
+            float t = s * v1.inverse_w / v.inverse_w;
+            v.color = v0.color + (v1.color - v0.color) * t;
+            v.tex_coord.u = v0.tex_coord.u +
+                (v1.tex_coord.u - v0.tex_coord.u) * t;
+            v.tex_coord.v = v0.tex_coord.v +
+                (v1.tex_coord.v - v0.tex_coord.v) * t;
+            v.eye_position = v0.eye_position + 
+                (v1.eye_position - v0.eye_position) * t;
+            v.normal = v0.normal + (v1.normal - v0.normal) * t;
+            v.tangent = v0.tangent + (v1.tangent - v0.tangent) * t;
+            for (int i = 0; i < buffer.shadow_map_count; i++)
+                v.shadowed[i] = v0.shadowed[i] + 
+                    (v1.shadowed[i] - v0.shadowed[i]) * t;
             return v;
         }
 
+        /* keeps the part of the polygon where w + sign * v[axis] >= 0 */
+        int clip_homogeneous(const Vector *input, int n, Vector *output,
+                int axis, float sign)
+        {
+            int count = 0;
+            for (int i = 0; i < n; i++)
+            {
+                const Vector &v0 = input[(i - 1 + n) % n];
+                const Vector &v1 = input[i];
+                float d0 = v0.h() + sign * v0.v[axis];
+                float d1 = v1.h() + sign * v1.v[axis];
+                if ((d0 >= 0.0f) != (d1 >= 0.0f))
+                    output[count++] = v0 + (v1 - v0) * (d0 / (d0 - d1));
+                if (d1 >= 0.0f)
+                    output[count++] = v1;
+            }
+            return count;
+        }
+
+        int clip_homogeneous(Vector *points, int n)
+        {
+            // unlike clipping() this works before the perspective divide,
+            // so points behind the eye or at infinity are handled
+            Vector clipped[MAX_CLIP_VERTEX_COUNT];
+            n = clip_homogeneous(points, n, clipped, 0, 1.0f);
+            n = clip_homogeneous(clipped, n, points, 0, -1.0f);
+            n = clip_homogeneous(points, n, clipped, 1, 1.0f);
+            n = clip_homogeneous(clipped, n, points, 1, -1.0f);
+            n = clip_homogeneous(points, n, clipped, 2, 1.0f);
+            for (int i = 0; i < n; i++)
+                points[i] = clipped[i];
+            return n;
+        }
+
         bool clipping(InternalPolygon &polygon)
         {
             InternalVertex new_vertices[SSRE_MAX_VERTEX_COUNT];
@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    namespace internal
+    {
+        /* rows handed to a worker at a time */
+        const int UPSCALE_ROW_GRAIN = 16;
+        /* weight of the last frame in the smoothed frame time */
+        const float FRAME_TIME_SMOOTHING = 0.2f;
+        /*
+         * the scale stays while the frame time is within these fractions
+         * of the target, so that it does not flip every frame
+         */
+        const float FRAME_TIME_LOW = 0.85f;
+        const float FRAME_TIME_HIGH = 1.05f;
+        /* largest change of the scale in one frame */
+        const float SCALE_STEP = 0.1f;
+
+        static bool dynamic_resolution_enabled = false;
+        static float target_frame_time;
+        static float min_resolution_scale, max_resolution_scale;
+        static float current_scale = 1.0f;
+        static float frame_time = 0.0f;
+        static bool frame_started = false;
+        static std::chrono::steady_clock::time_point last_present;
+
+        static std::vector<uint32> upscale_buffer;
+        static std::vector<int> upscale_columns;
+        static std::vector<int> upscale_weights;
+
+        void apply_resolution_scale(float scale)
+        {
+            current_scale = scale;
+            int w = std::max(1, (int)(output_width * scale + 0.5f));
+            int h = std::max(1, (int)(output_height * scale + 0.5f));
+            set_render_size(std::min(w, output_width),
+                    std::min(h, output_height));
+        }
+
+        void update_dynamic_resolution()
+        {
+            auto now = std::chrono::steady_clock::now();
+            float elapsed = std::chrono::duration<float, std::milli>(
+                    now - last_present).count();
+            last_present = now;
+            if (!dynamic_resolution_enabled)
+                return;
+            if (!frame_started)
+            {
+                // the time before the first present is not a frame
+                frame_started = true;
+                return;
+            }
+            frame_time = frame_time == 0.0f ? elapsed : frame_time +
+                FRAME_TIME_SMOOTHING * (elapsed - frame_time);
+            float ratio = frame_time / target_frame_time;
+            if (ratio > FRAME_TIME_LOW && ratio < FRAME_TIME_HIGH)
+                return;
+            // the cost of a frame goes with its area
+            float scale = current_scale / std::sqrt(ratio);
+            scale = std::min(std::max(scale, current_scale - SCALE_STEP),
+                    current_scale + SCALE_STEP);
+            scale = std::min(std::max(scale, min_resolution_scale),
+                    max_resolution_scale);
+            if (scale != current_scale)
+                apply_resolution_scale(scale);
+        }
+
+        /*
+         * a + (b - a) * weight / 128 per channel, weight in [0, 128].
+         * The differences times the weights fit in 16 bits
+         */
+        inline uint32 lerp_channels(uint32 a, uint32 b, int weight)
+        {
+            uint32 c = 0;
+            for (int shift = 0; shift < 32; shift += 8)
+            {
+                int ca = (a >> shift) & 0xff, cb = (b >> shift) & 0xff;
+                c |= (uint32)(ca + (((cb - ca) * weight) >> 7)) << shift;
+            }
+            return c;
+        }
+
+        /* two source rows blended by weight */
+        void blend_rows(const uint32 *row0, const uint32 *row1, int weight,
+                uint32 *dest, int count)
+        {
+            int x = 0;
+#ifdef __SSE2__
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i w = _mm_set1_epi16(weight);
+            for (; x + 4 <= count; x += 4)
+            {
+                __m128i a = _mm_loadu_si128((const __m128i *)(row0 + x));
+                __m128i b = _mm_loadu_si128((const __m128i *)(row1 + x));
+                __m128i a_lo = _mm_unpacklo_epi8(a, zero);
+                __m128i a_hi = _mm_unpackhi_epi8(a, zero);
+                __m128i d_lo = _mm_sub_epi16(_mm_unpacklo_epi8(b, zero), a_lo);
+                __m128i d_hi = _mm_sub_epi16(_mm_unpackhi_epi8(b, zero), a_hi);
+                __m128i lo = _mm_add_epi16(a_lo,
+                        _mm_srai_epi16(_mm_mullo_epi16(d_lo, w), 7));
+                __m128i hi = _mm_add_epi16(a_hi,
+                        _mm_srai_epi16(_mm_mullo_epi16(d_hi, w), 7));
+                _mm_storeu_si128((__m128i *)(dest + x),
+                        _mm_packus_epi16(lo, hi));
+            }
+#endif
+            for (; x < count; x++)
+                dest[x] = lerp_channels(row0[x], row1[x], weight);
+        }
+
+        /* the pixel pairs starting at columns, blended by weights */
+        void blend_columns(const uint32 *row, const int *columns,
+                const int *weights, uint32 *dest, int count)
+        {
+            int x = 0;
+#ifdef __SSE2__
+            const __m128i zero = _mm_setzero_si128();
+            for (; x + 2 <= count; x += 2)
+            {
+                // the two pairs side by side, then their left and right
+                __m128i p0 = _mm_unpacklo_epi8(_mm_loadl_epi64(
+                            (const __m128i *)(row + columns[x])), zero);
+                __m128i p1 = _mm_unpacklo_epi8(_mm_loadl_epi64(
+                            (const __m128i *)(row + columns[x + 1])), zero);
+                __m128i a = _mm_unpacklo_epi64(p0, p1);
+                __m128i b = _mm_unpackhi_epi64(p0, p1);
+                __m128i w = _mm_unpacklo_epi64(_mm_set1_epi16(weights[x]),
+                        _mm_set1_epi16(weights[x + 1]));
+                __m128i c = _mm_add_epi16(a, _mm_srai_epi16(
+                            _mm_mullo_epi16(_mm_sub_epi16(b, a), w), 7));
+                _mm_storel_epi64((__m128i *)(dest + x),
+                        _mm_packus_epi16(c, zero));
+            }
+#endif
+            for (; x < count; x++)
+                dest[x] = lerp_channels(row[columns[x]],
+                        row[columns[x] + 1], weights[x]);
+        }
+
+        /*
+         * source position of the center of dest pixel i, as the pixel
+         * on its left and the weight of the one on its right. The last
+         * pixel is paired with itself
+         */
+        void upscale_taps(int src, int dest, int &pixel, int &weight, int i)
+        {
+            float s = (i + 0.5f) * src / dest - 0.5f;
+            s = std::min(std::max(s, 0.0f), src - 1.0f);
+            pixel = std::min((int)s, src - 1);
+            weight = (int)((s - pixel) * 128.0f + 0.5f);
+        }
+
+        const uint32 *upscale(const uint32 *src, int width, int height,
+                int out_width, int out_height)
+        {
+            // one extra column so that the last pair can be read
+            int stride = width + 1;
+            upscale_buffer.resize((size_t)out_width * out_height);
+            upscale_columns.resize(out_width);
+            upscale_weights.resize(out_width);
+            for (int x = 0; x < out_width; x++)
+            {
+                upscale_taps(width, out_width, upscale_columns[x],
+                        upscale_weights[x], x);
+                if (upscale_columns[x] == width - 1)
+                    upscale_weights[x] = 0;
+            }
+            parallel_for(0, out_height, UPSCALE_ROW_GRAIN,
+                    [&](int begin, int end) {
+                std::vector<uint32> row(stride);
+                for (int y = begin; y < end; y++)
+                {
+                    int pixel, weight;
+                    upscale_taps(height, out_height, pixel, weight, y);
+                    int next = std::min(pixel + 1, height - 1);
+                    blend_rows(src + pixel * width, src + next * width,
+                            weight, row.data(), width);
+                    row[width] = row[width - 1];
+                    blend_columns(row.data(), upscale_columns.data(),
+                            upscale_weights.data(), upscale_buffer.data() +
+                            (size_t)y * out_width, out_width);
+                }
+            });
+            return upscale_buffer.data();
+        }
+    }
+
+    void enable_dynamic_resolution(float target_ms, float min_scale,
+            float max_scale)
+    {
+        using namespace internal;
+        if (target_ms <= 0.0f)
+            throw new std::invalid_argument("non positive frame time");
+        if (min_scale <= 0.0f || min_scale > max_scale || max_scale > 1.0f)
+            throw new std::invalid_argument(
+                    "resolution scales out of (0, 1]");
+        target_frame_time = target_ms;
+        min_resolution_scale = min_scale;
+        max_resolution_scale = max_scale;
+        dynamic_resolution_enabled = true;
+        frame_started = false;
+        frame_time = 0.0f;
+        apply_resolution_scale(max_scale);
+    }
+
+    void disable_dynamic_resolution()
+    {
+        internal::dynamic_resolution_enabled = false;
+        internal::apply_resolution_scale(1.0f);
+    }
+
+    float resolution_scale()
+    {
+        return internal::current_scale;
+    }
+}
@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    extern float *depths;
+
+    void enable_s_buffer()
+    {
+        // depths drawn with the z-buffer earlier in the frame still occlude
+        if (!internal::s_buffer_enabled && internal::z_buffer_enabled &&
+                depths)
+            internal::seed_s_buffer();
+        internal::s_buffer_enabled = true;
+    }
+
+    void disable_s_buffer()
+    {
+        internal::s_buffer_enabled = false;
+    }
+
+    namespace internal
+    {
+        bool s_buffer_enabled = false;
+
+        /* pixels [x0, x1] of a row covered by one plane, z linear in x */
+        struct SBufferSegment
+        {
+            int x0, x1;
+            float z0, dz;
+
+            float z(int x) const
+            {
+                return z0 + dz * (x - x0);
+            }
+
+            SBufferSegment clip(int p, int q) const
+            {
+                return SBufferSegment {p, q, z(p), dz};
+            }
+        };
+
+        /*
+         * every row keeps its segments sorted and disjoint, so that a
+         * span is only compared with the segments it overlaps. Pixels
+         * without a segment are at the far plane
+         */
+        static std::vector<std::vector<SBufferSegment>> s_buffer_rows;
+        static std::vector<SBufferSegment> s_buffer_pieces;
+
+        void clear_s_buffer()
+        {
+            s_buffer_rows.resize(window_height);
+            for (auto &row : s_buffer_rows)
+                row.clear();
+        }
+
+        /*
+         * rebuilds the rows from the depth buffer, one segment for each
+         * run of pixels whose depths lie on a line
+         */
+        void seed_s_buffer()
+        {
+            const float tolerance = 1e-6f;
+            s_buffer_rows.resize(window_height);
+            for (int y = 0; y < window_height; y++)
+            {
+                std::vector<SBufferSegment> &row = s_buffer_rows[y];
+                row.clear();
+                const float *d = depths + (window_height - 1 - y) *
+                    window_width;
+                int x0 = 0;
+                while (x0 < window_width)
+                {
+                    float dz = x0 + 1 < window_width ? d[x0 + 1] - d[x0] :
+                        0.0f;
+                    int x1 = x0;
+                    while (x1 + 1 < window_width &&
+                            std::fabs(d[x0] + dz * (x1 + 1 - x0) -
+                                d[x1 + 1]) <= tolerance)
+                        x1++;
+                    row.push_back(SBufferSegment {x0, x1, d[x0], dz});
+                    x0 = x1 + 1;
+                }
+            }
+        }
+
+        void s_buffer_span(int y, int x_left, int x_right, float z, float dz,
+                bool occlude, const RangeFunction &visible)
+        {
+            if ((int)s_buffer_rows.size() != window_height)
+                clear_s_buffer();
+            std::vector<SBufferSegment> &row = s_buffer_rows[y];
+            const SBufferSegment span = {x_left, x_right, z, dz};
+            std::vector<SBufferSegment> &pieces = s_buffer_pieces;
+            pieces.clear();
+            // pieces of the span are merged while they stay adjacent
+            bool last_new = false;
+            auto keep = [&](const SBufferSegment &segment, int p, int q) {
+                pieces.push_back(segment.clip(p, q));
+                last_new = false;
+            };
+            auto show = [&](int p, int q) {
+                visible(p, q + 1);
+                if (!occlude)
+                    return;
+                if (last_new && pieces.back().x1 + 1 == p)
+                    pieces.back().x1 = q;
+                else
+                    pieces.push_back(span.clip(p, q));
+                last_new = true;
+            };
+
+            auto first = std::lower_bound(row.begin(), row.end(), x_left,
+                    [](const SBufferSegment &s, int x) { return s.x1 < x; });
+            auto it = first;
+            int x = x_left;
+            for (; it != row.end() && it->x0 <= x_right; ++it)
+            {
+                const SBufferSegment &s = *it;
+                if (s.x0 < x_left)
+                    keep(s, s.x0, x_left - 1);
+                if (x < s.x0)
+                    show(x, s.x0 - 1);
+                int a = std::max(x, s.x0);
+                int b = std::min(x_right, s.x1);
+                // the difference of two planes is linear, so the span is
+                // in front on one side of where it crosses zero
+                float da = span.z(a) - s.z(a);
+                float db = span.z(b) - s.z(b);
+                if (da < 0.0f && db < 0.0f)
+                    show(a, b);
+                else if (da >= 0.0f && db >= 0.0f)
+                    keep(s, a, b);
+                else
+                {
+                    int c = a + (int)std::floor(da / (da - db) * (b - a));
+                    c = std::min(std::max(c, a), b - 1);
+                    if (da < 0.0f)
+                    {
+                        show(a, c);
+                        keep(s, c + 1, b);
+                    }
+                    else
+                    {
+                        keep(s, a, c);
+                        show(c + 1, b);
+                    }
+                }
+                if (s.x1 > x_right)
+                    keep(s, x_right + 1, s.x1);
+                x = b + 1;
+            }
+            if (x <= x_right)
+                show(x, x_right);
+            if (!occlude)
+                return;
+            // replace the overlapped segments with what is left of them
+            size_t offset = first - row.begin();
+            size_t replaced = it - first;
+            if (pieces.size() > replaced)
+                row.insert(row.begin() + offset + replaced,
+                        pieces.size() - replaced, SBufferSegment());
+            else
+                row.erase(row.begin() + offset + pieces.size(),
+                        row.begin() + offset + replaced);
+            std::copy(pieces.begin(), pieces.end(), row.begin() + offset);
+        }
+    }
+}
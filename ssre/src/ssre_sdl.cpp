@@ -15,7 +15,7 @@ namespace ssre
     static SDL_Renderer *sdl_renderer = nullptr;
     static SDL_Texture *sdl_texture = nullptr;
 
-    void present_impl(uint32 *pixels, int pitch)
+    void present_impl(const uint32 *pixels, int pitch)
     {
         SDL_UpdateTexture(sdl_texture, nullptr, (const void *)pixels, pitch);
         SDL_RenderCopy(sdl_renderer, sdl_texture, nullptr, nullptr);
@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+#include "internal/ssre_scan.h"
+
+namespace ssre
+{
+    namespace internal
+    {
+        ShadowMode shadow_mode = PerVertex;
+        bool shadow_pcf_enabled = false;
+        ShadowMap shadow_maps[SSRE_MAX_SHADOW_MAPS];
+        const ShadowMap *shadow_pass = nullptr;
+
+        /* rows of a shadow map rendered by one worker at a time */
+        const int SHADOW_BAND_ROWS = 32;
+        /* blend between logarithmic and uniform cascade splits */
+        const float CASCADE_SPLIT_LAMBDA = 0.5f;
+
+        /* polygons of the current pass, rasterized by end_shadow_pass */
+        static std::vector<RasterPolygon> shadow_queue[SSRE_MAX_SHADOW_CASCADES];
+
+        int light_shadow_map(int light)
+        {
+            for (int i = 0; i < buffer.shadow_map_count; i++)
+                if (shadow_maps[i].light == light)
+                    return i;
+            return -1;
+        }
+
+        Vector any_perpendicular_up(const Vector &direction)
+        {
+            if (std::abs(direction.y()) < 0.99f)
+                return Vector {0.0f, 1.0f, 0.0f};
+            return Vector {1.0f, 0.0f, 0.0f};
+        }
+
+        void setup_spot_light(ShadowMap &map, const LightingSource &source,
+                const ShadowSettings &settings)
+        {
+            if (settings.dnear <= 0.0f || settings.dfar <= settings.dnear)
+                throw new std::invalid_argument("invalid shadow depth range");
+            if (source.spotlight_cutoff >= 89.0f)
+                throw new std::invalid_argument("spot light cutoff too wide");
+            Vector position = {source.position.x(), source.position.y(),
+                source.position.z()};
+            Matrix view = look_at_matrix(position, position + source.direction,
+                    any_perpendicular_up(source.direction));
+            map.cascades = 1;
+            map.splits[0] = FLT_MAX;
+            map.projections[0] = perspective_matrix(
+                    2.0f * source.spotlight_cutoff, 1.0f,
+                    settings.dnear, settings.dfar) * view;
+        }
+
+        void setup_directional_light(ShadowMap &map,
+                const LightingSource &source, const ShadowSettings &settings)
+        {
+            if (settings.dfar < 0.0f)
+                throw new std::invalid_argument("invalid shadow depth range");
+            // corners of the view frustum, near plane first
+            Matrix inverse = matrix_projection.inverse();
+            Vector corners[8];
+            for (int i = 0; i < 8; i++)
+            {
+                Vector ndc = {i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f,
+                    i & 4 ? 1.0f : -1.0f, 1.0f};
+                corners[i] = (inverse * ndc).divideH();
+            }
+            float dnear = -corners[0].z(), dfar = -corners[4].z();
+            if (dnear > dfar)
+                std::swap(dnear, dfar);
+
+            // the light looks against the direction towards it
+            Vector forward = -source.direction;
+            Matrix view = look_at_matrix(Vector {0.0f, 0.0f, 0.0f}, forward,
+                    any_perpendicular_up(forward));
+            map.cascades = settings.cascades;
+            float begin = dnear;
+            for (int c = 0; c < map.cascades; c++)
+            {
+                float f = (float)(c + 1) / map.cascades;
+                float uniform = dnear + (dfar - dnear) * f;
+                float end = uniform;
+                if (dnear > 0.0f)
+                    end = CASCADE_SPLIT_LAMBDA * dnear * pow(dfar / dnear, f) +
+                        (1.0f - CASCADE_SPLIT_LAMBDA) * uniform;
+                map.splits[c] = end;
+
+                // bound the slice of the frustum in light space
+                float lo[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+                float hi[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+                for (int i = 0; i < 4; i++)
+                {
+                    const Vector &p0 = corners[i], &p1 = corners[i + 4];
+                    for (int k = 0; k < 2; k++)
+                    {
+                        float d = k == 0 ? begin : end;
+                        float t = dfar > dnear ?
+                            (d - dnear) / (dfar - dnear) : 0.0f;
+                        Vector p = p0 + (p1 - p0) * t;
+                        p.v[3] = 1.0f;
+                        p = view * p;
+                        for (int j = 0; j < 3; j++)
+                        {
+                            lo[j] = std::min(lo[j], p.v[j]);
+                            hi[j] = std::max(hi[j], p.v[j]);
+                        }
+                    }
+                }
+                // snap to whole texels so the map does not shimmer while
+                // the camera moves
+                for (int j = 0; j < 2; j++)
+                {
+                    float texel = (hi[j] - lo[j]) / settings.size;
+                    if (texel <= 0.0f)
+                        continue;
+                    lo[j] = floor(lo[j] / texel) * texel;
+                    hi[j] = ceil(hi[j] / texel) * texel;
+                }
+                map.projections[c] = ortho_matrix(lo[0], hi[0], lo[1], hi[1],
+                        -hi[2] - settings.dfar, -lo[2]) * view;
+                begin = end;
+            }
+        }
+
+        void queue_shadow_polygon(int cascade, const Vector *points, int n,
+                int size)
+        {
+            RasterPolygon polygon;
+            polygon.count = n;
+            polygon.attribute_count = 1;
+            float *depths = buffer.arena.allocate<float>(n);
+            for (int i = 0; i < n; i++)
+            {
+                Vector p = points[i].divideH();
+                polygon.points[i] = {
+                    to_subpixel((p.x() * 0.5f + 0.5f) * size),
+                    to_subpixel((p.y() * 0.5f + 0.5f) * size)};
+                depths[i] = p.z() * 0.5f + 0.5f;
+            }
+            polygon.attributes = depths;
+            bound_rows(polygon);
+            shadow_queue[cascade].push_back(polygon);
+        }
+
+        void render_shadow_polygon(const InternalPolygon &polygon)
+        {
+            const ShadowMap &map = *shadow_pass;
+            for (int c = 0; c < map.cascades; c++)
+            {
+                Vector clipped[MAX_CLIP_VERTEX_COUNT];
+                int n = polygon.count;
+                for (int i = 0; i < n; i++)
+                {
+                    const Vector &p = polygon.vertices[i].position;
+                    clipped[i] = map.projections[c] *
+                        Vector {p.x(), p.y(), p.z(), 1.0f};
+                }
+                // the far plane is left to the depth test
+                n = clip_homogeneous(clipped, n);
+                if (n < 3)
+                    continue;
+                // clipping may add vertices, split it into a fan if needed
+                Vector piece[SSRE_MAX_VERTEX_COUNT];
+                for (int start = 1; start < n - 1;
+                        start += SSRE_MAX_VERTEX_COUNT - 2)
+                {
+                    int count = std::min(n - start, SSRE_MAX_VERTEX_COUNT - 1);
+                    piece[0] = clipped[0];
+                    for (int i = 0; i < count; i++)
+                        piece[i + 1] = clipped[start + i];
+                    queue_shadow_polygon(c, piece, count + 1, map.size);
+                }
+            }
+        }
+
+        /* keeps the nearest depth, clipped to the columns of the map */
+        struct DepthSpan
+        {
+            float *depths;
+            int size;
+
+            void operator()(int y, int x_left, int x_right,
+                    const float *attributes, const float *steps) const
+            {
+                float z = attributes[0];
+                if (x_left < 0)
+                {
+                    z += steps[0] * -x_left;
+                    x_left = 0;
+                }
+                x_right = std::min(x_right, size - 1);
+                float *line = depths + y * size;
+                for (int x = x_left; x <= x_right; x++)
+                {
+                    line[x] = std::min(line[x], z);
+                    z += steps[0];
+                }
+            }
+        };
+
+        void rasterize_shadow_queue(ShadowMap &map, int cascade)
+        {
+            std::vector<float> &depths = map.depths[cascade];
+            depths.assign((size_t)map.size * map.size, 1.0f);
+            const std::vector<RasterPolygon> &queue = shadow_queue[cascade];
+            int bands = (map.size + SHADOW_BAND_ROWS - 1) / SHADOW_BAND_ROWS;
+            // bands own disjoint rows, so no two workers share a pixel
+            parallel_for(0, bands, 1, [&](int b0, int b1) {
+                DepthSpan span = {depths.data(), map.size};
+                int y0 = b0 * SHADOW_BAND_ROWS;
+                int y1 = std::min(map.size, b1 * SHADOW_BAND_ROWS);
+                for (const RasterPolygon &polygon : queue)
+                    scan_polygon(polygon, y0, y1, span);
+            });
+            shadow_queue[cascade].clear();
+        }
+
+        float sample_shadow(const ShadowMap &map, int cascade,
+                int x, int y, float depth)
+        {
+            if (x < 0 || y < 0 || x >= map.size || y >= map.size)
+                return 1.0f;
+            return depth <= map.depths[cascade][y * map.size + x] ?
+                1.0f : 0.0f;
+        }
+
+        float shadow_visibility(const ShadowMap &map, const Vector &eye_position)
+        {
+            float distance = -eye_position.z();
+            int c = 0;
+            while (c < map.cascades && distance > map.splits[c])
+                ++c;
+            // beyond the last cascade nothing is known, count it as lit
+            if (c == map.cascades)
+                return 1.0f;
+            Vector p = map.projections[c] * Vector {eye_position.x(),
+                eye_position.y(), eye_position.z(), 1.0f};
+            if (p.h() <= 0.0f)
+                return 1.0f;
+            p = p.divideH();
+            float x = (p.x() * 0.5f + 0.5f) * map.size;
+            float y = (p.y() * 0.5f + 0.5f) * map.size;
+            float depth = p.z() * 0.5f + 0.5f - map.bias;
+            // texels sit on integer coordinates like the pixels of the
+            // color pass
+            if (!shadow_pcf_enabled)
+                return sample_shadow(map, c, (int)floor(x + 0.5f),
+                        (int)floor(y + 0.5f), depth);
+            // bilinear weighted 2x2 percentage closer filter
+            int ix = (int)floor(x), iy = (int)floor(y);
+            float fx = x - ix, fy = y - iy;
+            float s00 = sample_shadow(map, c, ix, iy, depth);
+            float s10 = sample_shadow(map, c, ix + 1, iy, depth);
+            float s01 = sample_shadow(map, c, ix, iy + 1, depth);
+            float s11 = sample_shadow(map, c, ix + 1, iy + 1, depth);
+            return (s00 * (1.0f - fx) + s10 * fx) * (1.0f - fy) +
+                (s01 * (1.0f - fx) + s11 * fx) * fy;
+        }
+    }
+
+    void begin_shadow_pass(int light_handle, const ShadowSettings &settings)
+    {
+        using namespace internal;
+        if (shadow_pass)
+            throw new std::runtime_error("shadow pass already begun");
+        if (light_handle < 0 || light_handle >= buffer.lighting_source_count)
+            throw new std::invalid_argument("invalid light handle");
+        if (light_shadow_map(light_handle) >= 0)
+            throw new std::invalid_argument("light already has a shadow map");
+        if (buffer.shadow_map_count == SSRE_MAX_SHADOW_MAPS)
+            throw new std::runtime_error("too many shadow maps");
+        if (settings.size <= 0)
+            throw new std::invalid_argument("invalid shadow map size");
+        if (settings.cascades < 1 ||
+                settings.cascades > SSRE_MAX_SHADOW_CASCADES)
+            throw new std::invalid_argument("invalid shadow cascade count");
+
+        const LightingSource &source = buffer.lighting_sources[light_handle];
+        ShadowMap &map = shadow_maps[buffer.shadow_map_count];
+        map.light = light_handle;
+        map.type = source.type;
+        map.size = settings.size;
+        map.bias = settings.bias;
+        if (source.type == SpotLight)
+            setup_spot_light(map, source, settings);
+        else if (source.type == DirectionalSource)
+            setup_directional_light(map, source, settings);
+        else
+            throw new std::invalid_argument(
+                    "point lights do not cast shadows");
+        ++buffer.shadow_map_count;
+        shadow_pass = &map;
+    }
+
+    void end_shadow_pass()
+    {
+        using namespace internal;
+        if (!shadow_pass)
+            throw new std::runtime_error("no shadow pass to end");
+        ShadowMap &map = shadow_maps[buffer.shadow_map_count - 1];
+        for (int c = 0; c < map.cascades; c++)
+            rasterize_shadow_queue(map, c);
+        shadow_pass = nullptr;
+    }
+
+    void shadow_mode_per_vertex()
+    {
+        internal::shadow_mode = internal::PerVertex;
+    }
+
+    void shadow_mode_per_pixel()
+    {
+        internal::shadow_mode = internal::PerPixel;
+    }
+
+    void enable_shadow_pcf()
+    {
+        internal::shadow_pcf_enabled = true;
+    }
+
+    void disable_shadow_pcf()
+    {
+        internal::shadow_pcf_enabled = false;
+    }
+}
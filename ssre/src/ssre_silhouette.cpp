@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    EdgeMesh create_edge_mesh(const Mesh &mesh, float crease_angle)
+    {
+        std::vector<int> adjacency(mesh.triangle_count * 3);
+        build_adjacency(mesh, adjacency.data());
+
+        EdgeMesh edges;
+        edges.face_count = mesh.triangle_count;
+        edges.plane_x = new float[mesh.triangle_count];
+        edges.plane_y = new float[mesh.triangle_count];
+        edges.plane_z = new float[mesh.triangle_count];
+        edges.plane_d = new float[mesh.triangle_count];
+        for (int t = 0; t < mesh.triangle_count; t++)
+        {
+            const int *index = mesh.indices + t * 3;
+            Vector p0 = mesh.vertices[index[0]].position.discardH();
+            Vector p1 = mesh.vertices[index[1]].position.discardH();
+            Vector p2 = mesh.vertices[index[2]].position.discardH();
+            Vector normal = (p1 - p0) * (p2 - p0);
+            if (normal.dot_product(normal) > 0.0f)
+                normal = normal.normalize();
+            edges.plane_x[t] = normal.x();
+            edges.plane_y[t] = normal.y();
+            edges.plane_z[t] = normal.z();
+            edges.plane_d[t] = normal.dot_product(p0);
+        }
+
+        // every shared edge once, from the lower triangle
+        auto owned = [&](int t, int e) {
+            int neighbour = adjacency[t * 3 + e];
+            return neighbour < 0 || t < neighbour;
+        };
+        int count = 0;
+        for (int t = 0; t < mesh.triangle_count; t++)
+            for (int e = 0; e < 3; e++)
+                count += owned(t, e);
+        edges.edge_count = count;
+        edges.vertices = new int[count * 2];
+        edges.faces = new int[count * 2];
+        edges.creases = new uint8[count];
+        float cos_crease = cos(crease_angle * M_PI / 180.0);
+        int k = 0;
+        for (int t = 0; t < mesh.triangle_count; t++)
+            for (int e = 0; e < 3; e++)
+            {
+                if (!owned(t, e))
+                    continue;
+                int neighbour = adjacency[t * 3 + e];
+                edges.vertices[k * 2] = mesh.indices[t * 3 + e];
+                edges.vertices[k * 2 + 1] = mesh.indices[t * 3 + (e + 1) % 3];
+                edges.faces[k * 2] = t;
+                edges.faces[k * 2 + 1] = neighbour;
+                edges.creases[k] = 0;
+                if (neighbour >= 0)
+                {
+                    float cos_angle =
+                        edges.plane_x[t] * edges.plane_x[neighbour] +
+                        edges.plane_y[t] * edges.plane_y[neighbour] +
+                        edges.plane_z[t] * edges.plane_z[neighbour];
+                    edges.creases[k] = cos_angle < cos_crease;
+                }
+                k++;
+            }
+        return edges;
+    }
+
+    void release_edge_mesh(EdgeMesh &edges)
+    {
+        delete[] edges.vertices;
+        delete[] edges.faces;
+        delete[] edges.creases;
+        delete[] edges.plane_x;
+        delete[] edges.plane_y;
+        delete[] edges.plane_z;
+        delete[] edges.plane_d;
+        memset(&edges, 0, sizeof(edges));
+    }
+
+    namespace internal
+    {
+        /* faces and edges handed to a worker at a time */
+        const int OUTLINE_GRAIN = 4096;
+
+        /*
+         * flags the faces turned towards the eye, given in model space
+         * as a homogeneous point, at infinity for parallel projections
+         */
+        void classify_faces(const EdgeMesh &edges, const Vector &eye,
+                uint8 *facing, int begin, int end)
+        {
+            int t = begin;
+#ifdef __SSE2__
+            const __m128 ex = _mm_set1_ps(eye.x());
+            const __m128 ey = _mm_set1_ps(eye.y());
+            const __m128 ez = _mm_set1_ps(eye.z());
+            const __m128 ew = _mm_set1_ps(eye.h());
+            for (; t + 4 <= end; t += 4)
+            {
+                __m128 x = _mm_mul_ps(_mm_loadu_ps(&edges.plane_x[t]), ex);
+                __m128 y = _mm_mul_ps(_mm_loadu_ps(&edges.plane_y[t]), ey);
+                __m128 z = _mm_mul_ps(_mm_loadu_ps(&edges.plane_z[t]), ez);
+                __m128 d = _mm_mul_ps(_mm_loadu_ps(&edges.plane_d[t]), ew);
+                __m128 side = _mm_sub_ps(_mm_add_ps(_mm_add_ps(x, y), z), d);
+                int mask = _mm_movemask_ps(_mm_cmpgt_ps(side,
+                            _mm_setzero_ps()));
+                for (int k = 0; k < 4; k++)
+                    facing[t + k] = (mask >> k) & 1;
+            }
+#endif
+            for (; t < end; t++)
+                facing[t] = edges.plane_x[t] * eye.x() +
+                    edges.plane_y[t] * eye.y() + edges.plane_z[t] * eye.z() -
+                    edges.plane_d[t] * eye.h() > 0.0f;
+        }
+
+        /*
+         * clips a clip space line against the same planes as polygons,
+         * false when nothing is left
+         */
+        bool clip_line(Vector &p0, Vector &p1)
+        {
+            float t0 = 0.0f, t1 = 1.0f;
+            for (int plane = 0; plane < 5; plane++)
+            {
+                // signed distances, inside where positive
+                int axis = plane >> 1;
+                float sign = (plane & 1) ? -1.0f : 1.0f;
+                float d0 = p0.h() + sign * p0.v[axis];
+                float d1 = p1.h() + sign * p1.v[axis];
+                if (d0 < 0.0f && d1 < 0.0f)
+                    return false;
+                if (d0 < 0.0f)
+                    t0 = std::max(t0, d0 / (d0 - d1));
+                else if (d1 < 0.0f)
+                    t1 = std::min(t1, d0 / (d0 - d1));
+            }
+            if (t0 > t1)
+                return false;
+            Vector d = p1 - p0;
+            Vector q0 = p0 + d * t0;
+            p1 = p0 + d * t1;
+            p0 = q0;
+            return true;
+        }
+
+        Pointi window_point(const Vector &clip)
+        {
+            Vector p = matrix_view_port * clip.divideH();
+            int x = std::min(std::max((int)(p.x() + 0.5f), 0),
+                    window_width - 1);
+            int y = std::min(std::max((int)(p.y() + 0.5f), 0),
+                    window_height - 1);
+            return Pointi {x, y};
+        }
+    }
+
+    void render_outline(const Mesh &mesh, const EdgeMesh &edges, uint32 color)
+    {
+        using namespace internal;
+        // the eye in model space, a direction for parallel projections
+        bool perspective = matrix_projection.v[3][3] == 0.0f;
+        Vector eye = matrix_model_view.inverse() * (perspective ?
+                Vector {0.0f, 0.0f, 0.0f, 1.0f} :
+                Vector {0.0f, 0.0f, 1.0f, 0.0f});
+
+        uint8 *facing = buffer.arena.allocate<uint8>(edges.face_count);
+        parallel_for(0, edges.face_count, OUTLINE_GRAIN,
+                [&](int begin, int end) {
+            classify_faces(edges, eye, facing, begin, end);
+        });
+
+        // silhouettes split the faces turned towards and away from the
+        // eye, creases are kept while one of their faces is visible
+        uint8 *drawn = buffer.arena.allocate<uint8>(edges.edge_count);
+        parallel_for(0, edges.edge_count, OUTLINE_GRAIN,
+                [&](int begin, int end) {
+            for (int i = begin; i < end; i++)
+            {
+                int f1 = edges.faces[i * 2 + 1];
+                uint8 front0 = facing[edges.faces[i * 2]];
+                uint8 front1 = f1 >= 0 ? facing[f1] : 0;
+                drawn[i] = (front0 ^ front1) |
+                    (edges.creases[i] & (front0 | front1));
+            }
+        });
+
+        Matrix to_clip = matrix_projection * matrix_model_view;
+        for (int i = 0; i < edges.edge_count;)
+        {
+#ifdef __SSE2__
+            // most edges are neither, skip them sixteen at a time
+            if (i + 16 <= edges.edge_count && !_mm_movemask_epi8(
+                        _mm_cmpgt_epi8(_mm_loadu_si128(
+                                (const __m128i *)(drawn + i)),
+                            _mm_setzero_si128())))
+            {
+                i += 16;
+                continue;
+            }
+#endif
+            for (int end = std::min(i + 16, edges.edge_count); i < end; i++)
+            {
+                if (!drawn[i])
+                    continue;
+                const int *vertices = edges.vertices + i * 2;
+                Vector p0 = to_clip * mesh.vertices[vertices[0]].position;
+                Vector p1 = to_clip * mesh.vertices[vertices[1]].position;
+                if (clip_line(p0, p1))
+                    draw_line(window_point(p0), window_point(p1), color);
+            }
+        }
+    }
+}
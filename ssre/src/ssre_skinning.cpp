@@ -0,0 +1,815 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#ifdef __SSE2__
+#include "internal/ssre_intrinsics.h"
+#endif
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    namespace internal
+    {
+        /* vertices skinned by a worker at a time */
+        const int SKINNING_CHUNK = 1024;
+        /* most joints a vertex follows, the rest are dropped */
+        const int MAX_VERTEX_WEIGHTS = 4;
+
+        struct Quaternion
+        {
+            float x, y, z, w;
+        };
+
+        inline Quaternion multiply(const Quaternion &a, const Quaternion &b)
+        {
+            return Quaternion {
+                a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+                a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+                a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w,
+                a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z
+            };
+        }
+
+        inline Quaternion conjugate(const Quaternion &q)
+        {
+            return Quaternion {-q.x, -q.y, -q.z, q.w};
+        }
+
+        inline Vector rotate(const Quaternion &q, const Vector &v)
+        {
+            Vector u = {q.x, q.y, q.z};
+            Vector t = (u * v) * 2.0f;
+            return v + t * q.w + u * t;
+        }
+
+        Quaternion slerp(const Quaternion &a, Quaternion b, float t)
+        {
+            float d = a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
+            // the shorter way around
+            if (d < 0.0f)
+            {
+                b = Quaternion {-b.x, -b.y, -b.z, -b.w};
+                d = -d;
+            }
+            float wa = 1.0f - t, wb = t;
+            if (d < 0.9995f)
+            {
+                float theta = acos(d);
+                float s = sin(theta);
+                wa = sin(wa * theta) / s;
+                wb = sin(wb * theta) / s;
+            }
+            Quaternion r = {a.x * wa + b.x * wb, a.y * wa + b.y * wb,
+                a.z * wa + b.z * wb, a.w * wa + b.w * wb};
+            float length = std::sqrt(r.x * r.x + r.y * r.y + r.z * r.z +
+                    r.w * r.w);
+            return Quaternion {r.x / length, r.y / length, r.z / length,
+                r.w / length};
+        }
+
+        /* MD5 files only store x, y and z of unit quaternions */
+        Quaternion unit_quaternion(float x, float y, float z)
+        {
+            float w = 1.0f - x * x - y * y - z * z;
+            return Quaternion {x, y, z, w < 0.0f ? 0.0f : -std::sqrt(w)};
+        }
+
+        struct Joint
+        {
+            Vector position;
+            Quaternion orientation;
+        };
+
+        /* an affine transform as four columns, the last the translation */
+        struct alignas(16) Bone
+        {
+            float columns[4][4];
+        };
+
+        struct VertexWeights
+        {
+            float weights[MAX_VERTEX_WEIGHTS];
+            int joints[MAX_VERTEX_WEIGHTS];
+        };
+
+        struct SkinnedMesh
+        {
+            std::vector<Vertex> bind_vertices;
+            std::vector<VertexWeights> weights;
+            std::vector<int> indices;
+        };
+
+        /* splits MD5 text into numbers, names, quoted strings and braces */
+        class Md5Reader
+        {
+        public:
+            Md5Reader(const char *file)
+            {
+                std::ifstream in(file);
+                if (!in)
+                    throw new std::runtime_error("failed opening md5 file");
+                std::stringstream content;
+                content << in.rdbuf();
+                text = content.str();
+            }
+            DISABLE_COPY_AND_ASSIGN(Md5Reader);
+
+            bool done()
+            {
+                skip_space();
+                return position >= text.size();
+            }
+
+            std::string next()
+            {
+                skip_space();
+                if (position >= text.size())
+                    throw new std::runtime_error("unexpected end of md5 file");
+                size_t start = position;
+                char c = text[position];
+                if (c == '"')
+                {
+                    size_t end = text.find('"', start + 1);
+                    if (end == std::string::npos)
+                        throw new std::runtime_error("unterminated md5 string");
+                    position = end + 1;
+                    return text.substr(start + 1, end - start - 1);
+                }
+                if (strchr("(){}", c))
+                {
+                    position++;
+                    return text.substr(start, 1);
+                }
+                while (position < text.size() &&
+                        !isspace((unsigned char)text[position]) &&
+                        !strchr("(){}\"", text[position]))
+                    position++;
+                return text.substr(start, position - start);
+            }
+
+            void expect(const char *token)
+            {
+                if (next() != token)
+                    throw new std::runtime_error("malformed md5 file");
+            }
+
+            float number()
+            {
+                std::string token = next();
+                char *end = nullptr;
+                float value = strtof(token.c_str(), &end);
+                if (end == token.c_str() || *end)
+                    throw new std::runtime_error("malformed md5 number");
+                return value;
+            }
+
+            int integer()
+            {
+                return (int)number();
+            }
+
+            /* ( x y z ) */
+            Vector triple()
+            {
+                expect("(");
+                float x = number();
+                float y = number();
+                float z = number();
+                expect(")");
+                return Vector {x, y, z};
+            }
+
+        private:
+            void skip_space()
+            {
+                while (position < text.size())
+                {
+                    if (isspace((unsigned char)text[position]))
+                        position++;
+                    else if (text.compare(position, 2, "//") == 0)
+                    {
+                        size_t end = text.find('\n', position);
+                        position = end == std::string::npos ? text.size() : end;
+                    }
+                    else
+                        break;
+                }
+            }
+
+            std::string text;
+            size_t position = 0;
+        };
+
+        struct Md5Weight
+        {
+            int joint;
+            float bias;
+            Vector position;
+        };
+
+        void read_md5_mesh(Md5Reader &reader, const std::vector<Joint> &joints,
+                SkinnedMesh &mesh)
+        {
+            std::vector<int> first_weights, weight_counts;
+            std::vector<Md5Weight> weights;
+            reader.expect("{");
+            for (std::string key = reader.next(); key != "}";
+                    key = reader.next())
+            {
+                if (key == "shader")
+                    reader.next();
+                else if (key == "numverts")
+                {
+                    int count = reader.integer();
+                    mesh.bind_vertices.resize(count);
+                    first_weights.resize(count);
+                    weight_counts.resize(count);
+                }
+                else if (key == "vert")
+                {
+                    int i = reader.integer();
+                    if (i < 0 || i >= (int)mesh.bind_vertices.size())
+                        throw new std::runtime_error("md5 vertex out of range");
+                    reader.expect("(");
+                    mesh.bind_vertices[i].tex_coord.u = reader.number();
+                    mesh.bind_vertices[i].tex_coord.v = reader.number();
+                    reader.expect(")");
+                    first_weights[i] = reader.integer();
+                    weight_counts[i] = reader.integer();
+                }
+                else if (key == "numtris")
+                    mesh.indices.resize(reader.integer() * 3);
+                else if (key == "tri")
+                {
+                    int i = reader.integer();
+                    if (i < 0 || i * 3 >= (int)mesh.indices.size())
+                        throw new std::runtime_error(
+                                "md5 triangle out of range");
+                    // Doom 3 winds its triangles clockwise
+                    mesh.indices[i * 3] = reader.integer();
+                    mesh.indices[i * 3 + 2] = reader.integer();
+                    mesh.indices[i * 3 + 1] = reader.integer();
+                }
+                else if (key == "numweights")
+                    weights.resize(reader.integer());
+                else if (key == "weight")
+                {
+                    int i = reader.integer();
+                    if (i < 0 || i >= (int)weights.size())
+                        throw new std::runtime_error("md5 weight out of range");
+                    weights[i].joint = reader.integer();
+                    weights[i].bias = reader.number();
+                    weights[i].position = reader.triple();
+                    if (weights[i].joint < 0 ||
+                            weights[i].joint >= (int)joints.size())
+                        throw new std::runtime_error("md5 joint out of range");
+                }
+                else
+                    throw new std::runtime_error("unknown md5 mesh key");
+            }
+            for (int index : mesh.indices)
+                if (index < 0 || index >= (int)mesh.bind_vertices.size())
+                    throw new std::runtime_error("md5 index out of range");
+
+            // bind pose positions, and the strongest weights of each vertex
+            mesh.weights.resize(mesh.bind_vertices.size());
+            for (size_t i = 0; i < mesh.bind_vertices.size(); i++)
+            {
+                int first = first_weights[i], count = weight_counts[i];
+                if (first < 0 || count < 0 ||
+                        first + count > (int)weights.size())
+                    throw new std::runtime_error("md5 weight out of range");
+                Vector position = {0.0f, 0.0f, 0.0f};
+                for (int k = 0; k < count; k++)
+                {
+                    const Md5Weight &w = weights[first + k];
+                    const Joint &joint = joints[w.joint];
+                    position += (joint.position +
+                            rotate(joint.orientation, w.position)) * w.bias;
+                }
+                mesh.bind_vertices[i].position = Vector {position.x(),
+                    position.y(), position.z(), 1.0f};
+
+                std::vector<Md5Weight> strongest(weights.begin() + first,
+                        weights.begin() + first + count);
+                std::sort(strongest.begin(), strongest.end(),
+                        [](const Md5Weight &a, const Md5Weight &b) {
+                    return a.bias > b.bias;
+                });
+                count = std::min(count, MAX_VERTEX_WEIGHTS);
+                float total = 0.0f;
+                for (int k = 0; k < count; k++)
+                    total += strongest[k].bias;
+                VertexWeights &vertex = mesh.weights[i];
+                for (int k = 0; k < MAX_VERTEX_WEIGHTS; k++)
+                {
+                    bool used = k < count && total > 0.0f;
+                    vertex.weights[k] = used ? strongest[k].bias / total : 0.0f;
+                    vertex.joints[k] = used ? strongest[k].joint : 0;
+                }
+            }
+
+            // MD5 has no normals, average the faces around the vertices
+            for (Vertex &vertex : mesh.bind_vertices)
+                vertex.normal = Vector {0.0f, 0.0f, 0.0f};
+            for (size_t t = 0; t < mesh.indices.size(); t += 3)
+            {
+                Vertex &v0 = mesh.bind_vertices[mesh.indices[t]];
+                Vertex &v1 = mesh.bind_vertices[mesh.indices[t + 1]];
+                Vertex &v2 = mesh.bind_vertices[mesh.indices[t + 2]];
+                Vector normal = (v1.position - v0.position).discardH() *
+                    (v2.position - v0.position).discardH();
+                v0.normal += normal;
+                v1.normal += normal;
+                v2.normal += normal;
+            }
+            for (Vertex &vertex : mesh.bind_vertices)
+                if (vertex.normal.dot_product(vertex.normal) > 0.0f)
+                    vertex.normal = vertex.normal.normalize();
+            Mesh bind = {(int)mesh.bind_vertices.size(),
+                mesh.bind_vertices.data(), (int)mesh.indices.size() / 3,
+                mesh.indices.data(), nullptr};
+            compute_tangents(bind);
+        }
+
+        /* object space joints from joints relative to their parents */
+        void compose_joints(const std::vector<int> &parents, Joint *joints)
+        {
+            for (size_t j = 0; j < parents.size(); j++)
+            {
+                if (parents[j] < 0)
+                    continue;
+                const Joint &parent = joints[parents[j]];
+                joints[j].position = parent.position +
+                    rotate(parent.orientation, joints[j].position);
+                joints[j].orientation = multiply(parent.orientation,
+                        joints[j].orientation);
+            }
+        }
+
+        /* pose * inverse(bind) for every joint */
+        void build_palette(const Joint *bind, const Joint *pose, int count,
+                Bone *palette)
+        {
+            for (int j = 0; j < count; j++)
+            {
+                Quaternion q = multiply(pose[j].orientation,
+                        conjugate(bind[j].orientation));
+                Vector t = pose[j].position - rotate(q, bind[j].position);
+                float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+                float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+                float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+                float columns[4][4] = {
+                    {1.0f - 2.0f * (yy + zz), 2.0f * (xy + wz),
+                        2.0f * (xz - wy), 0.0f},
+                    {2.0f * (xy - wz), 1.0f - 2.0f * (xx + zz),
+                        2.0f * (yz + wx), 0.0f},
+                    {2.0f * (xz + wy), 2.0f * (yz - wx),
+                        1.0f - 2.0f * (xx + yy), 0.0f},
+                    {t.x(), t.y(), t.z(), 1.0f}
+                };
+                memcpy(palette[j].columns, columns, sizeof(columns));
+            }
+        }
+
+        void skin_vertices_scalar(const Bone *palette, const SkinnedMesh &mesh,
+                Vertex *vertices, int begin, int end)
+        {
+            for (int i = begin; i < end; i++)
+            {
+                const VertexWeights &w = mesh.weights[i];
+                const Vertex &bind = mesh.bind_vertices[i];
+                Vertex &vertex = vertices[i];
+                float c[4][4] = {};
+                for (int k = 0; k < MAX_VERTEX_WEIGHTS; k++)
+                {
+                    const Bone &bone = palette[w.joints[k]];
+                    for (int col = 0; col < 4; col++)
+                        for (int row = 0; row < 4; row++)
+                            c[col][row] += w.weights[k] *
+                                bone.columns[col][row];
+                }
+                for (int row = 0; row < 4; row++)
+                {
+                    auto transform = [&](const Vector &v) {
+                        return c[0][row] * v.x() + c[1][row] * v.y() +
+                            c[2][row] * v.z();
+                    };
+                    vertex.position.v[row] = transform(bind.position) +
+                        c[3][row];
+                    vertex.normal.v[row] = transform(bind.normal);
+                    vertex.tangent.v[row] = transform(bind.tangent);
+                }
+                vertex.tangent.v[3] = bind.tangent.h();
+                vertex.tex_coord = bind.tex_coord;
+            }
+        }
+
+#ifdef __SSE2__
+        /* the vertex bind moved by the blended columns c0 to c3 */
+        inline void store_skinned(__m128 c0, __m128 c1, __m128 c2, __m128 c3,
+                const Vertex &bind, Vertex &vertex)
+        {
+            auto transform = [&](const Vector &v) {
+                return _mm_add_ps(_mm_add_ps(
+                            _mm_mul_ps(c0, _mm_set1_ps(v.x())),
+                            _mm_mul_ps(c1, _mm_set1_ps(v.y()))),
+                        _mm_mul_ps(c2, _mm_set1_ps(v.z())));
+            };
+            _mm_storeu_ps(vertex.position.v,
+                    _mm_add_ps(transform(bind.position), c3));
+            _mm_storeu_ps(vertex.normal.v, transform(bind.normal));
+            _mm_storeu_ps(vertex.tangent.v, transform(bind.tangent));
+            vertex.tangent.v[3] = bind.tangent.h();
+            vertex.tex_coord = bind.tex_coord;
+        }
+
+        void skin_vertices_sse2(const Bone *palette, const SkinnedMesh &mesh,
+                Vertex *vertices, int begin, int end)
+        {
+            for (int i = begin; i < end; i++)
+            {
+                const VertexWeights &w = mesh.weights[i];
+                __m128 c0 = _mm_setzero_ps(), c1 = _mm_setzero_ps();
+                __m128 c2 = _mm_setzero_ps(), c3 = _mm_setzero_ps();
+                for (int k = 0; k < MAX_VERTEX_WEIGHTS; k++)
+                {
+                    const Bone &bone = palette[w.joints[k]];
+                    __m128 weight = _mm_set1_ps(w.weights[k]);
+                    c0 = _mm_add_ps(c0, _mm_mul_ps(weight,
+                                _mm_load_ps(bone.columns[0])));
+                    c1 = _mm_add_ps(c1, _mm_mul_ps(weight,
+                                _mm_load_ps(bone.columns[1])));
+                    c2 = _mm_add_ps(c2, _mm_mul_ps(weight,
+                                _mm_load_ps(bone.columns[2])));
+                    c3 = _mm_add_ps(c3, _mm_mul_ps(weight,
+                                _mm_load_ps(bone.columns[3])));
+                }
+                store_skinned(c0, c1, c2, c3, mesh.bind_vertices[i],
+                        vertices[i]);
+            }
+        }
+#endif
+
+#ifdef SSRE_X86_KERNELS
+        /* two columns per register halves the blending */
+        SSRE_TARGET("avx")
+        void skin_vertices_avx(const Bone *palette, const SkinnedMesh &mesh,
+                Vertex *vertices, int begin, int end)
+        {
+            for (int i = begin; i < end; i++)
+            {
+                const VertexWeights &w = mesh.weights[i];
+                __m256 c01 = _mm256_setzero_ps(), c23 = _mm256_setzero_ps();
+                for (int k = 0; k < MAX_VERTEX_WEIGHTS; k++)
+                {
+                    const Bone &bone = palette[w.joints[k]];
+                    __m256 weight = _mm256_set1_ps(w.weights[k]);
+                    c01 = _mm256_add_ps(c01, _mm256_mul_ps(weight,
+                                _mm256_loadu_ps(bone.columns[0])));
+                    c23 = _mm256_add_ps(c23, _mm256_mul_ps(weight,
+                                _mm256_loadu_ps(bone.columns[2])));
+                }
+                store_skinned(_mm256_castps256_ps128(c01),
+                        _mm256_extractf128_ps(c01, 1),
+                        _mm256_castps256_ps128(c23),
+                        _mm256_extractf128_ps(c23, 1),
+                        mesh.bind_vertices[i], vertices[i]);
+            }
+        }
+#endif
+    }
+
+    struct SkinnedModel
+    {
+        std::vector<std::string> joint_names;
+        std::vector<int> parents;
+        std::vector<internal::Joint> bind_pose;
+        std::vector<internal::SkinnedMesh> meshes;
+    };
+
+    struct SkeletalAnimation
+    {
+        int frame_count;
+        float frame_rate;
+        std::vector<int> parents;
+        // joints relative to their parents, frame after frame
+        std::vector<internal::Joint> frames;
+    };
+
+    struct SkinnedInstance
+    {
+        const SkinnedModel *model;
+        const SkeletalAnimation *animation = nullptr;
+        float time = 0.0f;
+        std::vector<std::vector<Vertex>> vertices;
+        std::vector<Mesh> meshes;
+        // filled by skin_instances
+        std::vector<internal::Bone> palette;
+    };
+
+    SkinnedModel *load_md5_model(const char *file)
+    {
+        using namespace internal;
+        Md5Reader reader(file);
+        SkinnedModel *model = new SkinnedModel;
+        try
+        {
+            while (!reader.done())
+            {
+                std::string key = reader.next();
+                if (key == "MD5Version")
+                {
+                    if (reader.integer() != 10)
+                        throw new std::runtime_error("unsupported md5 version");
+                }
+                else if (key == "commandline")
+                    reader.next();
+                else if (key == "numJoints" || key == "numMeshes")
+                    reader.integer();
+                else if (key == "joints")
+                {
+                    reader.expect("{");
+                    for (std::string name = reader.next(); name != "}";
+                            name = reader.next())
+                    {
+                        int parent = reader.integer();
+                        if (parent >= (int)model->parents.size())
+                            throw new std::runtime_error(
+                                    "md5 joint before its parent");
+                        Vector position = reader.triple();
+                        Vector q = reader.triple();
+                        Vector p = {position.x(), position.y(), position.z()};
+                        model->joint_names.push_back(name);
+                        model->parents.push_back(parent);
+                        model->bind_pose.push_back(Joint {p,
+                                unit_quaternion(q.x(), q.y(), q.z())});
+                    }
+                }
+                else if (key == "mesh")
+                {
+                    model->meshes.push_back(SkinnedMesh());
+                    read_md5_mesh(reader, model->bind_pose,
+                            model->meshes.back());
+                }
+                else
+                    throw new std::runtime_error("unknown md5 mesh key");
+            }
+        }
+        catch (...)
+        {
+            delete model;
+            throw;
+        }
+        return model;
+    }
+
+    void destroy_skinned_model(SkinnedModel *model)
+    {
+        delete model;
+    }
+
+    SkeletalAnimation *load_md5_animation(const char *file)
+    {
+        using namespace internal;
+        Md5Reader reader(file);
+        SkeletalAnimation *animation = new SkeletalAnimation;
+        try
+        {
+            int component_count = 0;
+            std::vector<int> flags, first_components;
+            std::vector<Joint> base;
+            animation->frame_count = 0;
+            animation->frame_rate = 24.0f;
+            while (!reader.done())
+            {
+                std::string key = reader.next();
+                if (key == "MD5Version")
+                {
+                    if (reader.integer() != 10)
+                        throw new std::runtime_error("unsupported md5 version");
+                }
+                else if (key == "commandline")
+                    reader.next();
+                else if (key == "numFrames")
+                    animation->frame_count = reader.integer();
+                else if (key == "numJoints")
+                    reader.integer();
+                else if (key == "frameRate")
+                    animation->frame_rate = reader.number();
+                else if (key == "numAnimatedComponents")
+                    component_count = reader.integer();
+                else if (key == "hierarchy")
+                {
+                    reader.expect("{");
+                    for (std::string name = reader.next(); name != "}";
+                            name = reader.next())
+                    {
+                        animation->parents.push_back(reader.integer());
+                        flags.push_back(reader.integer());
+                        first_components.push_back(reader.integer());
+                    }
+                }
+                else if (key == "bounds")
+                {
+                    reader.expect("{");
+                    for (std::string token = reader.next(); token != "}";
+                            token = reader.next())
+                        ;
+                }
+                else if (key == "baseframe")
+                {
+                    reader.expect("{");
+                    for (size_t j = 0; j < animation->parents.size(); j++)
+                    {
+                        Vector position = reader.triple();
+                        Vector q = reader.triple();
+                        base.push_back(Joint {position,
+                                unit_quaternion(q.x(), q.y(), q.z())});
+                    }
+                    reader.expect("}");
+                }
+                else if (key == "frame")
+                {
+                    int frame = reader.integer();
+                    int joint_count = (int)animation->parents.size();
+                    if (frame < 0 || frame >= animation->frame_count ||
+                            (int)base.size() != joint_count)
+                        throw new std::runtime_error("malformed md5 frame");
+                    std::vector<float> components(component_count);
+                    reader.expect("{");
+                    for (int k = 0; k < component_count; k++)
+                        components[k] = reader.number();
+                    reader.expect("}");
+
+                    // animated components replace the base frame in
+                    // the order x, y, z and then the quaternion
+                    animation->frames.resize(animation->frame_count *
+                            joint_count);
+                    Joint *joints = &animation->frames[frame * joint_count];
+                    for (int j = 0; j < joint_count; j++)
+                    {
+                        float values[6] = {base[j].position.x(),
+                            base[j].position.y(), base[j].position.z(),
+                            base[j].orientation.x, base[j].orientation.y,
+                            base[j].orientation.z};
+                        int next = first_components[j];
+                        for (int bit = 0; bit < 6; bit++)
+                            if (flags[j] & (1 << bit))
+                            {
+                                if (next < 0 || next >= component_count)
+                                    throw new std::runtime_error(
+                                            "md5 component out of range");
+                                values[bit] = components[next++];
+                            }
+                        joints[j].position = Vector {values[0], values[1],
+                            values[2]};
+                        joints[j].orientation = unit_quaternion(values[3],
+                                values[4], values[5]);
+                    }
+                }
+                else
+                    throw new std::runtime_error("unknown md5 animation key");
+            }
+            if (animation->frame_count < 1 || animation->frame_rate <= 0.0f ||
+                    (int)animation->frames.size() !=
+                    animation->frame_count * (int)animation->parents.size())
+                throw new std::runtime_error("incomplete md5 animation");
+        }
+        catch (...)
+        {
+            delete animation;
+            throw;
+        }
+        return animation;
+    }
+
+    void destroy_skeletal_animation(SkeletalAnimation *animation)
+    {
+        delete animation;
+    }
+
+    SkinnedInstance *create_skinned_instance(const SkinnedModel *model,
+            Material *material)
+    {
+        SkinnedInstance *instance = new SkinnedInstance;
+        instance->model = model;
+        instance->vertices.resize(model->meshes.size());
+        instance->palette.resize(model->bind_pose.size());
+        for (size_t i = 0; i < model->meshes.size(); i++)
+        {
+            const internal::SkinnedMesh &source = model->meshes[i];
+            instance->vertices[i] = source.bind_vertices;
+            // the indices are shared between instances, render_mesh
+            // only reads them
+            Mesh mesh = {(int)source.bind_vertices.size(),
+                instance->vertices[i].data(), (int)source.indices.size() / 3,
+                const_cast<int *>(source.indices.data()), material};
+            instance->meshes.push_back(mesh);
+        }
+        return instance;
+    }
+
+    void destroy_skinned_instance(SkinnedInstance *instance)
+    {
+        delete instance;
+    }
+
+    void pose_skinned_instance(SkinnedInstance *instance,
+            const SkeletalAnimation *animation, float time)
+    {
+        if (animation && animation->parents != instance->model->parents)
+            throw new std::invalid_argument(
+                    "animation does not match the skeleton");
+        instance->animation = animation;
+        instance->time = time;
+    }
+
+    int skinned_mesh_count(const SkinnedInstance *instance)
+    {
+        return (int)instance->meshes.size();
+    }
+
+    const Mesh &skinned_mesh(const SkinnedInstance *instance, int index)
+    {
+        return instance->meshes[index];
+    }
+
+    void skin_instances(SkinnedInstance *const instances[], int count)
+    {
+        using namespace internal;
+        // the pose of every instance, interpolated between two frames
+        parallel_for(0, count, 1, [&](int begin, int end) {
+            std::vector<Joint> pose;
+            for (int i = begin; i < end; i++)
+            {
+                SkinnedInstance *instance = instances[i];
+                const SkinnedModel *model = instance->model;
+                const SkeletalAnimation *animation = instance->animation;
+                int joint_count = (int)model->bind_pose.size();
+                if (!animation)
+                {
+                    build_palette(model->bind_pose.data(),
+                            model->bind_pose.data(), joint_count,
+                            instance->palette.data());
+                    continue;
+                }
+                float frame = instance->time * animation->frame_rate / 1000.0f;
+                frame -= std::floor(frame / animation->frame_count) *
+                    animation->frame_count;
+                int f0 = std::min((int)frame, animation->frame_count - 1);
+                int f1 = (f0 + 1) % animation->frame_count;
+                float t = frame - f0;
+                const Joint *j0 = &animation->frames[f0 * joint_count];
+                const Joint *j1 = &animation->frames[f1 * joint_count];
+                pose.resize(joint_count);
+                for (int j = 0; j < joint_count; j++)
+                {
+                    pose[j].position = j0[j].position +
+                        (j1[j].position - j0[j].position) * t;
+                    pose[j].orientation = slerp(j0[j].orientation,
+                            j1[j].orientation, t);
+                }
+                compose_joints(animation->parents, pose.data());
+                build_palette(model->bind_pose.data(), pose.data(),
+                        joint_count, instance->palette.data());
+            }
+        });
+
+        // vertices in chunks across all instances and meshes, so that a
+        // few large models spread over the workers as well
+        struct Chunk
+        {
+            SkinnedInstance *instance;
+            int mesh;
+            int begin, end;
+        };
+        std::vector<Chunk> chunks;
+        for (int i = 0; i < count; i++)
+            for (size_t m = 0; m < instances[i]->meshes.size(); m++)
+            {
+                int vertex_count = instances[i]->meshes[m].vertex_count;
+                for (int v = 0; v < vertex_count; v += SKINNING_CHUNK)
+                    chunks.push_back(Chunk {instances[i], (int)m, v,
+                            std::min(v + SKINNING_CHUNK, vertex_count)});
+            }
+        parallel_for(0, (int)chunks.size(), 1, [&](int begin, int end) {
+            for (int c = begin; c < end; c++)
+            {
+                const Chunk &chunk = chunks[c];
+                SkinnedInstance *instance = chunk.instance;
+                kernels.skin_vertices(instance->palette.data(),
+                        instance->model->meshes[chunk.mesh],
+                        instance->vertices[chunk.mesh].data(),
+                        chunk.begin, chunk.end);
+            }
+        });
+    }
+}
@@ -0,0 +1,190 @@
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    void enable_stencil_test()
+    {
+        internal::stencil_test_enabled = true;
+    }
+
+    void disable_stencil_test()
+    {
+        internal::stencil_test_enabled = false;
+    }
+
+    void stencil_func(CompareFunction func, uint8 ref, uint8 mask)
+    {
+        internal::stencil_state.func = func;
+        internal::stencil_state.reference = ref;
+        internal::stencil_state.mask = mask;
+    }
+
+    void stencil_write_mask(uint8 mask)
+    {
+        internal::stencil_state.write_mask = mask;
+    }
+
+    void stencil_op(PolygonFace face, StencilOperation sfail,
+            StencilOperation zfail, StencilOperation zpass)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            if ((i == 0 && face == BackFace) || (i == 1 && face == FrontFace))
+                continue;
+            StencilOperation *ops = internal::stencil_state.operations[i];
+            ops[0] = sfail;
+            ops[1] = zfail;
+            ops[2] = zpass;
+        }
+    }
+
+    void build_adjacency(const Mesh &mesh, int *adjacency)
+    {
+        // vertices are welded by position, so that seams in the normals
+        // or texture coordinates do not open the mesh
+        std::map<std::tuple<float, float, float>, int> positions;
+        std::vector<int> welded(mesh.vertex_count);
+        for (int i = 0; i < mesh.vertex_count; i++)
+        {
+            const Vector &p = mesh.vertices[i].position;
+            auto key = std::make_tuple(p.x(), p.y(), p.z());
+            auto it = positions.insert(std::make_pair(key, i)).first;
+            welded[i] = it->second;
+        }
+        // first half edge seen for every undirected edge
+        std::map<std::pair<int, int>, int> edges;
+        for (int i = 0; i < mesh.triangle_count * 3; i++)
+            adjacency[i] = -1;
+        for (int t = 0; t < mesh.triangle_count; t++)
+        {
+            for (int e = 0; e < 3; e++)
+            {
+                int v0 = welded[mesh.indices[t * 3 + e]];
+                int v1 = welded[mesh.indices[t * 3 + (e + 1) % 3]];
+                if (v0 == v1)
+                    continue;
+                auto key = std::make_pair(std::min(v0, v1), std::max(v0, v1));
+                auto it = edges.find(key);
+                if (it == edges.end())
+                {
+                    edges[key] = t * 3 + e;
+                    continue;
+                }
+                // edges shared by more than two triangles stay open
+                int other = it->second;
+                if (other < 0)
+                    continue;
+                adjacency[other] = t;
+                adjacency[t * 3 + e] = other / 3;
+                it->second = -1;
+            }
+        }
+    }
+
+    namespace internal
+    {
+        bool stencil_test_enabled = false;
+        StencilState stencil_state;
+
+        /* eye space polygon, possibly with points at infinity */
+        void render_volume_polygon(const Vector *points, int n)
+        {
+            Vector clipped[MAX_CLIP_VERTEX_COUNT];
+            for (int i = 0; i < n; i++)
+                clipped[i] = matrix_projection * points[i];
+            n = clip_homogeneous(clipped, n);
+            if (n < 3)
+                return;
+            float z_values[MAX_CLIP_VERTEX_COUNT];
+            RasterPolygon polygon;
+            polygon.count = n;
+            polygon.attribute_count = 1;
+            polygon.attributes = z_values;
+            for (int i = 0; i < n; i++)
+            {
+                // clipping keeps w >= |x|, only the very center of the
+                // view can end up exactly at infinity
+                Vector p = clipped[i];
+                p.v[3] = std::max(p.h(), 1e-6f);
+                p = matrix_view_port * p.divideH();
+                polygon.points[i] = to_subpixel(p);
+                z_values[i] = p.z();
+            }
+            bound_rows(polygon);
+            fill_stencil_polygon(polygon);
+        }
+    }
+
+    void render_shadow_volume(const Mesh &mesh, const int *adjacency,
+            int light_handle)
+    {
+        using namespace internal;
+        if (light_handle < 0 || light_handle >= buffer.lighting_source_count)
+            throw new std::invalid_argument("invalid light handle");
+        const LightingSource &light = buffer.lighting_sources[light_handle];
+        bool directional = light.type == DirectionalSource;
+
+        Vector *eye = buffer.arena.allocate<Vector>(mesh.vertex_count);
+        for (int i = 0; i < mesh.vertex_count; i++)
+        {
+            Vector p = mesh.vertices[i].position;
+            p.v[3] = 1.0f;
+            eye[i] = (matrix_model_view * p).divideH();
+        }
+        // points extruded away from the light to infinity
+        auto extrude = [&](const Vector &p) -> Vector {
+            Vector d = directional ? -light.direction : p - light.position;
+            return Vector {d.x(), d.y(), d.z(), 0.0f};
+        };
+
+        bool *facing = buffer.arena.allocate<bool>(mesh.triangle_count);
+        for (int t = 0; t < mesh.triangle_count; t++)
+        {
+            const int *index = mesh.indices + t * 3;
+            const Vector &a = eye[index[0]];
+            const Vector &b = eye[index[1]];
+            const Vector &c = eye[index[2]];
+            Vector normal = (b - a).discardH() * (c - a).discardH();
+            Vector to_light = directional ? light.direction :
+                light.position - a;
+            facing[t] = normal.dot_product(to_light.discardH()) > 0.0f;
+        }
+
+        for (int t = 0; t < mesh.triangle_count; t++)
+        {
+            if (!facing[t])
+                continue;
+            const int *index = mesh.indices + t * 3;
+            Vector points[4];
+            // the lit side closes the volume at the mesh, the back cap
+            // closes it at infinity, both facing outwards
+            for (int k = 0; k < 3; k++)
+                points[k] = eye[index[k]];
+            render_volume_polygon(points, 3);
+            for (int k = 0; k < 3; k++)
+                points[k] = extrude(eye[index[2 - k]]);
+            render_volume_polygon(points, 3);
+            // extrude the silhouette edges
+            for (int e = 0; e < 3; e++)
+            {
+                int neighbour = adjacency[t * 3 + e];
+                if (neighbour >= 0 && facing[neighbour])
+                    continue;
+                const Vector &v0 = eye[index[e]];
+                const Vector &v1 = eye[index[(e + 1) % 3]];
+                points[0] = v0;
+                points[1] = extrude(v0);
+                points[2] = extrude(v1);
+                points[3] = v1;
+                render_volume_polygon(points, 4);
+            }
+        }
+    }
+}
@@ -0,0 +1,407 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    namespace internal
+    {
+        enum StreamState
+        {
+            // waiting for or being decoded
+            StreamLoading,
+            StreamResident,
+            // dropped for the budget, decoded again on the next use
+            StreamEvicted,
+            StreamFailed,
+            StreamReleased
+        };
+
+        struct StreamedTexture
+        {
+            std::string file;
+            StreamState state;
+            Texture texture;
+            // the last frame it was handed out in
+            uint64 last_used;
+            // copies kept past the frame, by command buffers or materials
+            int pins;
+        };
+
+        struct DecodedTexture
+        {
+            int handle;
+            Texture texture;
+            bool failed;
+        };
+
+        /* shown while a texture is loading, grey like an untextured wall */
+        static uint32 placeholder_pixel = SSRE_ARGB(0xff, 0x80, 0x80, 0x80);
+        static const Texture placeholder = {1, 1, &placeholder_pixel};
+
+        /*
+         * decodes on its own threads, which also run the page reads of
+         * virtual textures. Decoded textures wait in a list until the
+         * next present, so that the pixels handed out during a frame
+         * stay valid for the whole frame
+         */
+        class TextureStreamer
+        {
+        public:
+            TextureStreamer() {}
+            ~TextureStreamer() { stop(); }
+            DISABLE_COPY_AND_ASSIGN(TextureStreamer);
+
+            void stop();
+            void set_thread_count(int count);
+            int stream(const char *file);
+            Texture get(int handle);
+            bool resident(int handle);
+            void release(int handle);
+            void pin(const Texture &texture);
+            void unpin(const Texture &texture);
+            void finish();
+            void update();
+            void run(const std::function<void()> &job);
+
+            size_t budget = 256 << 20;
+
+        private:
+            void start();
+            void work();
+            void decode(int handle, const std::string &file);
+            void queue(int handle);
+            StreamedTexture &entry(int handle);
+            void install(const DecodedTexture &decoded);
+            void free_pixels(StreamedTexture &texture);
+            void evict();
+
+            int thread_count = 0;
+            std::vector<std::thread> threads;
+            std::mutex mutex;
+            std::condition_variable work_ready;
+            std::condition_variable work_done;
+            bool stopping = false;
+            // jobs to run, and how many are taken but not done
+            std::deque<std::function<void()>> pending;
+            int running = 0;
+            std::vector<DecodedTexture> decoded;
+
+            // only touched by the rendering thread
+            std::vector<StreamedTexture> textures;
+            size_t resident_bytes = 0;
+            uint64 frame = 0;
+        };
+
+        void TextureStreamer::start()
+        {
+            int count = thread_count;
+            if (count <= 0)
+                count = std::max(1u, std::thread::hardware_concurrency() / 2);
+            stopping = false;
+            for (int i = 0; i < count; i++)
+                threads.push_back(std::thread(&TextureStreamer::work, this));
+        }
+
+        void TextureStreamer::stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            work_ready.notify_all();
+            for (std::thread &thread : threads)
+                thread.join();
+            threads.clear();
+        }
+
+        void TextureStreamer::set_thread_count(int count)
+        {
+            stop();
+            thread_count = count;
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!pending.empty())
+                start();
+        }
+
+        void TextureStreamer::work()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true)
+            {
+                work_ready.wait(lock, [&] {
+                    return stopping || !pending.empty();
+                });
+                if (stopping)
+                    return;
+                std::function<void()> job = std::move(pending.front());
+                pending.pop_front();
+                ++running;
+                lock.unlock();
+                job();
+                lock.lock();
+                if (--running == 0 && pending.empty())
+                    work_done.notify_all();
+            }
+        }
+
+        void TextureStreamer::decode(int handle, const std::string &file)
+        {
+            DecodedTexture result = {handle, {0, 0, nullptr}, false};
+            try
+            {
+                result.texture = load_external_texture_impl(file.c_str());
+            }
+            catch (std::exception *e)
+            {
+                delete e;
+                result.failed = true;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            decoded.push_back(result);
+        }
+
+        void TextureStreamer::run(const std::function<void()> &job)
+        {
+            if (threads.empty())
+                start();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending.push_back(job);
+            }
+            work_ready.notify_one();
+        }
+
+        void TextureStreamer::queue(int handle)
+        {
+            textures[handle].state = StreamLoading;
+            std::string file = textures[handle].file;
+            run([this, handle, file] { decode(handle, file); });
+        }
+
+        StreamedTexture &TextureStreamer::entry(int handle)
+        {
+            if (handle < 0 || handle >= (int)textures.size() ||
+                    textures[handle].state == StreamReleased)
+                throw new std::invalid_argument("invalid texture handle");
+            return textures[handle];
+        }
+
+        int TextureStreamer::stream(const char *file)
+        {
+            StreamedTexture texture = {file, StreamLoading,
+                {0, 0, nullptr}, frame, 0};
+            textures.push_back(texture);
+            int handle = textures.size() - 1;
+            queue(handle);
+            return handle;
+        }
+
+        Texture TextureStreamer::get(int handle)
+        {
+            StreamedTexture &texture = entry(handle);
+            texture.last_used = frame;
+            if (texture.state == StreamEvicted)
+                queue(handle);
+            return texture.state == StreamResident ? texture.texture :
+                placeholder;
+        }
+
+        bool TextureStreamer::resident(int handle)
+        {
+            return entry(handle).state == StreamResident;
+        }
+
+        void TextureStreamer::free_pixels(StreamedTexture &texture)
+        {
+            resident_bytes -= sizeof(uint32) * texture.texture.width *
+                texture.texture.height;
+            release_external_texture(texture.texture);
+        }
+
+        void TextureStreamer::release(int handle)
+        {
+            StreamedTexture &texture = entry(handle);
+            // pinned pixels go with the last unpin
+            if (texture.state == StreamResident && !texture.pins)
+                free_pixels(texture);
+            // a decode still running is dropped when it is installed
+            texture.state = StreamReleased;
+        }
+
+        void TextureStreamer::pin(const Texture &texture)
+        {
+            for (StreamedTexture &streamed : textures)
+                if (streamed.state == StreamResident &&
+                        streamed.texture.pixels == texture.pixels)
+                {
+                    streamed.pins++;
+                    return;
+                }
+        }
+
+        void TextureStreamer::unpin(const Texture &texture)
+        {
+            for (StreamedTexture &streamed : textures)
+                if (streamed.pins && streamed.texture.pixels == texture.pixels)
+                {
+                    if (--streamed.pins == 0 &&
+                            streamed.state == StreamReleased)
+                        free_pixels(streamed);
+                    return;
+                }
+        }
+
+        void TextureStreamer::install(const DecodedTexture &decoded)
+        {
+            StreamedTexture &texture = textures[decoded.handle];
+            Texture pixels = decoded.texture;
+            if (texture.state != StreamLoading)
+            {
+                release_external_texture(pixels);
+                return;
+            }
+            if (decoded.failed)
+            {
+                texture.state = StreamFailed;
+                return;
+            }
+            texture.texture = pixels;
+            texture.state = StreamResident;
+            resident_bytes += sizeof(uint32) * pixels.width * pixels.height;
+        }
+
+        /*
+         * least recently used first. Textures handed out in the frame
+         * just presented are kept even above the budget, dropping them
+         * would only decode them again for the next frame, and pinned
+         * ones are kept as their pixels are still referenced
+         */
+        void TextureStreamer::evict()
+        {
+            while (resident_bytes > budget)
+            {
+                StreamedTexture *oldest = nullptr;
+                for (StreamedTexture &texture : textures)
+                    if (texture.state == StreamResident && !texture.pins &&
+                            texture.last_used < frame && (!oldest ||
+                                texture.last_used < oldest->last_used))
+                        oldest = &texture;
+                if (!oldest)
+                    return;
+                free_pixels(*oldest);
+                oldest->state = StreamEvicted;
+            }
+        }
+
+        void TextureStreamer::update()
+        {
+            std::vector<DecodedTexture> ready;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ready.swap(decoded);
+            }
+            for (const DecodedTexture &texture : ready)
+                install(texture);
+            evict();
+            ++frame;
+        }
+
+        void TextureStreamer::finish()
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_done.wait(lock, [&] {
+                    return pending.empty() && running == 0;
+                });
+            }
+            std::vector<DecodedTexture> ready;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ready.swap(decoded);
+            }
+            for (const DecodedTexture &texture : ready)
+                install(texture);
+        }
+
+        static TextureStreamer streamer;
+
+        void update_streamed_textures()
+        {
+            streamer.update();
+        }
+
+        void stop_texture_decoding()
+        {
+            streamer.finish();
+            streamer.stop();
+        }
+
+        void run_on_decode_thread(const std::function<void()> &job)
+        {
+            streamer.run(job);
+        }
+
+        void pin_streamed_texture(const Texture &texture)
+        {
+            if (texture.pixels)
+                streamer.pin(texture);
+        }
+
+        void unpin_streamed_texture(const Texture &texture)
+        {
+            if (texture.pixels)
+                streamer.unpin(texture);
+        }
+    }
+
+    void set_texture_decode_thread_count(int count)
+    {
+        if (count < 0)
+            throw new std::invalid_argument("negative decode thread count");
+        internal::streamer.set_thread_count(count);
+    }
+
+    void set_texture_budget(size_t bytes)
+    {
+        internal::streamer.budget = bytes;
+    }
+
+    int stream_texture(const char *file)
+    {
+        return internal::streamer.stream(file);
+    }
+
+    Texture streamed_texture(int handle)
+    {
+        return internal::streamer.get(handle);
+    }
+
+    bool texture_resident(int handle)
+    {
+        return internal::streamer.resident(handle);
+    }
+
+    void enable_streamed_texture(int handle)
+    {
+        enable_texture(internal::streamer.get(handle));
+    }
+
+    void release_streamed_texture(int handle)
+    {
+        internal::streamer.release(handle);
+    }
+
+    void finish_texture_streaming()
+    {
+        internal::streamer.finish();
+    }
+}
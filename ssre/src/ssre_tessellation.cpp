@@ -0,0 +1,322 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    void enable_tessellation(const TessellationSettings &settings)
+    {
+        if (settings.max_level < 1)
+            throw new std::invalid_argument("invalid tessellation level");
+        if (settings.dnear < 0.0f || settings.dfar <= settings.dnear)
+            throw new std::invalid_argument("invalid tessellation distances");
+        internal::tessellation_settings = settings;
+        internal::tessellation_enabled = true;
+    }
+
+    void disable_tessellation()
+    {
+        internal::tessellation_enabled = false;
+    }
+
+    void tessellation_mode_flat()
+    {
+        internal::tessellation_mode = internal::FlatTessellation;
+    }
+
+    void tessellation_mode_pn_triangles()
+    {
+        internal::tessellation_mode = internal::PNTriangles;
+    }
+
+    namespace internal
+    {
+        bool tessellation_enabled = false;
+        TessellationMode tessellation_mode = FlatTessellation;
+        TessellationSettings tessellation_settings;
+
+        /* control vertices and patches handed to a worker at a time */
+        const int TESSELLATION_VERTEX_GRAIN = 256;
+        const int TESSELLATION_PATCH_GRAIN = 16;
+
+        /* segments of an edge from the eye distance of its middle */
+        int edge_level(const Vector &p0, const Vector &p1)
+        {
+            const TessellationSettings &s = tessellation_settings;
+            float distance = ((p0 + p1) * 0.5f).length();
+            float t = (s.dfar - distance) / (s.dfar - s.dnear);
+            t = std::min(std::max(t, 0.0f), 1.0f);
+            return 1 + (int)(t * (s.max_level - 1) + 0.5f);
+        }
+
+        /*
+         * weights of the corners x and y of an edge at parameter t from
+         * x, moved onto the points of the edge's own level. Counting from
+         * the lower index gives both patches sharing the edge the same
+         * points, so that finer patches do not open cracks next to it
+         */
+        void snap_edge(float t, int level, int index_x, int index_y,
+                float &wx, float &wy)
+        {
+            if (index_x > index_y)
+            {
+                snap_edge(1.0f - t, level, index_y, index_x, wy, wx);
+                return;
+            }
+            wy = std::floor(t * level + 0.5f) / level;
+            wx = 1.0f - wy;
+        }
+
+        /* a curved PN triangle, corners in eye space with unit normals */
+        struct PNPatch
+        {
+            Vector p[3], n[3];
+            // b210, b120, b021, b012, b102, b201 and b111
+            Vector cubic[7];
+            // n110, n011 and n101
+            Vector quadratic[3];
+
+            PNPatch(const Vertex *corners[3])
+            {
+                for (int k = 0; k < 3; k++)
+                {
+                    p[k] = corners[k]->position.discardH();
+                    n[k] = corners[k]->normal;
+                }
+                // project the thirds of the edges onto the tangent planes
+                // of the nearer corner
+                cubic[0] = edge_point(p[0], p[1], n[0]);
+                cubic[1] = edge_point(p[1], p[0], n[1]);
+                cubic[2] = edge_point(p[1], p[2], n[1]);
+                cubic[3] = edge_point(p[2], p[1], n[2]);
+                cubic[4] = edge_point(p[2], p[0], n[2]);
+                cubic[5] = edge_point(p[0], p[2], n[0]);
+                Vector e = (cubic[0] + cubic[1] + cubic[2] + cubic[3] +
+                        cubic[4] + cubic[5]) / 6.0f;
+                Vector v = (p[0] + p[1] + p[2]) / 3.0f;
+                cubic[6] = e + (e - v) * 0.5f;
+                quadratic[0] = edge_normal(p[0], p[1], n[0], n[1]);
+                quadratic[1] = edge_normal(p[1], p[2], n[1], n[2]);
+                quadratic[2] = edge_normal(p[2], p[0], n[2], n[0]);
+            }
+
+            static Vector edge_point(const Vector &pi, const Vector &pj,
+                    const Vector &ni)
+            {
+                return (pi * 2.0f + pj - ni * (pj - pi).dot_product(ni)) / 3.0f;
+            }
+
+            /* the average normal mirrored across the edge's normal plane */
+            static Vector edge_normal(const Vector &pi, const Vector &pj,
+                    const Vector &ni, const Vector &nj)
+            {
+                Vector d = pj - pi;
+                float length2 = d.dot_product(d);
+                float v = length2 > 0.0f ?
+                    2.0f * d.dot_product(ni + nj) / length2 : 0.0f;
+                Vector r = ni + nj - d * v;
+                return r.dot_product(r) > 0.0f ? r.normalize() : ni;
+            }
+
+            Vector position(float a, float b, float c) const
+            {
+                return p[0] * (a * a * a) + p[1] * (b * b * b) +
+                    p[2] * (c * c * c) +
+                    cubic[0] * (3.0f * a * a * b) +
+                    cubic[1] * (3.0f * a * b * b) +
+                    cubic[2] * (3.0f * b * b * c) +
+                    cubic[3] * (3.0f * b * c * c) +
+                    cubic[4] * (3.0f * a * c * c) +
+                    cubic[5] * (3.0f * a * a * c) +
+                    cubic[6] * (6.0f * a * b * c);
+            }
+
+            Vector normal(float a, float b, float c) const
+            {
+                return n[0] * (a * a) + n[1] * (b * b) + n[2] * (c * c) +
+                    quadratic[0] * (a * b) + quadratic[1] * (b * c) +
+                    quadratic[2] * (a * c);
+            }
+        };
+
+        Vertex blend_vertices(const Vertex *corners[3], float a, float b,
+                float c)
+        {
+            Vertex r;
+            r.position = corners[0]->position * a +
+                corners[1]->position * b + corners[2]->position * c;
+            r.normal = corners[0]->normal * a +
+                corners[1]->normal * b + corners[2]->normal * c;
+            r.tex_coord.u = corners[0]->tex_coord.u * a +
+                corners[1]->tex_coord.u * b + corners[2]->tex_coord.u * c;
+            r.tex_coord.v = corners[0]->tex_coord.v * a +
+                corners[1]->tex_coord.v * b + corners[2]->tex_coord.v * c;
+            r.tangent = corners[0]->tangent * a +
+                corners[1]->tangent * b + corners[2]->tangent * c;
+            return r;
+        }
+
+        /* snapped points are computed alike, so they compare exactly */
+        inline bool same_point(const Vector &p0, const Vector &p1)
+        {
+            return p0.x() == p1.x() && p0.y() == p1.y() && p0.z() == p1.z();
+        }
+
+        /* index of the grid point i rows towards corner 2, j towards 1 */
+        inline int grid_index(int n, int i, int j)
+        {
+            return i * (n + 1) - i * (i - 1) / 2 + j;
+        }
+
+        /*
+         * splits a patch into level * level triangles, writes its
+         * vertices and returns the count of non degenerate triangles
+         */
+        int tessellate_patch(const Vertex *corners[3], const int indices[3],
+                const int levels[3], int level, Vertex *vertices,
+                int *triangles, int first_vertex)
+        {
+            bool curved = tessellation_mode == PNTriangles;
+            PNPatch patch(corners);
+            for (int i = 0; i <= level; i++)
+                for (int j = 0; j <= level - i; j++)
+                {
+                    float c = (float)i / level;
+                    float b = (float)j / level;
+                    float a = 1.0f - b - c;
+                    // points on the border follow their edge's level
+                    if (i == 0)
+                        snap_edge(b, levels[0], indices[0], indices[1], a, b);
+                    else if (j == level - i)
+                    {
+                        snap_edge(c, levels[1], indices[1], indices[2], b, c);
+                        a = 0.0f;
+                    }
+                    else if (j == 0)
+                        snap_edge(c, levels[2], indices[0], indices[2], a, c);
+                    Vertex &vertex = vertices[grid_index(level, i, j)];
+                    vertex = blend_vertices(corners, a, b, c);
+                    if (curved)
+                    {
+                        Vector p = patch.position(a, b, c);
+                        vertex.position = Vector {p.x(), p.y(), p.z(), 1.0f};
+                        vertex.normal = patch.normal(a, b, c);
+                    }
+                }
+
+            int count = 0;
+            auto emit = [&](int v0, int v1, int v2) {
+                // snapping folds some triangles along the border
+                const Vector &p0 = vertices[v0].position;
+                const Vector &p1 = vertices[v1].position;
+                const Vector &p2 = vertices[v2].position;
+                if (same_point(p0, p1) || same_point(p1, p2) ||
+                        same_point(p2, p0))
+                    return;
+                int *t = triangles + count++ * 3;
+                t[0] = first_vertex + v0;
+                t[1] = first_vertex + v1;
+                t[2] = first_vertex + v2;
+            };
+            for (int i = 0; i < level; i++)
+                for (int j = 0; j < level - i; j++)
+                {
+                    emit(grid_index(level, i, j), grid_index(level, i, j + 1),
+                            grid_index(level, i + 1, j));
+                    if (j < level - i - 1)
+                        emit(grid_index(level, i, j + 1),
+                                grid_index(level, i + 1, j + 1),
+                                grid_index(level, i + 1, j));
+                }
+            return count;
+        }
+
+        void render_tessellated_mesh(const Mesh &mesh)
+        {
+            // control points in eye space
+            Vertex *eye = buffer.arena.allocate<Vertex>(mesh.vertex_count);
+            bool normal_mapped = material_normal_map(*mesh.material);
+            parallel_for(0, mesh.vertex_count, TESSELLATION_VERTEX_GRAIN,
+                    [&](int begin, int end) {
+                for (int i = begin; i < end; i++)
+                {
+                    const Vertex &vertex = mesh.vertices[i];
+                    Vertex &r = eye[i];
+                    r.position = (matrix_model_view *
+                            vertex.position).divideH();
+                    Vector normal = (model_view_inverse_transpose *
+                            vertex.normal).discardH();
+                    r.normal = normal.dot_product(normal) > 0.0f ?
+                        normal.normalize() : normal;
+                    r.tex_coord = vertex.tex_coord;
+                    r.tangent = vertex.tangent;
+                    if (normal_mapped)
+                    {
+                        const Vector &t0 = vertex.tangent;
+                        Vector t = matrix_model_view *
+                            Vector {t0.x(), t0.y(), t0.z(), 0.0f};
+                        r.tangent = Vector {t.x(), t.y(), t.z(), t0.h()};
+                    }
+                }
+            });
+
+            // levels, and where the output of every patch goes
+            int patch_count = mesh.triangle_count;
+            int *levels = buffer.arena.allocate<int>(patch_count * 4);
+            int *vertex_offsets = buffer.arena.allocate<int>(patch_count + 1);
+            int *triangle_offsets = buffer.arena.allocate<int>(patch_count + 1);
+            vertex_offsets[0] = triangle_offsets[0] = 0;
+            for (int t = 0; t < patch_count; t++)
+            {
+                const int *index = mesh.indices + t * 3;
+                int *level = levels + t * 4;
+                for (int e = 0; e < 3; e++)
+                    level[e] = edge_level(eye[index[e]].position.discardH(),
+                            eye[index[(e + 1) % 3]].position.discardH());
+                level[3] = std::max(level[0], std::max(level[1], level[2]));
+                vertex_offsets[t + 1] = vertex_offsets[t] +
+                    (level[3] + 1) * (level[3] + 2) / 2;
+                triangle_offsets[t + 1] = triangle_offsets[t] +
+                    level[3] * level[3];
+            }
+            Vertex *vertices = buffer.arena.allocate<Vertex>(
+                    vertex_offsets[patch_count]);
+            int *triangles = buffer.arena.allocate<int>(
+                    triangle_offsets[patch_count] * 3);
+            int *triangle_counts = buffer.arena.allocate<int>(patch_count);
+
+            parallel_for(0, patch_count, TESSELLATION_PATCH_GRAIN,
+                    [&](int begin, int end) {
+                for (int t = begin; t < end; t++)
+                {
+                    const int *index = mesh.indices + t * 3;
+                    const Vertex *corners[3] = {&eye[index[0]],
+                        &eye[index[1]], &eye[index[2]]};
+                    triangle_counts[t] = tessellate_patch(corners, index,
+                            levels + t * 4, levels[t * 4 + 3],
+                            vertices + vertex_offsets[t],
+                            triangles + triangle_offsets[t] * 3,
+                            vertex_offsets[t]);
+                }
+            });
+
+            // the rest of the pipeline goes a polygon at a time
+            Polygon polygon;
+            polygon.count = 3;
+            polygon.material = mesh.material;
+            for (int t = 0; t < patch_count; t++)
+            {
+                const int *triangle = triangles + triangle_offsets[t] * 3;
+                for (int k = 0; k < triangle_counts[t]; k++, triangle += 3)
+                {
+                    for (int v = 0; v < 3; v++)
+                        polygon.vertices[v] = &vertices[triangle[v]];
+                    InternalPolygon internal_polygon(polygon);
+                    render_eye_polygon(internal_polygon);
+                }
+            }
+        }
+    }
+}
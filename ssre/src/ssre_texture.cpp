@@ -1,3 +1,6 @@
+#ifdef __SSE2__
+#include "internal/ssre_intrinsics.h"
+#endif
 #include "internal/ssre_internal.h"
 
 namespace ssre 
@@ -24,27 +27,115 @@ namespace ssre
         }
 
         uint32 get_texture_color(float u, float v)
+        {
+            return sample_texture(texture, u, v);
+        }
+
+        /*
+         * the four texels around u, v, top left, top right, bottom left
+         * and bottom right, and the fractions between them. Texels past
+         * the last row or column are black
+         */
+        inline void bilinear_texels(const Texture &texture, float u, float v,
+                uint32 *c, float &ur, float &vr)
         {
             u = u * (texture.width - 1);
             v = v * (texture.height - 1);
             int x = (int)u, y = (int)v;
-            uint32 *cl0 = &texture.pixels[y * texture.width + x];
-            uint32 *cl1 = cl0 + texture.width;
-            uint32 c0 = cl0[0], c1 = 0, c2 = 0, c3 = 0;
+            const uint32 *cl0 = &texture.pixels[y * texture.width + x];
+            const uint32 *cl1 = cl0 + texture.width;
+            c[0] = cl0[0];
+            c[1] = c[2] = c[3] = 0;
             if (x + 1 < texture.width)
-                c1 = cl0[1];
+                c[1] = cl0[1];
             if (y + 1 < texture.height)
             {
-                c2 = cl1[0];
+                c[2] = cl1[0];
                 if (x + 1 < texture.width)
-                    c3 = cl1[1];
+                    c[3] = cl1[1];
             }
+            ur = u - x;
+            vr = v - y;
+        }
+
+        uint32 sample_texture_scalar(const Texture &texture, float u, float v)
+        {
+            uint32 c[4];
+            float ur, vr;
+            bilinear_texels(texture, u, v, c, ur, vr);
+            return merge_color(merge_color(c[0], c[1], ur), 
+                    merge_color(c[2], c[3], ur), vr);
+        }
+
+#ifdef __SSE2__
+        /*
+         * merge_color of channels over [0, 1] in every lane, truncated
+         * to bytes like it
+         */
+        inline __m128i merge_channels(__m128 c0, __m128 c1, __m128 ratio)
+        {
+            __m128 c = _mm_add_ps(_mm_mul_ps(c0,
+                        _mm_sub_ps(_mm_set1_ps(1.0f), ratio)),
+                    _mm_mul_ps(c1, ratio));
+            return _mm_cvttps_epi32(_mm_mul_ps(c, _mm_set1_ps(255.0f)));
+        }
 
-            float ur = u - x, vr = v - y;
-            return merge_color(merge_color(c0, c1, ur), 
-                    merge_color(c2, c3, ur), vr);
-            return *cl0;
+        inline __m128 byte_channels(__m128i c)
+        {
+            return _mm_div_ps(_mm_cvtepi32_ps(c), _mm_set1_ps(255.0f));
+        }
+
+        inline __m128 texel_channels(uint32 c)
+        {
+            __m128i zero = _mm_setzero_si128();
+            return byte_channels(_mm_unpacklo_epi16(_mm_unpacklo_epi8(
+                            _mm_cvtsi32_si128(c), zero), zero));
+        }
+
+        inline uint32 pack_channels(__m128i c)
+        {
+            c = _mm_packs_epi32(c, c);
+            return _mm_cvtsi128_si32(_mm_packus_epi16(c, c));
+        }
+
+        uint32 sample_texture_sse2(const Texture &texture, float u, float v)
+        {
+            uint32 c[4];
+            float ur, vr;
+            bilinear_texels(texture, u, v, c, ur, vr);
+            __m128 r = _mm_set1_ps(ur);
+            __m128i top = merge_channels(texel_channels(c[0]),
+                    texel_channels(c[1]), r);
+            __m128i bottom = merge_channels(texel_channels(c[2]),
+                    texel_channels(c[3]), r);
+            return pack_channels(merge_channels(byte_channels(top),
+                        byte_channels(bottom), _mm_set1_ps(vr)));
+        }
+#endif
+
+#ifdef SSRE_X86_KERNELS
+        /* both rows at once, the top one in the low half */
+        SSRE_TARGET("avx2")
+        uint32 sample_texture_avx2(const Texture &texture, float u, float v)
+        {
+            uint32 c[4];
+            float ur, vr;
+            bilinear_texels(texture, u, v, c, ur, vr);
+            const __m256 scale = _mm256_set1_ps(255.0f);
+            __m256 left = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+                            _mm_setr_epi32(c[0], c[2], 0, 0))), scale);
+            __m256 right = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+                            _mm_setr_epi32(c[1], c[3], 0, 0))), scale);
+            __m256 r = _mm256_set1_ps(ur);
+            __m256 rows = _mm256_add_ps(_mm256_mul_ps(left,
+                        _mm256_sub_ps(_mm256_set1_ps(1.0f), r)),
+                    _mm256_mul_ps(right, r));
+            rows = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvttps_epi32(
+                            _mm256_mul_ps(rows, scale))), scale);
+            return pack_channels(merge_channels(_mm256_castps256_ps128(rows),
+                        _mm256_extractf128_ps(rows, 1), _mm_set1_ps(vr)));
         }
+#endif
 
         uint8 modulate_color_component(uint8 c0, uint8 c1)
         {
@@ -73,6 +164,7 @@ namespace ssre
     void enable_texture(const Texture &texture)
     {
         internal::texture = texture;
+        internal::virtual_texture = nullptr;
         internal::texture_enabled = true;
     }
 
@@ -0,0 +1,243 @@
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    namespace internal
+    {
+        /*
+         * set on worker threads, and on the calling thread while it runs
+         * its chunks, so that nested parallel_for runs inline
+         */
+        static thread_local bool inside_worker = false;
+
+        /*
+         * the chunks [front, back) of a job left to one thread. The owner
+         * takes them from the front, in order, and idle threads steal
+         * from the back
+         */
+        struct WorkQueue
+        {
+            std::mutex mutex;
+            int front = 0;
+            int back = 0;
+            // keeps the queues of two threads off one cache line
+            char padding[64];
+        };
+
+        class WorkerPool
+        {
+        public:
+            WorkerPool() {}
+            ~WorkerPool() { stop(); }
+            DISABLE_COPY_AND_ASSIGN(WorkerPool);
+
+            void start(int count);
+            void stop();
+            bool started() const { return running; }
+            int size() const { return (int)threads.size() + 1; }
+            void run(int begin, int end, int grain, const RangeFunction &func);
+
+        private:
+            void worker(int index, uint64 seen);
+            void run_chunks(int index);
+            bool pop(int index, int &chunk);
+            bool steal(int index);
+
+            std::vector<std::thread> threads;
+            // one per thread, the calling thread first
+            std::unique_ptr<WorkQueue[]> queues;
+            std::mutex mutex;
+            std::condition_variable job_ready;
+            std::condition_variable job_done;
+            bool running = false;
+            bool stopping = false;
+            uint64 generation = 0;
+            int active = 0;
+
+            // the job currently executed
+            const RangeFunction *job = nullptr;
+            int job_begin = 0;
+            int job_end = 0;
+            int job_grain = 1;
+        };
+
+        void WorkerPool::start(int count)
+        {
+            stop();
+            stopping = false;
+            running = true;
+            queues.reset(new WorkQueue[count]);
+            // the calling thread takes part in every job. New workers start
+            // from the current generation, which the threads of an earlier
+            // start already ran
+            for (int i = 1; i < count; i++)
+                threads.push_back(std::thread(&WorkerPool::worker, this, i,
+                        generation));
+        }
+
+        void WorkerPool::stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            job_ready.notify_all();
+            for (std::thread &thread : threads)
+                thread.join();
+            threads.clear();
+            running = false;
+        }
+
+        bool WorkerPool::pop(int index, int &chunk)
+        {
+            WorkQueue &queue = queues[index];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.front == queue.back)
+                return false;
+            chunk = queue.front++;
+            return true;
+        }
+
+        /* moves the back half of another queue to an empty own queue */
+        bool WorkerPool::steal(int index)
+        {
+            int count = size();
+            for (int i = 1; i < count; i++)
+            {
+                WorkQueue &victim = queues[(index + i) % count];
+                int front, back;
+                {
+                    std::lock_guard<std::mutex> lock(victim.mutex);
+                    if (victim.front == victim.back)
+                        continue;
+                    back = victim.back;
+                    front = back - (back - victim.front + 1) / 2;
+                    victim.back = front;
+                }
+                WorkQueue &queue = queues[index];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.front = front;
+                queue.back = back;
+                return true;
+            }
+            return false;
+        }
+
+        void WorkerPool::run_chunks(int index)
+        {
+            int chunk;
+            while (pop(index, chunk) || (steal(index) && pop(index, chunk)))
+            {
+                int begin = job_begin + chunk * job_grain;
+                (*job)(begin, std::min(begin + job_grain, job_end));
+            }
+        }
+
+        void WorkerPool::worker(int index, uint64 seen)
+        {
+            inside_worker = true;
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    job_ready.wait(lock, [&] {
+                        return stopping || generation != seen;
+                    });
+                    if (stopping)
+                        return;
+                    seen = generation;
+                }
+                run_chunks(index);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (--active == 0)
+                        job_done.notify_one();
+                }
+            }
+        }
+
+        void WorkerPool::run(int begin, int end, int grain,
+                const RangeFunction &func)
+        {
+            // every thread starts on a contiguous share of the chunks,
+            // which keeps neighbouring chunks on the same core
+            int count = size();
+            int chunks = (end - begin + grain - 1) / grain;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                job = &func;
+                job_begin = begin;
+                job_end = end;
+                job_grain = grain;
+                for (int i = 0; i < count; i++)
+                {
+                    std::lock_guard<std::mutex> queue_lock(queues[i].mutex);
+                    queues[i].front = (int)((int64)chunks * i / count);
+                    queues[i].back = (int)((int64)chunks * (i + 1) / count);
+                }
+                active = (int)threads.size();
+                ++generation;
+            }
+            job_ready.notify_all();
+            // the pool is busy with this job until every chunk is done
+            inside_worker = true;
+            run_chunks(0);
+            inside_worker = false;
+            std::unique_lock<std::mutex> lock(mutex);
+            job_done.wait(lock, [&] { return active == 0; });
+            job = nullptr;
+        }
+
+        static WorkerPool pool;
+        static int requested_thread_count = 0;
+        static int thread_processes = 1;
+
+        int worker_count()
+        {
+            if (!pool.started())
+            {
+                int count = requested_thread_count;
+                if (count <= 0)
+                    count = std::max(1u, std::thread::hardware_concurrency() /
+                            thread_processes);
+                pool.start(count);
+            }
+            return pool.size();
+        }
+
+        void share_worker_threads(int processes)
+        {
+            pool.stop();
+            thread_processes = processes;
+        }
+
+        void parallel_for(int begin, int end, int grain,
+                const RangeFunction &func)
+        {
+            if (begin >= end)
+                return;
+            grain = std::max(1, grain);
+            if (inside_worker || end - begin <= grain || worker_count() == 1)
+            {
+                func(begin, end);
+                return;
+            }
+            pool.run(begin, end, grain, func);
+        }
+    }
+
+    void set_worker_thread_count(int count)
+    {
+        if (count < 0)
+            throw new std::invalid_argument("negative worker thread count");
+        internal::requested_thread_count = count;
+        internal::pool.stop();
+    }
+}
@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <cmath>
+#include <vector>
 #include "ssre.h"
 #include "internal/ssre_internal.h"
 
@@ -10,6 +12,7 @@ namespace ssre
         Matrix model_view_inverse_transpose;
         Matrix matrix_projection;
         Matrix matrix_view_port;
+        Matrix window_view_port;
     }
 
     void multiply_matrix_model_view(const Matrix &m)
@@ -91,7 +94,7 @@ namespace ssre
     {
         load_identity_model_view();
         load_identity_projection();
-        view_port(0, 0, internal::window_width, internal::window_height);
+        view_port(0, 0, internal::output_width, internal::output_height);
     }
 
     void view_look_at(
@@ -99,20 +102,9 @@ namespace ssre
             float xref, float yref, float zref,
             float vx, float vy, float vz)
     {
-        Vector f = Vector {xref - x0, yref - y0, zref - z0}.normalize();
-        Vector up = {vx, vy, vz};
-        Vector s = (f * up).normalize();
-        Vector u = s * f;
-
-        Matrix m = {{
-            {s.x(), s.y(), s.z(), 0.0f},
-            {u.x(), u.y(), u.z(), 0.0f},
-            {-f.x(), -f.y(), -f.z(), 0.0f},
-            {0.0f, 0.0f, 0.0f, 1.0f}
-        }};
-
-        multiply_matrix_model_view(m);
-        translate(-x0, -y0, -z0);
+        multiply_matrix_model_view(internal::look_at_matrix(
+                    Vector {x0, y0, z0}, Vector {xref, yref, zref},
+                    Vector {vx, vy, vz}));
     }
 
     void project_ortho(
@@ -120,59 +112,265 @@ namespace ssre
             float ymin, float ymax,
             float dnear, float dfar)
     {
-        float zn = -dnear, zf = -dfar;
-        multiply_projection_matrix(Matrix {{
-            {2.0f / (xmax - xmin), 0.0f, 0.0f, -(xmax + xmin) / (xmax - xmin)},
-            {0.0f, 2.0f / (ymax - ymin), 0.0f, -(ymax + ymin) / (ymax - ymin)},
-            {0.0f, 0.0f, -2.0f / (zn - zf), (zn + zf) / (zn - zf)},
-            {0.0f, 0.0f, 0.0f, 1.0f}
-        }});
+        multiply_projection_matrix(internal::ortho_matrix(
+                    xmin, xmax, ymin, ymax, dnear, dfar));
     }
 
     void project_perspective(
             float theta, float aspect,
             float dnear, float dfar)
     {
-        float zn = -dnear, zf = -dfar;
-        float cot = 1.0f / tan(theta / 2.0f * M_PI / 180.0f);
+        multiply_projection_matrix(internal::perspective_matrix(
+                    theta, aspect, dnear, dfar));
+    }
 
-        multiply_projection_matrix(Matrix {{
-            {cot / aspect, 0.0f, 0.0f, 0.0f},
-            {0.0f, cot, 0.0f, 0.0f},
-            {0.0f, 0.0f, (zn + zf) / (zn - zf), -2.0f * zn * zf / (zn - zf)},
-            {0.0f, 0.0f, -1.0f, 0.0f}
-        }});
+    namespace internal
+    {
+        Matrix look_at_matrix(const Vector &eye, const Vector &ref,
+                const Vector &up)
+        {
+            Vector f = (ref - eye).discardH().normalize();
+            Vector s = (f * up).normalize();
+            Vector u = s * f;
+
+            Matrix m = {{
+                {s.x(), s.y(), s.z(), 0.0f},
+                {u.x(), u.y(), u.z(), 0.0f},
+                {-f.x(), -f.y(), -f.z(), 0.0f},
+                {0.0f, 0.0f, 0.0f, 1.0f}
+            }};
+            return m * Matrix {{
+                {1.0f, 0.0f, 0.0f, -eye.x()},
+                {0.0f, 1.0f, 0.0f, -eye.y()},
+                {0.0f, 0.0f, 1.0f, -eye.z()},
+                {0.0f, 0.0f, 0.0f, 1.0f}
+            }};
+        }
+
+        Matrix ortho_matrix(float xmin, float xmax, float ymin, float ymax,
+                float dnear, float dfar)
+        {
+            float zn = -dnear, zf = -dfar;
+            return Matrix {{
+                {2.0f / (xmax - xmin), 0.0f, 0.0f, -(xmax + xmin) / (xmax - xmin)},
+                {0.0f, 2.0f / (ymax - ymin), 0.0f, -(ymax + ymin) / (ymax - ymin)},
+                {0.0f, 0.0f, -2.0f / (zn - zf), (zn + zf) / (zn - zf)},
+                {0.0f, 0.0f, 0.0f, 1.0f}
+            }};
+        }
+
+        Matrix perspective_matrix(float theta, float aspect,
+                float dnear, float dfar)
+        {
+            float zn = -dnear, zf = -dfar;
+            float cot = 1.0f / tan(theta / 2.0f * M_PI / 180.0f);
+            return Matrix {{
+                {cot / aspect, 0.0f, 0.0f, 0.0f},
+                {0.0f, cot, 0.0f, 0.0f},
+                {0.0f, 0.0f, (zn + zf) / (zn - zf), -2.0f * zn * zf / (zn - zf)},
+                {0.0f, 0.0f, -1.0f, 0.0f}
+            }};
+        }
+
+        Matrix view_port_matrix(int vp_xmin, int vp_ymin,
+                int vp_width, int vp_height)
+        {
+            int xmin = vp_xmin, xmax = vp_xmin + vp_width;
+            int ymin = vp_ymin, ymax = vp_ymin + vp_height;
+            return Matrix {{
+                {(xmax - xmin) / 2.0f, 0.0f, 0.0f, (xmax + xmin) / 2.0f},
+                {0.0f, (ymax - ymin) / 2.0f, 0.0f, (ymax + ymin) / 2.0f},
+                {0.0f, 0.0f, 1 / 2.0f, 1 / 2.0f},
+                {0.0f, 0.0f, 0.0f, 1.0f}
+            }};
+        }
     }
 
-    void view_port(int vp_xmin, int vp_ymin, int vp_width, int vp_height)
+    namespace internal
     {
-        int xmin = vp_xmin, xmax = vp_xmin + vp_width;
-        int ymin = vp_ymin, ymax = vp_ymin + vp_height;
-        internal::matrix_view_port = {{
-            {(xmax - xmin) / 2.0f, 0.0f, 0.0f, (xmax + xmin) / 2.0f},
-            {0.0f, (ymax - ymin) / 2.0f, 0.0f, (ymax + ymin) / 2.0f},
-            {0.0f, 0.0f, 1 / 2.0f, 1 / 2.0f},
-            {0.0f, 0.0f, 0.0f, 1.0f}
-        }};
+        Matrix render_view_port(const Matrix &view_port)
+        {
+            float sx = output_width ? (float)window_width / output_width : 1.0f;
+            float sy = output_height ?
+                (float)window_height / output_height : 1.0f;
+            return Matrix {{
+                {sx, 0.0f, 0.0f, 0.0f},
+                {0.0f, sy, 0.0f, 0.0f},
+                {0.0f, 0.0f, 1.0f, 0.0f},
+                {0.0f, 0.0f, 0.0f, 1.0f}
+            }} * view_port;
+        }
+
+        void update_view_port()
+        {
+            matrix_view_port = render_view_port(window_view_port);
+        }
     }
 
-    void transform_positions(internal::InternalPolygon &polygon, const Matrix &matrix)
+    void view_port(int vp_xmin, int vp_ymin, int vp_width, int vp_height)
     {
-        for (int i = 0; i < polygon.count; i++)
-            polygon.vertices[i].position = 
-                (matrix * polygon.vertices[i].position).divideH();
+        internal::window_view_port = internal::view_port_matrix(
+                vp_xmin, vp_ymin, vp_width, vp_height);
+        internal::update_view_port();
     }
 
-    void transform_normals(internal::InternalPolygon &polygon, const Matrix &matrix)
+    namespace internal
     {
-        for (int i = 0; i < polygon.count; i++)
-            polygon.vertices[i].normal =
-                (matrix * polygon.vertices[i].normal).discardH();
-        polygon.normal =(matrix * polygon.normal).discardH();
+        void transform_positions(InternalPolygon &polygon, const Matrix &matrix)
+        {
+            for (int i = 0; i < polygon.count; i++)
+                polygon.vertices[i].position = 
+                    (matrix * polygon.vertices[i].position).divideH();
+        }
+
+        void transform_normals(InternalPolygon &polygon, const Matrix &matrix)
+        {
+            for (int i = 0; i < polygon.count; i++)
+                polygon.vertices[i].normal =
+                    (matrix * polygon.vertices[i].normal).discardH();
+            polygon.normal =(matrix * polygon.normal).discardH();
+        }
+
+        void project_positions(InternalPolygon &polygon)
+        {
+            for (int i = 0; i < polygon.count; i++)
+            {
+                InternalVertex &vertex = polygon.vertices[i];
+                Vector p = matrix_projection * vertex.position;
+                vertex.inverse_w = 1.0f / p.h();
+                vertex.position = Vector {p.x() * vertex.inverse_w,
+                    p.y() * vertex.inverse_w, p.z() * vertex.inverse_w, 1.0f};
+            }
+        }
+
+        void transform_tangents(InternalPolygon &polygon, const Matrix &matrix)
+        {
+            // tangents follow the surface like positions, without the
+            // translation, and keep their handedness
+            for (int i = 0; i < polygon.count; i++)
+            {
+                Vector &t = polygon.vertices[i].tangent;
+                Vector r = (matrix * Vector {t.x(), t.y(), t.z(), 0.0f});
+                t = Vector {r.x(), r.y(), r.z(), t.h()};
+            }
+        }
     }
 
     namespace internal
     {
+        bool assemble_polygon(InternalPolygon &polygon)
+        {
+            if (culling_enabled && culling(polygon))
+                return false;
+            compute_lighting_color(polygon);
+            project_positions(polygon);
+            if (clipping_enabled && clipping(polygon))
+                return false;
+            transform_positions(polygon, matrix_view_port);
+            return true;
+        }
+
+        void render_eye_polygon(InternalPolygon &polygon)
+        {
+            if (shadow_pass)
+            {
+                render_shadow_polygon(polygon);
+                return;
+            }
+            if (assemble_polygon(polygon))
+                rasterize_polygon(polygon);
+        }
+
+        /* mesh vertices and triangles handed to a worker at a time */
+        const int VERTEX_GRAIN = 2048;
+        const int TRIANGLE_GRAIN = 512;
+        /* triangles assembled ahead of the rasterizer */
+        const int MESH_BATCH_TRIANGLES = 1 << 12;
+
+        /* the assembled polygons of a chunk, their vertices back to back */
+        struct TriangleBin
+        {
+            std::vector<InternalVertex> vertices;
+            std::vector<int> counts;
+        };
+
+        /*
+         * the mesh is transformed and its triangles assembled in chunks
+         * on the workers. Every chunk keeps what is left of its
+         * triangles in its own bin, and the bins are rasterized in
+         * order on this thread, so the pixels do not depend on the
+         * number of workers
+         */
+        void render_mesh_triangles(const Mesh &mesh)
+        {
+            std::vector<Vertex> eye(mesh.vertex_count);
+            parallel_for(0, mesh.vertex_count, VERTEX_GRAIN,
+                    [&](int begin, int end) {
+                transform_vertices(matrix_model_view,
+                        model_view_inverse_transpose, mesh.vertices + begin,
+                        &eye[begin], end - begin);
+            });
+
+            Polygon polygon;
+            polygon.count = 3;
+            polygon.material = mesh.material;
+            if (shadow_pass)
+            {
+                for (int t = 0; t < mesh.triangle_count; t++)
+                {
+                    for (int k = 0; k < 3; k++)
+                        polygon.vertices[k] = &eye[mesh.indices[t * 3 + k]];
+                    InternalPolygon internal_polygon(polygon);
+                    render_shadow_polygon(internal_polygon);
+                }
+                return;
+            }
+
+            std::vector<TriangleBin> bins(MESH_BATCH_TRIANGLES / TRIANGLE_GRAIN);
+            InternalPolygon assembled(*mesh.material);
+            for (int first = 0; first < mesh.triangle_count;
+                    first += MESH_BATCH_TRIANGLES)
+            {
+                int last = std::min(first + MESH_BATCH_TRIANGLES,
+                        mesh.triangle_count);
+                parallel_for(first, last, TRIANGLE_GRAIN,
+                        [&](int begin, int end) {
+                    TriangleBin &bin = bins[(begin - first) / TRIANGLE_GRAIN];
+                    bin.vertices.clear();
+                    bin.counts.clear();
+                    Polygon triangle = polygon;
+                    for (int t = begin; t < end; t++)
+                    {
+                        for (int k = 0; k < 3; k++)
+                            triangle.vertices[k] =
+                                &eye[mesh.indices[t * 3 + k]];
+                        InternalPolygon internal_polygon(triangle);
+                        if (!assemble_polygon(internal_polygon))
+                            continue;
+                        bin.vertices.insert(bin.vertices.end(),
+                                internal_polygon.vertices,
+                                internal_polygon.vertices +
+                                internal_polygon.count);
+                        bin.counts.push_back(internal_polygon.count);
+                    }
+                });
+                int chunks = (last - first + TRIANGLE_GRAIN - 1) /
+                    TRIANGLE_GRAIN;
+                for (int c = 0; c < chunks; c++)
+                {
+                    const InternalVertex *vertices = bins[c].vertices.data();
+                    for (int count : bins[c].counts)
+                    {
+                        assembled.count = count;
+                        std::copy(vertices, vertices + count,
+                                assembled.vertices);
+                        rasterize_polygon(assembled);
+                        vertices += count;
+                    }
+                }
+            }
+        }
+
         InternalPolygon::InternalPolygon(const Polygon &p) :
             count(p.count), material(*p.material)
         {
@@ -182,6 +380,8 @@ namespace ssre
                 vertices[i].normal = p.vertices[i]->normal;
                 vertices[i].color = {{0.0f, 0.0f, 0.0f, 0.0f}};
                 vertices[i].tex_coord = p.vertices[i]->tex_coord;
+                vertices[i].tangent = p.vertices[i]->tangent;
+                vertices[i].inverse_w = 1.0f;
             }
 
             // surface normal
@@ -191,16 +391,35 @@ namespace ssre
        
     void render_polygon(const Polygon &p)
     {
+        if (internal::recording)
+        {
+            internal::record_polygon(p);
+            return;
+        }
         internal::InternalPolygon polygon(p);
-        transform_positions(polygon, internal::matrix_model_view);
-        transform_normals(polygon, internal::model_view_inverse_transpose);
-        if (internal::culling_enabled && internal::culling(polygon))
+        internal::transform_positions(polygon, internal::matrix_model_view);
+        internal::transform_normals(polygon, internal::model_view_inverse_transpose);
+        if (internal::material_normal_map(polygon.material))
+            internal::transform_tangents(polygon, internal::matrix_model_view);
+        internal::render_eye_polygon(polygon);
+    }
+
+    void render_mesh(const Mesh &mesh)
+    {
+        if (internal::recording)
+        {
+            Matrix identity;
+            load_identity_matrix(identity);
+            internal::record_mesh(mesh, &identity, 1,
+                    internal::tessellation_enabled);
             return;
-        internal::compute_lighting_color(polygon);
-        transform_positions(polygon, internal::matrix_projection);
-        if (internal::clipping_enabled && internal::clipping(polygon))
+        }
+        if (internal::tessellation_enabled)
+        {
+            internal::render_tessellated_mesh(mesh);
             return;
-        transform_positions(polygon, internal::matrix_view_port);
-        internal::rasterize_polygon(polygon);
+        }
+        if (mesh.vertex_count > 0)
+            internal::render_mesh_triangles(mesh);
     }
 }
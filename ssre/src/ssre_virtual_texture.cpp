@@ -0,0 +1,400 @@
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include "ssre.h"
+#include "internal/ssre_internal.h"
+
+namespace ssre
+{
+    namespace internal
+    {
+        /*
+         * pages are PAGE_SIZE texels wide plus a border on the right and
+         * bottom, so that bilinear samples never leave their page
+         */
+        const int PAGE_BITS = 7;
+        const int PAGE_SIZE = 1 << PAGE_BITS;
+        const int PAGE_STRIDE = PAGE_SIZE + 1;
+        const int PAGE_TEXELS = PAGE_STRIDE * PAGE_STRIDE;
+        /* pages being read from the page file at a time */
+        const int PAGE_READS = 32;
+        const uint32 PAGE_FILE_MAGIC = 0x54565353;
+
+        struct PageFileHeader
+        {
+            uint32 magic;
+            int width, height, levels;
+        };
+
+        struct VirtualLevel
+        {
+            int width, height;
+            int pages_x, pages_y;
+            // index of its first page in the page table
+            int first_page;
+        };
+
+        struct CachePage
+        {
+            int page;
+            uint64 last_used;
+        };
+
+        /* read on a decode thread, waiting for the next present */
+        struct ReadPage
+        {
+            int page;
+            std::vector<uint32> texels;
+        };
+
+        /*
+         * levels halve until one page holds the whole texture. Pages of
+         * a level are stored row by row, the levels follow each other
+         */
+        std::vector<VirtualLevel> virtual_levels(int width, int height)
+        {
+            std::vector<VirtualLevel> levels;
+            int first_page = 0;
+            while (true)
+            {
+                VirtualLevel level = {width, height,
+                    (width + PAGE_SIZE - 1) >> PAGE_BITS,
+                    (height + PAGE_SIZE - 1) >> PAGE_BITS, first_page};
+                levels.push_back(level);
+                first_page += level.pages_x * level.pages_y;
+                if (level.pages_x == 1 && level.pages_y == 1)
+                    return levels;
+                width = std::max(1, width >> 1);
+                height = std::max(1, height >> 1);
+            }
+        }
+
+        /* box filter, the last row and column repeat on odd sizes */
+        std::vector<uint32> downsample_level(const std::vector<uint32> &src,
+                int width, int height)
+        {
+            int w = std::max(1, width >> 1), h = std::max(1, height >> 1);
+            std::vector<uint32> dest(w * h);
+            for (int y = 0; y < h; y++)
+                for (int x = 0; x < w; x++)
+                {
+                    int x0 = std::min(2 * x, width - 1);
+                    int x1 = std::min(2 * x + 1, width - 1);
+                    const uint32 *row0 = &src[std::min(2 * y, height - 1) *
+                        width];
+                    const uint32 *row1 = &src[std::min(2 * y + 1,
+                            height - 1) * width];
+                    dest[y * w + x] = average_color(row0[x0], row0[x1],
+                            row1[x0], row1[x1]);
+                }
+            return dest;
+        }
+    }
+
+    struct VirtualTexture
+    {
+        std::ifstream file;
+        // held by the reads of the decode threads
+        std::mutex file_mutex;
+        std::vector<internal::VirtualLevel> levels;
+        // cache page of every page, -1 when not resident
+        std::vector<int> page_table;
+        // pages sampled but not resident since the last present, or
+        // being read
+        std::vector<uint8> requested;
+        std::vector<int> requests;
+        std::vector<internal::CachePage> cache_pages;
+        std::vector<uint32> cache;
+        uint64 frame;
+
+        // guards the pages read and the reads in flight
+        std::mutex mutex;
+        std::condition_variable reads_done;
+        std::vector<internal::ReadPage> read_pages;
+        int reads;
+        bool read_failed;
+    };
+
+    namespace internal
+    {
+        VirtualTexture *virtual_texture = nullptr;
+        static std::vector<VirtualTexture *> virtual_textures;
+
+        bool read_page(VirtualTexture &texture, int page, uint32 *texels)
+        {
+            std::lock_guard<std::mutex> lock(texture.file_mutex);
+            std::streamoff offset = sizeof(PageFileHeader) +
+                (std::streamoff)page * PAGE_TEXELS * sizeof(uint32);
+            texture.file.seekg(offset);
+            texture.file.read((char *)texels, PAGE_TEXELS * sizeof(uint32));
+            return (bool)texture.file;
+        }
+
+        void install_page(VirtualTexture &texture, int page, int slot,
+                const uint32 *texels)
+        {
+            std::memcpy(&texture.cache[slot * PAGE_TEXELS], texels,
+                    PAGE_TEXELS * sizeof(uint32));
+            CachePage &cached = texture.cache_pages[slot];
+            if (cached.page >= 0)
+                texture.page_table[cached.page] = -1;
+            cached.page = page;
+            cached.last_used = texture.frame;
+            texture.page_table[page] = slot;
+        }
+
+        /*
+         * the cache page to load into, the least recently used one that
+         * was not sampled in the last frame. The first one holds the
+         * coarsest level for good, as the fallback of every other page
+         */
+        int free_cache_page(VirtualTexture &texture)
+        {
+            int oldest = -1;
+            for (int i = 1; i < (int)texture.cache_pages.size(); i++)
+            {
+                const CachePage &cached = texture.cache_pages[i];
+                if (cached.page < 0)
+                    return i;
+                if (cached.last_used < texture.frame && (oldest < 0 ||
+                            cached.last_used <
+                            texture.cache_pages[oldest].last_used))
+                    oldest = i;
+            }
+            return oldest;
+        }
+
+        /* on a decode thread, the page stays requested until installed */
+        void queue_page_read(VirtualTexture &texture, int page)
+        {
+            {
+                std::lock_guard<std::mutex> lock(texture.mutex);
+                texture.reads++;
+            }
+            VirtualTexture *target = &texture;
+            run_on_decode_thread([target, page] {
+                ReadPage read = {page, std::vector<uint32>(PAGE_TEXELS)};
+                bool ok = read_page(*target, page, read.texels.data());
+                std::lock_guard<std::mutex> lock(target->mutex);
+                if (ok)
+                    target->read_pages.push_back(std::move(read));
+                target->read_failed |= !ok;
+                if (--target->reads == 0)
+                    target->reads_done.notify_all();
+            });
+        }
+
+        /*
+         * installs the pages read since the last present and reads the
+         * requested ones, coarse pages first as they are the fallbacks
+         * of finer ones
+         */
+        void update_virtual_texture(VirtualTexture &texture)
+        {
+            std::vector<ReadPage> read_pages;
+            int reads;
+            {
+                std::lock_guard<std::mutex> lock(texture.mutex);
+                if (texture.read_failed)
+                    throw new std::runtime_error("failed reading texture page");
+                read_pages.swap(texture.read_pages);
+                reads = texture.reads;
+            }
+            for (const ReadPage &read : read_pages)
+            {
+                int slot = free_cache_page(texture);
+                if (slot >= 0)
+                    install_page(texture, read.page, slot, read.texels.data());
+                texture.requested[read.page] = 0;
+            }
+            std::vector<int> &requests = texture.requests;
+            std::sort(requests.begin(), requests.end(), std::greater<int>());
+            int count = std::min((int)requests.size(),
+                    std::max(PAGE_READS - reads, 0));
+            for (int i = 0; i < count; i++)
+                queue_page_read(texture, requests[i]);
+            // what is not read is requested again when sampled
+            for (size_t i = count; i < requests.size(); i++)
+                texture.requested[requests[i]] = 0;
+            requests.clear();
+            texture.frame++;
+        }
+
+        void update_virtual_textures()
+        {
+            for (VirtualTexture *texture : virtual_textures)
+                update_virtual_texture(*texture);
+        }
+
+        /* the texels the longer side of the pixel covers */
+        float virtual_texture_lod(const VirtualTexture &texture, float du_dx,
+                float dv_dx, float du_dy, float dv_dy)
+        {
+            const VirtualLevel &level = texture.levels[0];
+            float footprint = std::max(
+                    std::max(std::fabs(du_dx), std::fabs(du_dy)) *
+                    (level.width - 1),
+                    std::max(std::fabs(dv_dx), std::fabs(dv_dy)) *
+                    (level.height - 1));
+            return footprint > 1.0f ? std::log2(footprint) : 0.0f;
+        }
+
+        /*
+         * bilinear sample of the level nearest to lod, or of the finest
+         * coarser one that is resident. Missing pages are requested
+         */
+        uint32 sample_virtual_texture(VirtualTexture &texture, float u,
+                float v, float lod)
+        {
+            u = std::min(std::max(u, 0.0f), 1.0f);
+            v = std::min(std::max(v, 0.0f), 1.0f);
+            int levels = texture.levels.size();
+            int l = std::min(std::max((int)(lod + 0.5f), 0), levels - 1);
+            for (;; l++)
+            {
+                const VirtualLevel &level = texture.levels[l];
+                float s = u * (level.width - 1), t = v * (level.height - 1);
+                int x = (int)s, y = (int)t;
+                int page = level.first_page + (y >> PAGE_BITS) *
+                    level.pages_x + (x >> PAGE_BITS);
+                int slot = texture.page_table[page];
+                if (slot < 0)
+                {
+                    if (!texture.requested[page])
+                    {
+                        texture.requested[page] = 1;
+                        texture.requests.push_back(page);
+                    }
+                    continue;
+                }
+                texture.cache_pages[slot].last_used = texture.frame;
+                const uint32 *row0 = &texture.cache[slot * PAGE_TEXELS +
+                    (y & (PAGE_SIZE - 1)) * PAGE_STRIDE + (x & (PAGE_SIZE - 1))];
+                const uint32 *row1 = row0 + PAGE_STRIDE;
+                int wx = (int)((s - x) * 256.0f), wy = (int)((t - y) * 256.0f);
+                return lerp_color(lerp_color(row0[0], row0[1], wx),
+                        lerp_color(row1[0], row1[1], wx), wy);
+            }
+        }
+    }
+
+    void bake_virtual_texture(const char *image, const char *page_file)
+    {
+        using namespace internal;
+        Texture source = load_external_texture_impl(image);
+        std::vector<VirtualLevel> levels = virtual_levels(source.width,
+                source.height);
+        std::vector<uint32> texels(source.pixels,
+                source.pixels + source.width * source.height);
+        release_external_texture(source);
+
+        std::ofstream out(page_file, std::ios::binary);
+        if (!out)
+            throw new std::runtime_error("failed creating texture page file");
+        PageFileHeader header = {PAGE_FILE_MAGIC, levels[0].width,
+            levels[0].height, (int)levels.size()};
+        out.write((const char *)&header, sizeof(header));
+        std::vector<uint32> page(PAGE_TEXELS);
+        for (size_t l = 0; l < levels.size(); l++)
+        {
+            const VirtualLevel &level = levels[l];
+            if (l > 0)
+                texels = downsample_level(texels, levels[l - 1].width,
+                        levels[l - 1].height);
+            for (int py = 0; py < level.pages_y; py++)
+                for (int px = 0; px < level.pages_x; px++)
+                {
+                    // the border repeats the next page, or the edge
+                    for (int y = 0; y < PAGE_STRIDE; y++)
+                        for (int x = 0; x < PAGE_STRIDE; x++)
+                        {
+                            int tx = std::min((px << PAGE_BITS) + x,
+                                    level.width - 1);
+                            int ty = std::min((py << PAGE_BITS) + y,
+                                    level.height - 1);
+                            page[y * PAGE_STRIDE + x] =
+                                texels[ty * level.width + tx];
+                        }
+                    out.write((const char *)page.data(),
+                            PAGE_TEXELS * sizeof(uint32));
+                }
+        }
+        if (!out)
+            throw new std::runtime_error("failed writing texture page file");
+    }
+
+    VirtualTexture *create_virtual_texture(const char *page_file,
+            int cache_pages)
+    {
+        using namespace internal;
+        if (cache_pages < 1)
+            throw new std::invalid_argument("virtual texture without cache");
+        VirtualTexture *texture = new VirtualTexture;
+        texture->file.open(page_file, std::ios::binary);
+        PageFileHeader header;
+        texture->file.read((char *)&header, sizeof(header));
+        if (!texture->file || header.magic != PAGE_FILE_MAGIC)
+        {
+            delete texture;
+            throw new std::runtime_error("invalid texture page file");
+        }
+        texture->levels = virtual_levels(header.width, header.height);
+        int page_count = texture->levels.back().first_page + 1;
+        texture->page_table.assign(page_count, -1);
+        texture->requested.assign(page_count, 0);
+        // one more for the coarsest level
+        CachePage empty = {-1, 0};
+        texture->cache_pages.assign(cache_pages + 1, empty);
+        texture->cache.resize((cache_pages + 1) * PAGE_TEXELS);
+        texture->frame = 0;
+        texture->reads = 0;
+        texture->read_failed = false;
+        std::vector<uint32> coarsest(PAGE_TEXELS);
+        if (!read_page(*texture, page_count - 1, coarsest.data()))
+        {
+            delete texture;
+            throw new std::runtime_error("failed reading texture page");
+        }
+        install_page(*texture, page_count - 1, 0, coarsest.data());
+        virtual_textures.push_back(texture);
+        return texture;
+    }
+
+    void destroy_virtual_texture(VirtualTexture *texture)
+    {
+        using namespace internal;
+        if (virtual_texture == texture)
+        {
+            virtual_texture = nullptr;
+            texture_enabled = false;
+        }
+        virtual_textures.erase(std::remove(virtual_textures.begin(),
+                    virtual_textures.end(), texture), virtual_textures.end());
+        {
+            std::unique_lock<std::mutex> lock(texture->mutex);
+            texture->reads_done.wait(lock, [&] {
+                return texture->reads == 0;
+            });
+        }
+        delete texture;
+    }
+
+    void enable_virtual_texture(VirtualTexture *texture)
+    {
+        internal::virtual_texture = texture;
+        internal::texture_enabled = true;
+    }
+
+    int resident_page_count(const VirtualTexture *texture)
+    {
+        int count = 0;
+        for (const internal::CachePage &cached : texture->cache_pages)
+            count += cached.page >= 0;
+        return count;
+    }
+}